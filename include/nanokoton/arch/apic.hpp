@@ -0,0 +1,64 @@
+#ifndef NANOKOTON_APIC_HPP
+#define NANOKOTON_APIC_HPP
+
+#include <nanokoton/types.hpp>
+
+namespace nk::arch {
+    class LocalAPIC {
+    private:
+        static constexpr u32 MSR_APIC_BASE = 0x1B;
+        static constexpr u64 APIC_BASE_ENABLE = 1 << 11;
+        static constexpr u64 APIC_BASE_MASK = 0xFFFFFF000;
+
+        static constexpr u32 REG_ID = 0x020;
+        static constexpr u32 REG_EOI = 0x0B0;
+        static constexpr u32 REG_SPURIOUS = 0x0F0;
+        static constexpr u32 REG_ICR_LOW = 0x300;
+        static constexpr u32 REG_ICR_HIGH = 0x310;
+        static constexpr u32 REG_LVT_TIMER = 0x320;
+        static constexpr u32 REG_TIMER_INITIAL = 0x380;
+        static constexpr u32 REG_TIMER_CURRENT = 0x390;
+        static constexpr u32 REG_TIMER_DIVIDE = 0x3E0;
+
+        static constexpr u32 SPURIOUS_ENABLE = 1 << 8;
+        static constexpr u32 LVT_MASKED = 1 << 16;
+        static constexpr u32 TIMER_DIVIDE_16 = 0x3;
+        static constexpr u32 ICR_LEVEL_ASSERT = 1 << 14;
+        static constexpr u32 ICR_DELIVERY_PENDING = 1 << 12;
+        static constexpr u64 CALIBRATION_TICKS = 10;
+
+        static volatile u32* registers_;
+        static u64 counts_per_tick_;
+        static bool available_;
+        static u64 oneshots_armed_;
+
+        static u64 read_msr(u32 msr);
+        static void write_msr(u32 msr, u64 value);
+        static u32 read(u32 reg);
+        static void write(u32 reg, u32 value);
+
+        static void enable();
+        static bool calibrate();
+
+    public:
+        static constexpr u8 TIMER_VECTOR = 48;
+        static constexpr u8 TLB_SHOOTDOWN_VECTOR = 49;
+        static constexpr u8 RESCHEDULE_VECTOR = 50;
+        static constexpr u8 SPURIOUS_VECTOR = 0xFF;
+
+        static bool init();
+        static void init_ap();
+
+        static bool is_available() { return available_; }
+        static u32 id();
+        static void eoi();
+        static void send_ipi(u32 apic_id, u8 vector);
+
+        static void arm_oneshot(u64 ticks);
+        static void stop_timer();
+
+        static u64 oneshots_armed() { return oneshots_armed_; }
+    };
+}
+
+#endif
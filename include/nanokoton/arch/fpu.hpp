@@ -0,0 +1,83 @@
+#ifndef NANOKOTON_FPU_HPP
+#define NANOKOTON_FPU_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/arch/smp.hpp>
+
+namespace nk::arch {
+    struct FPUState {
+        u8* area;
+        u32 loaded_cpu;
+
+        FPUState() : area(nullptr), loaded_cpu(~0u) {}
+    };
+
+    enum class FPUSaveMode {
+        FXSave,
+        XSave,
+        XSaveOpt,
+        XSaves
+    };
+
+    class FPU {
+    private:
+        static constexpr u64 CR0_MP = 1 << 1;
+        static constexpr u64 CR0_EM = 1 << 2;
+        static constexpr u64 CR0_TS = 1 << 3;
+        static constexpr u64 CR4_OSFXSR = 1 << 9;
+        static constexpr u64 CR4_OSXMMEXCPT = 1 << 10;
+        static constexpr u64 CR4_OSXSAVE = 1 << 18;
+
+        static constexpr u32 MSR_XSS = 0xDA0;
+        static constexpr u64 XCR0_SUPPORTED = 0xE7;
+        static constexpr usize FXSAVE_SIZE = 512;
+        static constexpr usize AREA_ALIGNMENT = 64;
+        static constexpr usize XSTATE_BV_OFFSET = 512;
+        static constexpr usize XCOMP_BV_OFFSET = 520;
+        static constexpr u64 XCOMP_BV_COMPACTED = 1ULL << 63;
+
+        static FPUState* owners_[MAX_CPUS];
+        static FPUSaveMode mode_;
+        static u64 xcr0_;
+        static usize area_size_;
+
+        static u64 traps_;
+        static u64 saves_;
+        static u64 restores_;
+        static u64 elided_restores_;
+        static u64 areas_allocated_;
+        static u64 kernel_sections_;
+
+        static u64 read_cr0();
+        static void write_cr0(u64 value);
+        static u64 read_cr4();
+        static void write_cr4(u64 value);
+        static void write_xcr0(u64 value);
+        static void set_task_switched() { write_cr0(read_cr0() | CR0_TS); }
+        static void clear_task_switched() { asm volatile("clts"); }
+
+        static void enable();
+        static bool allocate_area(FPUState& state);
+        static void save(FPUState& state);
+        static void restore(FPUState& state);
+
+    public:
+        static void init();
+        static void init_ap();
+
+        static void switch_out(FPUState* state);
+        static bool handle_device_not_available(FPUState* state);
+        static void release(FPUState& state);
+
+        static void begin_kernel_use();
+        static void end_kernel_use();
+
+        static FPUSaveMode save_mode() { return mode_; }
+        static usize area_size() { return area_size_; }
+        static u64 enabled_features() { return xcr0_; }
+
+        static void dump_statistics();
+    };
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef NANOKOTON_SMP_HPP
+#define NANOKOTON_SMP_HPP
+
+#include <nanokoton/types.hpp>
+
+namespace nk::arch {
+    static constexpr usize MAX_CPUS = 64;
+
+    struct PerCPU {
+        PerCPU* self;
+        u32 cpu_id;
+        u32 apic_id;
+        bool online;
+    };
+
+    class SMP {
+    private:
+        static constexpr u32 MSR_GS_BASE = 0xC0000101;
+
+        static PerCPU cpus_[MAX_CPUS];
+        static u32 cpu_count_;
+
+        static void write_msr(u32 msr, u64 value);
+        static u64 read_msr(u32 msr);
+        static void install(PerCPU& cpu);
+
+    public:
+        static void init_bsp();
+        static bool init_ap(u32 cpu_id, u32 apic_id);
+
+        static FORCE_INLINE PerCPU& current() {
+            PerCPU* self;
+            asm volatile("movq %%gs:%c1, %0" : "=r"(self) : "i"(__builtin_offsetof(PerCPU, self)));
+            return *self;
+        }
+
+        static FORCE_INLINE u32 current_cpu_id() {
+            u32 id;
+            asm volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(PerCPU, cpu_id)));
+            return id;
+        }
+
+        static PerCPU& cpu(u32 cpu_id) { return cpus_[cpu_id]; }
+        static u32 cpu_count() { return cpu_count_; }
+    };
+}
+
+#endif
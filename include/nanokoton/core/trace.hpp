@@ -0,0 +1,109 @@
+#ifndef NANOKOTON_TRACE_HPP
+#define NANOKOTON_TRACE_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/arch/smp.hpp>
+
+namespace nk::task {
+    class Thread;
+}
+
+namespace nk::debug {
+    enum class TraceComponent : u8 {
+        Scheduler,
+        Memory,
+        AHCI,
+        Network,
+        Count
+    };
+
+    class Trace {
+    public:
+        static constexpr usize MAX_ARGS = 5;
+        static constexpr usize RING_RECORDS = 1024;
+        static constexpr usize DRAIN_BUDGET = 64;
+        static constexpr u64 DRAIN_INTERVAL_MS = 10;
+        static constexpr usize DRAIN_STACK_SIZE = 16384;
+
+    private:
+        struct alignas(64) Record {
+            u64 timestamp;
+            const char* format;
+            u64 args[MAX_ARGS];
+            u16 length;
+            u8 component;
+            u8 level;
+            u8 continuation;
+        };
+
+        struct alignas(64) Ring {
+            Record* records;
+            u64 dropped;
+            alignas(64) u64 head;
+            alignas(64) u64 tail;
+        };
+
+    public:
+        static constexpr usize INLINE_TEXT = sizeof(Record::args);
+        static constexpr usize MAX_LOG_LENGTH = INLINE_TEXT + 4 * sizeof(Record);
+
+    private:
+        static Ring rings_[arch::MAX_CPUS];
+        static u32 enabled_mask_;
+        static bool deferred_;
+        static bool draining_;
+        static u64 drained_;
+        static task::Thread* drain_thread_;
+
+        static Record* slot(Ring& ring, u64 index) {
+            return &ring.records[index & (RING_RECORDS - 1)];
+        }
+
+        static bool reserve(Ring& ring, usize slots, u64& head);
+        static void record(TraceComponent component, const char* format, const u64* args, usize count);
+        static usize render(u32 cpu, Ring& ring, u64& tail, char* line, usize size);
+        static void drain_main();
+
+        template<typename T>
+        static FORCE_INLINE u64 raw(T* value) { return reinterpret_cast<u64>(value); }
+
+        template<typename T>
+        static FORCE_INLINE u64 raw(T value) { return static_cast<u64>(value); }
+
+    public:
+        static bool init_cpu(u32 cpu);
+        static bool start();
+
+        static void enable(TraceComponent component, bool enable);
+        static bool enabled(TraceComponent component) {
+            return __atomic_load_n(&enabled_mask_, __ATOMIC_RELAXED) & (1u << static_cast<u32>(component));
+        }
+        static void set_mask(u32 mask) { __atomic_store_n(&enabled_mask_, mask, __ATOMIC_RELAXED); }
+        static u32 mask() { return __atomic_load_n(&enabled_mask_, __ATOMIC_RELAXED); }
+
+        template<typename... Args>
+        static FORCE_INLINE void point(TraceComponent component, const char* format, Args... args) {
+            static_assert(sizeof...(Args) <= MAX_ARGS, "too many trace arguments");
+            if (!enabled(component)) {
+                return;
+            }
+
+            const u64 values[MAX_ARGS] = { raw(args)... };
+            record(component, format, values, sizeof...(Args));
+        }
+
+        static bool log(LogLevel level, const char* text, usize length);
+
+        static bool deferred() { return __atomic_load_n(&deferred_, __ATOMIC_ACQUIRE); }
+        static void set_deferred(bool deferred);
+
+        static usize drain(usize budget);
+        static void flush();
+
+        static u64 dropped();
+        static void dump_statistics();
+    };
+}
+
+#endif
@@ -7,6 +7,10 @@
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/spinlock.hpp>
 
+namespace nk::task {
+    class Thread;
+}
+
 namespace nk::drivers {
     struct PACKED AHCIPort {
         u64 command_list_base;
@@ -186,8 +190,79 @@ namespace nk::drivers {
         u32 reserved3;
     };
 
+    struct AHCISegment {
+        phys_addr address;
+        usize length;
+    };
+
+    struct AHCIRequest;
+    using AHCICompletion = void (*)(AHCIRequest* request, void* context);
+
+    struct AHCIRequest {
+        u32 port_index;
+        u64 lba;
+        u32 count;
+        void* buffer;
+        const AHCISegment* segments;
+        u32 segment_count;
+        bool write;
+        
+        AHCICompletion callback;
+        void* context;
+        task::Thread* waiter;
+        
+        bool completed;
+        bool success;
+        
+        AHCIRequest* next;
+        u32 slot;
+        u64 submit_time;
+        
+        AHCIRequest() : port_index(0), lba(0), count(0), buffer(nullptr),
+                        segments(nullptr), segment_count(0), write(false),
+                        callback(nullptr), context(nullptr), waiter(nullptr),
+                        completed(false), success(false), next(nullptr), slot(0),
+                        submit_time(0) {}
+    };
+
     class AHCIController {
     private:
+        static constexpr u32 MAX_PORTS = 32;
+        static constexpr u32 MAX_SLOTS = 32;
+        static constexpr usize COMMAND_TABLE_SIZE = 4096;
+        static constexpr u32 PRDT_ENTRIES = (COMMAND_TABLE_SIZE - sizeof(HBACommandTable)) /
+                                            sizeof(HBACommandTable::HBAPRDTEntry);
+        static constexpr usize PRDT_MAX_BYTES = 0x400000;
+        static constexpr usize PAGE_SIZE = 4096;
+        static constexpr u32 COMMAND_TIMEOUT = 1000000;
+        static constexpr u32 MAX_SECTORS_LBA28 = 256;
+        static constexpr u32 MAX_SECTORS_LBA48 = 65536;
+        static constexpr u64 REQUEST_TIMEOUT_MS = 5000;
+        static constexpr u64 WAIT_SLICE_MS = 10;
+        
+        static constexpr u32 PORT_IS_TFES = 1 << 30;
+        static constexpr u32 PORT_CMD_ST = 1 << 0;
+        static constexpr u32 PORT_CMD_CLO = 1 << 3;
+        static constexpr u32 PORT_CMD_FRE = 1 << 4;
+        static constexpr u32 PORT_CMD_CR = 1 << 15;
+        static constexpr u32 PORT_TFD_ERR = 1 << 0;
+        static constexpr u32 PORT_TFD_DRQ = 1 << 3;
+        static constexpr u32 PORT_TFD_BSY = 1 << 7;
+        static constexpr u32 PORT_SCTL_DET_MASK = 0x0F;
+        static constexpr u32 PORT_SCTL_DET_INIT = 0x01;
+        static constexpr u32 PORT_SSTS_DET_MASK = 0x0F;
+        static constexpr u32 PORT_SSTS_DET_PRESENT = 0x03;
+        static constexpr u32 COMRESET_HOLD = 100000;
+        static constexpr u32 HBA_CAP_SNCQ = 1 << 30;
+        static constexpr u32 HBA_CAP_SCLO = 1 << 24;
+        static constexpr u8 ATA_READ_LOG_EXT = 0x2F;
+        static constexpr u8 NCQ_ERROR_LOG_PAGE = 0x10;
+        static constexpr u8 NCQ_ERROR_LOG_NQ = 0x80;
+        static constexpr usize NCQ_ERROR_LOG_SIZE = 512;
+        static constexpr u32 HBA_CAP_CCCS = 1 << 7;
+        static constexpr u32 CCC_CTL_EN = 1 << 0;
+        static constexpr u32 LATENCY_BUCKETS = 40;
+        
         PCI::Device* pci_device_;
         AHCIHostControl* hba_;
         u32 capabilities_;
@@ -201,13 +276,61 @@ namespace nk::drivers {
             u32 sector_size;
             bool supports_48bit;
             bool supports_ncq;
+            u32 queue_depth;
+            u32 max_sectors;
             char model[41];
             char serial[21];
             char firmware[9];
             bool initialized;
         };
         
+        struct PortQueue {
+            HBACommandHeader* command_list;
+            HBACommandTable* tables[MAX_SLOTS];
+            AHCIRequest* active[MAX_SLOTS];
+            u64 issued_at[MAX_SLOTS];
+            u32 port_number;
+            u32 sector_size;
+            bool supports_48bit;
+            u32 depth;
+            bool ncq;
+            u32 allocated;
+            
+            AHCIRequest* backlog_head;
+            AHCIRequest* backlog_tail;
+            SpinLock lock;
+            
+            u8* error_log;
+            phys_addr error_log_phys;
+            
+            u64 commands;
+            u64 ncq_commands;
+            u64 completions;
+            u64 interrupts;
+            u64 errors;
+            u64 slot_waits;
+            u32 max_outstanding;
+            
+            u64 stats_start;
+            u64 reads;
+            u64 writes;
+            u64 bytes_read;
+            u64 bytes_written;
+            u64 depth_total;
+            u64 depth_samples;
+            u64 latency_total;
+            u64 latency_max;
+            u64 latency_histogram[LATENCY_BUCKETS];
+            
+            bool coalesced;
+        };
+        
         Vector<PortInfo> ports_;
+        PortQueue* queues_[MAX_PORTS];
+        u8 irq_line_;
+        u32 coalescing_ports_;
+        u8 coalescing_completions_;
+        u16 coalescing_timeout_ms_;
         SpinLock lock_;
         
         bool find_device();
@@ -216,16 +339,37 @@ namespace nk::drivers {
         bool reset_port(u32 port_number);
         bool start_port(u32 port_number);
         bool stop_port(u32 port_number);
+        void recover_port(PortQueue& queue, AHCIRequest*& completed);
+        bool comreset_port(u32 port_number);
+        bool read_ncq_error_log(PortQueue& queue, u32& tag);
+        static void free_queue(PortQueue* queue);
         
         bool identify_device(u32 port_number, PortInfo& info);
-        bool read_sectors(u32 port_number, u64 lba, u32 count, void* buffer);
-        bool write_sectors(u32 port_number, u64 lba, u32 count, const void* buffer);
+        bool lookup_port(u32 port_index, PortInfo& info);
+        bool read_sectors(u32 port_index, u64 lba, u32 count, void* buffer);
+        bool write_sectors(u32 port_index, u64 lba, u32 count, const void* buffer);
+        bool transfer(u32 port_index, u64 lba, u32 count, void* buffer, bool write);
+        bool transfer_vector(u32 port_index, u64 lba, const AHCISegment* segments,
+                            u32 segment_count, bool write);
         
         bool wait_for_clear(u32 port_number, u32 offset, u32 mask, u32 timeout);
         bool wait_for_set(u32 port_number, u32 offset, u32 mask, u32 timeout);
         
-        bool send_command(u32 port_number, HBACommandHeader* header, 
-                         HBACommandTable* table, void* buffer, usize buffer_size);
+        static bool append_prdt(HBACommandTable* table, u32& entries,
+                                phys_addr address, usize length);
+        static void pin_segments(const AHCIRequest* request, bool pin);
+        bool build_command(PortQueue& queue, u32 slot, const AHCIRequest* request);
+        bool dispatch(PortQueue& queue, AHCIRequest* request, AHCIRequest*& completed);
+        void dispatch_backlog(PortQueue& queue, AHCIRequest*& completed);
+        void service_port(PortQueue& queue);
+        static void finish(AHCIRequest*& completed, AHCIRequest* request, bool success);
+        static void record_completion(PortQueue& queue, const AHCIRequest* request, u64 now);
+        static void reset_queue_statistics(PortQueue& queue);
+        static u64 latency_percentile(const PortQueue& queue, u32 percent);
+        static u64 ms_to_cycles(u64 milliseconds);
+        static u64 cycles_to_us(u64 cycles);
+        void program_coalescing();
+        static void complete_requests(AHCIRequest* completed);
         
     public:
         AHCIController(PCI::Device* pci_device);
@@ -234,6 +378,21 @@ namespace nk::drivers {
         bool init();
         bool read(u32 port_number, u64 lba, u32 count, void* buffer);
         bool write(u32 port_number, u64 lba, u32 count, const void* buffer);
+        bool readv(u32 port_number, u64 lba, const AHCISegment* segments, u32 segment_count);
+        bool writev(u32 port_number, u64 lba, const AHCISegment* segments, u32 segment_count);
+        
+        bool submit(AHCIRequest* request);
+        bool wait(AHCIRequest* request);
+        bool poll(u32 port_index);
+        bool handle_interrupt();
+        
+        bool supports_coalescing() const { return (capabilities_ & HBA_CAP_CCCS) != 0; }
+        bool set_coalescing(u32 port_index, bool enable, u8 completions, u16 timeout_ms);
+        
+        usize export_latency_histogram(u32 port_index, u64* buckets, usize count) const;
+        void reset_statistics(u32 port_index);
+        void dump_statistics() const;
+        u8 get_irq() const { return irq_line_; }
         
         usize get_port_count() const { return ports_.size(); }
         const PortInfo* get_port_info(u32 index) const;
@@ -256,6 +415,14 @@ namespace nk::drivers {
                         u64 lba, u32 count, void* buffer);
         static bool write(u32 controller_index, u32 port_index,
                          u64 lba, u32 count, const void* buffer);
+        
+        static bool readv(u32 controller_index, u32 port_index, u64 lba,
+                         const AHCISegment* segments, u32 segment_count);
+        static bool writev(u32 controller_index, u32 port_index, u64 lba,
+                          const AHCISegment* segments, u32 segment_count);
+        
+        static bool submit(u32 controller_index, AHCIRequest* request);
+        static bool handle_interrupt(u8 irq);
     };
 }
 #endif
@@ -0,0 +1,144 @@
+#ifndef NANOKOTON_BLOCK_HPP
+#define NANOKOTON_BLOCK_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/drivers/ahci.hpp>
+#include <nanokoton/lib/vector.hpp>
+#include <nanokoton/lib/spinlock.hpp>
+
+namespace nk::drivers {
+    struct BlockRequest;
+    using BlockCompletion = void (*)(BlockRequest* request, void* context);
+
+    struct BlockRequest {
+        u64 lba;
+        u32 count;
+        void* buffer;
+        bool write;
+
+        BlockCompletion callback;
+        void* context;
+        task::Thread* waiter;
+
+        bool completed;
+        bool success;
+
+        u64 deadline;
+        BlockRequest* next;
+
+        u32 submitted;
+        u32 chunks;
+        bool failed;
+
+        BlockRequest() : lba(0), count(0), buffer(nullptr), write(false),
+                         callback(nullptr), context(nullptr), waiter(nullptr),
+                         completed(false), success(false), deadline(0), next(nullptr),
+                         submitted(0), chunks(0), failed(false) {}
+    };
+
+    struct BlockQueueStatistics {
+        u64 requests;
+        u64 reads;
+        u64 writes;
+        u64 sectors;
+        u64 commands;
+        u64 merges;
+        u64 splits;
+        u64 plugs;
+        u64 forced_unplugs;
+        u64 deadline_dispatches;
+        u64 errors;
+        u32 max_pending;
+        u32 max_in_flight;
+    };
+
+    class BlockQueue {
+    private:
+        static constexpr u32 MAX_DEPTH = 32;
+        static constexpr u32 MAX_SEGMENTS = 128;
+        static constexpr u32 MAX_MERGE_SECTORS = 2048;
+        static constexpr u32 MAX_PENDING = 256;
+        static constexpr u64 READ_DEADLINE_MS = 50;
+        static constexpr u64 WRITE_DEADLINE_MS = 500;
+        static constexpr u64 WAIT_SLICE_MS = 10;
+        static constexpr usize PAGE_SIZE = 4096;
+
+        struct Command {
+            AHCIRequest ahci;
+            AHCISegment segments[MAX_SEGMENTS];
+            BlockRequest* requests;
+            BlockRequest* partial;
+            BlockQueue* queue;
+            Command* next;
+        };
+
+        AHCIController* controller_;
+        u32 port_index_;
+        u32 sector_size_;
+        u32 max_sectors_;
+        u32 depth_;
+
+        Command* commands_;
+        Command* free_commands_;
+
+        BlockRequest* pending_;
+        u32 pending_count_;
+        u32 in_flight_;
+        u32 plug_depth_;
+        u64 head_position_;
+
+        SpinLock lock_;
+        BlockQueueStatistics statistics_;
+
+        void insert_sorted(BlockRequest* request);
+        void unlink_pending(BlockRequest* previous, BlockRequest* request);
+        BlockRequest* select_next(BlockRequest*& previous);
+        bool append_segments(Command* command, const BlockRequest* request,
+                             u32 offset, u32 limit, u32& sectors);
+        Command* build_command(BlockRequest*& failed);
+        void retire_command(Command* command, bool success, BlockRequest*& completed);
+        static void retire_request(BlockRequest* request, bool success, BlockRequest*& completed);
+        void run_queue(bool force);
+
+        static void command_complete(AHCIRequest* request, void* context);
+        static void complete_requests(BlockRequest* requests);
+
+    public:
+        BlockQueue(AHCIController* controller, u32 port_index);
+        ~BlockQueue();
+
+        bool submit(BlockRequest* request);
+        bool wait(BlockRequest* request);
+
+        bool read(u64 lba, u32 count, void* buffer);
+        bool write(u64 lba, u32 count, const void* buffer);
+
+        void plug();
+        void unplug();
+
+        AHCIController* get_controller() const { return controller_; }
+        u32 get_port_index() const { return port_index_; }
+        u32 get_sector_size() const { return sector_size_; }
+        u32 get_queue_depth() const { return depth_; }
+        void set_queue_depth(u32 depth);
+
+        const BlockQueueStatistics& get_statistics() const { return statistics_; }
+        void dump_statistics() const;
+
+        BlockQueue(const BlockQueue&) = delete;
+        BlockQueue& operator=(const BlockQueue&) = delete;
+    };
+
+    class BlockLayer {
+    private:
+        static Vector<BlockQueue*> queues_;
+        static SpinLock lock_;
+
+    public:
+        static BlockQueue* get_queue(AHCIController* controller, u32 port_index);
+        static usize get_queue_count() { return queues_.size(); }
+        static void dump_statistics();
+    };
+}
+
+#endif
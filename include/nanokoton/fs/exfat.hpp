@@ -4,11 +4,15 @@
 #include <nanokoton/types.hpp>
 #include <nanokoton/fs/vfs.hpp>
 #include <nanokoton/drivers/ahci.hpp>
+#include <nanokoton/drivers/block.hpp>
 #include <nanokoton/lib/vector.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/hashmap.hpp>
 #include <nanokoton/lib/mutex.hpp>
 #include <nanokoton/lib/bitmap.hpp>
+#include <nanokoton/mm/slab.hpp>
+#include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/task/process.hpp>
 
 namespace nk::fs {
     struct PACKED exFATBootSector {
@@ -91,6 +95,11 @@ namespace nk::fs {
         Archive = 0x0020
     };
 
+    enum class exFATStreamFlags : u16 {
+        AllocationPossible = 0x0001,
+        NoFatChain = 0x0002
+    };
+
     struct exFATDateTime {
         u16 year;
         u8 month;
@@ -103,20 +112,78 @@ namespace nk::fs {
 
     class exFATVolume : public VFS::Volume {
     private:
+        static constexpr usize MIN_CACHE_ENTRIES = 64;
+        static constexpr usize MAX_CACHE_ENTRIES = 65536;
+        static constexpr usize CACHE_MEMORY_DIVISOR = 32;
+        static constexpr usize LOW_MEMORY_DIVISOR = 16;
+        static constexpr usize WRITEBACK_BATCH = 64;
+        static constexpr u32 MIN_READAHEAD_CLUSTERS = 4;
+        static constexpr u32 MAX_READAHEAD_CLUSTERS = 256;
+        static constexpr usize DENTRY_CAPACITY = 4096;
+        static constexpr usize DENTRY_BUCKETS = 1024;
+        static constexpr usize MAX_DIRECTORY_INDEXES = 64;
+        static constexpr usize MAX_INDEXED_ENTRIES = 262144;
+        static constexpr usize MIN_INDEX_BUCKETS = 16;
+        static constexpr usize MAX_INDEX_BUCKETS = 65536;
+        static constexpr usize PAGE_SIZE = 4096;
+
         struct CacheEntry {
-            u64 cluster;
+            drivers::BlockRequest io;
+            u32 cluster;
             u8* data;
             bool dirty;
-            u64 last_access;
+            bool valid;
+            bool readahead;
+            bool io_active;
+            bool io_write;
+            u32 pins;
+            CacheEntry* hash_next;
+            CacheEntry* lru_prev;
+            CacheEntry* lru_next;
+        };
+
+        struct Extent {
+            u32 file_cluster;
+            u32 first_cluster;
+            u32 length;
+        };
+
+        struct Dentry {
+            u32 parent;
+            u16 hash;
+            bool negative;
+            String name;
+            exFATDirectoryEntry dir_entry;
+            exFATStreamExtensionEntry stream_entry;
+            Dentry* hash_next;
+            Dentry* lru_prev;
+            Dentry* lru_next;
+        };
+
+        struct DirectoryIndex {
+            u32 cluster;
+            Dentry** buckets;
+            usize bucket_mask;
+            usize entries;
+            DirectoryIndex* lru_prev;
+            DirectoryIndex* lru_next;
         };
 
         struct FileHandle {
+            String name;
             u32 first_cluster;
             u64 file_size;
             u64 current_offset;
             u32 current_cluster;
             u64 cluster_offset;
             u16 attributes;
+            bool no_fat_chain;
+            Vector<Extent> extents;
+            u32 mapped_clusters;
+            u32 allocated_clusters;
+            u64 readahead_next;
+            u32 readahead_window;
+            u32 readahead_end;
             exFATDateTime create_time;
             exFATDateTime modify_time;
             exFATDateTime access_time;
@@ -128,8 +195,24 @@ namespace nk::fs {
             Vector<u8> buffer;
         };
 
+        class Mapping : public mm::PageProvider {
+        private:
+            exFATVolume* volume_;
+            FileHandle file_;
+
+            friend class exFATVolume;
+
+        public:
+            Mapping(exFATVolume* volume, const FileHandle& file) : volume_(volume), file_(file) {}
+            ~Mapping() override { volume_->detach_mapping(this); }
+
+            Optional<phys_addr> get_page(u64 index) override { return volume_->map_file_page(file_, index); }
+            void set_page_dirty(u64 index) override { volume_->dirty_file_page(file_, index); }
+        };
+
         exFATBootSector bs_;
         drivers::AHCIController* controller_;
+        drivers::BlockQueue* block_;
         u32 port_index_;
         u64 partition_start_;
         
@@ -143,29 +226,94 @@ namespace nk::fs {
         u32 root_dir_cluster_;
         
         Bitmap cluster_bitmap_;
-        Vector<CacheEntry> cache_;
-        HashMap<u32, u32> cluster_chain_cache_;
+        u32 allocation_hint_;
+        CacheEntry** cache_buckets_;
+        usize cache_bucket_mask_;
+        CacheEntry* lru_head_;
+        CacheEntry* lru_tail_;
+        usize cache_size_;
+        usize cache_capacity_;
+        usize dirty_entries_;
         Mutex lock_;
         u64 cache_hits_;
         u64 cache_misses_;
+        u64 cache_evictions_;
+        u64 cache_writebacks_;
+        u64 cache_shrinks_;
+        u64 readahead_issued_;
+        u64 readahead_hits_;
+        bool frame_backed_;
+        u64 mapped_faults_;
+        Vector<Mapping*> mappings_;
+        Dentry* dentry_buckets_[DENTRY_BUCKETS];
+        Dentry* dentry_lru_head_;
+        Dentry* dentry_lru_tail_;
+        usize dentry_count_;
+        DirectoryIndex* index_lru_head_;
+        DirectoryIndex* index_lru_tail_;
+        usize index_count_;
+        usize indexed_entries_;
+        u64 dentry_hits_;
+        u64 dentry_negative_hits_;
+        u64 dentry_misses_;
+        mm::SlabCache* cluster_cache_;
         
         bool read_sector(u64 sector, void* buffer);
         bool write_sector(u64 sector, const void* buffer);
+        bool read_sectors(u64 sector, u32 count, void* buffer);
+        bool write_sectors(u64 sector, u32 count, const void* buffer);
         bool read_cluster(u32 cluster, void* buffer);
         bool write_cluster(u32 cluster, const void* buffer);
         
         u32 read_fat_entry(u32 cluster);
         bool write_fat_entry(u32 cluster, u32 value);
+        u32 clusters_for(u64 size) const;
+        bool find_free_run(u32 wanted, u32& start, u32& length);
+        bool range_free(u32 start, u32 count);
+        void mark_clusters(u32 start, u32 count, bool used);
+        bool sync_bitmap(u32 start, u32 count);
+        u32 allocate_clusters(u32 wanted, u32& count);
+        bool release_clusters(u32 first_cluster, u32 count);
         u32 allocate_cluster();
         bool free_cluster_chain(u32 first_cluster);
+        bool extend_file(FileHandle& file, u32 clusters);
+        bool release_reservation(FileHandle& file);
         u32 find_next_cluster(u32 current_cluster);
         u32 cluster_to_sector(u32 cluster);
         
         bool read_cluster_chain(u32 first_cluster, u64 offset, u64 size, void* buffer);
         bool write_cluster_chain(u32 first_cluster, u64 offset, u64 size, const void* buffer);
         
+        bool map_cluster(FileHandle& file, u32 file_cluster, u32& disk_cluster, u32& run);
+        void invalidate_extents(FileHandle& file);
+        void update_position(FileHandle& file);
+        bool materialize_fat_chain(FileHandle& file);
+        bool read_file_data(FileHandle& file, u64 offset, u64 size, void* buffer);
+        bool write_file_data(FileHandle& file, u64 offset, u64 size, const void* buffer);
+        
         bool read_directory(u32 cluster, Vector<u8>& buffer);
         bool parse_directory(const u8* buffer, usize size, Vector<VFS::DirectoryEntry>& entries);
+        void read_entry_name(const u8* entry_set, String& name);
+        void fill_file_handle(const exFATDirectoryEntry* dir_entry,
+                              const exFATStreamExtensionEntry* stream_entry,
+                              const char* name, FileHandle& file);
+        usize dentry_bucket(u32 parent, u16 hash) const;
+        Dentry* dentry_lookup(u32 parent, const char* name, u16 hash);
+        void dentry_unlink(Dentry* dentry);
+        void dentry_push_front(Dentry* dentry);
+        void dentry_remove(Dentry* dentry);
+        void dentry_insert(u32 parent, const char* name,
+                           const exFATDirectoryEntry* dir_entry,
+                           const exFATStreamExtensionEntry* stream_entry);
+        DirectoryIndex* index_find(u32 cluster);
+        DirectoryIndex* index_create(u32 cluster, usize entries);
+        void index_destroy(DirectoryIndex* index);
+        Dentry* index_lookup(DirectoryIndex* index, const char* name, u16 hash);
+        bool index_insert(DirectoryIndex* index, const char* name, u16 hash,
+                          const exFATDirectoryEntry* dir_entry,
+                          const exFATStreamExtensionEntry* stream_entry);
+        void index_remove(DirectoryIndex* index, const char* name, u16 hash);
+        void dentry_clear();
         bool find_file_in_directory(u32 directory_cluster, const char* name, FileHandle& file);
         bool create_directory_entry(u32 directory_cluster, const VFS::DirectoryEntry& entry, FileHandle& file);
         bool delete_directory_entry(u32 directory_cluster, const char* name);
@@ -178,11 +326,39 @@ namespace nk::fs {
         
         void update_cache_statistics(bool hit);
         void flush_cache();
+        bool init_cache();
+        usize default_cache_capacity() const;
+        usize hash_bucket(u32 cluster) const;
+        void lru_unlink(CacheEntry* entry);
+        void lru_push_front(CacheEntry* entry);
+        void hash_unlink(CacheEntry* entry);
+        void mark_dirty(CacheEntry* entry);
+        void reap_io(CacheEntry* entry);
+        void wait_for_io(CacheEntry* entry);
+        bool start_writeback(CacheEntry* entry, task::Thread* waiter);
+        usize writeback_dirty(usize limit);
+        bool evict_entry(CacheEntry* entry);
+        usize shrink_cache_locked(usize target);
+        bool memory_low() const;
+        CacheEntry* find_entry(u32 cluster);
+        CacheEntry* insert_entry(u32 cluster);
         CacheEntry* get_cached_cluster(u32 cluster);
-        void put_cached_cluster(u32 cluster, const u8* data);
+        void release_cached_cluster(CacheEntry* entry);
+        bool put_cached_cluster(u32 cluster, const u8* data, bool dirty);
+        void start_readahead(FileHandle& file);
+        u8* allocate_cluster_buffer();
+        void free_cluster_buffer(u8* data);
+        bool entry_mapped(const CacheEntry* entry) const;
+        Optional<phys_addr> map_file_page(FileHandle& file, u64 index);
+        void dirty_file_page(FileHandle& file, u64 index);
+        Mapping* find_mapping(u32 first_cluster);
+        void update_mapping(const FileHandle& file);
+        void detach_mapping(Mapping* mapping);
+        void zap_mapping(u32 first_cluster, u64 size);
         
     public:
-        exFATVolume(drivers::AHCIController* controller, u32 port_index, u64 partition_start);
+        exFATVolume(drivers::AHCIController* controller, u32 port_index, u64 partition_start,
+                    usize cache_capacity = 0);
         ~exFATVolume();
         
         bool init() override;
@@ -195,6 +371,10 @@ namespace nk::fs {
         bool seek(VFS::FileHandle* handle, i64 offset, VFS::SeekMode mode) override;
         u64 tell(VFS::FileHandle* handle) override;
         bool truncate(VFS::FileHandle* handle, u64 size) override;
+        bool fallocate(VFS::FileHandle* handle, u64 size);
+        bool mmap(VFS::FileHandle* handle, mm::VirtualMemoryManager::AddressSpace* space,
+                  virt_addr address, usize length, u64 offset, mm::PageFlags flags);
+        bool msync(mm::VirtualMemoryManager::AddressSpace* space, virt_addr address, usize length);
         
         VFS::DirectoryHandle* opendir(const char* path) override;
         bool readdir(VFS::DirectoryHandle* handle, VFS::DirectoryEntry& entry) override;
@@ -216,6 +396,12 @@ namespace nk::fs {
         void sync() override;
         void dump_info() const override;
         
+        usize get_cache_capacity() const { return cache_capacity_; }
+        usize get_cache_size() const { return cache_size_; }
+        void set_cache_capacity(usize capacity);
+        usize shrink_cache();
+        usize writeback();
+        
         bool format(u64 total_sectors);
         bool check_and_repair();
         
@@ -224,8 +410,17 @@ namespace nk::fs {
     
     class exFATFileSystem : public VFS::FileSystem {
     private:
+        static constexpr u64 WRITEBACK_INTERVAL_MS = 1000;
+        static constexpr usize WRITEBACK_STACK_SIZE = 16384;
+        
         HashMap<String, exFATVolume*> volumes_;
         Mutex lock_;
+        task::Thread* writeback_thread_;
+        
+        bool start_writeback_thread();
+        usize writeback_volumes();
+        
+        static void writeback_main();
         
     public:
         exFATFileSystem();
@@ -4,21 +4,56 @@
 #include <nanokoton/types.hpp>
 #include <nanokoton/lib/bitmap.hpp>
 #include <nanokoton/lib/spinlock.hpp>
+#include <nanokoton/arch/smp.hpp>
+#include <nanokoton/arch/idt.hpp>
 
 namespace nk::mm {
     class PhysicalMemoryManager {
+    public:
+        static constexpr usize MAX_ORDER = 10;
+
     private:
+        struct FreeBlock {
+            FreeBlock* next;
+            FreeBlock* prev;
+        };
+
         struct MemoryRegion {
             phys_addr base;
             usize size;
             usize free_pages;
             usize total_pages;
             Bitmap* bitmap;
+
+            phys_addr buddy_base;
+            usize buddy_offset;
+            usize buddy_pages;
+            u8* free_heads[MAX_ORDER + 1];
+            FreeBlock* free_lists[MAX_ORDER + 1];
+            usize free_blocks[MAX_ORDER + 1];
+
+            u16* shared_counts;
+            u8* cached_frames;
+        };
+
+        static constexpr usize MAGAZINE_SIZE = 64;
+        static constexpr usize MAGAZINE_BATCH = 32;
+
+        struct PageMagazine {
+            phys_addr frames[MAGAZINE_SIZE];
+            usize count;
+            usize hits;
+            usize misses;
+            usize refills;
+            usize drains;
         };
 
         static constexpr usize PAGE_SIZE = 4096;
         static constexpr usize MAX_MEMORY_REGIONS = 32;
         static constexpr usize BITMAP_SIZE = 1024 * 1024;
+        static constexpr usize MAX_BLOCK_PAGES = static_cast<usize>(1) << MAX_ORDER;
+        static constexpr usize FREE_HEAD_STORAGE_SIZE =
+            BITMAP_SIZE * 2 + MAX_MEMORY_REGIONS * (MAX_BLOCK_PAGES / 4 + (MAX_ORDER + 1) * 2);
 
         MemoryRegion regions_[MAX_MEMORY_REGIONS];
         usize region_count_;
@@ -32,8 +67,13 @@ namespace nk::mm {
         usize page_frames_allocated_;
         usize page_frames_freed_;
 
+        PageMagazine magazines_[arch::MAX_CPUS];
+
         Bitmap global_bitmap_;
         u8 bitmap_storage_[BITMAP_SIZE];
+        usize bitmap_storage_used_;
+        u8 free_head_storage_[FREE_HEAD_STORAGE_SIZE];
+        usize free_head_storage_used_;
         SpinLock lock_;
 
         PhysicalMemoryManager();
@@ -44,6 +84,31 @@ namespace nk::mm {
         Optional<usize> find_free_page_in_region(usize region_index);
         void merge_free_regions();
 
+        u8* allocate_bitmap_storage(usize bits);
+        bool init_buddy(MemoryRegion& region);
+        bool init_shared_counts(MemoryRegion& region);
+        bool init_cached_frames(MemoryRegion& region);
+        u16* shared_count_for(phys_addr page) const;
+        static usize order_for_pages(usize count);
+
+        bool test_free_head(const MemoryRegion& region, usize block, usize order) const;
+        void set_free_head(MemoryRegion& region, usize block, usize order, bool free);
+        void push_free_block(MemoryRegion& region, usize block, usize order);
+        void remove_free_block(MemoryRegion& region, usize block, usize order);
+        void free_block(MemoryRegion& region, usize block, usize order);
+        void release_range(MemoryRegion& region, usize block, usize count);
+
+        Optional<phys_addr> allocate_block(usize count, usize align_order);
+        Optional<phys_addr> allocate_large(usize count, usize align_order);
+        void claim_pages(MemoryRegion& region, usize block, usize count);
+        usize release_pages(MemoryRegion& region, usize start_page, usize count);
+
+        bool is_cacheable_page(phys_addr page) const;
+        bool mark_cached(phys_addr page, bool cached);
+        void free_page_locked(phys_addr page);
+        bool refill_magazine(PageMagazine& magazine);
+        void drain_magazine(PageMagazine& magazine, usize count);
+
     public:
         static PhysicalMemoryManager& instance();
 
@@ -57,6 +122,11 @@ namespace nk::mm {
         void free_page(phys_addr page);
         void free_pages(phys_addr base, usize count);
 
+        void ref_page(phys_addr page);
+        void unref_page(phys_addr page);
+        usize page_refcount(phys_addr page) const;
+        bool owns_page(phys_addr page) const { return shared_count_for(page) != nullptr; }
+
         usize total_memory() const { return total_memory_; }
         usize free_memory() const { return free_memory_; }
         usize used_memory() const { return used_memory_; }
@@ -67,6 +137,15 @@ namespace nk::mm {
 
         usize page_frames_allocated() const { return page_frames_allocated_; }
         usize page_frames_freed() const { return page_frames_freed_; }
+        usize magazine_hits() const;
+        usize magazine_misses() const;
+        usize magazine_refills() const;
+        usize magazine_drains() const;
+        usize magazine_cached_pages() const;
+
+        void drain_local_magazine();
+
+        usize free_blocks_of_order(usize order) const;
 
         phys_addr page_to_phys(usize page_index) const;
         usize phys_to_page(phys_addr address) const;
@@ -84,6 +163,7 @@ namespace nk::mm {
 
         class ScopedLock {
         private:
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq_;
             PhysicalMemoryManager& pmm_;
         
         public:
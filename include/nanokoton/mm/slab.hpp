@@ -0,0 +1,107 @@
+#ifndef NANOKOTON_SLAB_HPP
+#define NANOKOTON_SLAB_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/lib/spinlock.hpp>
+
+namespace nk::mm {
+    class SlabCache {
+    public:
+        static constexpr usize SLAB_SLOT_SIZE = 64 * 1024;
+        static constexpr usize MAX_OBJECT_SIZE = 16 * 1024;
+
+    private:
+        struct FreeObject {
+            FreeObject* next;
+        };
+
+        struct Slab {
+            u32 magic;
+            u32 in_use;
+            SlabCache* cache;
+            Slab* next;
+            Slab* prev;
+            FreeObject* free_list;
+        };
+
+        static constexpr u32 SLAB_MAGIC = 0x534C4142;
+        static constexpr usize PAGE_SIZE = 4096;
+        static constexpr usize MIN_OBJECTS_PER_SLAB = 8;
+        static constexpr usize MAX_SLAB_PAGES = SLAB_SLOT_SIZE / PAGE_SIZE;
+        static constexpr usize MAX_EMPTY_SLABS = 2;
+
+        const char* name_;
+        usize object_size_;
+        usize stride_;
+        usize first_offset_;
+        usize slab_pages_;
+        usize objects_per_slab_;
+
+        Slab* partial_;
+        Slab* full_;
+        Slab* empty_;
+        usize empty_count_;
+
+        usize slab_count_;
+        usize active_objects_;
+        usize allocations_;
+        usize frees_;
+
+        SpinLock lock_;
+
+        Slab* grow();
+        void release(Slab* slab);
+
+        static void push(Slab*& list, Slab* slab);
+        static void unlink(Slab*& list, Slab* slab);
+
+    public:
+        SlabCache(const char* name, usize object_size, usize alignment = 16);
+        ~SlabCache();
+
+        void* allocate();
+        void free(void* ptr);
+        usize shrink();
+
+        static SlabCache* owner(const void* ptr);
+
+        const char* name() const { return name_; }
+        usize object_size() const { return object_size_; }
+        usize objects_per_slab() const { return objects_per_slab_; }
+        usize slab_count() const { return slab_count_; }
+        usize active_objects() const { return active_objects_; }
+
+        void dump_statistics() const;
+
+        SlabCache(const SlabCache&) = delete;
+        SlabCache& operator=(const SlabCache&) = delete;
+    };
+
+    class SlabAllocator {
+    private:
+        static constexpr usize MIN_CLASS_SHIFT = 4;
+        static constexpr usize MAX_CLASS_SHIFT = 11;
+        static constexpr usize CLASS_COUNT = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+        SlabCache caches_[CLASS_COUNT];
+
+        SlabAllocator();
+        ~SlabAllocator() = default;
+
+        static usize class_index(usize size);
+
+    public:
+        static constexpr usize MAX_SIZE = static_cast<usize>(1) << MAX_CLASS_SHIFT;
+
+        static SlabAllocator& instance();
+
+        void* allocate(usize size);
+        void free(void* ptr);
+        usize allocation_size(const void* ptr) const;
+        usize shrink();
+
+        void dump_statistics() const;
+    };
+}
+
+#endif
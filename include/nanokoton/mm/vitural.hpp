@@ -3,7 +3,11 @@
 
 #include <nanokoton/types.hpp>
 #include <nanokoton/mm/physical.hpp>
+#include <nanokoton/mm/slab.hpp>
 #include <nanokoton/lib/spinlock.hpp>
+#include <nanokoton/lib/bitmap.hpp>
+#include <nanokoton/lib/vector.hpp>
+#include <nanokoton/arch/smp.hpp>
 
 namespace nk::mm {
     enum class PageFlags : u64 {
@@ -16,6 +20,7 @@ namespace nk::mm {
         Dirty           = 1 << 6,
         HugePage        = 1 << 7,
         Global          = 1 << 8,
+        CopyOnWrite     = 1 << 9,
         NoExecute       = 1ULL << 63
     };
 
@@ -27,7 +32,46 @@ namespace nk::mm {
         return static_cast<PageFlags>(static_cast<u64>(a) & static_cast<u64>(b));
     }
 
+    class PageProvider {
+    private:
+        usize references_;
+        u64 sequence_;
+
+    public:
+        PageProvider() : references_(1), sequence_(0) {}
+        virtual ~PageProvider() = default;
+
+        virtual Optional<phys_addr> get_page(u64 index) = 0;
+        virtual void set_page_dirty(u64 index) = 0;
+
+        void retain() { __atomic_add_fetch(&references_, 1, __ATOMIC_RELAXED); }
+        bool try_retain() {
+            usize references = __atomic_load_n(&references_, __ATOMIC_RELAXED);
+            while (references) {
+                if (__atomic_compare_exchange_n(&references_, &references, references + 1, true,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        void release() {
+            if (__atomic_sub_fetch(&references_, 1, __ATOMIC_ACQ_REL) == 0) {
+                delete this;
+            }
+        }
+
+        u64 sequence() const { return __atomic_load_n(&sequence_, __ATOMIC_ACQUIRE); }
+        void invalidate() { __atomic_add_fetch(&sequence_, 1, __ATOMIC_ACQ_REL); }
+
+        PageProvider(const PageProvider&) = delete;
+        PageProvider& operator=(const PageProvider&) = delete;
+    };
+
     class VirtualMemoryManager {
+    public:
+        class MMUGather;
+
     private:
         struct PageTableEntry {
             union {
@@ -78,30 +122,96 @@ namespace nk::mm {
         static constexpr usize PAGE_TABLE_ENTRIES = 512;
         static constexpr usize PAGE_SIZE = 4096;
         static constexpr usize HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+        static constexpr usize GIGA_PAGE_SIZE = 1024 * 1024 * 1024;
         
         static constexpr u64 KERNEL_BASE = 0xFFFFFFFF80000000;
         static constexpr u64 KERNEL_HEAP_BASE = 0xFFFF800000000000;
         static constexpr u64 KERNEL_HEAP_SIZE = 0x100000000;
+        static constexpr u64 KERNEL_SLAB_BASE = KERNEL_HEAP_BASE;
+        static constexpr u64 KERNEL_SLAB_SIZE = 0x40000000;
+        static constexpr u64 KERNEL_LARGE_BASE = KERNEL_SLAB_BASE + KERNEL_SLAB_SIZE;
+        static constexpr usize SLAB_SLOT_COUNT = KERNEL_SLAB_SIZE / SlabCache::SLAB_SLOT_SIZE;
+        static constexpr usize LARGE_BUCKETS = 256;
+        static constexpr u64 KERNEL_HALF_BASE = 0xFFFF800000000000;
+        
+        static constexpr usize PCID_COUNT = 4096;
+        static constexpr u64 CR3_NOFLUSH = 1ULL << 63;
+        static constexpr u64 CR4_PGE = 1ULL << 7;
+        static constexpr u64 CR4_PCIDE = 1ULL << 17;
+        static constexpr usize TLB_FLUSH_THRESHOLD = 32;
         static constexpr u64 USER_BASE = 0x0000000000400000;
         static constexpr u64 USER_STACK_BASE = 0x00007FFFFFFFFFFF;
         static constexpr u64 USER_STACK_SIZE = 0x800000;
 
+        struct VirtualMemoryArea {
+            virt_addr start;
+            virt_addr end;
+            PageFlags flags;
+            PageProvider* provider;
+            u64 page_offset;
+        };
+
         struct AddressSpace {
             PageTableEntry* pml4;
             SpinLock lock;
             usize reference_count;
             u64 allocated_pages;
             u64 mapped_pages;
+            u16 pcid;
+            u64 stale_cpus;
+            u64 active_cpus;
+            Vector<VirtualMemoryArea> areas;
+            u64 demand_faults;
+            u64 cow_faults;
+            u64 file_faults;
+            AddressSpace* prev;
+            AddressSpace* next;
             
-            AddressSpace() : pml4(nullptr), reference_count(1), allocated_pages(0), mapped_pages(0) {}
+            AddressSpace() : pml4(nullptr), reference_count(1), allocated_pages(0), mapped_pages(0),
+                             pcid(0), stale_cpus(~0ULL), active_cpus(0), demand_faults(0), cow_faults(0),
+                             file_faults(0), prev(nullptr), next(nullptr) {}
+        };
+
+        struct HeapRange {
+            virt_addr base;
+            usize pages;
+            HeapRange* next;
         };
 
         AddressSpace* kernel_space_;
         AddressSpace* current_space_;
+        AddressSpace* spaces_;
+        SpinLock spaces_lock_;
         
         virt_addr kernel_heap_current_;
         virt_addr kernel_heap_end_;
         SpinLock heap_lock_;
+        bool gigabyte_pages_;
+        
+        bool pcid_enabled_;
+        u8 pcid_storage_[PCID_COUNT / 8];
+        Bitmap pcid_map_;
+        usize pcid_hint_;
+        usize shared_pcid_spaces_;
+        SpinLock pcid_lock_;
+        AddressSpace* active_spaces_[arch::MAX_CPUS];
+        u64 shootdown_requested_[arch::MAX_CPUS];
+        u64 shootdown_completed_[arch::MAX_CPUS];
+        
+        usize tlb_single_flushes_;
+        usize tlb_full_flushes_;
+        usize tlb_shootdowns_;
+
+        HeapRange* free_ranges_;
+        HeapRange* large_allocations_[LARGE_BUCKETS];
+        SlabCache range_cache_;
+        usize large_pages_;
+
+        u8 slab_slot_storage_[SLAB_SLOT_COUNT / 8];
+        Bitmap slab_slots_;
+        usize slab_slot_hint_;
+        usize slab_pages_;
+        SpinLock slab_lock_;
 
         static VirtualMemoryManager instance_;
 
@@ -109,13 +219,49 @@ namespace nk::mm {
         ~VirtualMemoryManager() = default;
 
         PageTableEntry* get_next_table(PageTableEntry* entry, usize level, bool allocate);
-        void free_table(PageTableEntry* table, usize level);
+        void free_table(AddressSpace* space, PageTableEntry* table, usize level);
         
         Optional<phys_addr> walk_page_table(virt_addr address, usize* level = nullptr);
         bool map_page_internal(virt_addr virt, phys_addr phys, PageFlags flags);
+        bool map_huge_internal(virt_addr virt, phys_addr phys, usize level, PageFlags flags);
+        bool split_huge_entry(AddressSpace* space, PageTableEntry& entry, usize level);
         bool unmap_page_internal(virt_addr virt);
+        usize unmap_entry_internal(virt_addr virt, usize max_pages, MMUGather* gather, bool release_frames);
+        bool unmap_range_internal(virt_addr virt, usize count, MMUGather* gather, bool release_frames = false);
+        void release_mapped_pages(virt_addr virt, usize count);
+        
+        static usize level_page_size(usize level);
+        static bool detect_gigabyte_pages();
+        static void apply_flags(PageTableEntry& entry, PageFlags flags);
         
         void invalidate_page(virt_addr address);
+        void flush_tlb_all(bool include_global);
+        void shootdown_tlb(u64 targets);
+        
+        static bool detect_pcid();
+        static u64 read_cr4();
+        static void write_cr4(u64 value);
+        
+        u16 allocate_pcid();
+        void release_pcid(u16 pcid);
+        
+        PageTableEntry* lookup_entry(AddressSpace* space, virt_addr virt, bool allocate);
+        const VirtualMemoryArea* find_area(const AddressSpace* space, virt_addr address) const;
+        bool resolve_demand_fault(AddressSpace* space, virt_addr page, const VirtualMemoryArea& area);
+        bool resolve_copy_on_write(AddressSpace* space, virt_addr page, PageTableEntry& entry);
+        bool install_file_page(AddressSpace* space, virt_addr page, const VirtualMemoryArea& area,
+                               phys_addr frame);
+        usize report_dirty_pages(AddressSpace* space, const VirtualMemoryArea& area,
+                                 virt_addr start, virt_addr end, MMUGather* gather);
+        bool clone_table(AddressSpace* parent, PageTableEntry* table, usize level,
+                         virt_addr base, AddressSpace* child, MMUGather& gather);
+
+        void* allocate_large(usize pages, usize align_pages);
+        void free_large(void* ptr);
+        usize large_allocation_size(const void* ptr);
+        Optional<virt_addr> reserve_heap_range(usize pages, usize align_pages);
+        void release_heap_range(virt_addr base, usize pages);
+        static usize large_bucket(virt_addr base);
 
     public:
         static VirtualMemoryManager& instance();
@@ -130,16 +276,42 @@ namespace nk::mm {
         Optional<phys_addr> get_physical_address(virt_addr virt);
         
         AddressSpace* create_address_space();
+        AddressSpace* clone_address_space(AddressSpace* parent);
         void destroy_address_space(AddressSpace* space);
+        
+        bool map_lazy(AddressSpace* space, virt_addr start, usize size, PageFlags flags);
+        bool map_file(AddressSpace* space, virt_addr start, usize size, PageFlags flags,
+                      PageProvider* provider, u64 page_offset);
+        bool sync_region(AddressSpace* space, virt_addr start, usize size);
+        bool unmap_region(AddressSpace* space, virt_addr start, usize size);
+        usize zap_provider(PageProvider* provider, u64 first_page);
+        virt_addr reserve_user_stack(AddressSpace* space);
+        
+        bool handle_page_fault(virt_addr address, u64 error_code);
         void switch_address_space(AddressSpace* space);
         
         AddressSpace* get_kernel_space() { return kernel_space_; }
         AddressSpace* get_current_space() { return current_space_; }
         
+        bool supports_gigabyte_pages() const { return gigabyte_pages_; }
+        bool pcid_enabled() const { return pcid_enabled_; }
+        
+        void flush_tlb_range(AddressSpace* space, virt_addr start, virt_addr end, usize pages);
+        void handle_tlb_shootdown();
+        
         void* kmalloc(usize size);
         void* kmalloc_aligned(usize size, usize alignment);
         void* krealloc(void* ptr, usize new_size);
         void kfree(void* ptr);
+
+        void* allocate_guarded_stack(usize pages);
+        void free_guarded_stack(void* stack, usize pages);
+
+        virt_addr allocate_slab_span(usize pages);
+        void free_slab_span(virt_addr base, usize pages);
+        bool is_slab_address(virt_addr address) const {
+            return address >= KERNEL_SLAB_BASE && address < KERNEL_SLAB_BASE + KERNEL_SLAB_SIZE;
+        }
         
         usize get_allocated_pages() const;
         usize get_mapped_pages() const;
@@ -147,6 +319,38 @@ namespace nk::mm {
         void dump_page_tables(virt_addr start, virt_addr end);
         void dump_memory_statistics();
         
+        class MMUGather {
+        private:
+            static constexpr usize MAX_DEFERRED_FRAMES = 32;
+            
+            struct DeferredFrame {
+                phys_addr base;
+                usize pages;
+                bool shared;
+            };
+            
+            AddressSpace* space_;
+            virt_addr start_;
+            virt_addr end_;
+            usize pages_;
+            DeferredFrame frames_[MAX_DEFERRED_FRAMES];
+            usize frame_count_;
+        
+        public:
+            MMUGather(AddressSpace* space) : space_(space), start_(0), end_(0), pages_(0), frame_count_(0) {}
+            
+            ~MMUGather() {
+                flush();
+            }
+            
+            void add(virt_addr address, usize size);
+            void defer_free(phys_addr base, usize pages, bool shared);
+            void flush();
+            
+            MMUGather(const MMUGather&) = delete;
+            MMUGather& operator=(const MMUGather&) = delete;
+        };
+        
         class ScopedAddressSpace {
         private:
             AddressSpace* old_space_;
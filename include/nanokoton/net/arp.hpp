@@ -0,0 +1,127 @@
+#ifndef NANOKOTON_ARP_HPP
+#define NANOKOTON_ARP_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/net/ethernet.hpp>
+#include <nanokoton/net/packet.hpp>
+#include <nanokoton/mm/slab.hpp>
+#include <nanokoton/lib/mutex.hpp>
+#include <nanokoton/task/timer.hpp>
+
+namespace nk::net {
+    struct PACKED ARPHeader {
+        u16 hardware_type;
+        u16 protocol_type;
+        u8 hardware_length;
+        u8 protocol_length;
+        u16 operation;
+        u8 sender_mac[6];
+        u32 sender_address;
+        u8 target_mac[6];
+        u32 target_address;
+    };
+
+    enum class NeighborState : u8 {
+        Incomplete,
+        Reachable,
+        Stale,
+        Failed
+    };
+
+    class ARPLayer {
+    public:
+        static constexpr u16 HARDWARE_ETHERNET = 1;
+        static constexpr u16 OPERATION_REQUEST = 1;
+        static constexpr u16 OPERATION_REPLY = 2;
+
+    private:
+        static constexpr usize HASH_BUCKETS = 64;
+        static constexpr u32 MAX_QUEUED_PACKETS = 8;
+        static constexpr u32 MAX_PROBES = 3;
+        static constexpr u64 RETRANSMIT_MS = 1000;
+        static constexpr u64 REACHABLE_TIME_MS = 30000;
+        static constexpr u64 STALE_TIMEOUT_MS = 300000;
+
+        struct Neighbor {
+            u32 address;
+            u32 source_address;
+            EthernetDevice* device;
+
+            u32 sequence;
+            u8 mac_address[6];
+            NeighborState state;
+            bool used;
+
+            u8 probes;
+            u64 confirmed;
+            u64 last_probe;
+
+            PacketBuffer* pending[MAX_QUEUED_PACKETS];
+            u16 pending_types[MAX_QUEUED_PACKETS];
+            u32 pending_count;
+
+            Neighbor* next;
+        };
+
+        struct PendingFlush {
+            EthernetDevice* device;
+            u8 mac_address[6];
+            PacketBuffer* packets[MAX_QUEUED_PACKETS];
+            u16 types[MAX_QUEUED_PACKETS];
+            u32 count;
+        };
+
+        Neighbor* buckets_[HASH_BUCKETS];
+        usize neighbor_count_;
+        Mutex lock_;
+        task::Timer poll_timer_;
+        bool poll_due_;
+
+        u64 hits_;
+        u64 misses_;
+        u64 requests_sent_;
+        u64 replies_sent_;
+        u64 queued_;
+        u64 dropped_;
+
+        static mm::SlabCache cache_;
+
+        static usize bucket_index(u32 address) {
+            return (address * 0x9E3779B1u) >> 26;
+        }
+
+        Neighbor* find_locked(u32 address, EthernetDevice* device);
+        Neighbor* create_locked(u32 address, u32 source, EthernetDevice* device);
+        void update_locked(Neighbor* neighbor, const u8* mac_address, PendingFlush& flush);
+        void unlink_locked(Neighbor* neighbor);
+        void drop_pending(Neighbor* neighbor);
+
+        void send_request(EthernetDevice* device, u32 source, u32 target, const u8* destination);
+        void send_reply(EthernetDevice* device, u32 source, const ARPHeader* request);
+        void flush_pending(PendingFlush& flush);
+
+        void process_packet(PacketBuffer* packet);
+        void poll_if_due();
+        void arm_poll();
+
+        static void poll_tick(void* context);
+
+    public:
+        ARPLayer();
+        ~ARPLayer();
+
+        bool init();
+
+        bool lookup(EthernetDevice* device, u32 address, u8* mac_address);
+        bool output(EthernetDevice* device, u32 source, u32 next_hop,
+                   u16 ether_type, PacketBuffer* packet);
+
+        void poll();
+
+        void dump_neighbors() const;
+
+        static ARPLayer& instance();
+    };
+}
+
+#endif
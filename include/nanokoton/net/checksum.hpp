@@ -0,0 +1,54 @@
+#ifndef NANOKOTON_CHECKSUM_HPP
+#define NANOKOTON_CHECKSUM_HPP
+
+#include <nanokoton/types.hpp>
+
+namespace nk::net {
+    enum class ChecksumKernel {
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    class Checksum {
+    public:
+        static constexpr usize SIMD_THRESHOLD = 512;
+
+    private:
+        static constexpr usize SIMD_BLOCK = 64;
+        static constexpr usize SIMD_FLUSH_BYTES = 64 * 1024;
+
+        using VectorKernel = u64 (*)(const u8* data, usize length);
+
+        static ChecksumKernel kernel_;
+        static VectorKernel vector_kernel_;
+
+        static u64 scalar_bytes_;
+        static u64 vector_bytes_;
+        static u64 incremental_updates_;
+
+        static u64 add_carry(u64 sum, u64 value);
+        static u64 sum_scalar(const u8* data, usize length, u64 sum);
+        static u64 sum_sse2(const u8* data, usize length);
+        static u64 sum_avx2(const u8* data, usize length);
+
+    public:
+        static void init();
+
+        static u64 partial(const void* data, usize length, u64 sum = 0);
+        static u16 fold(u64 sum);
+        static u16 compute(const void* data, usize length, u64 sum = 0) {
+            return static_cast<u16>(~fold(partial(data, length, sum)));
+        }
+
+        static u64 pseudo_header(u32 source, u32 destination, u8 protocol, u16 length);
+
+        static u16 update16(u16 checksum, u16 old_value, u16 new_value);
+        static u16 update32(u16 checksum, u32 old_value, u32 new_value);
+
+        static ChecksumKernel kernel() { return kernel_; }
+        static void dump_statistics();
+    };
+}
+
+#endif
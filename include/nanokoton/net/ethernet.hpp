@@ -6,6 +6,8 @@
 #include <nanokoton/lib/queue.hpp>
 #include <nanokoton/lib/mutex.hpp>
 #include <nanokoton/drivers/pci.hpp>
+#include <nanokoton/mm/slab.hpp>
+#include <nanokoton/net/packet.hpp>
 
 namespace nk::net {
     struct PACKED EthernetHeader {
@@ -23,7 +25,22 @@ namespace nk::net {
     };
 
     class EthernetDevice {
+    public:
+        static constexpr u32 RX_POLL_BUDGET = 64;
+        static constexpr u32 TX_CLEAN_BUDGET = 64;
+
     private:
+        static constexpr u32 INTERRUPT_LINK = 0x00000004;
+        static constexpr u32 INTERRUPT_RX = 0x00000080;
+        static constexpr u32 INTERRUPT_TX = 0x00000400;
+
+        static constexpr u8 RX_STATUS_IXSM = 0x04;
+        static constexpr u8 RX_STATUS_TCPCS = 0x20;
+        static constexpr u8 RX_STATUS_IPCS = 0x40;
+        static constexpr u8 RX_ERROR_TCPE = 0x20;
+        static constexpr u8 RX_ERROR_IPE = 0x40;
+        static constexpr u8 TX_CMD_IC = 0x04;
+
         struct PACKED ReceiveDescriptor {
             u64 buffer_address;
             u64 buffer_address_high;
@@ -49,6 +66,7 @@ namespace nk::net {
             u8* data;
             usize size;
             phys_addr physical;
+            PacketBuffer* packet;
         };
 
         PCI::Device* pci_device_;
@@ -75,6 +93,24 @@ namespace nk::net {
         u32 rx_descriptor_count_;
         u32 tx_descriptor_count_;
         
+        bool poll_scheduled_;
+        bool tx_reclaim_pending_;
+        u64 interrupts_;
+        u64 polls_;
+        u64 polled_packets_;
+        u64 budget_exhausted_;
+        u64 tx_reclaimed_;
+        
+        bool checksum_offload_;
+        u64 rx_checksum_verified_;
+        u64 rx_checksum_errors_;
+        u64 tx_checksum_offloaded_;
+        
+        static constexpr usize PACKET_BUFFER_SIZE = 2048;
+        static mm::SlabCache buffer_cache_;
+        
+        static u8* allocate_buffer(usize size);
+        
         bool init_hardware();
         bool init_descriptors();
         bool init_interrupts();
@@ -82,9 +118,11 @@ namespace nk::net {
         bool receive_packet(u8* buffer, usize size);
         bool transmit_packet(const u8* buffer, usize size);
         
+        bool refill_rx_buffer(u32 index);
+        PacketBuffer* take_rx_packet(u32 index);
         void update_rx_descriptor(u32 index);
         void update_tx_descriptor(u32 index);
-        void cleanup_tx_descriptors();
+        u32 cleanup_tx_descriptors(u32 budget);
         
         bool set_mac_address(const u8* mac);
         bool get_mac_address(u8* mac);
@@ -111,6 +149,9 @@ namespace nk::net {
         bool send(const u8* destination, u16 ether_type, const u8* data, usize size);
         bool receive(u8* buffer, usize* size, u64 timeout_ms = 0);
         
+        bool send_buffer(const u8* destination, u16 ether_type, PacketBuffer* packet);
+        PacketBuffer* receive_buffer();
+        
         const u8* get_mac_address() const { return mac_address_; }
         bool set_mac_address(const u8* mac);
         
@@ -118,6 +159,8 @@ namespace nk::net {
         bool set_promiscuous_mode(bool enable);
         
         u32 get_mtu() const { return 1500; }
+        bool checksum_offload() const { return checksum_offload_; }
+        void set_checksum_offload(bool enable) { checksum_offload_ = enable; }
         u32 get_speed() const;
         bool is_link_up() const;
         
@@ -128,6 +171,10 @@ namespace nk::net {
         void handle_interrupt();
         void poll();
         
+        bool poll_pending() const { return __atomic_load_n(&poll_scheduled_, __ATOMIC_ACQUIRE); }
+        usize poll_receive(PacketBuffer** packets, usize budget);
+        void reclaim_tx();
+        
         void dump_registers() const;
         void dump_statistics() const;
     };
@@ -144,22 +191,41 @@ namespace nk::net {
             Vector<u8> data;
         };
         
+        static constexpr usize HANDLER_SLOTS = 64;
+        
         Queue<Packet> packet_queue_;
         Mutex queue_lock_;
         
         using ReceiveCallback = void (*)(const u8* source, const u8* destination,
                                         u16 ether_type, const u8* data, usize size,
                                         void* user_data);
+        using PacketCallback = void (*)(const u8* source, const u8* destination,
+                                       u16 ether_type, PacketBuffer* packet,
+                                       void* user_data);
         
         struct CallbackEntry {
             u16 ether_type;
             ReceiveCallback callback;
+            PacketCallback packet_callback;
             void* user_data;
+            CallbackEntry* next;
         };
         
-        Vector<CallbackEntry> callbacks_;
+        CallbackEntry* handlers_[HANDLER_SLOTS];
         Mutex callback_lock_;
         
+        u64 dispatched_;
+        u64 unhandled_;
+        
+        static usize handler_slot(u16 ether_type) {
+            return (ether_type ^ (ether_type >> 6)) & (HANDLER_SLOTS - 1);
+        }
+        
+        void add_handler(u16 ether_type, ReceiveCallback callback, PacketCallback packet_callback,
+                        void* user_data);
+        bool remove_handler(u16 ether_type, ReceiveCallback callback, PacketCallback packet_callback);
+        void deliver_packet(PacketBuffer* packet);
+        
     public:
         EthernetManager();
         ~EthernetManager();
@@ -176,11 +242,14 @@ namespace nk::net {
         
         bool register_callback(u16 ether_type, ReceiveCallback callback, void* user_data);
         bool unregister_callback(u16 ether_type, ReceiveCallback callback);
+        bool register_packet_callback(u16 ether_type, PacketCallback callback, void* user_data);
+        bool unregister_packet_callback(u16 ether_type, PacketCallback callback);
         
         void process_packets();
         void poll_devices();
         
         void dump_devices() const;
+        void dump_statistics() const;
         
         static EthernetManager& instance();
     };
@@ -3,6 +3,8 @@
 
 #include <nanokoton/types.hpp>
 #include <nanokoton/net/ethernet.hpp>
+#include <nanokoton/net/packet.hpp>
+#include <nanokoton/net/route.hpp>
 #include <nanokoton/lib/vector.hpp>
 #include <nanokoton/lib/hashmap.hpp>
 #include <nanokoton/lib/mutex.hpp>
@@ -81,9 +83,15 @@ namespace nk::net {
         u16 identification;
         u8 time_to_live;
         Vector<u8> data;
+        PacketBuffer* buffer = nullptr;
         bool is_fragment;
         u16 fragment_offset;
         bool more_fragments;
+        
+        const u8* payload() const { return buffer ? buffer->data() : data.data(); }
+        usize payload_size() const { return buffer ? buffer->length() : data.size(); }
+        
+        bool verify_checksum() const;
     };
 
     class IPLayer {
@@ -122,6 +130,7 @@ namespace nk::net {
         HashMap<u64, FragmentBuffer> fragment_buffers_;
         Vector<RouteEntry> routing_table_;
         Vector<Interface> interfaces_;
+        RouteTable routes_;
         Mutex lock_;
         
         u16 identification_counter_;
@@ -139,16 +148,20 @@ namespace nk::net {
         Mutex callback_lock_;
         
         u16 calculate_checksum(const u8* data, usize length);
-        bool validate_packet(const u8* buffer, usize size);
+        bool validate_packet(const u8* buffer, usize size, bool checksum_verified = false);
         void process_fragment(const IPv4Header* header, const u8* data, usize size);
         void reassemble_packets();
         void cleanup_old_fragments();
         
-        bool find_route(const IPAddress& destination, RouteEntry* route);
+        void rebuild_routes();
         u32 find_interface_for_address(const IPAddress& address);
         
-        void send_packet_to_interface(u32 interface_index, const IPAddress& destination,
-                                     IPProtocol protocol, const u8* data, usize size);
+        PacketBuffer* reserve_headroom(PacketBuffer* packet);
+        bool resolve_link_address(const Route& route, const IPAddress& destination,
+                                 u8* mac_address, u32* next_hop);
+        usize send_batch_via(const Route& route, const IPAddress& destination,
+                            IPProtocol protocol, PacketBuffer** packets, usize count);
+        void dispatch_packet(const IPPacket& packet);
         
     public:
         IPLayer();
@@ -170,9 +183,13 @@ namespace nk::net {
         bool add_route(const IPAddress& network, const IPAddress& netmask,
                       const IPAddress& gateway, u32 interface_index, u32 metric = 0);
         bool remove_route(const IPAddress& network, const IPAddress& netmask);
+        bool lookup_route(const IPAddress& destination, Route* route);
         
         bool send_packet(const IPAddress& destination, IPProtocol protocol,
                         const u8* data, usize size);
+        bool send_buffer(const IPAddress& destination, IPProtocol protocol, PacketBuffer* packet);
+        usize send_buffers(const IPAddress& destination, IPProtocol protocol,
+                          PacketBuffer** packets, usize count);
         
         bool register_protocol_handler(IPProtocol protocol, PacketCallback callback,
                                       void* user_data);
@@ -180,6 +197,8 @@ namespace nk::net {
         
         void process_packet(const u8* source_mac, const u8* destination_mac,
                            const u8* buffer, usize size);
+        void process_packet_buffer(const u8* source_mac, const u8* destination_mac,
+                                  PacketBuffer* packet);
         
         void poll();
         
@@ -0,0 +1,83 @@
+#ifndef NANOKOTON_PACKET_HPP
+#define NANOKOTON_PACKET_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/mm/slab.hpp>
+
+namespace nk::net {
+    class PacketBuffer {
+    public:
+        static constexpr usize BUFFER_SIZE = 2048;
+        static constexpr usize DEFAULT_HEADROOM = 128;
+
+        static constexpr u8 CHECKSUM_IP_VERIFIED = 0x01;
+        static constexpr u8 CHECKSUM_L4_VERIFIED = 0x02;
+        static constexpr u8 CHECKSUM_PARTIAL = 0x04;
+
+    private:
+        struct Storage {
+            u8* buffer;
+            usize capacity;
+            u32 references;
+        };
+
+        Storage* storage_;
+        u8* data_;
+        usize length_;
+        u32 references_;
+
+        u8 checksum_flags_;
+        u16 checksum_offset_;
+        u8* checksum_start_;
+
+        static mm::SlabCache cache_;
+        static mm::SlabCache data_cache_;
+        static mm::SlabCache storage_cache_;
+
+        static u64 allocations_;
+        static u64 slices_;
+        static u64 frees_;
+
+        PacketBuffer(Storage* storage, u8* data, usize length);
+        ~PacketBuffer();
+
+        static void release_storage(Storage* storage);
+
+    public:
+        static void* operator new(usize size);
+        static void operator delete(void* ptr);
+
+        static PacketBuffer* allocate(usize size, usize headroom = DEFAULT_HEADROOM);
+
+        void retain() { __atomic_add_fetch(&references_, 1, __ATOMIC_RELAXED); }
+        void release();
+
+        PacketBuffer* slice(usize offset, usize length);
+
+        u8* data() const { return data_; }
+        usize length() const { return length_; }
+        usize headroom() const { return data_ - storage_->buffer; }
+        usize tailroom() const { return storage_->capacity - headroom() - length_; }
+        bool shared() const { return __atomic_load_n(&storage_->references, __ATOMIC_ACQUIRE) > 1; }
+
+        u8* push(usize size);
+        u8* pull(usize size);
+        u8* put(usize size);
+        bool trim(usize length);
+
+        u8 checksum_flags() const { return checksum_flags_; }
+        void set_checksum_flags(u8 flags) { checksum_flags_ = flags; }
+        u8* checksum_start() const { return checksum_start_; }
+        u16 checksum_offset() const { return checksum_offset_; }
+        void set_checksum_partial(u8* start, u16 offset);
+        void finish_checksum();
+
+        phys_addr physical_address() const;
+
+        static void dump_statistics();
+
+        PacketBuffer(const PacketBuffer&) = delete;
+        PacketBuffer& operator=(const PacketBuffer&) = delete;
+    };
+}
+#endif
@@ -0,0 +1,57 @@
+#ifndef NANOKOTON_RCU_HPP
+#define NANOKOTON_RCU_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/arch/smp.hpp>
+#include <nanokoton/arch/idt.hpp>
+
+namespace nk::net {
+    class RCU {
+    private:
+        struct alignas(64) ReaderState {
+            u64 sequence;
+            u32 depth;
+        };
+
+        static ReaderState readers_[arch::MAX_CPUS];
+        static u64 synchronizations_;
+
+    public:
+        class ReadGuard {
+        private:
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq_;
+            ReaderState& state_;
+
+        public:
+            ReadGuard() : state_(readers_[arch::SMP::current_cpu_id()]) {
+                if (state_.depth++ == 0) {
+                    __atomic_store_n(&state_.sequence, state_.sequence + 1, __ATOMIC_SEQ_CST);
+                }
+            }
+
+            ~ReadGuard() {
+                if (--state_.depth == 0) {
+                    __atomic_store_n(&state_.sequence, state_.sequence + 1, __ATOMIC_RELEASE);
+                }
+            }
+
+            ReadGuard(const ReadGuard&) = delete;
+            ReadGuard& operator=(const ReadGuard&) = delete;
+        };
+
+        template<typename T>
+        static T* dereference(T* const& pointer) {
+            return __atomic_load_n(&pointer, __ATOMIC_ACQUIRE);
+        }
+
+        template<typename T>
+        static void assign(T*& pointer, T* value) {
+            __atomic_store_n(&pointer, value, __ATOMIC_RELEASE);
+        }
+
+        static void synchronize();
+        static u64 synchronizations() { return synchronizations_; }
+    };
+}
+
+#endif
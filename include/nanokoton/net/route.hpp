@@ -0,0 +1,119 @@
+#ifndef NANOKOTON_ROUTE_HPP
+#define NANOKOTON_ROUTE_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/mm/slab.hpp>
+
+namespace nk::net {
+    class EthernetDevice;
+
+    struct Route {
+        u32 network;
+        u32 netmask;
+        u32 gateway;
+        u32 source;
+        u32 interface_index;
+        u32 metric;
+        u32 mtu;
+        bool local;
+        EthernetDevice* device;
+    };
+
+    class RouteTrie {
+    private:
+        struct Node {
+            u32 prefix;
+            u8 length;
+            bool has_route;
+            Route route;
+            Node* children[2];
+        };
+
+        Node* root_;
+        usize node_count_;
+        usize route_count_;
+
+        static mm::SlabCache cache_;
+
+        static u32 prefix_mask(u8 length) {
+            return length ? ~0u << (32 - length) : 0;
+        }
+
+        static u32 bit_at(u32 address, u8 position) {
+            return (address >> (31 - position)) & 1;
+        }
+
+        static u8 common_length(u32 a, u32 b, u8 limit);
+
+        Node* create_node(u32 prefix, u8 length);
+        void destroy(Node* node);
+
+    public:
+        RouteTrie();
+        ~RouteTrie();
+
+        bool insert(const Route& route);
+        const Route* lookup(u32 destination) const;
+
+        usize node_count() const { return node_count_; }
+        usize route_count() const { return route_count_; }
+
+        RouteTrie(const RouteTrie&) = delete;
+        RouteTrie& operator=(const RouteTrie&) = delete;
+    };
+
+    class RouteCache {
+    private:
+        static constexpr usize SLOTS = 256;
+
+        struct alignas(64) Slot {
+            u32 sequence;
+            u32 generation;
+            u32 destination;
+            Route route;
+        };
+
+        Slot slots_[SLOTS];
+        u32 generation_;
+
+        u64 hits_;
+        u64 misses_;
+
+        static usize slot_index(u32 destination) {
+            return (destination * 0x9E3779B1u) >> 24;
+        }
+
+    public:
+        RouteCache();
+
+        u32 generation() const { return __atomic_load_n(&generation_, __ATOMIC_ACQUIRE); }
+        void invalidate() { __atomic_add_fetch(&generation_, 1, __ATOMIC_RELEASE); }
+
+        bool lookup(u32 destination, u32 generation, Route* route);
+        void insert(u32 destination, u32 generation, const Route& route);
+
+        u64 hits() const { return hits_; }
+        u64 misses() const { return misses_; }
+    };
+
+    class RouteTable {
+    private:
+        RouteTrie* trie_;
+        RouteCache cache_;
+        u64 publications_;
+
+    public:
+        RouteTable();
+        ~RouteTable();
+
+        void publish(RouteTrie* trie);
+        bool lookup(u32 destination, Route* route);
+
+        void dump_statistics() const;
+
+        RouteTable(const RouteTable&) = delete;
+        RouteTable& operator=(const RouteTable&) = delete;
+    };
+}
+
+#endif
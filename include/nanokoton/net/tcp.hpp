@@ -7,7 +7,9 @@
 #include <nanokoton/lib/hashmap.hpp>
 #include <nanokoton/lib/queue.hpp>
 #include <nanokoton/lib/mutex.hpp>
-#include <nanokoton/lib/ringbuffer.hpp>
+#include <nanokoton/mm/slab.hpp>
+#include <nanokoton/task/timer.hpp>
+#include <nanokoton/task/process.hpp>
 
 namespace nk::net {
     struct PACKED TCPHeader {
@@ -21,6 +23,8 @@ namespace nk::net {
         u16 checksum;
         u16 urgent_pointer;
         
+        static constexpr u16 CHECKSUM_OFFSET = 16;
+        
         u8 data_offset() const { return (data_offset_reserved >> 4) & 0x0F; }
         u16 header_length() const { return data_offset() * 4; }
         
@@ -56,7 +60,16 @@ namespace nk::net {
         TimeWait
     };
 
+    struct TCPSackBlock {
+        u32 start;
+        u32 end;
+    };
+
     struct TCPSegment {
+        IPAddress source_address;
+        u16 source_port = 0;
+        IPAddress destination_address;
+        u16 destination_port = 0;
         u32 sequence_number;
         u32 acknowledgment_number;
         u16 window_size;
@@ -64,25 +77,76 @@ namespace nk::net {
         bool ack;
         bool fin;
         bool rst;
+        bool psh = false;
         Vector<u8> data;
+        PacketBuffer* buffer = nullptr;
         u64 timestamp;
+        
+        u16 mss = 0;
+        bool has_window_scale = false;
+        u8 window_scale = 0;
+        bool sack_permitted = false;
+        bool has_timestamp = false;
+        u32 timestamp_value = 0;
+        u32 timestamp_echo = 0;
+        u32 sack_count = 0;
+        TCPSackBlock sack_blocks[4];
+        
+        const u8* payload() const { return buffer ? buffer->data() : data.data(); }
+        usize payload_size() const { return buffer ? buffer->length() : data.size(); }
+    };
+
+    class StreamBuffer {
+    private:
+        u8* data_;
+        u32 capacity_;
+        u32 head_;
+        u32 tail_;
+        
+    public:
+        explicit StreamBuffer(u32 capacity);
+        ~StreamBuffer();
+        
+        u32 size() const { return tail_ - head_; }
+        u32 capacity() const { return capacity_; }
+        u32 free_space() const { return capacity_ - size(); }
+        bool empty() const { return head_ == tail_; }
+        
+        u32 write(const u8* data, u32 length);
+        u32 read(u8* buffer, u32 length);
+        u32 peek(u32 offset, u8* buffer, u32 length) const;
+        void consume(u32 length);
+        
+        StreamBuffer(const StreamBuffer&) = delete;
+        StreamBuffer& operator=(const StreamBuffer&) = delete;
     };
 
     class TCPSocket {
     private:
-        struct SendBuffer {
-            u32 sequence_start;
-            u32 sequence_end;
-            Vector<u8> data;
-            u64 timestamp;
-            bool acknowledged;
-        };
+        static constexpr u32 DEFAULT_MSS = 1460;
+        static constexpr u32 SEND_BUFFER_SIZE = 256 * 1024;
+        static constexpr u32 RECEIVE_BUFFER_SIZE = 256 * 1024;
+        static constexpr u8 WINDOW_SCALE = 3;
+        static constexpr u8 MAX_WINDOW_SCALE = 14;
+        static constexpr u32 MAX_OUT_OF_ORDER = 64;
+        static constexpr u32 MAX_SACK_BLOCKS = 4;
+        static constexpr u32 ACK_EVERY_SEGMENTS = 2;
+        static constexpr u64 DELAYED_ACK_MS = 40;
+        static constexpr u32 INITIAL_RTO_MS = 1000;
+        static constexpr u32 MIN_RTO_MS = 200;
+        static constexpr u32 MAX_RTO_MS = 60000;
+        static constexpr u32 MAX_RETRANSMITS = 10;
+        static constexpr u32 RETRANSMIT_BURST = 4;
+        static constexpr u32 DUPLICATE_ACK_THRESHOLD = 3;
+        static constexpr usize TIMESTAMP_OPTION_SIZE = 12;
         
         struct ReceiveBuffer {
             u32 sequence_start;
             u32 sequence_end;
             Vector<u8> data;
-            bool consumed;
+            PacketBuffer* packet;
+            
+            const u8* payload() const { return packet ? packet->data() : data.data(); }
         };
         
         IPAddress local_address_;
@@ -98,41 +162,104 @@ namespace nk::net {
         
         u32 send_window_;
         u32 receive_window_;
+        u32 advertised_window_;
         u32 maximum_segment_size_;
         
-        Vector<SendBuffer> send_buffers_;
-        Vector<ReceiveBuffer> receive_buffers_;
-        RingBuffer<u8> receive_queue_;
+        bool window_scaling_;
+        u8 send_window_scale_;
+        u8 receive_window_scale_;
+        bool sack_permitted_;
+        bool timestamps_;
+        u32 timestamp_recent_;
+        u32 last_ack_sent_;
+        
+        StreamBuffer send_queue_;
+        Vector<TCPSackBlock> sacked_;
+        StreamBuffer receive_queue_;
+        Vector<ReceiveBuffer> out_of_order_;
+        u32 last_out_of_order_;
+        
+        bool nodelay_;
+        bool corked_;
+        bool fin_pending_;
         
         u64 last_activity_;
+        u32 smoothed_rtt_;
+        u32 rtt_variance_;
         u32 retransmit_timeout_;
         u32 retransmit_count_;
+        u32 duplicate_acks_;
+        bool rtt_active_;
+        u32 rtt_sequence_;
+        u64 rtt_start_;
+        task::Timer retransmit_timer_;
+        bool retransmit_due_;
+        
+        u32 pending_ack_segments_;
+        task::Timer delayed_ack_timer_;
+        bool delayed_ack_due_;
+        
+        u64 segments_sent_;
+        u64 segments_received_;
+        u64 retransmits_;
+        u64 fast_retransmits_;
+        u64 delayed_acks_;
+        u64 out_of_order_segments_;
         
         Mutex send_lock_;
         Mutex receive_lock_;
         
+        static mm::SlabCache cache_;
+        
+        static bool sequence_before(u32 a, u32 b) { return static_cast<i32>(a - b) < 0; }
+        static bool sequence_after(u32 a, u32 b) { return static_cast<i32>(a - b) > 0; }
+        
         bool send_segment(const TCPSegment& segment);
         bool receive_segment(const TCPSegment& segment);
         
+        void init_segment(TCPSegment& segment, u32 sequence_number) const;
+        usize write_options(const TCPSegment& segment, u8* options) const;
+        u32 build_sack_blocks(TCPSackBlock* blocks, u32 max_blocks) const;
+        u32 effective_mss() const;
+        
         void process_syn(const TCPSegment& segment);
         void process_syn_ack(const TCPSegment& segment);
         void process_ack(const TCPSegment& segment);
         void process_fin(const TCPSegment& segment);
         void process_rst(const TCPSegment& segment);
         void process_data(const TCPSegment& segment);
+        void negotiate_options(const TCPSegment& segment);
+        
+        void send_ack();
+        void schedule_ack();
+        static void delayed_ack_expired(void* context);
+        void update_receive_window();
         
+        bool send_data_segment(u32 sequence_number, u32 length);
+        void transmit_pending(bool force);
         void retransmit_pending_data();
+        u32 retransmit_holes(u32 limit);
+        void arm_retransmit_timer();
+        void restart_retransmit_timer();
+        static void retransmit_timer_expired(void* context);
         void acknowledge_data(u32 acknowledgment_number);
+        void record_sack_blocks(const TCPSegment& segment);
+        void update_rtt(u32 sample);
         void update_window(u32 window_size);
+        void reset_connection();
         
         bool validate_sequence(u32 sequence_number, u32 length);
-        void reorder_buffers();
-        void cleanup_acknowledged_data();
+        void queue_out_of_order(const TCPSegment& segment, u32 offset, u32 sequence_number, u32 length);
+        void drain_out_of_order();
+        void release_out_of_order();
         
     public:
         TCPSocket();
         ~TCPSocket();
         
+        static void* operator new(usize size);
+        static void operator delete(void* ptr);
+        
         bool bind(const IPAddress& address, u16 port);
         bool listen(u32 backlog = 5);
         bool connect(const IPAddress& address, u16 port);
@@ -141,6 +268,11 @@ namespace nk::net {
         usize send(const u8* data, usize size);
         usize receive(u8* buffer, usize size, u64 timeout_ms = 0);
         
+        void set_nodelay(bool enable);
+        void set_cork(bool enable);
+        bool is_nodelay() const { return nodelay_; }
+        bool is_corked() const { return corked_; }
+        
         bool close();
         bool abort();
         
@@ -160,6 +292,8 @@ namespace nk::net {
         void poll();
         
         void dump_state() const;
+        
+        friend class TCPLayer;
     };
     
     class TCPLayer {
@@ -190,15 +324,27 @@ namespace nk::net {
             };
         };
         
+        static constexpr u64 TIMER_INTERVAL_MS = 1;
+        static constexpr usize TIMER_STACK_SIZE = 16384;
+        
         HashMap<ConnectionKey, TCPSocket*, ConnectionKey::Hash> connections_;
         HashMap<u16, TCPSocket*> listening_sockets_;
         Mutex lock_;
         
+        u64 checksum_errors_;
+        task::Thread* timer_thread_;
+        bool timers_due_;
+        
+        bool start_timer_thread();
+        static void timer_main();
+        
         u16 allocate_port();
         bool is_port_available(u16 port);
         
+        static void parse_options(const TCPHeader* header, TCPSegment& segment);
+        
         void process_tcp_packet(const IPPacket& packet);
-        void handle_new_connection(TCPSocket* listening_socket, const TCPSegment& segment);
+        void handle_new_connection(TCPSocket* listening_socket, const IPPacket& packet);
         
     public:
         TCPLayer();
@@ -217,6 +363,7 @@ namespace nk::net {
         
         void process_packet(const IPPacket& packet);
         void poll_sockets();
+        void timer_expired() { __atomic_store_n(&timers_due_, true, __ATOMIC_RELEASE); }
         
         usize get_connection_count() const { return connections_.size(); }
         usize get_listening_socket_count() const { return listening_sockets_.size(); }
@@ -5,7 +5,6 @@
 #include <nanokoton/net/ip.hpp>
 #include <nanokoton/lib/vector.hpp>
 #include <nanokoton/lib/hashmap.hpp>
-#include <nanokoton/lib/queue.hpp>
 #include <nanokoton/lib/mutex.hpp>
 
 namespace nk::net {
@@ -14,6 +13,8 @@ namespace nk::net {
         u16 destination_port;
         u16 length;
         u16 checksum;
+        
+        static constexpr u16 CHECKSUM_OFFSET = 6;
     };
 
     struct UDPDatagram {
@@ -22,11 +23,37 @@ namespace nk::net {
         IPAddress destination_address;
         u16 destination_port;
         Vector<u8> data;
+        PacketBuffer* buffer = nullptr;
         u64 timestamp;
+        
+        const u8* payload() const { return buffer ? buffer->data() : data.data(); }
+        usize payload_size() const { return buffer ? buffer->length() : data.size(); }
+    };
+
+    struct UDPMessage {
+        IPAddress address;
+        u16 port;
+        u8* buffer;
+        usize capacity;
+        usize length;
+        u64 timestamp;
+        bool truncated;
     };
 
     class UDPSocket {
+    public:
+        static constexpr usize RECEIVE_RING_SIZE = 1024;
+        static constexpr usize MAX_BATCH = 64;
+        static constexpr usize MAX_PAYLOAD = 65507;
+
     private:
+        struct RingEntry {
+            PacketBuffer* buffer;
+            IPAddress source_address;
+            u16 source_port;
+            u64 timestamp;
+        };
+
         IPAddress local_address_;
         u16 local_port_;
         IPAddress remote_address_;
@@ -35,13 +62,19 @@ namespace nk::net {
         bool bound_;
         bool connected_;
         
-        Queue<UDPDatagram> receive_queue_;
+        RingEntry* ring_;
+        alignas(64) usize ring_head_;
+        alignas(64) usize ring_tail_;
+        u64 ring_drops_;
         Mutex queue_lock_;
         
         using ReceiveCallback = void (*)(const UDPDatagram& datagram, void* user_data);
         ReceiveCallback callback_;
         void* callback_user_data_;
         
+        PacketBuffer* build_datagram(u16 port, const u8* data, usize size, u64 pseudo_base);
+        usize drain_ring(UDPMessage* messages, usize count);
+        
     public:
         UDPSocket();
         ~UDPSocket();
@@ -56,6 +89,9 @@ namespace nk::net {
         usize receive_from(u8* buffer, usize size, IPAddress* source_address,
                           u16* source_port, u64 timeout_ms = 0);
         
+        usize send_batch(const UDPMessage* messages, usize count);
+        usize receive_batch(UDPMessage* messages, usize count, u64 timeout_ms = 0);
+        
         bool close();
         
         void set_receive_callback(ReceiveCallback callback, void* user_data) {
@@ -71,6 +107,12 @@ namespace nk::net {
         u16 get_remote_port() const { return remote_port_; }
         const IPAddress& get_remote_address() const { return remote_address_; }
         
+        usize get_queued_count() const {
+            return __atomic_load_n(&ring_head_, __ATOMIC_ACQUIRE) -
+                   __atomic_load_n(&ring_tail_, __ATOMIC_ACQUIRE);
+        }
+        u64 get_drop_count() const { return ring_drops_; }
+        
         void queue_datagram(const UDPDatagram& datagram);
         
         void poll();
@@ -98,6 +140,8 @@ namespace nk::net {
         HashMap<SocketKey, UDPSocket*, SocketKey::Hash> bound_sockets_;
         Mutex lock_;
         
+        u64 checksum_errors_;
+        
         u16 allocate_port();
         bool is_port_available(u16 port);
         
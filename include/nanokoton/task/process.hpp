@@ -7,6 +7,8 @@
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/mutex.hpp>
 #include <nanokoton/lib/hashmap.hpp>
+#include <nanokoton/task/timer.hpp>
+#include <nanokoton/arch/fpu.hpp>
 
 namespace nk::task {
     enum class ProcessState {
@@ -44,6 +46,18 @@ namespace nk::task {
         u64 signals_received;
     };
 
+    struct ThreadSchedulingStatistics {
+        u64 wait_time;
+        u64 run_time;
+        u64 max_wait;
+        u64 dispatches;
+        u64 voluntary_switches;
+        u64 involuntary_switches;
+        u64 last_enqueue;
+        u64 last_dispatch;
+        u32 last_priority;
+    };
+
     class Thread {
     private:
         u64 id_;
@@ -58,10 +72,39 @@ namespace nk::task {
         void* tls_base_;
         usize tls_size_;
         
+        u64 cpu_affinity_;
+        u32 last_cpu_;
+        bool background_;
+        u64 last_run_time_;
+        u64 run_ticket_;
+        u64 queued_ticket_;
+        
+        Thread* list_next_;
+        Thread* list_prev_;
+        const void* list_owner_;
+        
+        Timer sleep_timer_;
+        ThreadSchedulingStatistics sched_statistics_;
+        arch::FPUState fpu_state_;
+        
+        static mm::SlabCache cache_;
+        static u64 next_id_;
+        
+        friend class Scheduler;
+        friend class ThreadPool;
+        
+        static u64 allocate_id();
+        
+        void init_registers();
+        void recycle(Process* process, u64 entry_point);
+        
     public:
         Thread(Process* process, u64 entry_point, usize stack_size = 8192);
         ~Thread();
         
+        static void* operator new(usize size);
+        static void operator delete(void* ptr);
+        
         u64 get_id() const { return id_; }
         ThreadState get_state() const { return state_; }
         Process* get_process() const { return process_; }
@@ -75,9 +118,20 @@ namespace nk::task {
         void* get_stack_top() const { return stack_ + stack_size_; }
         usize get_stack_size() const { return stack_size_; }
         
+        arch::FPUState* get_fpu_state() { return &fpu_state_; }
+        
         void* get_tls_base() const { return tls_base_; }
         usize get_tls_size() const { return tls_size_; }
         
+        u64 get_cpu_affinity() const { return cpu_affinity_; }
+        void set_cpu_affinity(u64 mask) { cpu_affinity_ = mask; }
+        u32 get_last_cpu() const { return last_cpu_; }
+        
+        bool is_background() const { return background_; }
+        void set_background(bool background) { background_ = background; }
+        
+        const ThreadSchedulingStatistics& get_scheduling_statistics() const { return sched_statistics_; }
+        
         bool is_sleeping() const { return state_ == ThreadState::Sleeping; }
         bool should_wake_up(u64 current_time) const;
         
@@ -125,6 +179,7 @@ namespace nk::task {
         
         Thread* create_thread(u64 entry_point, usize stack_size = 8192);
         bool destroy_thread(u64 thread_id);
+        bool detach_thread(Thread* thread);
         Thread* get_thread(u64 thread_id);
         Vector<Thread*> get_threads() const { return threads_; }
         usize get_thread_count() const { return threads_.size(); }
@@ -7,6 +7,9 @@
 #include <nanokoton/lib/queue.hpp>
 #include <nanokoton/lib/mutex.hpp>
 #include <nanokoton/lib/bitmap.hpp>
+#include <nanokoton/lib/spinlock.hpp>
+#include <nanokoton/arch/smp.hpp>
+#include <nanokoton/task/timer.hpp>
 
 namespace nk::task {
     enum class SchedulingPolicy {
@@ -26,40 +29,119 @@ namespace nk::task {
 
     class Scheduler {
     private:
+        static constexpr u32 PRIORITY_LEVELS = 4;
+        static constexpr usize RUN_QUEUE_CAPACITY = 256;
+        static constexpr u64 STEAL_THRESHOLD = 2;
+        static constexpr u64 CACHE_HOT_CYCLES = 500000;
+        static constexpr u32 MAX_STEAL_ATTEMPTS = 8;
+        static constexpr usize REAP_BATCH = 16;
+        static constexpr u64 REAP_INTERVAL_MS = 50;
+        static constexpr usize REAPER_STACK_SIZE = 16384;
+        static constexpr u64 MAX_IDLE_TICKS = 100;
+        static constexpr usize LATENCY_BUCKETS = 48;
+
+        struct RunQueueSlot {
+            u64 sequence;
+            Thread* thread;
+            u64 ticket;
+        };
+
         struct RunQueue {
-            Vector<Thread*> threads;
-            usize current_index;
+            RunQueueSlot slots[RUN_QUEUE_CAPACITY];
+            alignas(64) u64 enqueue_pos;
+            alignas(64) u64 dequeue_pos;
             u64 time_slice;
             u32 priority_level;
         };
-        
-        Vector<RunQueue> run_queues_;
-        Thread* idle_thread_;
-        Thread* current_thread_;
+
+        struct ThreadList {
+            Thread* head;
+            Thread* tail;
+            usize count;
+        };
+
+        struct CpuQueue {
+            RunQueue levels[PRIORITY_LEVELS];
+            alignas(64) u32 ready_mask;
+            u64 ready_count;
+            Thread* current;
+            Thread* idle;
+            u64 last_schedule_time;
+
+            ThreadList reaper;
+            SpinLock reaper_lock;
+
+            SchedulingStatistics statistics;
+            u64 local_picks;
+            u64 steals;
+            u64 stolen;
+            u64 remote_enqueues;
+            u64 migrations;
+            u64 reaped;
+            u64 tickless_idle;
+            
+            u64 wait_histogram[PRIORITY_LEVELS][LATENCY_BUCKETS];
+            u64 switch_cost_total;
+            u64 switch_cost_min;
+            u64 switch_cost_max;
+            u64 switch_cost_samples;
+        };
+
+        CpuQueue* cpus_[arch::MAX_CPUS];
         Process* idle_process_;
+        Thread* reaper_thread_;
         
         SchedulingPolicy policy_;
         u64 time_slice_default_;
-        u64 last_schedule_time_;
         u64 timer_ticks_;
         
-        SchedulingStatistics statistics_;
         Mutex lock_;
         
         Bitmap cpu_affinity_;
+        u64 cpu_affinity_storage_;
         u32 cpu_count_;
         
+        bool latency_tracing_;
+        
+        ThreadList overflow_;
+        u64 overflow_count_;
+        u64 overflows_;
+        SpinLock overflow_lock_;
+        
+        CpuQueue* create_cpu_queue(u32 cpu);
+        CpuQueue& local_queue() { return *cpus_[arch::SMP::current_cpu_id()]; }
+        bool cpu_allowed(const Thread* thread, u32 cpu) const;
+        u32 select_cpu(Thread* thread, u32 current_cpu);
+
+        static bool push(RunQueue& queue, Thread* thread, u64 ticket);
+        static bool pop(RunQueue& queue, RunQueueSlot& entry);
+        static bool claim(const RunQueueSlot& entry);
+        static void list_push(ThreadList& list, Thread* thread);
+        static void list_unlink(ThreadList& list, Thread* thread);
+        static void list_init(ThreadList& list);
+        void enqueue(u32 cpu, Thread* thread);
+        void spill(Thread* thread, u64 ticket);
+        void drain_overflow(CpuQueue& queue, u32 cpu);
+        Thread* dequeue(u32 cpu, u32 thief_cpu);
+        Thread* steal_work(CpuQueue& queue, u32 cpu);
+        
         void initialize_idle_thread();
-        void switch_to_thread(Thread* thread);
+        void switch_to_thread(Thread* thread, bool voluntary);
+        void trace_switch(CpuQueue& queue, Thread* old_thread, Thread* thread,
+                          bool voluntary, u64 current_time);
+        static usize latency_bucket(u64 cycles);
         void save_current_context();
         void load_thread_context(Thread* thread);
         
-        Thread* select_next_thread();
-        void update_thread_priorities();
+        Thread* select_next_thread(CpuQueue& queue, u32 cpu);
         void handle_timer_tick();
+        void program_next_event(CpuQueue& queue);
+        static void sleep_timeout(void* context);
+        static void reaper_main();
         
         bool validate_thread(Thread* thread);
-        void cleanup_dead_threads();
+        bool is_running_anywhere(const Thread* thread) const;
+        void discard_thread(CpuQueue& queue, Thread* thread);
         
         u64 calculate_time_slice(Thread* thread);
         u32 calculate_priority(Thread* thread);
@@ -69,15 +151,18 @@ namespace nk::task {
         ~Scheduler();
         
         bool init();
+        bool init_cpu(u32 cpu);
         void start();
         
         void add_thread(Thread* thread);
         void remove_thread(Thread* thread);
         void yield();
         void sleep(u64 milliseconds);
+        bool wait(const bool* condition, u64 milliseconds);
         void wake_up(Thread* thread);
+        usize reap_dead_threads();
         
-        Thread* get_current_thread() { return current_thread_; }
+        Thread* get_current_thread();
         Process* get_current_process();
         
         void set_scheduling_policy(SchedulingPolicy policy) { policy_ = policy; }
@@ -86,12 +171,20 @@ namespace nk::task {
         void set_time_slice(u64 time_slice) { time_slice_default_ = time_slice; }
         u64 get_time_slice() const { return time_slice_default_; }
         
-        const SchedulingStatistics& get_statistics() const { return statistics_; }
+        SchedulingStatistics get_statistics() const;
+        u64 runnable_threads(u32 cpu) const;
+        
+        void set_latency_tracing(bool enabled);
+        bool latency_tracing() const { return latency_tracing_; }
+        void reset_latency_statistics();
+        usize export_latency_histogram(u32 priority, u64* buckets, usize count) const;
         
         void dump_run_queues() const;
+        void dump_latency() const;
         void dump_statistics() const;
         
         void on_timer_tick();
+        void on_reschedule();
         
         static Scheduler& instance();
     };
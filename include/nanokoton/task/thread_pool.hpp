@@ -0,0 +1,74 @@
+#ifndef NANOKOTON_THREAD_POOL_HPP
+#define NANOKOTON_THREAD_POOL_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/lib/spinlock.hpp>
+
+namespace nk::task {
+    class Thread;
+    class Process;
+
+    class ThreadPool {
+    public:
+        static constexpr usize PAGE_SIZE = 4096;
+        static constexpr usize MIN_STACK_SHIFT = 13;
+        static constexpr usize STACK_CLASSES = 4;
+        static constexpr usize MAX_POOLED_STACK = static_cast<usize>(1) << (MIN_STACK_SHIFT + STACK_CLASSES - 1);
+        static constexpr usize PREFILL_STACKS = 8;
+
+    private:
+        static constexpr usize MAX_POOLED_THREADS = 64;
+        static constexpr usize MAX_POOLED_STACKS = 32;
+
+        struct PooledStack {
+            PooledStack* next;
+        };
+
+        struct SizeClass {
+            Thread* threads;
+            usize thread_count;
+            PooledStack* stacks;
+            usize stack_count;
+
+            u64 thread_hits;
+            u64 thread_misses;
+            u64 stack_hits;
+            u64 stack_misses;
+        };
+
+        SizeClass classes_[STACK_CLASSES];
+        u64 recycled_;
+        u64 destroyed_;
+        SpinLock lock_;
+
+        ThreadPool();
+        ~ThreadPool() = default;
+
+        static usize class_index(usize stack_size);
+
+    public:
+        static ThreadPool& instance();
+
+        static usize stack_size_for(usize size);
+
+        Thread* acquire(Process* process, u64 entry_point, usize stack_size);
+        void release(Thread* thread);
+
+        u64* allocate_stack(usize stack_size);
+        void free_stack(u64* stack, usize stack_size);
+
+        usize prefill(usize stack_size, usize count);
+
+        u64 thread_hits() const;
+        u64 thread_misses() const;
+        u64 stack_hits() const;
+        u64 stack_misses() const;
+
+        void dump_statistics() const;
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+    };
+}
+
+#endif
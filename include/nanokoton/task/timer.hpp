@@ -0,0 +1,105 @@
+#ifndef NANOKOTON_TIMER_HPP
+#define NANOKOTON_TIMER_HPP
+
+#include <nanokoton/types.hpp>
+#include <nanokoton/lib/spinlock.hpp>
+#include <nanokoton/arch/smp.hpp>
+
+namespace nk::task {
+    using TimerCallback = void (*)(void* context);
+
+    struct Timer {
+        Timer* next;
+        Timer* prev;
+        u64 expires;
+        TimerCallback callback;
+        void* context;
+        u32 cpu;
+        u8 level;
+        u8 slot;
+        bool pending;
+
+        Timer() : next(nullptr), prev(nullptr), expires(0), callback(nullptr),
+                  context(nullptr), cpu(0), level(0), slot(0), pending(false) {}
+
+        Timer(TimerCallback cb, void* ctx) : Timer() {
+            callback = cb;
+            context = ctx;
+        }
+    };
+
+    class TimerWheel {
+    public:
+        static constexpr u64 DEFAULT_TSC_PER_TICK = 1000000;
+        static constexpr u64 NO_DEADLINE = ~0ULL;
+
+    private:
+        static constexpr u64 PIT_FREQUENCY = 1193182;
+        static constexpr u64 PIT_CALIBRATION_MS = 10;
+        static constexpr u64 PIT_POLL_LIMIT = 100000000;
+        static constexpr u32 LEVEL_BITS = 6;
+        static constexpr u32 LEVEL_SIZE = 1 << LEVEL_BITS;
+        static constexpr u32 LEVEL_MASK = LEVEL_SIZE - 1;
+        static constexpr u32 LEVEL_COUNT = 4;
+        static constexpr u64 MAX_DELAY = (1ULL << (LEVEL_BITS * LEVEL_COUNT)) - 1;
+
+        struct Wheel {
+            Timer* slots[LEVEL_COUNT][LEVEL_SIZE];
+            u64 occupied[LEVEL_COUNT];
+            u64 current_tick;
+            usize pending;
+            bool started;
+            SpinLock lock;
+
+            u64 armed;
+            u64 expired;
+            u64 cancelled;
+            u64 cascaded;
+            u64 ticks_skipped;
+        };
+
+        Wheel wheels_[arch::MAX_CPUS];
+        u64 tsc_per_tick_;
+
+        TimerWheel();
+        ~TimerWheel() = default;
+
+        static u64 level_shift(u32 level) { return static_cast<u64>(level) * LEVEL_BITS; }
+
+        void insert(Wheel& wheel, Timer* timer);
+        void unlink(Wheel& wheel, Timer* timer);
+        void cascade(Wheel& wheel, u32 level);
+        u64 next_event_tick(const Wheel& wheel) const;
+        Wheel& local_wheel();
+
+        static u64 tsc_frequency_from_cpuid(u32 leaf);
+        static u64 tsc_frequency_from_pit();
+
+    public:
+        static TimerWheel& instance();
+
+        u64 now() const;
+        u64 ms_to_ticks(u64 milliseconds) const { return milliseconds; }
+        u64 cycles_to_ticks(u64 cycles) const { return (cycles + tsc_per_tick_ - 1) / tsc_per_tick_; }
+        u64 ticks_to_cycles(u64 ticks) const { return ticks * tsc_per_tick_; }
+        u64 tsc_per_tick() const { return tsc_per_tick_; }
+        void set_tsc_frequency(u64 hz);
+        bool calibrate_tsc();
+
+        void add_timer(Timer* timer, u64 delay_ticks);
+        bool cancel_timer(Timer* timer);
+        bool is_pending(const Timer* timer) const { return __atomic_load_n(&timer->pending, __ATOMIC_ACQUIRE); }
+
+        static void signal_flag(void* context);
+
+        usize run_timers();
+        u64 ticks_until_next_event();
+
+        void dump_statistics() const;
+
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+    };
+}
+
+#endif
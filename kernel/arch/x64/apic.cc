@@ -0,0 +1,143 @@
+#include <nanokoton/arch/apic.hpp>
+#include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/task/timer.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+
+namespace nk::arch {
+    volatile u32* LocalAPIC::registers_ = nullptr;
+    u64 LocalAPIC::counts_per_tick_ = 0;
+    bool LocalAPIC::available_ = false;
+    u64 LocalAPIC::oneshots_armed_ = 0;
+
+    u64 LocalAPIC::read_msr(u32 msr) {
+        u32 low, high;
+        asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+        return (static_cast<u64>(high) << 32) | low;
+    }
+
+    void LocalAPIC::write_msr(u32 msr, u64 value) {
+        u32 low = static_cast<u32>(value);
+        u32 high = static_cast<u32>(value >> 32);
+        asm volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+    }
+
+    u32 LocalAPIC::read(u32 reg) {
+        return registers_[reg / sizeof(u32)];
+    }
+
+    void LocalAPIC::write(u32 reg, u32 value) {
+        registers_[reg / sizeof(u32)] = value;
+    }
+
+    void LocalAPIC::enable() {
+        write_msr(MSR_APIC_BASE, read_msr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+        write(REG_SPURIOUS, SPURIOUS_ENABLE | SPURIOUS_VECTOR);
+        write(REG_TIMER_DIVIDE, TIMER_DIVIDE_16);
+        write(REG_LVT_TIMER, LVT_MASKED | TIMER_VECTOR);
+    }
+
+    bool LocalAPIC::calibrate() {
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        u64 cycles = wheel.ticks_to_cycles(CALIBRATION_TICKS);
+
+        write(REG_TIMER_INITIAL, 0xFFFFFFFF);
+        u64 start = CPU::read_tsc();
+        while (CPU::read_tsc() - start < cycles) {
+            CPU::pause();
+        }
+        u32 remaining = read(REG_TIMER_CURRENT);
+        write(REG_TIMER_INITIAL, 0);
+
+        u64 elapsed_ticks = wheel.cycles_to_ticks(cycles);
+        counts_per_tick_ = (0xFFFFFFFFULL - remaining) / elapsed_ticks;
+        return counts_per_tick_ != 0;
+    }
+
+    bool LocalAPIC::init() {
+        u32 eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+        if (!(edx & (1 << 9))) {
+            debug::log(debug::LogLevel::Warning, "APIC", "Local APIC not present");
+            return false;
+        }
+
+        phys_addr base = read_msr(MSR_APIC_BASE) & APIC_BASE_MASK;
+        virt_addr virt = phys_to_virt(base);
+
+        mm::PageFlags flags = mm::PageFlags::Present | mm::PageFlags::Writable |
+                              mm::PageFlags::CacheDisabled | mm::PageFlags::WriteThrough |
+                              mm::PageFlags::Global | mm::PageFlags::NoExecute;
+        if (!mm::VirtualMemoryManager::instance().map_page(virt, base, flags)) {
+            debug::log(debug::LogLevel::Error, "APIC", "Failed to map local APIC registers");
+            return false;
+        }
+
+        registers_ = reinterpret_cast<volatile u32*>(virt);
+        enable();
+
+        if (!calibrate()) {
+            debug::log(debug::LogLevel::Error, "APIC", "Local APIC timer calibration failed");
+            return false;
+        }
+
+        available_ = true;
+
+        debug::log(debug::LogLevel::Info, "APIC",
+                  "Local APIC %u at 0x%016llX, timer %llu counts/ms",
+                  id(), base, counts_per_tick_);
+        return true;
+    }
+
+    void LocalAPIC::init_ap() {
+        if (available_) {
+            enable();
+        }
+    }
+
+    u32 LocalAPIC::id() {
+        return read(REG_ID) >> 24;
+    }
+
+    void LocalAPIC::eoi() {
+        write(REG_EOI, 0);
+    }
+
+    void LocalAPIC::send_ipi(u32 apic_id, u8 vector) {
+        if (!available_) {
+            return;
+        }
+
+        write(REG_ICR_HIGH, apic_id << 24);
+        write(REG_ICR_LOW, ICR_LEVEL_ASSERT | vector);
+
+        while (read(REG_ICR_LOW) & ICR_DELIVERY_PENDING) {
+            CPU::pause();
+        }
+    }
+
+    void LocalAPIC::arm_oneshot(u64 ticks) {
+        if (!available_) {
+            return;
+        }
+
+        u64 counts = max(ticks, static_cast<u64>(1)) * counts_per_tick_;
+        if (counts > 0xFFFFFFFF) {
+            counts = 0xFFFFFFFF;
+        }
+
+        write(REG_LVT_TIMER, TIMER_VECTOR);
+        write(REG_TIMER_INITIAL, static_cast<u32>(counts));
+        oneshots_armed_++;
+    }
+
+    void LocalAPIC::stop_timer() {
+        if (!available_) {
+            return;
+        }
+
+        write(REG_LVT_TIMER, LVT_MASKED | TIMER_VECTOR);
+        write(REG_TIMER_INITIAL, 0);
+    }
+}
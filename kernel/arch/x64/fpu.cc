@@ -0,0 +1,254 @@
+#include <nanokoton/arch/fpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/lib/string.hpp>
+
+namespace nk::arch {
+    FPUState* FPU::owners_[MAX_CPUS];
+    FPUSaveMode FPU::mode_ = FPUSaveMode::FXSave;
+    u64 FPU::xcr0_ = 0;
+    usize FPU::area_size_ = FXSAVE_SIZE;
+
+    u64 FPU::traps_ = 0;
+    u64 FPU::saves_ = 0;
+    u64 FPU::restores_ = 0;
+    u64 FPU::elided_restores_ = 0;
+    u64 FPU::areas_allocated_ = 0;
+    u64 FPU::kernel_sections_ = 0;
+
+    u64 FPU::read_cr0() {
+        u64 value;
+        asm volatile("mov %%cr0, %0" : "=r"(value));
+        return value;
+    }
+
+    void FPU::write_cr0(u64 value) {
+        asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+    }
+
+    u64 FPU::read_cr4() {
+        u64 value;
+        asm volatile("mov %%cr4, %0" : "=r"(value));
+        return value;
+    }
+
+    void FPU::write_cr4(u64 value) {
+        asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+    }
+
+    void FPU::write_xcr0(u64 value) {
+        asm volatile("xsetbv" : : "c"(0), "a"(static_cast<u32>(value)),
+                     "d"(static_cast<u32>(value >> 32)));
+    }
+
+    void FPU::enable() {
+        write_cr0((read_cr0() & ~CR0_EM) | CR0_MP);
+
+        u64 cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+        if (mode_ != FPUSaveMode::FXSave) {
+            cr4 |= CR4_OSXSAVE;
+        }
+        write_cr4(cr4);
+
+        if (mode_ != FPUSaveMode::FXSave) {
+            write_xcr0(xcr0_);
+        }
+
+        if (mode_ == FPUSaveMode::XSaves) {
+            asm volatile("wrmsr" : : "c"(MSR_XSS), "a"(0), "d"(0));
+        }
+
+        owners_[SMP::current_cpu_id()] = nullptr;
+        set_task_switched();
+    }
+
+    void FPU::init() {
+        u32 eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+
+        for (u32 cpu = 0; cpu < MAX_CPUS; cpu++) {
+            owners_[cpu] = nullptr;
+        }
+
+        if (ecx & (1 << 26)) {
+            u32 features_low, features_high;
+            asm volatile("cpuid" : "=a"(features_low), "=b"(ebx), "=c"(ecx), "=d"(features_high)
+                         : "a"(0xD), "c"(0));
+            xcr0_ = ((static_cast<u64>(features_high) << 32) | features_low) & XCR0_SUPPORTED;
+            mode_ = FPUSaveMode::XSave;
+
+            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(1));
+            if (eax & (1 << 3)) {
+                mode_ = FPUSaveMode::XSaves;
+            } else if (eax & (1 << 0)) {
+                mode_ = FPUSaveMode::XSaveOpt;
+            }
+        }
+
+        enable();
+
+        if (mode_ == FPUSaveMode::XSaves) {
+            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(1));
+            area_size_ = ebx;
+        } else if (mode_ != FPUSaveMode::FXSave) {
+            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(0));
+            area_size_ = ebx;
+        }
+
+        static const char* mode_names[] = { "FXSAVE", "XSAVE", "XSAVEOPT", "XSAVES" };
+        debug::log(debug::LogLevel::Info, "FPU",
+                  "Lazy FPU switching via %s, XCR0=0x%llX, %llu byte state area",
+                  mode_names[static_cast<u32>(mode_)], xcr0_, area_size_);
+    }
+
+    void FPU::init_ap() {
+        enable();
+    }
+
+    bool FPU::allocate_area(FPUState& state) {
+        state.area = reinterpret_cast<u8*>(
+            mm::VirtualMemoryManager::instance().kmalloc_aligned(area_size_, AREA_ALIGNMENT));
+        if (!state.area) {
+            debug::log(debug::LogLevel::Error, "FPU", "Failed to allocate FPU state area");
+            return false;
+        }
+
+        memset(state.area, 0, area_size_);
+
+        *reinterpret_cast<u16*>(state.area) = 0x037F;
+        *reinterpret_cast<u32*>(state.area + 24) = 0x1F80;
+
+        if (mode_ != FPUSaveMode::FXSave) {
+            *reinterpret_cast<u64*>(state.area + XSTATE_BV_OFFSET) = 0x3 & xcr0_;
+        }
+        if (mode_ == FPUSaveMode::XSaves) {
+            *reinterpret_cast<u64*>(state.area + XCOMP_BV_OFFSET) = XCOMP_BV_COMPACTED | xcr0_;
+        }
+
+        __atomic_add_fetch(&areas_allocated_, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void FPU::save(FPUState& state) {
+        u32 low = static_cast<u32>(xcr0_);
+        u32 high = static_cast<u32>(xcr0_ >> 32);
+
+        switch (mode_) {
+            case FPUSaveMode::XSaves:
+                asm volatile("xsaves64 (%0)" : : "r"(state.area), "a"(low), "d"(high) : "memory");
+                break;
+            case FPUSaveMode::XSaveOpt:
+                asm volatile("xsaveopt64 (%0)" : : "r"(state.area), "a"(low), "d"(high) : "memory");
+                break;
+            case FPUSaveMode::XSave:
+                asm volatile("xsave64 (%0)" : : "r"(state.area), "a"(low), "d"(high) : "memory");
+                break;
+            case FPUSaveMode::FXSave:
+                asm volatile("fxsave64 (%0)" : : "r"(state.area) : "memory");
+                break;
+        }
+
+        __atomic_add_fetch(&saves_, 1, __ATOMIC_RELAXED);
+    }
+
+    void FPU::restore(FPUState& state) {
+        u32 low = static_cast<u32>(xcr0_);
+        u32 high = static_cast<u32>(xcr0_ >> 32);
+
+        switch (mode_) {
+            case FPUSaveMode::XSaves:
+                asm volatile("xrstors64 (%0)" : : "r"(state.area), "a"(low), "d"(high) : "memory");
+                break;
+            case FPUSaveMode::XSaveOpt:
+            case FPUSaveMode::XSave:
+                asm volatile("xrstor64 (%0)" : : "r"(state.area), "a"(low), "d"(high) : "memory");
+                break;
+            case FPUSaveMode::FXSave:
+                asm volatile("fxrstor64 (%0)" : : "r"(state.area) : "memory");
+                break;
+        }
+
+        __atomic_add_fetch(&restores_, 1, __ATOMIC_RELAXED);
+    }
+
+    void FPU::switch_out(FPUState* state) {
+        u32 cpu = SMP::current_cpu_id();
+
+        if (state && owners_[cpu] == state && !(read_cr0() & CR0_TS)) {
+            save(*state);
+        }
+
+        set_task_switched();
+    }
+
+    bool FPU::handle_device_not_available(FPUState* state) {
+        if (!state) {
+            return false;
+        }
+
+        InterruptDescriptorTable::ScopedInterruptDisable irq;
+
+        u32 cpu = SMP::current_cpu_id();
+        __atomic_add_fetch(&traps_, 1, __ATOMIC_RELAXED);
+
+        if (!state->area && !allocate_area(*state)) {
+            return false;
+        }
+
+        clear_task_switched();
+
+        if (owners_[cpu] == state && state->loaded_cpu == cpu) {
+            __atomic_add_fetch(&elided_restores_, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        restore(*state);
+        state->loaded_cpu = cpu;
+        owners_[cpu] = state;
+        return true;
+    }
+
+    void FPU::release(FPUState& state) {
+        InterruptDescriptorTable::ScopedInterruptDisable irq;
+
+        for (u32 cpu = 0; cpu < MAX_CPUS; cpu++) {
+            FPUState* expected = &state;
+            __atomic_compare_exchange_n(&owners_[cpu], &expected, nullptr,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+
+        if (state.area) {
+            mm::VirtualMemoryManager::instance().kfree(state.area);
+            state.area = nullptr;
+        }
+        state.loaded_cpu = ~0u;
+    }
+
+    void FPU::begin_kernel_use() {
+        u32 cpu = SMP::current_cpu_id();
+
+        if (owners_[cpu] && !(read_cr0() & CR0_TS)) {
+            save(*owners_[cpu]);
+        }
+        owners_[cpu] = nullptr;
+
+        clear_task_switched();
+        __atomic_add_fetch(&kernel_sections_, 1, __ATOMIC_RELAXED);
+    }
+
+    void FPU::end_kernel_use() {
+        set_task_switched();
+    }
+
+    void FPU::dump_statistics() {
+        debug::log(debug::LogLevel::Info, "FPU", "FPU Statistics:");
+        debug::log(debug::LogLevel::Info, "FPU", "  #NM traps: %llu", traps_);
+        debug::log(debug::LogLevel::Info, "FPU", "  Saves: %llu", saves_);
+        debug::log(debug::LogLevel::Info, "FPU", "  Restores: %llu", restores_);
+        debug::log(debug::LogLevel::Info, "FPU", "  Elided restores: %llu", elided_restores_);
+        debug::log(debug::LogLevel::Info, "FPU", "  Kernel sections: %llu", kernel_sections_);
+        debug::log(debug::LogLevel::Info, "FPU", "  State areas: %llu x %llu bytes",
+                  areas_allocated_, area_size_);
+    }
+}
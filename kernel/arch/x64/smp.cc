@@ -0,0 +1,64 @@
+#include <nanokoton/arch/smp.hpp>
+#include <nanokoton/arch/fpu.hpp>
+#include <nanokoton/arch/apic.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/lib/string.hpp>
+
+namespace nk::arch {
+    PerCPU SMP::cpus_[MAX_CPUS];
+    u32 SMP::cpu_count_ = 0;
+
+    void SMP::write_msr(u32 msr, u64 value) {
+        u32 low = static_cast<u32>(value);
+        u32 high = static_cast<u32>(value >> 32);
+        asm volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
+    }
+
+    u64 SMP::read_msr(u32 msr) {
+        u32 low, high;
+        asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+        return (static_cast<u64>(high) << 32) | low;
+    }
+
+    void SMP::install(PerCPU& cpu) {
+        cpu.self = &cpu;
+        cpu.online = true;
+        write_msr(MSR_GS_BASE, reinterpret_cast<u64>(&cpu));
+    }
+
+    void SMP::init_bsp() {
+        memset(cpus_, 0, sizeof(cpus_));
+
+        cpus_[0].cpu_id = 0;
+        cpus_[0].apic_id = 0;
+        install(cpus_[0]);
+        cpu_count_ = 1;
+
+        debug::log(debug::LogLevel::Info, "SMP",
+                  "Bootstrap processor per-CPU area at 0x%016llX",
+                  read_msr(MSR_GS_BASE));
+    }
+
+    bool SMP::init_ap(u32 cpu_id, u32 apic_id) {
+        if (cpu_id == 0 || cpu_id >= MAX_CPUS) {
+            debug::log(debug::LogLevel::Error, "SMP", "Invalid CPU id %u", cpu_id);
+            return false;
+        }
+
+        PerCPU& cpu = cpus_[cpu_id];
+        if (cpu.online) {
+            debug::log(debug::LogLevel::Warning, "SMP", "CPU %u already online", cpu_id);
+            return false;
+        }
+
+        cpu.cpu_id = cpu_id;
+        cpu.apic_id = apic_id;
+        install(cpu);
+        FPU::init_ap();
+        LocalAPIC::init_ap();
+        __atomic_add_fetch(&cpu_count_, 1, __ATOMIC_SEQ_CST);
+
+        debug::log(debug::LogLevel::Info, "SMP", "CPU %u (APIC %u) online", cpu_id, apic_id);
+        return true;
+    }
+}
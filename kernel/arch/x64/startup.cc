@@ -3,8 +3,12 @@
 #include <nanokoton/arch/cpu.hpp>
 #include <nanokoton/arch/gdt.hpp>
 #include <nanokoton/arch/idt.hpp>
+#include <nanokoton/arch/smp.hpp>
+#include <nanokoton/arch/apic.hpp>
+#include <nanokoton/arch/fpu.hpp>
 #include <nanokoton/mm/physical.hpp>
 #include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/task/timer.hpp>
 #include <nanokoton/drivers/vga.hpp>
 #include <nanokoton/drivers/serial.hpp>
 #include <nanokoton/drivers/pic.hpp>
@@ -36,10 +40,13 @@ namespace nk {
 
         arch::CPU::init();
         arch::GDT::init();
+        arch::SMP::init_bsp();
         arch::IDT::init();
+        arch::FPU::init();
 
         drivers::PIC::remap(0x20, 0x28);
         drivers::PIT::init(1000);
+        task::TimerWheel::instance().calibrate_tsc();
 
         drivers::Keyboard::init();
 
@@ -103,6 +110,10 @@ namespace nk {
         drivers::Serial::write_string("Device drivers initialized\n");
 
         drivers::PIT::start();
+        if (arch::LocalAPIC::init()) {
+            drivers::PIC::mask_irq(0);
+            arch::LocalAPIC::arm_oneshot(1);
+        }
         drivers::Keyboard::enable();
     }
 
@@ -125,6 +136,7 @@ namespace nk {
     void Kernel::init_process_management() {
         task::Scheduler::init();
         task::ProcessManager::init();
+        task::Scheduler::instance().start();
 
         drivers::VGA::write_string("Process management initialized\n");
     }
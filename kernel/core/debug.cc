@@ -1,9 +1,15 @@
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
 #include <nanokoton/drivers/serial.hpp>
 #include <nanokoton/drivers/vga.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/task/process.hpp>
+#include <nanokoton/task/scheduler.hpp>
+#include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/stdio.hpp>
+#include <nanokoton/lib/algorithm.hpp>
 
 namespace nk {
     namespace debug {
@@ -29,36 +35,311 @@ namespace nk {
             vga_logging_enabled = enable;
         }
 
+        static void write_output(const char* message) {
+            if (serial_logging_enabled) {
+                drivers::Serial::write_string(message);
+            }
+
+            if (vga_logging_enabled) {
+                drivers::VGA::write_string(message);
+            }
+        }
+
+        static const char* level_strings[] = {
+            "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
+        };
+
+        static const char* component_names[] = {
+            "SCHED", "MM", "AHCI", "NET"
+        };
+
+        Trace::Ring Trace::rings_[arch::MAX_CPUS];
+        u32 Trace::enabled_mask_ = 0;
+        bool Trace::deferred_ = false;
+        bool Trace::draining_ = false;
+        u64 Trace::drained_ = 0;
+        task::Thread* Trace::drain_thread_ = nullptr;
+
+        bool Trace::init_cpu(u32 cpu) {
+            if (cpu >= arch::MAX_CPUS) {
+                return false;
+            }
+
+            Ring& ring = rings_[cpu];
+            if (ring.records) {
+                return true;
+            }
+
+            Record* records = static_cast<Record*>(
+                mm::VirtualMemoryManager::instance().kmalloc(RING_RECORDS * sizeof(Record)));
+            if (!records) {
+                debug::log(LogLevel::Error, "TRACE", "Failed to allocate trace ring for CPU %u", cpu);
+                return false;
+            }
+
+            ring.head = 0;
+            ring.tail = 0;
+            ring.dropped = 0;
+            __atomic_store_n(&ring.records, records, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        bool Trace::start() {
+            if (drain_thread_) {
+                return true;
+            }
+
+            task::Process* process = task::ProcessManager::instance().get_current_process();
+            if (!process) {
+                return false;
+            }
+
+            task::Thread* thread = process->create_thread(reinterpret_cast<u64>(&Trace::drain_main),
+                                                          DRAIN_STACK_SIZE);
+            if (!thread) {
+                debug::log(LogLevel::Error, "TRACE", "Failed to create trace drain thread");
+                return false;
+            }
+
+            thread->set_background(true);
+            drain_thread_ = thread;
+            set_deferred(true);
+            task::Scheduler::instance().add_thread(thread);
+
+            debug::log(LogLevel::Info, "TRACE", "Deferred logging enabled, %llu records per CPU",
+                RING_RECORDS);
+            return true;
+        }
+
+        void Trace::drain_main() {
+            task::Scheduler& scheduler = task::Scheduler::instance();
+
+            for (;;) {
+                if (drain(DRAIN_BUDGET) == 0) {
+                    scheduler.sleep(DRAIN_INTERVAL_MS);
+                } else {
+                    scheduler.yield();
+                }
+            }
+        }
+
+        void Trace::enable(TraceComponent component, bool enable) {
+            u32 bit = 1u << static_cast<u32>(component);
+            if (enable) {
+                __atomic_or_fetch(&enabled_mask_, bit, __ATOMIC_RELAXED);
+            } else {
+                __atomic_and_fetch(&enabled_mask_, ~bit, __ATOMIC_RELAXED);
+            }
+        }
+
+        void Trace::set_deferred(bool deferred) {
+            if (!deferred) {
+                flush();
+            }
+            __atomic_store_n(&deferred_, deferred && drain_thread_, __ATOMIC_RELEASE);
+        }
+
+        bool Trace::reserve(Ring& ring, usize slots, u64& head) {
+            if (!__atomic_load_n(&ring.records, __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+
+            head = ring.head;
+            if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) + slots > RING_RECORDS) {
+                __atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+                return false;
+            }
+
+            return true;
+        }
+
+        void Trace::record(TraceComponent component, const char* format, const u64* args, usize count) {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            Ring& ring = rings_[arch::SMP::current_cpu_id()];
+
+            u64 head;
+            if (!reserve(ring, 1, head)) {
+                return;
+            }
+
+            Record* record = slot(ring, head);
+            record->timestamp = arch::CPU::read_tsc();
+            record->format = format;
+            for (usize i = 0; i < MAX_ARGS; i++) {
+                record->args[i] = i < count ? args[i] : 0;
+            }
+            record->length = 0;
+            record->component = static_cast<u8>(component);
+            record->level = static_cast<u8>(LogLevel::Trace);
+            record->continuation = 0;
+
+            __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+        }
+
+        bool Trace::log(LogLevel level, const char* text, usize length) {
+            if (!deferred()) {
+                return false;
+            }
+
+            length = min(length, MAX_LOG_LENGTH);
+            usize extra = length > INLINE_TEXT
+                ? (length - INLINE_TEXT + sizeof(Record) - 1) / sizeof(Record)
+                : 0;
+
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            Ring& ring = rings_[arch::SMP::current_cpu_id()];
+
+            u64 head;
+            if (!reserve(ring, 1 + extra, head)) {
+                return __atomic_load_n(&ring.records, __ATOMIC_ACQUIRE) != nullptr;
+            }
+
+            Record* record = slot(ring, head);
+            record->timestamp = arch::CPU::read_tsc();
+            record->format = nullptr;
+            record->length = static_cast<u16>(length);
+            record->component = static_cast<u8>(TraceComponent::Count);
+            record->level = static_cast<u8>(level);
+            record->continuation = static_cast<u8>(extra);
+
+            usize copied = min(length, INLINE_TEXT);
+            memcpy(record->args, text, copied);
+            for (usize i = 1; i <= extra; i++) {
+                usize chunk = min(length - copied, sizeof(Record));
+                memcpy(slot(ring, head + i), text + copied, chunk);
+                copied += chunk;
+            }
+
+            __atomic_store_n(&ring.head, head + 1 + extra, __ATOMIC_RELEASE);
+            return true;
+        }
+
+        usize Trace::render(u32 cpu, Ring& ring, u64& tail, char* line, usize size) {
+            const Record* record = slot(ring, tail);
+
+            if (record->format) {
+                char body[MAX_LOG_LENGTH];
+                snprintf(body, sizeof(body), record->format,
+                         record->args[0], record->args[1], record->args[2],
+                         record->args[3], record->args[4]);
+                tail++;
+                return snprintf(line, size, "[TRACE] [%s] [cpu%u %llu] %s\n",
+                                component_names[record->component], cpu, record->timestamp, body);
+            }
+
+            usize length = min(static_cast<usize>(record->length), size - 1);
+            usize copied = min(length, INLINE_TEXT);
+            memcpy(line, record->args, copied);
+            for (usize i = 1; i <= record->continuation; i++) {
+                usize chunk = min(length - copied, sizeof(Record));
+                memcpy(line + copied, slot(ring, tail + i), chunk);
+                copied += chunk;
+            }
+            line[copied] = '\0';
+
+            tail += 1 + record->continuation;
+            return copied;
+        }
+
+        usize Trace::drain(usize budget) {
+            bool expected = false;
+            if (!__atomic_compare_exchange_n(&draining_, &expected, true, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return 0;
+            }
+
+            u32 cpus = max(arch::SMP::cpu_count(), 1u);
+            usize per_cpu = max(budget / cpus, static_cast<usize>(1));
+            usize emitted = 0;
+
+            for (u32 cpu = 0; cpu < cpus && emitted < budget; cpu++) {
+                Ring& ring = rings_[cpu];
+                if (!__atomic_load_n(&ring.records, __ATOMIC_ACQUIRE)) {
+                    continue;
+                }
+
+                u64 tail = ring.tail;
+                u64 head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+                for (usize count = 0; tail != head && count < per_cpu; count++) {
+                    char line[MAX_LOG_LENGTH + 96];
+                    render(cpu, ring, tail, line, sizeof(line));
+                    __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+
+                    write_output(line);
+                    emitted++;
+                }
+            }
+
+            drained_ += emitted;
+            __atomic_store_n(&draining_, false, __ATOMIC_RELEASE);
+            return emitted;
+        }
+
+        void Trace::flush() {
+            while (drain(RING_RECORDS) != 0) {
+            }
+        }
+
+        u64 Trace::dropped() {
+            u64 total = 0;
+            for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+                total += __atomic_load_n(&rings_[cpu].dropped, __ATOMIC_RELAXED);
+            }
+            return total;
+        }
+
+        void Trace::dump_statistics() {
+            debug::log(LogLevel::Info, "TRACE", "Trace Statistics:");
+            debug::log(LogLevel::Info, "TRACE", "  Deferred: %s, Enabled mask: 0x%X, Drained: %llu, Dropped: %llu",
+                deferred() ? "yes" : "no", mask(), drained_, dropped());
+
+            for (u32 cpu = 0; cpu < arch::SMP::cpu_count(); cpu++) {
+                const Ring& ring = rings_[cpu];
+                if (!ring.records) {
+                    continue;
+                }
+
+                u64 head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+                u64 tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+                debug::log(LogLevel::Info, "TRACE", "  CPU %u: %llu written, %llu pending, %llu dropped",
+                    cpu, head, head - tail, ring.dropped);
+            }
+        }
+
         void log(LogLevel level, const char* component, const char* format, ...) {
             if (level < current_log_level) {
                 return;
             }
 
-            const char* level_strings[] = {
-                "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
-            };
-
-            const char* level_string = level_strings[static_cast<int>(level)];
-            char buffer[512];
+            char message[1024];
+            usize prefix = min(static_cast<usize>(snprintf(message, sizeof(message), "[%s] [%s] ",
+                                                           level_strings[static_cast<int>(level)],
+                                                           component)),
+                               sizeof(message) - 1);
 
             va_list args;
             va_start(args, format);
-            vsnprintf(buffer, sizeof(buffer), format, args);
+            vsnprintf(message + prefix, sizeof(message) - prefix, format, args);
             va_end(args);
 
-            char message[1024];
-            snprintf(message, sizeof(message), "[%s] [%s] %s\n", level_string, component, buffer);
+            usize length = min(strlen(message), sizeof(message) - 2);
+            message[length++] = '\n';
+            message[length] = '\0';
 
-            if (serial_logging_enabled) {
-                drivers::Serial::write_string(message);
+            if (level != LogLevel::Fatal && Trace::log(level, message, length)) {
+                return;
             }
 
-            if (vga_logging_enabled) {
-                drivers::VGA::write_string(message);
+            if (level == LogLevel::Fatal) {
+                Trace::flush();
             }
 
+            write_output(message);
+
             if (level == LogLevel::Fatal) {
-                Kernel::panic(buffer);
+                message[length - 1] = '\0';
+                Kernel::panic(message + prefix);
             }
         }
 
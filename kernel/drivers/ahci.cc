@@ -2,10 +2,15 @@
 #include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/mm/physical.hpp>
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
 #include <nanokoton/lib/bitops.hpp>
 #include <nanokoton/lib/algorithm.hpp>
 #include <nanokoton/arch/io.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/drivers/pic.hpp>
+#include <nanokoton/task/scheduler.hpp>
+#include <nanokoton/task/timer.hpp>
 
 namespace nk::drivers {
     Vector<AHCIController*> AHCIManager::controllers_;
@@ -16,7 +21,15 @@ namespace nk::drivers {
           hba_(nullptr),
           capabilities_(0),
           ports_implemented_(0),
-          version_(0) {
+          version_(0),
+          irq_line_(0xFF),
+          coalescing_ports_(0),
+          coalescing_completions_(0),
+          coalescing_timeout_ms_(0) {
+        for (u32 i = 0; i < MAX_PORTS; i++) {
+            queues_[i] = nullptr;
+        }
+        
         if (pci_device_) {
             pci_device_->enable_bus_mastering();
             pci_device_->enable_memory_space();
@@ -30,6 +43,9 @@ namespace nk::drivers {
                 if (ports_implemented_ & (1 << i)) {
                     stop_port(i);
                 }
+                
+                free_queue(queues_[i]);
+                queues_[i] = nullptr;
             }
             
             mm::VirtualMemoryManager::instance().kfree(hba_);
@@ -61,9 +77,11 @@ namespace nk::drivers {
             }
         }
 
+        irq_line_ = pci_device_->get_interrupt_line();
+
         debug::log(debug::LogLevel::Info, "AHCI", 
-                  "AHCI controller initialized with %u/%u ports active",
-                  successful_ports, count_bits(ports_implemented_));
+                  "AHCI controller initialized with %u/%u ports active, IRQ %u",
+                  successful_ports, count_bits(ports_implemented_), irq_line_);
         
         return successful_ports > 0;
     }
@@ -243,16 +261,27 @@ namespace nk::drivers {
             return false;
         }
 
+        u32 command_slots = ((capabilities_ >> 8) & 0x1F) + 1;
+        PortQueue& queue = *queues_[port_number];
+        
+        queue.sector_size = info.sector_size;
+        queue.supports_48bit = info.supports_48bit;
+        queue.ncq = info.supports_ncq && info.supports_48bit && (capabilities_ & HBA_CAP_SNCQ);
+        queue.depth = queue.ncq ? min(info.queue_depth, command_slots) : 1;
+        info.queue_depth = queue.depth;
+        info.max_sectors = info.supports_48bit ? MAX_SECTORS_LBA48 : MAX_SECTORS_LBA28;
         info.initialized = true;
         
         {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
             ScopedLock lock(lock_);
             ports_.push_back(info);
         }
         
         debug::log(debug::LogLevel::Success, "AHCI",
-                  "Port %u: Device '%s' initialized, %llu sectors",
-                  port_number, info.model, info.sector_count);
+                  "Port %u: Device '%s' initialized, %llu sectors, %s queue depth %u",
+                  port_number, info.model, info.sector_count,
+                  queue.ncq ? "NCQ" : "legacy", queue.depth);
         
         return true;
     }
@@ -370,7 +399,9 @@ namespace nk::drivers {
         u8* fis_base = reinterpret_cast<u8*>(fis_virt);
         memset(fis_base, 0, 256);
 
-        for (u32 i = 0; i < 32; i++) {
+        HBACommandTable* tables[MAX_SLOTS];
+
+        for (u32 i = 0; i < MAX_SLOTS; i++) {
             auto table_phys_opt = mm::PhysicalMemoryManager::instance().allocate_page();
             if (!table_phys_opt.has_value()) {
                 for (u32 j = 0; j < i; j++) {
@@ -432,23 +463,22 @@ namespace nk::drivers {
             }
 
             HBACommandTable* table = reinterpret_cast<HBACommandTable*>(table_virt);
-            memset(table, 0, sizeof(HBACommandTable) + 8 * sizeof(HBACommandTable::HBAPRDTEntry));
+            memset(table, 0, COMMAND_TABLE_SIZE);
+            tables[i] = table;
 
             cmd_list[i].command_table_base_address = table_phys & 0xFFFFFFFF;
             cmd_list[i].command_table_base_address_upper = table_phys >> 32;
-            cmd_list[i].prdt_length = 8;
+            cmd_list[i].prdt_length = PRDT_ENTRIES;
         }
 
-        port.command_list_base = cl_phys & 0xFFFFFFFF;
-        port.command_list_base_upper = cl_phys >> 32;
-        port.fis_base = fis_phys & 0xFFFFFFFF;
-        port.fis_base_upper = fis_phys >> 32;
+        port.command_list_base = cl_phys;
+        port.fis_base = fis_phys;
 
         port.interrupt_status = 0xFFFFFFFF;
         port.interrupt_enable = 0;
 
         u32 cmd = port.command_status;
-        cmd |= 0x01;
+        cmd |= PORT_CMD_ST | PORT_CMD_FRE;
         cmd &= ~0x02;
         port.command_status = cmd;
 
@@ -465,13 +495,59 @@ namespace nk::drivers {
                       "Port %u: Failed to start command engine", port_number);
             
             port.command_list_base = 0;
-            port.command_list_base_upper = 0;
             port.fis_base = 0;
-            port.fis_base_upper = 0;
             
             return false;
         }
 
+        PortQueue* queue = new PortQueue();
+        if (!queue) {
+            debug::log(debug::LogLevel::Error, "AHCI",
+                      "Port %u: Failed to allocate command queue", port_number);
+            stop_port(port_number);
+            return false;
+        }
+
+        queue->command_list = cmd_list;
+        for (u32 i = 0; i < MAX_SLOTS; i++) {
+            queue->tables[i] = tables[i];
+            queue->active[i] = nullptr;
+            queue->issued_at[i] = 0;
+        }
+        queue->port_number = port_number;
+        queue->sector_size = 512;
+        queue->supports_48bit = false;
+        queue->depth = 1;
+        queue->ncq = false;
+        queue->allocated = 0;
+        queue->backlog_head = nullptr;
+        queue->backlog_tail = nullptr;
+        queue->commands = 0;
+        queue->ncq_commands = 0;
+        queue->completions = 0;
+        queue->interrupts = 0;
+        queue->errors = 0;
+        queue->slot_waits = 0;
+        queue->max_outstanding = 0;
+        queue->coalesced = false;
+        reset_queue_statistics(*queue);
+        
+        queue->error_log = reinterpret_cast<u8*>(
+            mm::VirtualMemoryManager::instance().kmalloc_aligned(NCQ_ERROR_LOG_SIZE, NCQ_ERROR_LOG_SIZE));
+        queue->error_log_phys = 0;
+        if (queue->error_log) {
+            queue->error_log_phys = mm::VirtualMemoryManager::instance()
+                .get_physical_address(reinterpret_cast<virt_addr>(queue->error_log)).value_or(0);
+        }
+        if (!queue->error_log_phys) {
+            debug::log(debug::LogLevel::Warning, "AHCI",
+                      "Port %u: No NCQ error log buffer, error recovery will not identify failed tags",
+                      port_number);
+        }
+
+        free_queue(queues_[port_number]);
+        queues_[port_number] = queue;
+
         port.interrupt_enable = 0xFFFFFFFF;
 
         return true;
@@ -520,27 +596,17 @@ namespace nk::drivers {
 
         memset(identify_data, 0, 512);
 
-        HBACommandHeader* header = reinterpret_cast<HBACommandHeader*>(
-            reinterpret_cast<virt_addr>(hba_->ports[port_number].command_list_base) |
-            (static_cast<u64>(hba_->ports[port_number].command_list_base_upper) << 32));
+        PortQueue* queue = queues_[port_number];
         
-        if (!header) {
+        if (!queue) {
             mm::VirtualMemoryManager::instance().kfree(identify_data);
             debug::log(debug::LogLevel::Error, "AHCI",
                       "Port %u: No command list allocated", port_number);
             return false;
         }
 
-        HBACommandTable* table = reinterpret_cast<HBACommandTable*>(
-            header[0].command_table_base_address |
-            (static_cast<u64>(header[0].command_table_base_address_upper) << 32));
-        
-        if (!table) {
-            mm::VirtualMemoryManager::instance().kfree(identify_data);
-            debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: No command table allocated", port_number);
-            return false;
-        }
+        HBACommandHeader* header = queue->command_list;
+        HBACommandTable* table = queue->tables[0];
 
         FISRegisterH2D* fis = reinterpret_cast<FISRegisterH2D*>(table->command_fis);
         memset(fis, 0, sizeof(FISRegisterH2D));
@@ -605,6 +671,7 @@ namespace nk::drivers {
         
         info.supports_48bit = (identify_words[83] & (1 << 10)) != 0;
         info.supports_ncq = (identify_words[76] & (1 << 8)) != 0;
+        info.queue_depth = info.supports_ncq ? (identify_words[75] & 0x1F) + 1 : 1;
 
         if (info.supports_48bit) {
             info.sector_count = 
@@ -675,87 +742,159 @@ namespace nk::drivers {
         return false;
     }
 
-    bool AHCIController::send_command(u32 port_number, HBACommandHeader* header,
-                                      HBACommandTable* table, void* buffer, usize buffer_size) {
-        AHCIPort& port = hba_->ports[port_number];
-        
-        port.interrupt_status = 0xFFFFFFFF;
-        
-        u32 slot = 0;
-        
-        header->clear_busy_on_ok = 1;
-        
-        port.command_issue = 1 << slot;
+    bool AHCIController::lookup_port(u32 port_index, PortInfo& info) {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(lock_);
         
-        if (!wait_for_clear(port_number, offsetof(AHCIPort, command_issue), 
-                           1 << slot, 1000000)) {
-            debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Command timeout", port_number);
+        if (port_index >= ports_.size()) {
             return false;
         }
         
-        if (port.interrupt_status & (1 << 30)) {
-            port.interrupt_status = 1 << 30;
-            debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Command failed with error", port_number);
-            return false;
+        info = ports_[port_index];
+        return info.initialized && queues_[info.number] != nullptr;
+    }
+
+    bool AHCIController::append_prdt(HBACommandTable* table, u32& entries,
+                                     phys_addr address, usize length) {
+        if (entries > 0) {
+            HBACommandTable::HBAPRDTEntry& last = table->prdt_entries[entries - 1];
+            phys_addr last_base = last.data_base_address |
+                                  (static_cast<u64>(last.data_base_address_upper) << 32);
+            usize last_size = static_cast<usize>(last.byte_count) + 1;
+            
+            if (last_base + last_size == address && last_size < PRDT_MAX_BYTES) {
+                usize merged = min(length, PRDT_MAX_BYTES - last_size);
+                last.byte_count = last_size + merged - 1;
+                address += merged;
+                length -= merged;
+            }
         }
         
-        port.interrupt_status = 0xFFFFFFFF;
+        while (length > 0) {
+            if (entries >= PRDT_ENTRIES) {
+                return false;
+            }
+            
+            usize chunk_size = min(length, PRDT_MAX_BYTES);
+            HBACommandTable::HBAPRDTEntry& entry = table->prdt_entries[entries++];
+            
+            entry.data_base_address = address & 0xFFFFFFFF;
+            entry.data_base_address_upper = address >> 32;
+            entry.reserved0 = 0;
+            entry.byte_count = chunk_size - 1;
+            entry.reserved1 = 0;
+            entry.interrupt_on_completion = 0;
+            
+            address += chunk_size;
+            length -= chunk_size;
+        }
         
         return true;
     }
 
-    bool AHCIController::read_sectors(u32 port_number, u64 lba, u32 count, void* buffer) {
-        if (port_number >= ports_.size()) {
-            return false;
-        }
-
-        ScopedLock lock(lock_);
+    void AHCIController::pin_segments(const AHCIRequest* request, bool pin) {
+        mm::PhysicalMemoryManager& pmm = mm::PhysicalMemoryManager::instance();
         
-        const PortInfo& info = ports_[port_number];
-        
-        if (!info.initialized) {
-            return false;
+        for (u32 i = 0; i < request->segment_count; i++) {
+            const AHCISegment& segment = request->segments[i];
+            phys_addr first = segment.address & ~(PAGE_SIZE - 1);
+            phys_addr last = (segment.address + segment.length - 1) & ~(PAGE_SIZE - 1);
+            
+            for (phys_addr page = first; page <= last; page += PAGE_SIZE) {
+                if (!pmm.owns_page(page)) {
+                    continue;
+                }
+                
+                if (pin) {
+                    pmm.ref_page(page);
+                } else {
+                    pmm.unref_page(page);
+                }
+            }
         }
+    }
 
-        if (lba + count > info.sector_count) {
-            debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Read beyond end of disk (lba=%llu, count=%u, total=%llu)",
-                      port_number, lba, count, info.sector_count);
-            return false;
-        }
+    bool AHCIController::build_command(PortQueue& queue, u32 slot, const AHCIRequest* request) {
+        HBACommandHeader* header = &queue.command_list[slot];
+        HBACommandTable* table = queue.tables[slot];
+        u64 lba = request->lba;
+        u32 count = request->count;
+        usize total_bytes = count * queue.sector_size;
 
-        if (count == 0) {
-            return true;
-        }
+        memset(table, 0, sizeof(HBACommandTable));
 
-        HBACommandHeader* header = reinterpret_cast<HBACommandHeader*>(
-            reinterpret_cast<virt_addr>(hba_->ports[port_number].command_list_base) |
-            (static_cast<u64>(hba_->ports[port_number].command_list_base_upper) << 32));
+        u32 entries = 0;
+        usize mapped = 0;
         
-        if (!header) {
-            return false;
+        if (request->segments) {
+            for (u32 i = 0; i < request->segment_count; i++) {
+                const AHCISegment& segment = request->segments[i];
+                
+                if (segment.length == 0 || (segment.address & 1) || (segment.length & 1)) {
+                    debug::log(debug::LogLevel::Error, "AHCI",
+                              "Port %u: Misaligned DMA segment 0x%016llX+%llu",
+                              queue.port_number, segment.address, segment.length);
+                    return false;
+                }
+                
+                if (!append_prdt(table, entries, segment.address, segment.length)) {
+                    break;
+                }
+                mapped += segment.length;
+            }
+        } else {
+            virt_addr current = reinterpret_cast<virt_addr>(request->buffer);
+            usize remaining = total_bytes;
+            
+            while (remaining > 0) {
+                phys_addr phys = mm::VirtualMemoryManager::instance()
+                    .get_physical_address(current).value_or(0);
+                
+                if (!phys) {
+                    debug::log(debug::LogLevel::Error, "AHCI",
+                              "Port %u: Failed to get physical address for buffer", queue.port_number);
+                    return false;
+                }
+                
+                usize chunk_size = min(remaining, PAGE_SIZE - (current & (PAGE_SIZE - 1)));
+                if (!append_prdt(table, entries, phys, chunk_size)) {
+                    break;
+                }
+                
+                current += chunk_size;
+                remaining -= chunk_size;
+                mapped += chunk_size;
+            }
         }
 
-        HBACommandTable* table = reinterpret_cast<HBACommandTable*>(
-            header[0].command_table_base_address |
-            (static_cast<u64>(header[0].command_table_base_address_upper) << 32));
-        
-        if (!table) {
+        if (mapped != total_bytes || entries == 0) {
+            debug::log(debug::LogLevel::Error, "AHCI",
+                      "Port %u: Cannot map transfer (%llu of %llu bytes in %u PRDT entries)",
+                      queue.port_number, mapped, total_bytes, entries);
             return false;
         }
 
-        memset(table, 0, sizeof(HBACommandTable) + 8 * sizeof(HBACommandTable::HBAPRDTEntry));
+        table->prdt_entries[entries - 1].interrupt_on_completion = 1;
 
         FISRegisterH2D* fis = reinterpret_cast<FISRegisterH2D*>(table->command_fis);
-        memset(fis, 0, sizeof(FISRegisterH2D));
         
         fis->fis_type = 0x27;
         fis->command_control = 1;
-        fis->command = info.supports_48bit ? 0x25 : 0x20;
         
-        if (info.supports_48bit) {
+        if (queue.ncq) {
+            fis->command = request->write ? 0x61 : 0x60;
+            fis->lba0 = (lba >> 0) & 0xFF;
+            fis->lba1 = (lba >> 8) & 0xFF;
+            fis->lba2 = (lba >> 16) & 0xFF;
+            fis->lba3 = (lba >> 24) & 0xFF;
+            fis->lba4 = (lba >> 32) & 0xFF;
+            fis->lba5 = (lba >> 40) & 0xFF;
+            fis->feature_low = count & 0xFF;
+            fis->feature_high = (count >> 8) & 0xFF;
+            fis->count_low = slot << 3;
+            fis->device = 0x40;
+        } else if (queue.supports_48bit) {
+            fis->command = request->write ? 0x35 : 0x25;
             fis->lba0 = (lba >> 0) & 0xFF;
             fis->lba1 = (lba >> 8) & 0xFF;
             fis->lba2 = (lba >> 16) & 0xFF;
@@ -764,168 +903,615 @@ namespace nk::drivers {
             fis->lba5 = (lba >> 40) & 0xFF;
             fis->count_low = count & 0xFF;
             fis->count_high = (count >> 8) & 0xFF;
+            fis->device = 0xE0;
         } else {
+            fis->command = request->write ? 0x30 : 0x20;
             fis->lba0 = (lba >> 0) & 0xFF;
             fis->lba1 = (lba >> 8) & 0xFF;
             fis->lba2 = (lba >> 16) & 0xFF;
-            fis->device = 0x40 | ((lba >> 24) & 0x0F);
+            fis->device = 0xE0 | ((lba >> 24) & 0x0F);
             fis->count_low = count & 0xFF;
         }
 
-        fis->device |= 0xE0;
+        header->command_fis_length = sizeof(FISRegisterH2D) / sizeof(u32);
+        header->write = request->write ? 1 : 0;
+        header->prdt_length = entries;
+        header->prdb_byte_count = 0;
+        header->clear_busy_on_ok = 1;
 
-        virt_addr buffer_virt = reinterpret_cast<virt_addr>(buffer);
-        phys_addr buffer_phys = mm::VirtualMemoryManager::instance()
-            .get_physical_address(buffer_virt).value_or(0);
+        return true;
+    }
+
+    bool AHCIController::dispatch(PortQueue& queue, AHCIRequest* request, AHCIRequest*& completed) {
+        AHCIPort& port = hba_->ports[queue.port_number];
         
-        if (!buffer_phys) {
-            debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Failed to get physical address for buffer", port_number);
+        if (port.interrupt_status & PORT_IS_TFES) {
+            recover_port(queue, completed);
+        }
+        
+        u32 depth_mask = queue.depth >= MAX_SLOTS ? ~0u : (1u << queue.depth) - 1;
+        u32 free = ~(queue.allocated | port.sata_active | port.command_issue) & depth_mask;
+        
+        if (!free) {
+            request->next = nullptr;
+            if (queue.backlog_tail) {
+                queue.backlog_tail->next = request;
+            } else {
+                queue.backlog_head = request;
+            }
+            queue.backlog_tail = request;
+            queue.slot_waits++;
+            return true;
+        }
+        
+        u32 slot = __builtin_ctz(free);
+        if (!build_command(queue, slot, request)) {
             return false;
         }
+        
+        u32 bit = 1u << slot;
+        request->slot = slot;
+        queue.active[slot] = request;
+        queue.issued_at[slot] = arch::CPU::read_tsc();
+        queue.depth_total += count_bits(queue.allocated) + 1;
+        queue.depth_samples++;
+        queue.allocated |= bit;
+        
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (queue.ncq) {
+            port.sata_active = bit;
+            queue.ncq_commands++;
+        }
+        port.command_issue = bit;
+        
+        queue.commands++;
+        queue.max_outstanding = max(queue.max_outstanding,
+                                    static_cast<u32>(count_bits(queue.allocated)));
+        return true;
+    }
 
-        usize total_bytes = count * info.sector_size;
-        usize prdt_entries_needed = (total_bytes + 0x40000 - 1) / 0x40000;
+    void AHCIController::dispatch_backlog(PortQueue& queue, AHCIRequest*& completed) {
+        AHCIPort& port = hba_->ports[queue.port_number];
+        u32 depth_mask = queue.depth >= MAX_SLOTS ? ~0u : (1u << queue.depth) - 1;
         
-        if (prdt_entries_needed > 8) {
+        while (queue.backlog_head) {
+            if (!(~(queue.allocated | port.sata_active | port.command_issue) & depth_mask)) {
+                break;
+            }
+            
+            AHCIRequest* request = queue.backlog_head;
+            queue.backlog_head = request->next;
+            if (!queue.backlog_head) {
+                queue.backlog_tail = nullptr;
+            }
+            
+            if (!dispatch(queue, request, completed)) {
+                finish(completed, request, false);
+            }
+        }
+    }
+
+    void AHCIController::free_queue(PortQueue* queue) {
+        if (queue && queue->error_log) {
+            mm::VirtualMemoryManager::instance().kfree(queue->error_log);
+        }
+        delete queue;
+    }
+
+    bool AHCIController::comreset_port(u32 port_number) {
+        AHCIPort& port = hba_->ports[port_number];
+        
+        port.sata_control = (port.sata_control & ~PORT_SCTL_DET_MASK) | PORT_SCTL_DET_INIT;
+        for (u32 hold = 0; hold < COMRESET_HOLD; hold++) {
+            arch::CPU::pause();
+        }
+        port.sata_control &= ~PORT_SCTL_DET_MASK;
+        
+        u32 timeout = COMMAND_TIMEOUT;
+        while ((port.sata_status & PORT_SSTS_DET_MASK) != PORT_SSTS_DET_PRESENT && timeout--) {
+            arch::CPU::pause();
+        }
+        
+        port.sata_error = 0xFFFFFFFF;
+        
+        timeout = COMMAND_TIMEOUT;
+        while ((port.task_file_data & (PORT_TFD_BSY | PORT_TFD_DRQ)) && timeout--) {
+            arch::CPU::pause();
+        }
+        
+        port.interrupt_status = 0xFFFFFFFF;
+        return (port.sata_status & PORT_SSTS_DET_MASK) == PORT_SSTS_DET_PRESENT &&
+               (port.task_file_data & (PORT_TFD_BSY | PORT_TFD_DRQ)) == 0;
+    }
+
+    bool AHCIController::read_ncq_error_log(PortQueue& queue, u32& tag) {
+        if (!queue.error_log_phys) {
+            return false;
+        }
+        
+        AHCIPort& port = hba_->ports[queue.port_number];
+        HBACommandHeader* header = &queue.command_list[0];
+        HBACommandTable* table = queue.tables[0];
+        
+        memset(table, 0, sizeof(HBACommandTable));
+        memset(queue.error_log, 0, NCQ_ERROR_LOG_SIZE);
+        
+        table->prdt_entries[0].data_base_address = queue.error_log_phys & 0xFFFFFFFF;
+        table->prdt_entries[0].data_base_address_upper = queue.error_log_phys >> 32;
+        table->prdt_entries[0].byte_count = NCQ_ERROR_LOG_SIZE - 1;
+        table->prdt_entries[0].interrupt_on_completion = 0;
+        
+        FISRegisterH2D* fis = reinterpret_cast<FISRegisterH2D*>(table->command_fis);
+        fis->fis_type = 0x27;
+        fis->command_control = 1;
+        fis->command = ATA_READ_LOG_EXT;
+        fis->lba0 = NCQ_ERROR_LOG_PAGE;
+        fis->count_low = 1;
+        
+        header->command_fis_length = sizeof(FISRegisterH2D) / sizeof(u32);
+        header->write = 0;
+        header->prdt_length = 1;
+        header->prdb_byte_count = 0;
+        header->clear_busy_on_ok = 1;
+        
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        port.command_issue = 1u << 0;
+        
+        u32 timeout = COMMAND_TIMEOUT;
+        while ((port.command_issue & 1u) && !(port.interrupt_status & PORT_IS_TFES) && timeout--) {
+            arch::CPU::pause();
+        }
+        
+        if ((port.command_issue & 1u) || (port.interrupt_status & PORT_IS_TFES)) {
             debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Transfer too large (%llu bytes, max %llu)",
-                      port_number, total_bytes, 8 * 0x40000);
+                      "Port %u: READ LOG EXT for the NCQ error log failed (TFD=0x%08X)",
+                      queue.port_number, port.task_file_data);
+            return false;
+        }
+        
+        port.interrupt_status = 0xFFFFFFFF;
+        
+        const u8* log = queue.error_log;
+        if (log[0] & NCQ_ERROR_LOG_NQ) {
             return false;
         }
+        
+        tag = log[0] & 0x1F;
+        u64 lba = static_cast<u64>(log[4]) | (static_cast<u64>(log[5]) << 8) |
+                  (static_cast<u64>(log[6]) << 16) | (static_cast<u64>(log[8]) << 24) |
+                  (static_cast<u64>(log[9]) << 32) | (static_cast<u64>(log[10]) << 40);
+        
+        debug::log(debug::LogLevel::Error, "AHCI",
+                  "Port %u: NCQ command on tag %u failed at lba %llu (status=0x%02X, error=0x%02X)",
+                  queue.port_number, tag, lba, log[2], log[3]);
+        return true;
+    }
 
-        usize remaining = total_bytes;
-        phys_addr current_phys = buffer_phys;
+    void AHCIController::recover_port(PortQueue& queue, AHCIRequest*& completed) {
+        AHCIPort& port = hba_->ports[queue.port_number];
+        u32 task_file = port.task_file_data;
+        
+        debug::log(debug::LogLevel::Error, "AHCI",
+                  "Port %u: Restarting command engine (TFD=0x%08X, SERR=0x%08X)",
+                  queue.port_number, task_file, port.sata_error);
         
-        for (usize i = 0; i < prdt_entries_needed && remaining > 0; i++) {
-            usize chunk_size = min(remaining, static_cast<usize>(0x40000));
+        u32 pending = port.command_issue;
+        if (queue.ncq) {
+            pending |= port.sata_active;
+        }
+        
+        u64 now = arch::CPU::read_tsc();
+        u32 slots = queue.allocated;
+        while (slots) {
+            u32 slot = __builtin_ctz(slots);
+            slots &= slots - 1;
             
-            table->prdt_entries[i].data_base_address = current_phys & 0xFFFFFFFF;
-            table->prdt_entries[i].data_base_address_upper = current_phys >> 32;
-            table->prdt_entries[i].byte_count = chunk_size - 1;
-            table->prdt_entries[i].interrupt_on_completion = (i == prdt_entries_needed - 1) ? 1 : 0;
+            AHCIRequest* request = queue.active[slot];
+            queue.active[slot] = nullptr;
+            if (!request) {
+                continue;
+            }
             
-            current_phys += chunk_size;
-            remaining -= chunk_size;
+            if (pending & (1u << slot)) {
+                finish(completed, request, false);
+            } else {
+                queue.completions++;
+                record_completion(queue, request, now);
+                finish(completed, request, true);
+            }
         }
+        
+        queue.allocated = 0;
+        queue.errors++;
+        
+        port.command_status &= ~PORT_CMD_ST;
+        
+        u32 timeout = COMMAND_TIMEOUT;
+        while ((port.command_status & PORT_CMD_CR) && timeout--) {
+            arch::CPU::pause();
+        }
+        
+        port.sata_error = 0xFFFFFFFF;
+        port.interrupt_status = 0xFFFFFFFF;
+        
+        bool reset = (port.command_status & PORT_CMD_CR) != 0;
+        if (!reset && (port.task_file_data & (PORT_TFD_BSY | PORT_TFD_DRQ))) {
+            if (capabilities_ & HBA_CAP_SCLO) {
+                port.command_status |= PORT_CMD_CLO;
+                
+                timeout = COMMAND_TIMEOUT;
+                while ((port.command_status & PORT_CMD_CLO) && timeout--) {
+                    arch::CPU::pause();
+                }
+            }
+            reset = (port.task_file_data & (PORT_TFD_BSY | PORT_TFD_DRQ)) != 0;
+        }
+        
+        if (reset) {
+            debug::log(debug::LogLevel::Warning, "AHCI",
+                      "Port %u: Device still busy (TFD=0x%08X), issuing COMRESET",
+                      queue.port_number, port.task_file_data);
+            if (!comreset_port(queue.port_number)) {
+                debug::log(debug::LogLevel::Error, "AHCI",
+                          "Port %u: COMRESET did not bring the link back", queue.port_number);
+            }
+        }
+        
+        port.command_status |= PORT_CMD_ST;
+        
+        u32 tag;
+        if (!reset && queue.ncq && (task_file & PORT_TFD_ERR)) {
+            read_ncq_error_log(queue, tag);
+        }
+    }
 
-        header[0].command_fis_length = sizeof(FISRegisterH2D) / sizeof(u32);
-        header[0].write = 0;
-        header[0].prdt_length = prdt_entries_needed;
-        header[0].clear_busy_on_ok = 1;
-
-        return send_command(port_number, &header[0], table, buffer, total_bytes);
+    void AHCIController::finish(AHCIRequest*& completed, AHCIRequest* request, bool success) {
+        request->success = success;
+        request->next = completed;
+        completed = request;
     }
 
-    bool AHCIController::write_sectors(u32 port_number, u64 lba, u32 count, const void* buffer) {
-        if (port_number >= ports_.size()) {
-            return false;
+    void AHCIController::complete_requests(AHCIRequest* completed) {
+        while (completed) {
+            AHCIRequest* request = completed;
+            completed = request->next;
+            
+            AHCICompletion callback = request->callback;
+            void* context = request->context;
+            task::Thread* waiter = request->waiter;
+            
+            if (request->segments) {
+                pin_segments(request, false);
+            }
+            
+            __atomic_store_n(&request->completed, true, __ATOMIC_SEQ_CST);
+            
+            if (callback) {
+                callback(request, context);
+            }
+            
+            if (waiter) {
+                task::Scheduler::instance().wake_up(waiter);
+            }
         }
+    }
 
-        ScopedLock lock(lock_);
+    void AHCIController::service_port(PortQueue& queue) {
+        AHCIRequest* completed = nullptr;
         
-        const PortInfo& info = ports_[port_number];
+        {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(queue.lock);
+            
+            AHCIPort& port = hba_->ports[queue.port_number];
+            u32 status = port.interrupt_status;
+            port.interrupt_status = status;
+            
+            if (status & PORT_IS_TFES) {
+                recover_port(queue, completed);
+            } else {
+                u32 pending = port.command_issue;
+                if (queue.ncq) {
+                    pending |= port.sata_active;
+                }
+                
+                u64 now = arch::CPU::read_tsc();
+                u32 done = queue.allocated & ~pending;
+                while (done) {
+                    u32 slot = __builtin_ctz(done);
+                    done &= done - 1;
+                    
+                    AHCIRequest* request = queue.active[slot];
+                    queue.active[slot] = nullptr;
+                    queue.allocated &= ~(1u << slot);
+                    queue.completions++;
+                    
+                    if (request) {
+                        record_completion(queue, request, now);
+                        finish(completed, request, true);
+                    }
+                }
+                
+                for (u32 busy = queue.allocated; busy; busy &= busy - 1) {
+                    u32 slot = __builtin_ctz(busy);
+                    if (now - queue.issued_at[slot] > ms_to_cycles(REQUEST_TIMEOUT_MS)) {
+                        debug::log(debug::LogLevel::Error, "AHCI",
+                                  "Port %u: Command timeout on slot %u", queue.port_number, slot);
+                        recover_port(queue, completed);
+                        break;
+                    }
+                }
+            }
+            
+            dispatch_backlog(queue, completed);
+        }
         
-        if (!info.initialized) {
+        complete_requests(completed);
+    }
+
+    bool AHCIController::poll(u32 port_index) {
+        PortInfo info;
+        if (!lookup_port(port_index, info)) {
             return false;
         }
+        
+        service_port(*queues_[info.number]);
+        return true;
+    }
 
-        if (lba + count > info.sector_count) {
-            debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Write beyond end of disk (lba=%llu, count=%u, total=%llu)",
-                      port_number, lba, count, info.sector_count);
+    bool AHCIController::handle_interrupt() {
+        if (!hba_) {
             return false;
         }
-
-        if (count == 0) {
-            return true;
+        
+        u32 pending = hba_->interrupt_status;
+        if (!pending) {
+            return false;
         }
+        
+        u32 ports = pending;
+        if (coalescing_ports_) {
+            u32 ccc_bit = 1u << ((hba_->command_completion_coalescing_control >> 3) & 0x1F);
+            if (pending & ccc_bit) {
+                ports = (ports & ~ccc_bit) | coalescing_ports_;
+            }
+        }
+        
+        for (u32 bits = ports; bits; bits &= bits - 1) {
+            u32 port_number = __builtin_ctz(bits);
+            PortQueue* queue = queues_[port_number];
+            
+            if (queue) {
+                __atomic_add_fetch(&queue->interrupts, 1, __ATOMIC_RELAXED);
+                service_port(*queue);
+            } else {
+                hba_->ports[port_number].interrupt_status = 0xFFFFFFFF;
+            }
+        }
+        
+        hba_->interrupt_status = pending;
+        return true;
+    }
 
-        HBACommandHeader* header = reinterpret_cast<HBACommandHeader*>(
-            reinterpret_cast<virt_addr>(hba_->ports[port_number].command_list_base) |
-            (static_cast<u64>(hba_->ports[port_number].command_list_base_upper) << 32));
+    bool AHCIController::submit(AHCIRequest* request) {
+        if (!request) {
+            return false;
+        }
         
-        if (!header) {
+        PortInfo info;
+        if (!lookup_port(request->port_index, info)) {
             return false;
         }
 
-        HBACommandTable* table = reinterpret_cast<HBACommandTable*>(
-            header[0].command_table_base_address |
-            (static_cast<u64>(header[0].command_table_base_address_upper) << 32));
-        
-        if (!table) {
+        if (request->lba + request->count > info.sector_count) {
+            debug::log(debug::LogLevel::Error, "AHCI",
+                      "Port %u: %s beyond end of disk (lba=%llu, count=%u, total=%llu)",
+                      info.number, request->write ? "Write" : "Read",
+                      request->lba, request->count, info.sector_count);
             return false;
         }
 
-        memset(table, 0, sizeof(HBACommandTable) + 8 * sizeof(HBACommandTable::HBAPRDTEntry));
+        if (request->count > info.max_sectors) {
+            debug::log(debug::LogLevel::Error, "AHCI",
+                      "Port %u: %u sectors exceed the %u sector command limit",
+                      info.number, request->count, info.max_sectors);
+            return false;
+        }
 
-        FISRegisterH2D* fis = reinterpret_cast<FISRegisterH2D*>(table->command_fis);
-        memset(fis, 0, sizeof(FISRegisterH2D));
+        if (request->segments) {
+            u32 entries = 0;
+            for (u32 i = 0; i < request->segment_count; i++) {
+                entries += (request->segments[i].length + PRDT_MAX_BYTES - 1) / PRDT_MAX_BYTES;
+            }
+            
+            if (entries > PRDT_ENTRIES) {
+                debug::log(debug::LogLevel::Error, "AHCI",
+                          "Port %u: %u segments need %u PRDT entries, limit is %u",
+                          info.number, request->segment_count, entries, PRDT_ENTRIES);
+                return false;
+            }
+        }
+
+        request->completed = false;
+        request->success = false;
+        request->next = nullptr;
+        request->submit_time = arch::CPU::read_tsc();
         
-        fis->fis_type = 0x27;
-        fis->command_control = 1;
-        fis->command = info.supports_48bit ? 0x35 : 0x30;
+        debug::Trace::point(debug::TraceComponent::AHCI,
+                           "Port %u: submit %s lba=%llu count=%u",
+                           info.number, request->write ? "write" : "read",
+                           request->lba, request->count);
         
-        if (info.supports_48bit) {
-            fis->lba0 = (lba >> 0) & 0xFF;
-            fis->lba1 = (lba >> 8) & 0xFF;
-            fis->lba2 = (lba >> 16) & 0xFF;
-            fis->lba3 = (lba >> 24) & 0xFF;
-            fis->lba4 = (lba >> 32) & 0xFF;
-            fis->lba5 = (lba >> 40) & 0xFF;
-            fis->count_low = count & 0xFF;
-            fis->count_high = (count >> 8) & 0xFF;
+        if (request->segments) {
+            pin_segments(request, true);
+        }
+        
+        AHCIRequest* completed = nullptr;
+        bool queued = true;
+        
+        if (request->count == 0) {
+            finish(completed, request, true);
         } else {
-            fis->lba0 = (lba >> 0) & 0xFF;
-            fis->lba1 = (lba >> 8) & 0xFF;
-            fis->lba2 = (lba >> 16) & 0xFF;
-            fis->device = 0x40 | ((lba >> 24) & 0x0F);
-            fis->count_low = count & 0xFF;
+            PortQueue& queue = *queues_[info.number];
+            
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(queue.lock);
+            queued = dispatch(queue, request, completed);
         }
+        
+        if (!queued && request->segments) {
+            pin_segments(request, false);
+        }
+        
+        complete_requests(completed);
+        return queued;
+    }
 
-        fis->device |= 0xE0;
+    bool AHCIController::wait(AHCIRequest* request) {
+        PortInfo info;
+        if (!request || !lookup_port(request->port_index, info)) {
+            return false;
+        }
+        
+        PortQueue& queue = *queues_[info.number];
+        u64 deadline = arch::CPU::read_tsc() + ms_to_cycles(REQUEST_TIMEOUT_MS);
+        
+        while (!__atomic_load_n(&request->completed, __ATOMIC_ACQUIRE)) {
+            service_port(queue);
+            
+            if (__atomic_load_n(&request->completed, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            
+            if (arch::CPU::read_tsc() >= deadline) {
+                AHCIRequest* completed = nullptr;
+                
+                {
+                    arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                    ScopedLock lock(queue.lock);
+                    
+                    if (queue.active[request->slot] == request) {
+                        debug::log(debug::LogLevel::Error, "AHCI",
+                                  "Port %u: Command timeout on slot %u",
+                                  queue.port_number, request->slot);
+                        recover_port(queue, completed);
+                    } else {
+                        AHCIRequest* previous = nullptr;
+                        for (AHCIRequest* it = queue.backlog_head; it; previous = it, it = it->next) {
+                            if (it != request) {
+                                continue;
+                            }
+                            
+                            if (previous) {
+                                previous->next = it->next;
+                            } else {
+                                queue.backlog_head = it->next;
+                            }
+                            if (queue.backlog_tail == it) {
+                                queue.backlog_tail = previous;
+                            }
+                            
+                            finish(completed, request, false);
+                            break;
+                        }
+                    }
+                }
+                
+                complete_requests(completed);
+                break;
+            }
+            
+            if (!task::Scheduler::instance().wait(&request->completed, WAIT_SLICE_MS)) {
+                arch::CPU::pause();
+            }
+        }
+        
+        return __atomic_load_n(&request->completed, __ATOMIC_ACQUIRE) && request->success;
+    }
 
-        virt_addr buffer_virt = reinterpret_cast<virt_addr>(buffer);
-        phys_addr buffer_phys = mm::VirtualMemoryManager::instance()
-            .get_physical_address(buffer_virt).value_or(0);
+    bool AHCIController::transfer(u32 port_index, u64 lba, u32 count, void* buffer, bool write) {
+        PortInfo info;
+        if (!lookup_port(port_index, info)) {
+            return false;
+        }
         
-        if (!buffer_phys) {
+        u8* current = static_cast<u8*>(buffer);
+        
+        while (count > 0) {
+            u32 chunk = min(count, info.max_sectors);
+            
+            usize offset = reinterpret_cast<virt_addr>(current) & (PAGE_SIZE - 1);
+            usize prdt_bytes = static_cast<usize>(PRDT_ENTRIES) * PAGE_SIZE - offset;
+            chunk = min(chunk, static_cast<u32>(prdt_bytes / info.sector_size));
+            
+            AHCIRequest request;
+            request.port_index = port_index;
+            request.lba = lba;
+            request.count = chunk;
+            request.buffer = current;
+            request.write = write;
+            request.waiter = task::Scheduler::instance().get_current_thread();
+            
+            if (!submit(&request) || !wait(&request)) {
+                return false;
+            }
+            
+            lba += chunk;
+            count -= chunk;
+            current += static_cast<usize>(chunk) * info.sector_size;
+        }
+        
+        return true;
+    }
+
+    bool AHCIController::transfer_vector(u32 port_index, u64 lba, const AHCISegment* segments,
+                                         u32 segment_count, bool write) {
+        PortInfo info;
+        if (!segments || segment_count == 0 || !lookup_port(port_index, info)) {
+            return false;
+        }
+        
+        usize total_bytes = 0;
+        for (u32 i = 0; i < segment_count; i++) {
+            total_bytes += segments[i].length;
+        }
+        
+        if (total_bytes % info.sector_size != 0) {
             debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Failed to get physical address for buffer", port_number);
+                      "Port %u: Vectored transfer of %llu bytes is not sector aligned",
+                      info.number, total_bytes);
             return false;
         }
-
-        usize total_bytes = count * info.sector_size;
-        usize prdt_entries_needed = (total_bytes + 0x40000 - 1) / 0x40000;
         
-        if (prdt_entries_needed > 8) {
+        if (total_bytes / info.sector_size > info.max_sectors) {
             debug::log(debug::LogLevel::Error, "AHCI",
-                      "Port %u: Transfer too large (%llu bytes, max %llu)",
-                      port_number, total_bytes, 8 * 0x40000);
+                      "Port %u: Vectored transfer of %llu bytes exceeds %u sectors, split it",
+                      info.number, total_bytes, info.max_sectors);
             return false;
         }
-
-        usize remaining = total_bytes;
-        phys_addr current_phys = buffer_phys;
         
-        for (usize i = 0; i < prdt_entries_needed && remaining > 0; i++) {
-            usize chunk_size = min(remaining, static_cast<usize>(0x40000));
-            
-            table->prdt_entries[i].data_base_address = current_phys & 0xFFFFFFFF;
-            table->prdt_entries[i].data_base_address_upper = current_phys >> 32;
-            table->prdt_entries[i].byte_count = chunk_size - 1;
-            table->prdt_entries[i].interrupt_on_completion = (i == prdt_entries_needed - 1) ? 1 : 0;
-            
-            current_phys += chunk_size;
-            remaining -= chunk_size;
+        AHCIRequest request;
+        request.port_index = port_index;
+        request.lba = lba;
+        request.count = total_bytes / info.sector_size;
+        request.segments = segments;
+        request.segment_count = segment_count;
+        request.write = write;
+        request.waiter = task::Scheduler::instance().get_current_thread();
+        
+        if (!submit(&request)) {
+            return false;
         }
+        
+        return wait(&request);
+    }
 
-        header[0].command_fis_length = sizeof(FISRegisterH2D) / sizeof(u32);
-        header[0].write = 1;
-        header[0].prdt_length = prdt_entries_needed;
-        header[0].clear_busy_on_ok = 1;
+    bool AHCIController::read_sectors(u32 port_index, u64 lba, u32 count, void* buffer) {
+        return transfer(port_index, lba, count, buffer, false);
+    }
 
-        return send_command(port_number, &header[0], table, const_cast<void*>(buffer), total_bytes);
+    bool AHCIController::write_sectors(u32 port_index, u64 lba, u32 count, const void* buffer) {
+        return transfer(port_index, lba, count, const_cast<void*>(buffer), true);
     }
 
     bool AHCIController::read(u32 port_number, u64 lba, u32 count, void* buffer) {
@@ -936,7 +1522,16 @@ namespace nk::drivers {
         return write_sectors(port_number, lba, count, buffer);
     }
 
+    bool AHCIController::readv(u32 port_number, u64 lba, const AHCISegment* segments, u32 segment_count) {
+        return transfer_vector(port_number, lba, segments, segment_count, false);
+    }
+
+    bool AHCIController::writev(u32 port_number, u64 lba, const AHCISegment* segments, u32 segment_count) {
+        return transfer_vector(port_number, lba, segments, segment_count, true);
+    }
+
     const AHCIController::PortInfo* AHCIController::get_port_info(u32 index) const {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
         ScopedLock lock(lock_);
         
         if (index >= ports_.size()) {
@@ -946,7 +1541,216 @@ namespace nk::drivers {
         return &ports_[index];
     }
 
+    void AHCIController::record_completion(PortQueue& queue, const AHCIRequest* request, u64 now) {
+        u64 latency = cycles_to_us(now - request->submit_time);
+        u64 bytes = static_cast<u64>(request->count) * queue.sector_size;
+        
+        debug::Trace::point(debug::TraceComponent::AHCI,
+                           "Port %u: complete slot %u lba=%llu latency=%llu us",
+                           queue.port_number, request->slot, request->lba, latency);
+        
+        if (request->write) {
+            queue.writes++;
+            queue.bytes_written += bytes;
+        } else {
+            queue.reads++;
+            queue.bytes_read += bytes;
+        }
+        
+        u32 bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+        queue.latency_histogram[min(bucket, LATENCY_BUCKETS - 1)]++;
+        queue.latency_total += latency;
+        queue.latency_max = max(queue.latency_max, latency);
+    }
+
+    u64 AHCIController::ms_to_cycles(u64 milliseconds) {
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        return wheel.ticks_to_cycles(wheel.ms_to_ticks(milliseconds));
+    }
+
+    u64 AHCIController::cycles_to_us(u64 cycles) {
+        u64 cycles_per_ms = max(ms_to_cycles(1), static_cast<u64>(1));
+        return cycles * 1000 / cycles_per_ms;
+    }
+
+    void AHCIController::reset_queue_statistics(PortQueue& queue) {
+        queue.stats_start = arch::CPU::read_tsc();
+        queue.reads = 0;
+        queue.writes = 0;
+        queue.bytes_read = 0;
+        queue.bytes_written = 0;
+        queue.depth_total = 0;
+        queue.depth_samples = 0;
+        queue.latency_total = 0;
+        queue.latency_max = 0;
+        
+        for (u32 i = 0; i < LATENCY_BUCKETS; i++) {
+            queue.latency_histogram[i] = 0;
+        }
+    }
+
+    u64 AHCIController::latency_percentile(const PortQueue& queue, u32 percent) {
+        u64 total = queue.reads + queue.writes;
+        if (total == 0) {
+            return 0;
+        }
+        
+        u64 threshold = (total * percent + 99) / 100;
+        u64 seen = 0;
+        
+        for (u32 i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += queue.latency_histogram[i];
+            if (seen >= threshold) {
+                return 2ULL << i;
+            }
+        }
+        
+        return queue.latency_max;
+    }
+
+    void AHCIController::program_coalescing() {
+        u32 control = hba_->command_completion_coalescing_control;
+        
+        hba_->command_completion_coalescing_control = control & ~CCC_CTL_EN;
+        
+        if (!coalescing_ports_) {
+            hba_->command_completion_coalescing_ports = 0;
+            return;
+        }
+        
+        control &= 0xF8;
+        control |= static_cast<u32>(coalescing_timeout_ms_) << 16;
+        control |= static_cast<u32>(coalescing_completions_) << 8;
+        
+        hba_->command_completion_coalescing_control = control;
+        hba_->command_completion_coalescing_ports = coalescing_ports_;
+        hba_->command_completion_coalescing_control = control | CCC_CTL_EN;
+    }
+
+    bool AHCIController::set_coalescing(u32 port_index, bool enable, u8 completions, u16 timeout_ms) {
+        if (!hba_ || !supports_coalescing()) {
+            debug::log(debug::LogLevel::Warning, "AHCI",
+                      "Command completion coalescing not supported by HBA");
+            return false;
+        }
+        
+        PortInfo info;
+        if (!lookup_port(port_index, info)) {
+            return false;
+        }
+        
+        if (enable && (completions == 0 || timeout_ms == 0)) {
+            return false;
+        }
+        
+        PortQueue& queue = *queues_[info.number];
+        
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(lock_);
+        
+        if (enable) {
+            coalescing_ports_ |= 1u << info.number;
+            coalescing_completions_ = completions;
+            coalescing_timeout_ms_ = timeout_ms;
+        } else {
+            coalescing_ports_ &= ~(1u << info.number);
+        }
+        queue.coalesced = enable;
+        
+        program_coalescing();
+        
+        debug::log(debug::LogLevel::Info, "AHCI",
+                  "Port %u: Completion coalescing %s (%u completions, %u ms)",
+                  info.number, enable ? "enabled" : "disabled",
+                  coalescing_completions_, coalescing_timeout_ms_);
+        return true;
+    }
+
+    usize AHCIController::export_latency_histogram(u32 port_index, u64* buckets, usize count) const {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(lock_);
+        
+        if (!buckets || port_index >= ports_.size()) {
+            return 0;
+        }
+        
+        const PortQueue* queue = queues_[ports_[port_index].number];
+        if (!queue) {
+            return 0;
+        }
+        
+        usize exported = min(count, static_cast<usize>(LATENCY_BUCKETS));
+        for (usize i = 0; i < exported; i++) {
+            buckets[i] = queue->latency_histogram[i];
+        }
+        return exported;
+    }
+
+    void AHCIController::reset_statistics(u32 port_index) {
+        PortInfo info;
+        if (!lookup_port(port_index, info)) {
+            return;
+        }
+        
+        PortQueue& queue = *queues_[info.number];
+        
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(queue.lock);
+        reset_queue_statistics(queue);
+    }
+
+    void AHCIController::dump_statistics() const {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(lock_);
+        
+        u64 now = arch::CPU::read_tsc();
+        
+        debug::log(debug::LogLevel::Info, "AHCI", "AHCI I/O Statistics:");
+        if (coalescing_ports_) {
+            debug::log(debug::LogLevel::Info, "AHCI",
+                      "  Coalescing: ports=0x%08X completions=%u timeout=%u ms",
+                      coalescing_ports_, coalescing_completions_, coalescing_timeout_ms_);
+        }
+        
+        for (usize i = 0; i < ports_.size(); i++) {
+            const PortQueue* queue = queues_[ports_[i].number];
+            if (!queue) {
+                continue;
+            }
+            
+            u64 completions = queue->reads + queue->writes;
+            u64 elapsed_ms = max(cycles_to_us(now - queue->stats_start) / 1000, static_cast<u64>(1));
+            
+            debug::log(debug::LogLevel::Info, "AHCI",
+                      "  Port %u: %llu IOPS, %llu KB/s read, %llu KB/s written",
+                      queue->port_number, completions * 1000 / elapsed_ms,
+                      queue->bytes_read / elapsed_ms, queue->bytes_written / elapsed_ms);
+            debug::log(debug::LogLevel::Info, "AHCI",
+                      "    Reads: %llu (%llu bytes), writes: %llu (%llu bytes)",
+                      queue->reads, queue->bytes_read, queue->writes, queue->bytes_written);
+            debug::log(debug::LogLevel::Info, "AHCI",
+                      "    Queue depth: avg %llu.%02llu, max %u of %u, interrupts: %llu%s",
+                      queue->depth_samples ? queue->depth_total / queue->depth_samples : 0,
+                      queue->depth_samples ? (queue->depth_total * 100 / queue->depth_samples) % 100 : 0,
+                      queue->max_outstanding, queue->depth, queue->interrupts,
+                      queue->coalesced ? " (coalesced)" : "");
+            debug::log(debug::LogLevel::Info, "AHCI",
+                      "    Latency (us): avg %llu, p50 <%llu, p99 <%llu, max %llu",
+                      completions ? queue->latency_total / completions : 0,
+                      latency_percentile(*queue, 50), latency_percentile(*queue, 99),
+                      queue->latency_max);
+            
+            for (u32 bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+                if (queue->latency_histogram[bucket]) {
+                    debug::log(debug::LogLevel::Info, "AHCI", "      [%llu, %llu) us: %llu",
+                              1ULL << bucket, 2ULL << bucket, queue->latency_histogram[bucket]);
+                }
+            }
+        }
+    }
+
     void AHCIController::dump_info() const {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
         ScopedLock lock(lock_);
         
         debug::log(debug::LogLevel::Info, "AHCI", "AHCI Controller Information:");
@@ -969,6 +1773,17 @@ namespace nk::drivers {
                       info.supports_48bit ? "yes" : "no");
             debug::log(debug::LogLevel::Info, "AHCI", "    NCQ: %s",
                       info.supports_ncq ? "yes" : "no");
+            
+            const PortQueue* queue = queues_[info.number];
+            if (queue) {
+                debug::log(debug::LogLevel::Info, "AHCI",
+                          "    Queue: depth=%u ncq=%s commands=%llu ncq_commands=%llu "
+                          "completions=%llu interrupts=%llu max_outstanding=%u "
+                          "slot_waits=%llu errors=%llu",
+                          queue->depth, queue->ncq ? "yes" : "no", queue->commands,
+                          queue->ncq_commands, queue->completions, queue->interrupts,
+                          queue->max_outstanding, queue->slot_waits, queue->errors);
+            }
         }
     }
 
@@ -999,6 +1814,10 @@ namespace nk::drivers {
         if (controller->init()) {
             controllers_.push_back(controller);
             controller->dump_info();
+            
+            if (controller->get_irq() < 16) {
+                PIC::unmask_irq(controller->get_irq());
+            }
         } else {
             debug::log(debug::LogLevel::Error, "AHCI",
                       "Failed to initialize AHCI controller");
@@ -1018,25 +1837,62 @@ namespace nk::drivers {
 
     bool AHCIManager::read(u32 controller_index, u32 port_index, 
                           u64 lba, u32 count, void* buffer) {
-        ScopedLock lock(lock_);
-        
-        if (controller_index >= controllers_.size()) {
+        AHCIController* controller = get_controller(controller_index);
+        if (!controller) {
             return false;
         }
         
-        AHCIController* controller = controllers_[controller_index];
         return controller->read(port_index, lba, count, buffer);
     }
 
     bool AHCIManager::write(u32 controller_index, u32 port_index,
                            u64 lba, u32 count, const void* buffer) {
-        ScopedLock lock(lock_);
-        
-        if (controller_index >= controllers_.size()) {
+        AHCIController* controller = get_controller(controller_index);
+        if (!controller) {
             return false;
         }
         
-        AHCIController* controller = controllers_[controller_index];
         return controller->write(port_index, lba, count, buffer);
     }
-}
+
+    bool AHCIManager::readv(u32 controller_index, u32 port_index, u64 lba,
+                           const AHCISegment* segments, u32 segment_count) {
+        AHCIController* controller = get_controller(controller_index);
+        if (!controller) {
+            return false;
+        }
+        
+        return controller->readv(port_index, lba, segments, segment_count);
+    }
+
+    bool AHCIManager::writev(u32 controller_index, u32 port_index, u64 lba,
+                            const AHCISegment* segments, u32 segment_count) {
+        AHCIController* controller = get_controller(controller_index);
+        if (!controller) {
+            return false;
+        }
+        
+        return controller->writev(port_index, lba, segments, segment_count);
+    }
+
+    bool AHCIManager::submit(u32 controller_index, AHCIRequest* request) {
+        AHCIController* controller = get_controller(controller_index);
+        if (!controller) {
+            return false;
+        }
+        
+        return controller->submit(request);
+    }
+
+    bool AHCIManager::handle_interrupt(u8 irq) {
+        bool handled = false;
+        
+        for (AHCIController* controller : controllers_) {
+            if (controller->get_irq() == irq && controller->handle_interrupt()) {
+                handled = true;
+            }
+        }
+        
+        return handled;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,553 @@
+#include <nanokoton/drivers/block.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/task/scheduler.hpp>
+#include <nanokoton/task/timer.hpp>
+#include <nanokoton/lib/string.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+
+namespace nk::drivers {
+    Vector<BlockQueue*> BlockLayer::queues_;
+    SpinLock BlockLayer::lock_;
+
+    BlockQueue::BlockQueue(AHCIController* controller, u32 port_index)
+        : controller_(controller),
+          port_index_(port_index),
+          sector_size_(512),
+          max_sectors_(256),
+          depth_(MAX_DEPTH),
+          commands_(nullptr),
+          free_commands_(nullptr),
+          pending_(nullptr),
+          pending_count_(0),
+          in_flight_(0),
+          plug_depth_(0),
+          head_position_(0) {
+        memset(&statistics_, 0, sizeof(statistics_));
+
+        const auto* info = controller_ ? controller_->get_port_info(port_index_) : nullptr;
+        if (info) {
+            sector_size_ = info->sector_size;
+            max_sectors_ = max(info->max_sectors, 1u);
+            depth_ = max(min(info->queue_depth, MAX_DEPTH), 1u);
+        }
+
+        commands_ = new Command[MAX_DEPTH];
+        if (!commands_) {
+            debug::log(debug::LogLevel::Error, "BLOCK",
+                      "Failed to allocate command pool for port %u", port_index_);
+            return;
+        }
+
+        for (u32 i = 0; i < MAX_DEPTH; i++) {
+            commands_[i].queue = this;
+            commands_[i].requests = nullptr;
+            commands_[i].partial = nullptr;
+            commands_[i].next = free_commands_;
+            free_commands_ = &commands_[i];
+        }
+    }
+
+    BlockQueue::~BlockQueue() {
+        delete[] commands_;
+    }
+
+    void BlockQueue::insert_sorted(BlockRequest* request) {
+        BlockRequest* previous = nullptr;
+        BlockRequest* current = pending_;
+
+        while (current && current->lba <= request->lba) {
+            previous = current;
+            current = current->next;
+        }
+
+        request->next = current;
+        if (previous) {
+            previous->next = request;
+        } else {
+            pending_ = request;
+        }
+    }
+
+    void BlockQueue::unlink_pending(BlockRequest* previous, BlockRequest* request) {
+        if (previous) {
+            previous->next = request->next;
+        } else {
+            pending_ = request->next;
+        }
+
+        request->next = nullptr;
+        pending_count_--;
+    }
+
+    BlockRequest* BlockQueue::select_next(BlockRequest*& previous) {
+        u64 now = task::TimerWheel::instance().now();
+
+        BlockRequest* chosen = nullptr;
+        BlockRequest* chosen_previous = nullptr;
+        BlockRequest* expired = nullptr;
+        BlockRequest* expired_previous = nullptr;
+
+        BlockRequest* last = nullptr;
+        for (BlockRequest* it = pending_; it; last = it, it = it->next) {
+            if (it->deadline <= now && (!expired || it->deadline < expired->deadline)) {
+                expired = it;
+                expired_previous = last;
+            }
+
+            if (!chosen && it->lba >= head_position_) {
+                chosen = it;
+                chosen_previous = last;
+            }
+        }
+
+        if (expired) {
+            statistics_.deadline_dispatches++;
+            previous = expired_previous;
+            return expired;
+        }
+
+        if (!chosen) {
+            chosen = pending_;
+            chosen_previous = nullptr;
+        }
+
+        previous = chosen_previous;
+        return chosen;
+    }
+
+    bool BlockQueue::append_segments(Command* command, const BlockRequest* request,
+                                     u32 offset, u32 limit, u32& sectors) {
+        AHCISegment* segments = command->segments;
+        u32& segment_count = command->ahci.segment_count;
+
+        virt_addr current = reinterpret_cast<virt_addr>(request->buffer) +
+                            static_cast<usize>(offset) * sector_size_;
+        usize remaining = static_cast<usize>(min(request->count - offset, limit)) * sector_size_;
+        usize appended = 0;
+
+        while (remaining > 0) {
+            phys_addr phys = mm::VirtualMemoryManager::instance()
+                .get_physical_address(current).value_or(0);
+            if (!phys) {
+                return false;
+            }
+
+            usize chunk_size = min(remaining, PAGE_SIZE - (current & (PAGE_SIZE - 1)));
+
+            if (segment_count > 0 &&
+                segments[segment_count - 1].address + segments[segment_count - 1].length == phys) {
+                segments[segment_count - 1].length += chunk_size;
+            } else {
+                if (segment_count >= MAX_SEGMENTS) {
+                    break;
+                }
+                segments[segment_count].address = phys;
+                segments[segment_count].length = chunk_size;
+                segment_count++;
+            }
+
+            current += chunk_size;
+            remaining -= chunk_size;
+            appended += chunk_size;
+        }
+
+        usize excess = appended % sector_size_;
+        while (excess > 0) {
+            AHCISegment& last = segments[segment_count - 1];
+            if (last.length > excess) {
+                last.length -= excess;
+                break;
+            }
+            excess -= last.length;
+            segment_count--;
+        }
+
+        sectors = appended / sector_size_;
+        return true;
+    }
+
+    BlockQueue::Command* BlockQueue::build_command(BlockRequest*& failed) {
+        if (!pending_ || !free_commands_ || in_flight_ >= depth_) {
+            return nullptr;
+        }
+
+        BlockRequest* previous = nullptr;
+        BlockRequest* request = select_next(previous);
+        Command* command = free_commands_;
+
+        command->ahci = AHCIRequest();
+        command->ahci.segments = command->segments;
+        command->ahci.segment_count = 0;
+        command->requests = nullptr;
+        command->partial = nullptr;
+
+        u32 sectors = 0;
+        if (!append_segments(command, request, request->submitted, max_sectors_, sectors) || sectors == 0) {
+            debug::log(debug::LogLevel::Error, "BLOCK",
+                      "Port %u: Cannot map buffer for lba=%llu count=%u",
+                      port_index_, request->lba + request->submitted, request->count - request->submitted);
+            unlink_pending(previous, request);
+            request->failed = true;
+            request->submitted = request->count;
+            if (request->chunks == 0) {
+                request->next = failed;
+                failed = request;
+            }
+            statistics_.errors++;
+            return nullptr;
+        }
+
+        u64 start = request->lba + request->submitted;
+        u64 end = start + sectors;
+        request->submitted += sectors;
+        request->chunks++;
+
+        if (request->submitted < request->count) {
+            command->partial = request;
+            statistics_.splits++;
+        } else {
+            BlockRequest* candidate = request->next;
+            unlink_pending(previous, request);
+            command->requests = request;
+
+            BlockRequest* tail = request;
+            u32 merge_limit = min(MAX_MERGE_SECTORS, max_sectors_);
+
+            while (candidate && candidate->submitted == 0 && candidate->lba == end &&
+                   candidate->write == request->write && sectors + candidate->count <= merge_limit) {
+                u32 saved_count = command->ahci.segment_count;
+                usize saved_length = command->segments[saved_count - 1].length;
+
+                u32 appended = 0;
+                if (!append_segments(command, candidate, 0, candidate->count, appended) ||
+                    appended != candidate->count) {
+                    command->ahci.segment_count = saved_count;
+                    command->segments[saved_count - 1].length = saved_length;
+                    break;
+                }
+
+                BlockRequest* next = candidate->next;
+                unlink_pending(previous, candidate);
+                candidate->submitted = candidate->count;
+                candidate->chunks = 1;
+
+                tail->next = candidate;
+                tail = candidate;
+
+                end += candidate->count;
+                sectors += candidate->count;
+                statistics_.merges++;
+
+                candidate = next;
+            }
+        }
+
+        free_commands_ = command->next;
+        command->next = nullptr;
+
+        command->ahci.port_index = port_index_;
+        command->ahci.lba = start;
+        command->ahci.count = sectors;
+        command->ahci.write = request->write;
+        command->ahci.callback = command_complete;
+        command->ahci.context = command;
+
+        in_flight_++;
+        head_position_ = end;
+
+        statistics_.commands++;
+        statistics_.max_in_flight = max(statistics_.max_in_flight, in_flight_);
+
+        return command;
+    }
+
+    void BlockQueue::run_queue(bool force) {
+        for (;;) {
+            Command* command = nullptr;
+            BlockRequest* failed = nullptr;
+
+            {
+                arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                ScopedLock lock(lock_);
+
+                if (plug_depth_ > 0 && !force) {
+                    if (pending_count_ < MAX_PENDING) {
+                        return;
+                    }
+                    statistics_.forced_unplugs++;
+                }
+
+                command = build_command(failed);
+            }
+
+            if (failed) {
+                complete_requests(failed);
+            }
+
+            if (!command) {
+                if (failed) {
+                    continue;
+                }
+                return;
+            }
+
+            if (!controller_->submit(&command->ahci)) {
+                BlockRequest* completed = nullptr;
+
+                {
+                    arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                    ScopedLock lock(lock_);
+                    retire_command(command, false, completed);
+                }
+
+                complete_requests(completed);
+            }
+        }
+    }
+
+    void BlockQueue::retire_request(BlockRequest* request, bool success, BlockRequest*& completed) {
+        if (!success) {
+            request->failed = true;
+        }
+
+        if (--request->chunks == 0 && request->submitted == request->count) {
+            request->next = completed;
+            completed = request;
+        }
+    }
+
+    void BlockQueue::retire_command(Command* command, bool success, BlockRequest*& completed) {
+        BlockRequest* requests = command->requests;
+        BlockRequest* partial = command->partial;
+
+        command->requests = nullptr;
+        command->partial = nullptr;
+        command->next = free_commands_;
+        free_commands_ = command;
+        in_flight_--;
+
+        if (!success) {
+            statistics_.errors++;
+        }
+
+        if (partial) {
+            retire_request(partial, success, completed);
+        }
+
+        while (requests) {
+            BlockRequest* request = requests;
+            requests = request->next;
+            retire_request(request, success, completed);
+        }
+    }
+
+    void BlockQueue::command_complete(AHCIRequest* request, void* context) {
+        Command* command = static_cast<Command*>(context);
+        BlockQueue* queue = command->queue;
+        BlockRequest* completed = nullptr;
+
+        {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(queue->lock_);
+            queue->retire_command(command, request->success, completed);
+        }
+
+        complete_requests(completed);
+        queue->run_queue(false);
+    }
+
+    void BlockQueue::complete_requests(BlockRequest* requests) {
+        while (requests) {
+            BlockRequest* request = requests;
+            requests = request->next;
+
+            BlockCompletion callback = request->callback;
+            void* context = request->context;
+            task::Thread* waiter = __atomic_load_n(&request->waiter, __ATOMIC_ACQUIRE);
+
+            request->success = !request->failed;
+            __atomic_store_n(&request->completed, true, __ATOMIC_SEQ_CST);
+
+            if (callback) {
+                callback(request, context);
+            }
+
+            if (waiter) {
+                task::Scheduler::instance().wake_up(waiter);
+            }
+        }
+    }
+
+    bool BlockQueue::submit(BlockRequest* request) {
+        if (!request || request->count == 0 || !request->buffer || !commands_) {
+            return false;
+        }
+
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+
+        request->completed = false;
+        request->success = false;
+        request->next = nullptr;
+        request->submitted = 0;
+        request->chunks = 0;
+        request->failed = false;
+        request->deadline = wheel.now() +
+            wheel.ms_to_ticks(request->write ? WRITE_DEADLINE_MS : READ_DEADLINE_MS);
+
+        {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(lock_);
+
+            insert_sorted(request);
+            pending_count_++;
+
+            statistics_.requests++;
+            statistics_.sectors += request->count;
+            if (request->write) {
+                statistics_.writes++;
+            } else {
+                statistics_.reads++;
+            }
+            statistics_.max_pending = max(statistics_.max_pending, pending_count_);
+        }
+
+        run_queue(false);
+        return true;
+    }
+
+    bool BlockQueue::wait(BlockRequest* request) {
+        if (!request) {
+            return false;
+        }
+
+        while (!__atomic_load_n(&request->completed, __ATOMIC_ACQUIRE)) {
+            run_queue(true);
+            controller_->poll(port_index_);
+
+            if (__atomic_load_n(&request->completed, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            if (!task::Scheduler::instance().wait(&request->completed, WAIT_SLICE_MS)) {
+                arch::CPU::pause();
+            }
+        }
+
+        return request->success;
+    }
+
+    bool BlockQueue::read(u64 lba, u32 count, void* buffer) {
+        BlockRequest request;
+        request.lba = lba;
+        request.count = count;
+        request.buffer = buffer;
+        request.write = false;
+        request.waiter = task::Scheduler::instance().get_current_thread();
+
+        if (!submit(&request)) {
+            return false;
+        }
+
+        return wait(&request);
+    }
+
+    bool BlockQueue::write(u64 lba, u32 count, const void* buffer) {
+        BlockRequest request;
+        request.lba = lba;
+        request.count = count;
+        request.buffer = const_cast<void*>(buffer);
+        request.write = true;
+        request.waiter = task::Scheduler::instance().get_current_thread();
+
+        if (!submit(&request)) {
+            return false;
+        }
+
+        return wait(&request);
+    }
+
+    void BlockQueue::plug() {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(lock_);
+
+        plug_depth_++;
+        statistics_.plugs++;
+    }
+
+    void BlockQueue::unplug() {
+        bool run = false;
+
+        {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(lock_);
+
+            if (plug_depth_ > 0) {
+                plug_depth_--;
+            }
+            run = plug_depth_ == 0;
+        }
+
+        if (run) {
+            run_queue(false);
+        }
+    }
+
+    void BlockQueue::set_queue_depth(u32 depth) {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        ScopedLock lock(lock_);
+
+        depth_ = max(min(depth, MAX_DEPTH), 1u);
+    }
+
+    void BlockQueue::dump_statistics() const {
+        debug::log(debug::LogLevel::Info, "BLOCK", "Block Queue (port %u) Statistics:", port_index_);
+        debug::log(debug::LogLevel::Info, "BLOCK", "  Queue depth: %u (max in flight %u)",
+                  depth_, statistics_.max_in_flight);
+        debug::log(debug::LogLevel::Info, "BLOCK", "  Requests: %llu (reads %llu, writes %llu, %llu sectors)",
+                  statistics_.requests, statistics_.reads, statistics_.writes, statistics_.sectors);
+        debug::log(debug::LogLevel::Info, "BLOCK", "  Commands: %llu, merges: %llu, splits: %llu",
+                  statistics_.commands, statistics_.merges, statistics_.splits);
+        debug::log(debug::LogLevel::Info, "BLOCK", "  Pending: %u (max %u)",
+                  pending_count_, statistics_.max_pending);
+        debug::log(debug::LogLevel::Info, "BLOCK", "  Plugs: %llu, forced unplugs: %llu, deadline dispatches: %llu",
+                  statistics_.plugs, statistics_.forced_unplugs, statistics_.deadline_dispatches);
+        debug::log(debug::LogLevel::Info, "BLOCK", "  Errors: %llu", statistics_.errors);
+    }
+
+    BlockQueue* BlockLayer::get_queue(AHCIController* controller, u32 port_index) {
+        if (!controller) {
+            return nullptr;
+        }
+
+        ScopedLock lock(lock_);
+
+        for (BlockQueue* queue : queues_) {
+            if (queue->get_controller() == controller && queue->get_port_index() == port_index) {
+                return queue;
+            }
+        }
+
+        BlockQueue* queue = new BlockQueue(controller, port_index);
+        if (!queue) {
+            return nullptr;
+        }
+
+        queues_.push_back(queue);
+
+        debug::log(debug::LogLevel::Debug, "BLOCK",
+                  "Created block queue for port %u (depth %u)", port_index, queue->get_queue_depth());
+
+        return queue;
+    }
+
+    void BlockLayer::dump_statistics() {
+        ScopedLock lock(lock_);
+
+        for (BlockQueue* queue : queues_) {
+            queue->dump_statistics();
+        }
+    }
+}
@@ -1,13 +1,17 @@
 #include <nanokoton/fs/exfat.hpp>
 #include <nanokoton/core/debug.hpp>
 #include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/mm/physical.hpp>
 #include <nanokoton/lib/bitops.hpp>
 #include <nanokoton/lib/algorithm.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/task/scheduler.hpp>
 
 namespace nk::fs {
-    exFATVolume::exFATVolume(drivers::AHCIController* controller, u32 port_index, u64 partition_start)
+    exFATVolume::exFATVolume(drivers::AHCIController* controller, u32 port_index, u64 partition_start,
+                             usize cache_capacity)
         : controller_(controller),
+          block_(drivers::BlockLayer::get_queue(controller, port_index)),
           port_index_(port_index),
           partition_start_(partition_start),
           bytes_per_sector_(0),
@@ -19,14 +23,66 @@ namespace nk::fs {
           cluster_heap_start_sector_(0),
           root_dir_cluster_(0),
           cluster_bitmap_(nullptr, 0),
+          allocation_hint_(0),
+          cache_buckets_(nullptr),
+          cache_bucket_mask_(0),
+          lru_head_(nullptr),
+          lru_tail_(nullptr),
+          cache_size_(0),
+          cache_capacity_(cache_capacity),
+          dirty_entries_(0),
           cache_hits_(0),
-          cache_misses_(0) {
+          cache_misses_(0),
+          cache_evictions_(0),
+          cache_writebacks_(0),
+          cache_shrinks_(0),
+          readahead_issued_(0),
+          readahead_hits_(0),
+          frame_backed_(false),
+          mapped_faults_(0),
+          dentry_lru_head_(nullptr),
+          dentry_lru_tail_(nullptr),
+          dentry_count_(0),
+          index_lru_head_(nullptr),
+          index_lru_tail_(nullptr),
+          index_count_(0),
+          indexed_entries_(0),
+          dentry_hits_(0),
+          dentry_negative_hits_(0),
+          dentry_misses_(0),
+          cluster_cache_(nullptr) {
         memset(&bs_, 0, sizeof(bs_));
+        
+        for (usize i = 0; i < DENTRY_BUCKETS; i++) {
+            dentry_buckets_[i] = nullptr;
+        }
     }
 
     exFATVolume::~exFATVolume() {
         flush_cache();
         
+        {
+            ScopedLock lock(lock_);
+            shrink_cache_locked(0);
+        }
+        
+        while (lru_head_) {
+            CacheEntry* entry = lru_head_;
+            lru_unlink(entry);
+            free_cluster_buffer(entry->data);
+            delete entry;
+        }
+        
+        if (cache_buckets_) {
+            mm::VirtualMemoryManager::instance().kfree(cache_buckets_);
+        }
+        
+        dentry_clear();
+        
+        if (cluster_cache_) {
+            delete cluster_cache_;
+        }
+        
         if (cluster_bitmap_.data()) {
             mm::VirtualMemoryManager::instance().kfree(cluster_bitmap_.data());
         }
@@ -52,6 +108,24 @@ namespace nk::fs {
             return false;
         }
 
+        if (bs_.bytes_per_sector_shift < 9 || bs_.bytes_per_sector_shift > 12) {
+            debug::log(debug::LogLevel::Error, "exFAT", 
+                      "Invalid sector size shift: %u", bs_.bytes_per_sector_shift);
+            return false;
+        }
+
+        if (bs_.bytes_per_sector_shift + bs_.sectors_per_cluster_shift > 25) {
+            debug::log(debug::LogLevel::Error, "exFAT", 
+                      "Invalid sectors per cluster shift: %u", bs_.sectors_per_cluster_shift);
+            return false;
+        }
+
+        if (bs_.cluster_count == 0) {
+            debug::log(debug::LogLevel::Error, "exFAT", 
+                      "Invalid cluster count: %u", bs_.cluster_count);
+            return false;
+        }
+
         bytes_per_sector_ = 1 << bs_.bytes_per_sector_shift;
         sectors_per_cluster_ = 1 << bs_.sectors_per_cluster_shift;
         bytes_per_cluster_ = bytes_per_sector_ * sectors_per_cluster_;
@@ -61,15 +135,15 @@ namespace nk::fs {
         cluster_heap_start_sector_ = bs_.cluster_heap_offset;
         root_dir_cluster_ = bs_.first_cluster_of_root_directory;
 
-        if (bytes_per_sector_ < 512 || bytes_per_sector_ > 4096) {
-            debug::log(debug::LogLevel::Error, "exFAT", 
-                      "Invalid sector size: %u bytes", bytes_per_sector_);
-            return false;
+        frame_backed_ = bytes_per_cluster_ % PAGE_SIZE == 0;
+        
+        if (!frame_backed_ && !cluster_cache_ && bytes_per_cluster_ <= mm::SlabCache::MAX_OBJECT_SIZE) {
+            cluster_cache_ = new mm::SlabCache("exfat-cluster", bytes_per_cluster_, bytes_per_sector_);
         }
 
-        if (sectors_per_cluster_ == 0 || (sectors_per_cluster_ & (sectors_per_cluster_ - 1)) != 0) {
+        if (!init_cache()) {
             debug::log(debug::LogLevel::Error, "exFAT", 
-                      "Invalid sectors per cluster: %u", sectors_per_cluster_);
+                      "Failed to allocate cluster cache");
             return false;
         }
 
@@ -86,14 +160,12 @@ namespace nk::fs {
         cluster_bitmap_ = Bitmap(bitmap_data, total_clusters_);
 
         u32 allocation_bitmap_cluster = 2;
-        for (u32 i = 0; i < sectors_per_cluster_; i++) {
-            if (!read_sector(cluster_heap_start_sector_ + allocation_bitmap_cluster * sectors_per_cluster_ + i,
-                            bitmap_data + i * bytes_per_sector_)) {
-                mm::VirtualMemoryManager::instance().kfree(bitmap_data);
-                debug::log(debug::LogLevel::Error, "exFAT", 
-                          "Failed to read allocation bitmap");
-                return false;
-            }
+        if (!read_sectors(cluster_heap_start_sector_ + allocation_bitmap_cluster * sectors_per_cluster_,
+                          sectors_per_cluster_, bitmap_data)) {
+            mm::VirtualMemoryManager::instance().kfree(bitmap_data);
+            debug::log(debug::LogLevel::Error, "exFAT", 
+                      "Failed to read allocation bitmap");
+            return false;
         }
 
         debug::log(debug::LogLevel::Info, "exFAT", 
@@ -113,6 +185,9 @@ namespace nk::fs {
                   "  Cluster heap start: %u", cluster_heap_start_sector_);
         debug::log(debug::LogLevel::Info, "exFAT", 
                   "  Root directory cluster: %u", root_dir_cluster_);
+        debug::log(debug::LogLevel::Info, "exFAT", 
+                  "  Cluster cache: %llu entries (%llu KB)",
+                  cache_capacity_, cache_capacity_ * bytes_per_cluster_ / 1024);
         debug::log(debug::LogLevel::Info, "exFAT", 
                   "  Volume flags: 0x%04X", bs_.volume_flags);
         debug::log(debug::LogLevel::Info, "exFAT", 
@@ -122,11 +197,25 @@ namespace nk::fs {
     }
 
     bool exFATVolume::read_sector(u64 sector, void* buffer) {
-        return controller_->read(port_index_, partition_start_ + sector, 1, buffer);
+        return read_sectors(sector, 1, buffer);
     }
 
     bool exFATVolume::write_sector(u64 sector, const void* buffer) {
-        return controller_->write(port_index_, partition_start_ + sector, 1, buffer);
+        return write_sectors(sector, 1, buffer);
+    }
+
+    bool exFATVolume::read_sectors(u64 sector, u32 count, void* buffer) {
+        if (block_) {
+            return block_->read(partition_start_ + sector, count, buffer);
+        }
+        return controller_->read(port_index_, partition_start_ + sector, count, buffer);
+    }
+
+    bool exFATVolume::write_sectors(u64 sector, u32 count, const void* buffer) {
+        if (block_) {
+            return block_->write(partition_start_ + sector, count, buffer);
+        }
+        return controller_->write(port_index_, partition_start_ + sector, count, buffer);
     }
 
     bool exFATVolume::read_cluster(u32 cluster, void* buffer) {
@@ -137,22 +226,19 @@ namespace nk::fs {
         CacheEntry* cached = get_cached_cluster(cluster);
         if (cached) {
             memcpy(buffer, cached->data, bytes_per_cluster_);
+            release_cached_cluster(cached);
             update_cache_statistics(true);
             return true;
         }
 
         u64 start_sector = cluster_heap_start_sector_ + (cluster - 2) * sectors_per_cluster_;
-        u8* current = static_cast<u8*>(buffer);
         
-        for (u32 i = 0; i < sectors_per_cluster_; i++) {
-            if (!read_sector(start_sector + i, current)) {
-                update_cache_statistics(false);
-                return false;
-            }
-            current += bytes_per_sector_;
+        if (!read_sectors(start_sector, sectors_per_cluster_, buffer)) {
+            update_cache_statistics(false);
+            return false;
         }
 
-        put_cached_cluster(cluster, static_cast<const u8*>(buffer));
+        put_cached_cluster(cluster, static_cast<const u8*>(buffer), false);
         update_cache_statistics(false);
         
         return true;
@@ -165,26 +251,30 @@ namespace nk::fs {
 
         CacheEntry* cached = get_cached_cluster(cluster);
         if (cached) {
+            ScopedLock lock(lock_);
+            
+            if (cached->io_active) {
+                wait_for_io(cached);
+            }
+            
             memcpy(cached->data, buffer, bytes_per_cluster_);
-            cached->dirty = true;
-            cached->last_access = arch::CPU::read_tsc();
+            mark_dirty(cached);
+            cached->pins--;
             update_cache_statistics(true);
             return true;
         }
 
+        update_cache_statistics(false);
+        
+        if (block_ && put_cached_cluster(cluster, static_cast<const u8*>(buffer), true)) {
+            return true;
+        }
+        
         u64 start_sector = cluster_heap_start_sector_ + (cluster - 2) * sectors_per_cluster_;
-        const u8* current = static_cast<const u8*>(buffer);
         
-        for (u32 i = 0; i < sectors_per_cluster_; i++) {
-            if (!write_sector(start_sector + i, current)) {
-                update_cache_statistics(false);
-                return false;
-            }
-            current += bytes_per_sector_;
+        if (!write_sectors(start_sector, sectors_per_cluster_, buffer)) {
+            return false;
         }
-
-        put_cached_cluster(cluster, static_cast<const u8*>(buffer));
-        update_cache_statistics(false);
         
         return true;
     }
@@ -231,57 +321,207 @@ namespace nk::fs {
         return true;
     }
 
-    u32 exFATVolume::allocate_cluster() {
-        ScopedLock lock(lock_);
-
-        for (u32 cluster = 2; cluster < total_clusters_ + 2; cluster++) {
-            if (!cluster_bitmap_.test(cluster - 2)) {
-                cluster_bitmap_.set(cluster - 2, true);
+    u32 exFATVolume::clusters_for(u64 size) const {
+        return static_cast<u32>(max((size + bytes_per_cluster_ - 1) / bytes_per_cluster_,
+                                    static_cast<u64>(1)));
+    }
 
-                u32 allocation_bitmap_cluster = 2;
-                u32 bitmap_sector_offset = (cluster - 2) / (bytes_per_sector_ * 8);
-                u32 bitmap_byte_offset = ((cluster - 2) % (bytes_per_sector_ * 8)) / 8;
-                u32 bitmap_bit_offset = (cluster - 2) % 8;
+    bool exFATVolume::find_free_run(u32 wanted, u32& start, u32& length) {
+        const u64* words = reinterpret_cast<const u64*>(cluster_bitmap_.data());
+        u32 full_words = total_clusters_ / 64;
+        u32 index = allocation_hint_ < total_clusters_ ? allocation_hint_ : 0;
+        u32 run_start = index;
+        u32 run_length = 0;
+        u32 best_start = 0;
+        u32 best_length = 0;
+
+        for (u32 scanned = 0; scanned < total_clusters_;) {
+            if (index >= total_clusters_) {
+                index = 0;
+                run_length = 0;
+            }
 
-                u8 sector_buffer[512];
-                u64 bitmap_sector = cluster_heap_start_sector_ + 
-                                   allocation_bitmap_cluster * sectors_per_cluster_ + 
-                                   bitmap_sector_offset;
+            u32 word = index / 64;
+            if ((index & 63) == 0 && word < full_words && words[word] == ~0ULL) {
+                run_length = 0;
+                index += 64;
+                scanned += 64;
+                continue;
+            }
 
-                if (!read_sector(bitmap_sector, sector_buffer)) {
-                    cluster_bitmap_.set(cluster - 2, false);
-                    return 0;
+            if ((index & 63) == 0 && word < full_words && words[word] == 0) {
+                if (run_length == 0) {
+                    run_start = index;
+                }
+                run_length += 64;
+                index += 64;
+                scanned += 64;
+            } else {
+                if (cluster_bitmap_.test(index)) {
+                    run_length = 0;
+                } else {
+                    if (run_length == 0) {
+                        run_start = index;
+                    }
+                    run_length++;
                 }
+                index++;
+                scanned++;
+            }
 
-                sector_buffer[bitmap_byte_offset] |= (1 << bitmap_bit_offset);
+            if (run_length >= wanted) {
+                start = run_start;
+                length = wanted;
+                return true;
+            }
 
-                if (!write_sector(bitmap_sector, sector_buffer)) {
-                    cluster_bitmap_.set(cluster - 2, false);
-                    return 0;
-                }
+            if (run_length > best_length) {
+                best_start = run_start;
+                best_length = run_length;
+            }
+        }
 
-                if (!write_fat_entry(cluster, 0xFFFFFFF7)) {
-                    cluster_bitmap_.set(cluster - 2, false);
-                    return 0;
-                }
+        if (best_length == 0) {
+            return false;
+        }
 
-                u8* cluster_data = reinterpret_cast<u8*>(
-                    mm::VirtualMemoryManager::instance().kmalloc(bytes_per_cluster_));
-                
-                if (cluster_data) {
-                    memset(cluster_data, 0, bytes_per_cluster_);
-                    write_cluster(cluster, cluster_data);
-                    mm::VirtualMemoryManager::instance().kfree(cluster_data);
+        start = best_start;
+        length = best_length;
+        return true;
+    }
+
+    bool exFATVolume::range_free(u32 start, u32 count) {
+        const u64* words = reinterpret_cast<const u64*>(cluster_bitmap_.data());
+        u32 full_words = total_clusters_ / 64;
+        u32 end = start + count;
+
+        if (end > total_clusters_) {
+            return false;
+        }
+
+        for (u32 index = start; index < end;) {
+            u32 word = index / 64;
+            if ((index & 63) == 0 && end - index >= 64 && word < full_words) {
+                if (words[word] != 0) {
+                    return false;
                 }
+                index += 64;
+                continue;
+            }
 
-                debug::log(debug::LogLevel::Debug, "exFAT",
-                          "Allocated cluster %u", cluster);
-                
-                return cluster;
+            if (cluster_bitmap_.test(index)) {
+                return false;
+            }
+            index++;
+        }
+
+        return true;
+    }
+
+    void exFATVolume::mark_clusters(u32 start, u32 count, bool used) {
+        u64* words = reinterpret_cast<u64*>(cluster_bitmap_.data());
+        u32 full_words = total_clusters_ / 64;
+        u32 end = start + count;
+
+        for (u32 index = start; index < end;) {
+            u32 word = index / 64;
+            if ((index & 63) == 0 && end - index >= 64 && word < full_words) {
+                words[word] = used ? ~0ULL : 0;
+                index += 64;
+                continue;
+            }
+
+            cluster_bitmap_.set(index, used);
+            index++;
+        }
+    }
+
+    bool exFATVolume::sync_bitmap(u32 start, u32 count) {
+        u32 allocation_bitmap_cluster = 2;
+        u64 bitmap_start = cluster_heap_start_sector_ + allocation_bitmap_cluster * sectors_per_cluster_;
+        u32 bits_per_sector = bytes_per_sector_ * 8;
+        usize bitmap_bytes = (total_clusters_ + 7) / 8;
+        const u8* data = cluster_bitmap_.data();
+
+        u8 sector_buffer[bytes_per_sector_];
+        for (u32 sector = start / bits_per_sector; sector <= (start + count - 1) / bits_per_sector; sector++) {
+            usize offset = static_cast<usize>(sector) * bytes_per_sector_;
+            usize bytes = min(static_cast<usize>(bytes_per_sector_), bitmap_bytes - offset);
+
+            memset(sector_buffer, 0, bytes_per_sector_);
+            memcpy(sector_buffer, data + offset, bytes);
+
+            if (!write_sector(bitmap_start + sector, sector_buffer)) {
+                return false;
             }
         }
 
-        return 0;
+        return true;
+    }
+
+    u32 exFATVolume::allocate_clusters(u32 wanted, u32& count) {
+        ScopedLock lock(lock_);
+
+        count = 0;
+
+        u32 start;
+        u32 length;
+        if (wanted == 0 || !find_free_run(wanted, start, length)) {
+            return 0;
+        }
+
+        mark_clusters(start, length, true);
+        if (!sync_bitmap(start, length)) {
+            mark_clusters(start, length, false);
+            return 0;
+        }
+
+        allocation_hint_ = start + length;
+        count = length;
+
+        debug::log(debug::LogLevel::Debug, "exFAT",
+                  "Allocated %u clusters at %u", length, start + 2);
+
+        return start + 2;
+    }
+
+    bool exFATVolume::release_clusters(u32 first_cluster, u32 count) {
+        if (count == 0) {
+            return true;
+        }
+
+        if (first_cluster < 2 || first_cluster - 2 + count > total_clusters_) {
+            return false;
+        }
+
+        ScopedLock lock(lock_);
+
+        mark_clusters(first_cluster - 2, count, false);
+        return sync_bitmap(first_cluster - 2, count);
+    }
+
+    u32 exFATVolume::allocate_cluster() {
+        u32 count;
+        u32 cluster = allocate_clusters(1, count);
+        if (cluster == 0) {
+            return 0;
+        }
+
+        if (!write_fat_entry(cluster, 0xFFFFFFFF)) {
+            release_clusters(cluster, 1);
+            return 0;
+        }
+
+        u8* cluster_data = reinterpret_cast<u8*>(
+            mm::VirtualMemoryManager::instance().kmalloc(bytes_per_cluster_));
+        
+        if (cluster_data) {
+            memset(cluster_data, 0, bytes_per_cluster_);
+            write_cluster(cluster, cluster_data);
+            mm::VirtualMemoryManager::instance().kfree(cluster_data);
+        }
+
+        return cluster;
     }
 
     bool exFATVolume::free_cluster_chain(u32 first_cluster) {
@@ -291,28 +531,128 @@ namespace nk::fs {
         while (current >= 2 && current < total_clusters_ + 2) {
             u32 next = read_fat_entry(current);
             
-            cluster_bitmap_.set(current - 2, false);
+            mark_clusters(current - 2, 1, false);
+            sync_bitmap(current - 2, 1);
+
+            write_fat_entry(current, 0);
 
-            u32 allocation_bitmap_cluster = 2;
-            u32 bitmap_sector_offset = (current - 2) / (bytes_per_sector_ * 8);
-            u32 bitmap_byte_offset = ((current - 2) % (bytes_per_sector_ * 8)) / 8;
-            u32 bitmap_bit_offset = (current - 2) % 8;
+            current = next;
+        }
+
+        return true;
+    }
+
+    bool exFATVolume::extend_file(FileHandle& file, u32 clusters) {
+        if (clusters <= file.allocated_clusters) {
+            return true;
+        }
 
-            u8 sector_buffer[512];
-            u64 bitmap_sector = cluster_heap_start_sector_ + 
-                               allocation_bitmap_cluster * sectors_per_cluster_ + 
-                               bitmap_sector_offset;
+        u32 needed = clusters - file.allocated_clusters;
 
-            if (read_sector(bitmap_sector, sector_buffer)) {
-                sector_buffer[bitmap_byte_offset] &= ~(1 << bitmap_bit_offset);
-                write_sector(bitmap_sector, sector_buffer);
+        if (file.first_cluster < 2) {
+            u32 count;
+            u32 first = allocate_clusters(needed, count);
+            if (first == 0) {
+                return false;
             }
 
-            write_fat_entry(current, 0);
+            file.first_cluster = first;
+            file.current_cluster = first;
+            file.allocated_clusters = count;
+            file.no_fat_chain = true;
+            invalidate_extents(file);
+            needed -= count;
+        }
 
-            current = next;
+        if (needed == 0) {
+            return true;
+        }
+
+        if (file.no_fat_chain) {
+            ScopedLock lock(lock_);
+
+            u32 next = file.first_cluster - 2 + file.allocated_clusters;
+            if (range_free(next, needed)) {
+                mark_clusters(next, needed, true);
+                if (!sync_bitmap(next, needed)) {
+                    mark_clusters(next, needed, false);
+                    return false;
+                }
+
+                allocation_hint_ = next + needed;
+                file.allocated_clusters += needed;
+                return true;
+            }
+
+            if (!materialize_fat_chain(file)) {
+                return false;
+            }
+        }
+
+        u32 tail;
+        u32 run;
+        if (!map_cluster(file, file.allocated_clusters - 1, tail, run)) {
+            return false;
+        }
+
+        while (needed > 0) {
+            u32 count;
+            u32 first = allocate_clusters(needed, count);
+            if (first == 0) {
+                return false;
+            }
+
+            for (u32 i = 0; i + 1 < count; i++) {
+                if (!write_fat_entry(first + i, first + i + 1)) {
+                    return false;
+                }
+            }
+
+            if (!write_fat_entry(first + count - 1, 0xFFFFFFFF) || !write_fat_entry(tail, first)) {
+                return false;
+            }
+
+            tail = first + count - 1;
+            needed -= count;
+            file.allocated_clusters += count;
+        }
+
+        invalidate_extents(file);
+        return true;
+    }
+
+    bool exFATVolume::release_reservation(FileHandle& file) {
+        u32 needed = clusters_for(file.file_size);
+        if (file.first_cluster < 2 || file.allocated_clusters <= needed) {
+            return true;
+        }
+
+        if (file.no_fat_chain) {
+            if (!release_clusters(file.first_cluster + needed, file.allocated_clusters - needed)) {
+                return false;
+            }
+
+            file.allocated_clusters = needed;
+            return true;
+        }
+
+        u32 tail;
+        u32 run;
+        if (!map_cluster(file, needed - 1, tail, run)) {
+            return false;
+        }
+
+        u32 next = find_next_cluster(tail);
+        if (!write_fat_entry(tail, 0xFFFFFFFF)) {
+            return false;
         }
 
+        if (next >= 2 && next < total_clusters_ + 2) {
+            free_cluster_chain(next);
+        }
+
+        file.allocated_clusters = needed;
+        invalidate_extents(file);
         return true;
     }
 
@@ -493,69 +833,248 @@ namespace nk::fs {
         return true;
     }
 
-    bool exFATVolume::read_directory(u32 cluster, Vector<u8>& buffer) {
-        buffer.clear();
-
-        if (cluster < 2 || cluster >= total_clusters_ + 2) {
+    bool exFATVolume::map_cluster(FileHandle& file, u32 file_cluster, u32& disk_cluster, u32& run) {
+        if (file.first_cluster < 2 || file.first_cluster >= total_clusters_ + 2) {
             return false;
         }
 
-        Vector<u8> cluster_buffer(bytes_per_cluster_);
-        u32 current_cluster = cluster;
-
-        while (current_cluster < 0xFFFFFFF8) {
-            if (current_cluster == 0xFFFFFFF7) {
+        if (file.no_fat_chain) {
+            u32 clusters = file.allocated_clusters;
+            if (file_cluster >= clusters || file.first_cluster - 2 + clusters > total_clusters_) {
                 return false;
             }
 
-            if (current_cluster >= 0xFFFFFFF8) {
-                break;
-            }
+            disk_cluster = file.first_cluster + file_cluster;
+            run = clusters - file_cluster;
+            return true;
+        }
 
-            if (!read_cluster(current_cluster, cluster_buffer.data())) {
+        if (file.extents.size() == 0) {
+            Extent extent;
+            extent.file_cluster = 0;
+            extent.first_cluster = file.first_cluster;
+            extent.length = 1;
+            file.extents.push_back(extent);
+            file.mapped_clusters = 1;
+        }
+
+        while (file_cluster >= file.mapped_clusters) {
+            Extent& last = file.extents[file.extents.size() - 1];
+            u32 next = find_next_cluster(last.first_cluster + last.length - 1);
+            if (next < 2 || next >= total_clusters_ + 2) {
                 return false;
             }
 
-            bool found_end = false;
-            for (usize i = 0; i < bytes_per_cluster_; i += 32) {
-                u8 entry_type = cluster_buffer[i];
-                if (entry_type == 0x00) {
-                    found_end = true;
-                    break;
-                }
+            if (next == last.first_cluster + last.length) {
+                last.length++;
+            } else {
+                Extent extent;
+                extent.file_cluster = file.mapped_clusters;
+                extent.first_cluster = next;
+                extent.length = 1;
+                file.extents.push_back(extent);
             }
+            file.mapped_clusters++;
+        }
 
-            buffer.append(cluster_buffer.data(), cluster_buffer.size());
-
-            if (found_end) {
-                break;
+        usize low = 0;
+        usize high = file.extents.size();
+        while (high - low > 1) {
+            usize mid = low + (high - low) / 2;
+            if (file.extents[mid].file_cluster <= file_cluster) {
+                low = mid;
+            } else {
+                high = mid;
             }
-
-            current_cluster = find_next_cluster(current_cluster);
         }
 
+        const Extent& extent = file.extents[low];
+        disk_cluster = extent.first_cluster + (file_cluster - extent.file_cluster);
+        run = extent.length - (file_cluster - extent.file_cluster);
         return true;
     }
 
-    bool exFATVolume::parse_directory(const u8* buffer, usize size, Vector<VFS::DirectoryEntry>& entries) {
-        entries.clear();
-
-        for (usize i = 0; i + 32 <= size; i += 32) {
-            u8 entry_type = buffer[i];
-            
-            if (entry_type == 0x00) {
-                break;
-            }
+    void exFATVolume::invalidate_extents(FileHandle& file) {
+        file.extents.clear();
+        file.mapped_clusters = 0;
+    }
 
-            if (entry_type == 0x85) {
-                if (i + 64 > size) {
-                    break;
-                }
+    void exFATVolume::update_position(FileHandle& file) {
+        if (file.current_offset >= file.file_size) {
+            file.current_cluster = 0xFFFFFFFF;
+            file.cluster_offset = 0;
+            return;
+        }
 
-                const exFATDirectoryEntry* dir_entry = 
-                    reinterpret_cast<const exFATDirectoryEntry*>(buffer + i);
-                const exFATStreamExtensionEntry* stream_entry = 
-                    reinterpret_cast<const exFATStreamExtensionEntry*>(buffer + i + 32);
+        u32 disk_cluster;
+        u32 run;
+        file.cluster_offset = file.current_offset % bytes_per_cluster_;
+        file.current_cluster = map_cluster(file, file.current_offset / bytes_per_cluster_, disk_cluster, run) ?
+                               disk_cluster : 0xFFFFFFF7;
+    }
+
+    bool exFATVolume::materialize_fat_chain(FileHandle& file) {
+        if (!file.no_fat_chain) {
+            return true;
+        }
+
+        u32 clusters = max(file.allocated_clusters, 1u);
+
+        for (u32 i = 0; i + 1 < clusters; i++) {
+            if (!write_fat_entry(file.first_cluster + i, file.first_cluster + i + 1)) {
+                return false;
+            }
+        }
+
+        if (!write_fat_entry(file.first_cluster + clusters - 1, 0xFFFFFFFF)) {
+            return false;
+        }
+
+        file.no_fat_chain = false;
+        invalidate_extents(file);
+        return true;
+    }
+
+    bool exFATVolume::read_file_data(FileHandle& file, u64 offset, u64 size, void* buffer) {
+        u8* output = static_cast<u8*>(buffer);
+
+        while (size > 0) {
+            u32 disk_cluster;
+            u32 run;
+            if (!map_cluster(file, offset / bytes_per_cluster_, disk_cluster, run)) {
+                return false;
+            }
+
+            u64 cluster_offset = offset % bytes_per_cluster_;
+            for (u32 i = 0; i < run && size > 0; i++) {
+                u64 read_size = min(size, bytes_per_cluster_ - cluster_offset);
+
+                if (cluster_offset == 0 && read_size == bytes_per_cluster_) {
+                    if (!read_cluster(disk_cluster + i, output)) {
+                        return false;
+                    }
+                } else {
+                    u8 cluster_buffer[bytes_per_cluster_];
+                    if (!read_cluster(disk_cluster + i, cluster_buffer)) {
+                        return false;
+                    }
+                    memcpy(output, cluster_buffer + cluster_offset, read_size);
+                }
+
+                output += read_size;
+                offset += read_size;
+                size -= read_size;
+                cluster_offset = 0;
+            }
+        }
+
+        return true;
+    }
+
+    bool exFATVolume::write_file_data(FileHandle& file, u64 offset, u64 size, const void* buffer) {
+        const u8* input = static_cast<const u8*>(buffer);
+
+        while (size > 0) {
+            u32 disk_cluster;
+            u32 run;
+            if (!map_cluster(file, offset / bytes_per_cluster_, disk_cluster, run)) {
+                return false;
+            }
+
+            u64 cluster_offset = offset % bytes_per_cluster_;
+            for (u32 i = 0; i < run && size > 0; i++) {
+                u64 write_size = min(size, bytes_per_cluster_ - cluster_offset);
+
+                if (cluster_offset == 0 && write_size == bytes_per_cluster_) {
+                    if (!write_cluster(disk_cluster + i, input)) {
+                        return false;
+                    }
+                } else {
+                    u8 cluster_buffer[bytes_per_cluster_];
+                    if (!read_cluster(disk_cluster + i, cluster_buffer)) {
+                        return false;
+                    }
+
+                    memcpy(cluster_buffer + cluster_offset, input, write_size);
+
+                    if (!write_cluster(disk_cluster + i, cluster_buffer)) {
+                        return false;
+                    }
+                }
+
+                input += write_size;
+                offset += write_size;
+                size -= write_size;
+                cluster_offset = 0;
+            }
+        }
+
+        return true;
+    }
+
+    bool exFATVolume::read_directory(u32 cluster, Vector<u8>& buffer) {
+        buffer.clear();
+
+        if (cluster < 2 || cluster >= total_clusters_ + 2) {
+            return false;
+        }
+
+        Vector<u8> cluster_buffer(bytes_per_cluster_);
+        u32 current_cluster = cluster;
+
+        while (current_cluster < 0xFFFFFFF8) {
+            if (current_cluster == 0xFFFFFFF7) {
+                return false;
+            }
+
+            if (current_cluster >= 0xFFFFFFF8) {
+                break;
+            }
+
+            if (!read_cluster(current_cluster, cluster_buffer.data())) {
+                return false;
+            }
+
+            bool found_end = false;
+            for (usize i = 0; i < bytes_per_cluster_; i += 32) {
+                u8 entry_type = cluster_buffer[i];
+                if (entry_type == 0x00) {
+                    found_end = true;
+                    break;
+                }
+            }
+
+            buffer.append(cluster_buffer.data(), cluster_buffer.size());
+
+            if (found_end) {
+                break;
+            }
+
+            current_cluster = find_next_cluster(current_cluster);
+        }
+
+        return true;
+    }
+
+    bool exFATVolume::parse_directory(const u8* buffer, usize size, Vector<VFS::DirectoryEntry>& entries) {
+        entries.clear();
+
+        for (usize i = 0; i + 32 <= size; i += 32) {
+            u8 entry_type = buffer[i];
+            
+            if (entry_type == 0x00) {
+                break;
+            }
+
+            if (entry_type == 0x85) {
+                if (i + 64 > size) {
+                    break;
+                }
+
+                const exFATDirectoryEntry* dir_entry = 
+                    reinterpret_cast<const exFATDirectoryEntry*>(buffer + i);
+                const exFATStreamExtensionEntry* stream_entry = 
+                    reinterpret_cast<const exFATStreamExtensionEntry*>(buffer + i + 32);
 
                 u8 secondary_count = dir_entry->secondary_count;
                 if (secondary_count < 2) {
@@ -601,170 +1120,550 @@ namespace nk::fs {
         return true;
     }
 
-    bool exFATVolume::find_file_in_directory(u32 directory_cluster, const char* name, FileHandle& file) {
-        Vector<u8> buffer;
-        if (!read_directory(directory_cluster, buffer)) {
-            return false;
-        }
+    void exFATVolume::read_entry_name(const u8* entry_set, String& name) {
+        const exFATDirectoryEntry* dir_entry = reinterpret_cast<const exFATDirectoryEntry*>(entry_set);
+        const exFATStreamExtensionEntry* stream_entry = 
+            reinterpret_cast<const exFATStreamExtensionEntry*>(entry_set + 32);
+        u8 secondary_count = dir_entry->secondary_count;
 
-        Vector<VFS::DirectoryEntry> entries;
-        if (!parse_directory(buffer.data(), buffer.size(), entries)) {
-            return false;
+        name.clear();
+        for (u8 j = 0; j < stream_entry->name_length && j < secondary_count - 1; j++) {
+            const exFATFileNameEntry* name_entry = 
+                reinterpret_cast<const exFATFileNameEntry*>(entry_set + (j + 2) * 32);
+            
+            for (u8 k = 0; k < 15; k++) {
+                u16 ch = name_entry->name_character[k];
+                if (ch == 0) {
+                    break;
+                }
+                name.push_back(static_cast<char>(ch & 0xFF));
+            }
         }
+    }
 
-        for (const VFS::DirectoryEntry& entry : entries) {
-            if (entry.name == name) {
-                const u8* buf_ptr = buffer.data();
-                for (usize i = 0; i + 32 <= buffer.size(); i += 32) {
-                    u8 entry_type = buf_ptr[i];
-                    if (entry_type == 0x85) {
-                        const exFATDirectoryEntry* dir_entry = 
-                            reinterpret_cast<const exFATDirectoryEntry*>(buf_ptr + i);
-                        const exFATStreamExtensionEntry* stream_entry = 
-                            reinterpret_cast<const exFATStreamExtensionEntry*>(buf_ptr + i + 32);
-
-                        String current_name;
-                        u8 secondary_count = dir_entry->secondary_count;
-                        
-                        for (u8 j = 0; j < stream_entry->name_length && j < secondary_count - 1; j++) {
-                            const exFATFileNameEntry* name_entry = 
-                                reinterpret_cast<const exFATFileNameEntry*>(buf_ptr + i + (j + 2) * 32);
-                            
-                            for (u8 k = 0; k < 15; k++) {
-                                u16 ch = name_entry->name_character[k];
-                                if (ch == 0) {
-                                    break;
-                                }
-                                current_name.push_back(static_cast<char>(ch & 0xFF));
-                            }
-                        }
+    void exFATVolume::fill_file_handle(const exFATDirectoryEntry* dir_entry,
+                                       const exFATStreamExtensionEntry* stream_entry,
+                                       const char* name, FileHandle& file) {
+        file.name = name;
+        file.first_cluster = stream_entry->first_cluster;
+        file.file_size = stream_entry->data_length;
+        file.current_offset = 0;
+        file.current_cluster = stream_entry->first_cluster;
+        file.cluster_offset = 0;
+        file.attributes = dir_entry->file_attributes;
+        file.no_fat_chain = (stream_entry->flags &
+            static_cast<u16>(exFATStreamFlags::NoFatChain)) != 0;
+        file.allocated_clusters = file.first_cluster >= 2 ?
+            clusters_for(file.file_size) : 0;
+        invalidate_extents(file);
+        file.readahead_next = 0;
+        file.readahead_window = 0;
+        file.readahead_end = 0;
+        file.create_time = convert_timestamp(dir_entry->create_timestamp,
+                                           dir_entry->create_time_10ms,
+                                           dir_entry->create_timezone);
+        file.modify_time = convert_timestamp(dir_entry->last_modified_timestamp,
+                                           dir_entry->last_modified_time_10ms,
+                                           dir_entry->last_modified_timezone);
+        file.access_time = convert_timestamp(dir_entry->last_accessed_timestamp,
+                                           0,
+                                           dir_entry->last_accessed_timezone);
+    }
 
-                        if (current_name == name) {
-                            file.first_cluster = stream_entry->first_cluster;
-                            file.file_size = stream_entry->data_length;
-                            file.current_offset = 0;
-                            file.current_cluster = stream_entry->first_cluster;
-                            file.cluster_offset = 0;
-                            file.attributes = dir_entry->file_attributes;
-                            file.create_time = convert_timestamp(dir_entry->create_timestamp,
-                                                               dir_entry->create_time_10ms,
-                                                               dir_entry->create_timezone);
-                            file.modify_time = convert_timestamp(dir_entry->last_modified_timestamp,
-                                                               dir_entry->last_modified_time_10ms,
-                                                               dir_entry->last_modified_timezone);
-                            file.access_time = convert_timestamp(dir_entry->last_accessed_timestamp,
-                                                               0,
-                                                               dir_entry->last_accessed_timezone);
-                            return true;
-                        }
+    usize exFATVolume::dentry_bucket(u32 parent, u16 hash) const {
+        return ((parent * 0x9E3779B1u) ^ hash) & (DENTRY_BUCKETS - 1);
+    }
 
-                        i += (secondary_count * 32) - 32;
-                    }
+    exFATVolume::Dentry* exFATVolume::dentry_lookup(u32 parent, const char* name, u16 hash) {
+        for (Dentry* dentry = dentry_buckets_[dentry_bucket(parent, hash)]; dentry; dentry = dentry->hash_next) {
+            if (dentry->parent == parent && dentry->hash == hash && dentry->name == name) {
+                if (dentry != dentry_lru_head_) {
+                    dentry_unlink(dentry);
+                    dentry_push_front(dentry);
                 }
+                return dentry;
             }
         }
 
-        return false;
+        return nullptr;
     }
 
-    bool exFATVolume::create_directory_entry(u32 directory_cluster, const VFS::DirectoryEntry& entry, FileHandle& file) {
-        Vector<u8> buffer;
-        if (!read_directory(directory_cluster, buffer)) {
-            return false;
+    void exFATVolume::dentry_unlink(Dentry* dentry) {
+        if (dentry->lru_prev) {
+            dentry->lru_prev->lru_next = dentry->lru_next;
+        } else {
+            dentry_lru_head_ = dentry->lru_next;
         }
 
-        usize free_slot = 0;
-        bool found_free = false;
-        
-        for (usize i = 0; i + 32 <= buffer.size(); i += 32) {
-            u8 entry_type = buffer[i];
-            if (entry_type == 0x00) {
-                free_slot = i;
-                found_free = true;
-                break;
-            }
-            
-            if (entry_type == 0x85) {
-                const exFATDirectoryEntry* dir_entry = 
-                    reinterpret_cast<const exFATDirectoryEntry*>(buffer.data() + i);
-                i += (dir_entry->secondary_count * 32) - 32;
-            }
+        if (dentry->lru_next) {
+            dentry->lru_next->lru_prev = dentry->lru_prev;
+        } else {
+            dentry_lru_tail_ = dentry->lru_prev;
         }
 
-        if (!found_free) {
-            free_slot = buffer.size();
-            buffer.resize(buffer.size() + bytes_per_cluster_, 0);
+        dentry->lru_prev = nullptr;
+        dentry->lru_next = nullptr;
+    }
+
+    void exFATVolume::dentry_push_front(Dentry* dentry) {
+        dentry->lru_prev = nullptr;
+        dentry->lru_next = dentry_lru_head_;
+
+        if (dentry_lru_head_) {
+            dentry_lru_head_->lru_prev = dentry;
+        } else {
+            dentry_lru_tail_ = dentry;
         }
+        dentry_lru_head_ = dentry;
+    }
 
-        u8 name_length = static_cast<u8>(entry.name.length());
-        u8 secondary_count = 2 + (name_length + 14) / 15;
+    void exFATVolume::dentry_remove(Dentry* dentry) {
+        Dentry** link = &dentry_buckets_[dentry_bucket(dentry->parent, dentry->hash)];
+        while (*link && *link != dentry) {
+            link = &(*link)->hash_next;
+        }
 
-        if (free_slot + secondary_count * 32 > buffer.size()) {
-            buffer.resize(free_slot + secondary_count * 32, 0);
+        if (*link) {
+            *link = dentry->hash_next;
         }
 
-        u64 current_time = arch::CPU::read_tsc();
-        exFATDateTime now;
-        now.year = 2024;
-        now.month = 1;
-        now.day = 1;
-        now.hour = 0;
-        now.minute = 0;
-        now.second = 0;
-        now.milliseconds = 0;
+        dentry_unlink(dentry);
+        dentry_count_--;
+        delete dentry;
+    }
 
-        exFATDirectoryEntry* dir_entry = 
-            reinterpret_cast<exFATDirectoryEntry*>(buffer.data() + free_slot);
-        dir_entry->entry_type = 0x85;
-        dir_entry->secondary_count = secondary_count;
-        dir_entry->file_attributes = (entry.type == VFS::EntryType::Directory) ? 0x10 : 0x20;
-        dir_entry->create_timestamp = convert_to_timestamp(now);
-        dir_entry->last_modified_timestamp = convert_to_timestamp(now);
-        dir_entry->last_accessed_timestamp = convert_to_timestamp(now);
-        dir_entry->create_time_10ms = 0;
-        dir_entry->last_modified_time_10ms = 0;
-        dir_entry->create_timezone = 0;
-        dir_entry->last_modified_timezone = 0;
-        dir_entry->last_accessed_timezone = 0;
+    void exFATVolume::dentry_insert(u32 parent, const char* name,
+                                    const exFATDirectoryEntry* dir_entry,
+                                    const exFATStreamExtensionEntry* stream_entry) {
+        u16 hash = calculate_name_hash(name);
+
+        DirectoryIndex* index = index_find(parent);
+        if (index) {
+            if (!dir_entry || !stream_entry) {
+                index_remove(index, name, hash);
+            } else if (!index_insert(index, name, hash, dir_entry, stream_entry)) {
+                index_destroy(index);
+            }
+            return;
+        }
 
-        exFATStreamExtensionEntry* stream_entry = 
-            reinterpret_cast<exFATStreamExtensionEntry*>(buffer.data() + free_slot + 32);
-        stream_entry->entry_type = 0xC0;
-        stream_entry->secondary_count = secondary_count - 1;
-        stream_entry->name_length = name_length;
-        stream_entry->name_hash = calculate_name_hash(entry.name.c_str());
-        stream_entry->valid_data_length = 0;
-        stream_entry->first_cluster = file.first_cluster;
-        stream_entry->data_length = file.file_size;
+        Dentry* dentry = dentry_lookup(parent, name, hash);
+        if (!dentry) {
+            while (dentry_count_ >= DENTRY_CAPACITY && dentry_lru_tail_) {
+                dentry_remove(dentry_lru_tail_);
+            }
 
-        const char* name_ptr = entry.name.c_str();
-        for (u8 i = 0; i < secondary_count - 1; i++) {
-            exFATFileNameEntry* name_entry = 
-                reinterpret_cast<exFATFileNameEntry*>(buffer.data() + free_slot + (i + 2) * 32);
-            name_entry->entry_type = 0xC1;
-            name_entry->flags = 0;
+            dentry = new Dentry;
+            if (!dentry) {
+                return;
+            }
 
-            for (u8 j = 0; j < 15; j++) {
-                u8 idx = i * 15 + j;
-                if (idx < name_length) {
-                    name_entry->name_character[j] = name_ptr[idx];
+            dentry->parent = parent;
+            dentry->hash = hash;
+            dentry->name = name;
+
+            usize bucket = dentry_bucket(parent, hash);
+            dentry->hash_next = dentry_buckets_[bucket];
+            dentry_buckets_[bucket] = dentry;
+            dentry_push_front(dentry);
+            dentry_count_++;
+        }
+
+        dentry->negative = !dir_entry || !stream_entry;
+        if (!dentry->negative) {
+            memcpy(&dentry->dir_entry, dir_entry, sizeof(exFATDirectoryEntry));
+            memcpy(&dentry->stream_entry, stream_entry, sizeof(exFATStreamExtensionEntry));
+        }
+    }
+
+    exFATVolume::DirectoryIndex* exFATVolume::index_find(u32 cluster) {
+        for (DirectoryIndex* index = index_lru_head_; index; index = index->lru_next) {
+            if (index->cluster != cluster) {
+                continue;
+            }
+
+            if (index != index_lru_head_) {
+                index->lru_prev->lru_next = index->lru_next;
+                if (index->lru_next) {
+                    index->lru_next->lru_prev = index->lru_prev;
                 } else {
-                    name_entry->name_character[j] = 0;
+                    index_lru_tail_ = index->lru_prev;
                 }
+
+                index->lru_prev = nullptr;
+                index->lru_next = index_lru_head_;
+                index_lru_head_->lru_prev = index;
+                index_lru_head_ = index;
             }
+            return index;
         }
 
-        dir_entry->set_checksum = calculate_checksum(buffer.data() + free_slot, secondary_count * 32);
+        return nullptr;
+    }
 
-        if (!write_cluster_chain(directory_cluster, free_slot, secondary_count * 32, buffer.data() + free_slot)) {
-            return false;
+    exFATVolume::DirectoryIndex* exFATVolume::index_create(u32 cluster, usize entries) {
+        if (entries > MAX_INDEXED_ENTRIES) {
+            return nullptr;
         }
 
-        file.create_time = now;
-        file.modify_time = now;
-        file.access_time = now;
+        while (index_lru_tail_ &&
+               (index_count_ >= MAX_DIRECTORY_INDEXES || indexed_entries_ + entries > MAX_INDEXED_ENTRIES)) {
+            index_destroy(index_lru_tail_);
+        }
 
-        return true;
+        usize buckets = MIN_INDEX_BUCKETS;
+        while (buckets < entries && buckets < MAX_INDEX_BUCKETS) {
+            buckets <<= 1;
+        }
+
+        DirectoryIndex* index = new DirectoryIndex;
+        if (!index) {
+            return nullptr;
+        }
+
+        index->buckets = reinterpret_cast<Dentry**>(
+            mm::VirtualMemoryManager::instance().kmalloc(buckets * sizeof(Dentry*)));
+        if (!index->buckets) {
+            delete index;
+            return nullptr;
+        }
+
+        for (usize i = 0; i < buckets; i++) {
+            index->buckets[i] = nullptr;
+        }
+
+        for (usize i = 0; i < DENTRY_BUCKETS; i++) {
+            Dentry* dentry = dentry_buckets_[i];
+            while (dentry) {
+                Dentry* next = dentry->hash_next;
+                if (dentry->parent == cluster) {
+                    dentry_remove(dentry);
+                }
+                dentry = next;
+            }
+        }
+
+        index->cluster = cluster;
+        index->bucket_mask = buckets - 1;
+        index->entries = 0;
+        index->lru_prev = nullptr;
+        index->lru_next = index_lru_head_;
+
+        if (index_lru_head_) {
+            index_lru_head_->lru_prev = index;
+        } else {
+            index_lru_tail_ = index;
+        }
+        index_lru_head_ = index;
+        index_count_++;
+        return index;
+    }
+
+    void exFATVolume::index_destroy(DirectoryIndex* index) {
+        for (usize i = 0; i <= index->bucket_mask; i++) {
+            Dentry* dentry = index->buckets[i];
+            while (dentry) {
+                Dentry* next = dentry->hash_next;
+                delete dentry;
+                dentry = next;
+            }
+        }
+
+        if (index->lru_prev) {
+            index->lru_prev->lru_next = index->lru_next;
+        } else {
+            index_lru_head_ = index->lru_next;
+        }
+
+        if (index->lru_next) {
+            index->lru_next->lru_prev = index->lru_prev;
+        } else {
+            index_lru_tail_ = index->lru_prev;
+        }
+
+        indexed_entries_ -= index->entries;
+        index_count_--;
+        mm::VirtualMemoryManager::instance().kfree(index->buckets);
+        delete index;
+    }
+
+    exFATVolume::Dentry* exFATVolume::index_lookup(DirectoryIndex* index, const char* name, u16 hash) {
+        for (Dentry* dentry = index->buckets[hash & index->bucket_mask]; dentry; dentry = dentry->hash_next) {
+            if (dentry->hash == hash && dentry->name == name) {
+                return dentry;
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool exFATVolume::index_insert(DirectoryIndex* index, const char* name, u16 hash,
+                                   const exFATDirectoryEntry* dir_entry,
+                                   const exFATStreamExtensionEntry* stream_entry) {
+        Dentry* dentry = index_lookup(index, name, hash);
+        if (!dentry) {
+            if (indexed_entries_ >= MAX_INDEXED_ENTRIES) {
+                return false;
+            }
+
+            dentry = new Dentry;
+            if (!dentry) {
+                return false;
+            }
+
+            dentry->parent = index->cluster;
+            dentry->hash = hash;
+            dentry->negative = false;
+            dentry->name = name;
+            dentry->lru_prev = nullptr;
+            dentry->lru_next = nullptr;
+
+            usize bucket = hash & index->bucket_mask;
+            dentry->hash_next = index->buckets[bucket];
+            index->buckets[bucket] = dentry;
+            index->entries++;
+            indexed_entries_++;
+        }
+
+        memcpy(&dentry->dir_entry, dir_entry, sizeof(exFATDirectoryEntry));
+        memcpy(&dentry->stream_entry, stream_entry, sizeof(exFATStreamExtensionEntry));
+        return true;
+    }
+
+    void exFATVolume::index_remove(DirectoryIndex* index, const char* name, u16 hash) {
+        Dentry** link = &index->buckets[hash & index->bucket_mask];
+        while (*link) {
+            Dentry* dentry = *link;
+            if (dentry->hash == hash && dentry->name == name) {
+                *link = dentry->hash_next;
+                index->entries--;
+                indexed_entries_--;
+                delete dentry;
+                return;
+            }
+            link = &dentry->hash_next;
+        }
+    }
+
+    void exFATVolume::dentry_clear() {
+        while (index_lru_head_) {
+            index_destroy(index_lru_head_);
+        }
+
+        while (dentry_lru_head_) {
+            dentry_remove(dentry_lru_head_);
+        }
+    }
+
+    bool exFATVolume::find_file_in_directory(u32 directory_cluster, const char* name, FileHandle& file) {
+        ScopedLock lock(lock_);
+
+        u16 hash = calculate_name_hash(name);
+
+        DirectoryIndex* index = index_find(directory_cluster);
+        if (index) {
+            Dentry* dentry = index_lookup(index, name, hash);
+            if (!dentry) {
+                dentry_negative_hits_++;
+                return false;
+            }
+
+            dentry_hits_++;
+            fill_file_handle(&dentry->dir_entry, &dentry->stream_entry, name, file);
+            return true;
+        }
+
+        Dentry* dentry = dentry_lookup(directory_cluster, name, hash);
+        if (dentry) {
+            if (dentry->negative) {
+                dentry_negative_hits_++;
+                return false;
+            }
+
+            dentry_hits_++;
+            fill_file_handle(&dentry->dir_entry, &dentry->stream_entry, name, file);
+            return true;
+        }
+
+        dentry_misses_++;
+
+        Vector<u8> buffer;
+        if (!read_directory(directory_cluster, buffer)) {
+            return false;
+        }
+
+        const u8* buf_ptr = buffer.data();
+        usize entries = 0;
+
+        for (usize i = 0; i + 64 <= buffer.size(); i += 32) {
+            u8 entry_type = buf_ptr[i];
+            if (entry_type == 0x00) {
+                break;
+            }
+
+            if (entry_type == 0x85) {
+                u8 secondary_count = reinterpret_cast<const exFATDirectoryEntry*>(buf_ptr + i)->secondary_count;
+                if (secondary_count >= 2 && i + (secondary_count + 1) * 32 <= buffer.size()) {
+                    entries++;
+                    i += (secondary_count * 32) - 32;
+                }
+            }
+        }
+
+        index = index_create(directory_cluster, entries);
+
+        bool found = false;
+        String current_name;
+
+        for (usize i = 0; i + 64 <= buffer.size(); i += 32) {
+            u8 entry_type = buf_ptr[i];
+            if (entry_type == 0x00) {
+                break;
+            }
+
+            if (entry_type != 0x85) {
+                continue;
+            }
+
+            const exFATDirectoryEntry* dir_entry = 
+                reinterpret_cast<const exFATDirectoryEntry*>(buf_ptr + i);
+            const exFATStreamExtensionEntry* stream_entry = 
+                reinterpret_cast<const exFATStreamExtensionEntry*>(buf_ptr + i + 32);
+
+            u8 secondary_count = dir_entry->secondary_count;
+            if (secondary_count < 2 || i + (secondary_count + 1) * 32 > buffer.size()) {
+                continue;
+            }
+
+            read_entry_name(buf_ptr + i, current_name);
+
+            if (index && !index_insert(index, current_name.c_str(), calculate_name_hash(current_name.c_str()),
+                                       dir_entry, stream_entry)) {
+                index_destroy(index);
+                index = nullptr;
+            }
+
+            if (!found && current_name == name) {
+                fill_file_handle(dir_entry, stream_entry, name, file);
+                found = true;
+            }
+
+            i += (secondary_count * 32) - 32;
+            if (found && !index) {
+                break;
+            }
+        }
+
+        if (!found && !index) {
+            dentry_insert(directory_cluster, name, nullptr, nullptr);
+        }
+
+        return found;
+    }
+
+    bool exFATVolume::create_directory_entry(u32 directory_cluster, const VFS::DirectoryEntry& entry, FileHandle& file) {
+        Vector<u8> buffer;
+        if (!read_directory(directory_cluster, buffer)) {
+            return false;
+        }
+
+        usize free_slot = 0;
+        bool found_free = false;
+        
+        for (usize i = 0; i + 32 <= buffer.size(); i += 32) {
+            u8 entry_type = buffer[i];
+            if (entry_type == 0x00) {
+                free_slot = i;
+                found_free = true;
+                break;
+            }
+            
+            if (entry_type == 0x85) {
+                const exFATDirectoryEntry* dir_entry = 
+                    reinterpret_cast<const exFATDirectoryEntry*>(buffer.data() + i);
+                i += (dir_entry->secondary_count * 32) - 32;
+            }
+        }
+
+        if (!found_free) {
+            free_slot = buffer.size();
+            buffer.resize(buffer.size() + bytes_per_cluster_, 0);
+        }
+
+        u8 name_length = static_cast<u8>(entry.name.length());
+        u8 secondary_count = 2 + (name_length + 14) / 15;
+
+        if (free_slot + secondary_count * 32 > buffer.size()) {
+            buffer.resize(free_slot + secondary_count * 32, 0);
+        }
+
+        u64 current_time = arch::CPU::read_tsc();
+        exFATDateTime now;
+        now.year = 2024;
+        now.month = 1;
+        now.day = 1;
+        now.hour = 0;
+        now.minute = 0;
+        now.second = 0;
+        now.milliseconds = 0;
+
+        exFATDirectoryEntry* dir_entry = 
+            reinterpret_cast<exFATDirectoryEntry*>(buffer.data() + free_slot);
+        dir_entry->entry_type = 0x85;
+        dir_entry->secondary_count = secondary_count;
+        dir_entry->file_attributes = (entry.type == VFS::EntryType::Directory) ? 0x10 : 0x20;
+        dir_entry->create_timestamp = convert_to_timestamp(now);
+        dir_entry->last_modified_timestamp = convert_to_timestamp(now);
+        dir_entry->last_accessed_timestamp = convert_to_timestamp(now);
+        dir_entry->create_time_10ms = 0;
+        dir_entry->last_modified_time_10ms = 0;
+        dir_entry->create_timezone = 0;
+        dir_entry->last_modified_timezone = 0;
+        dir_entry->last_accessed_timezone = 0;
+
+        exFATStreamExtensionEntry* stream_entry = 
+            reinterpret_cast<exFATStreamExtensionEntry*>(buffer.data() + free_slot + 32);
+        stream_entry->entry_type = 0xC0;
+        stream_entry->flags = static_cast<u16>(exFATStreamFlags::AllocationPossible) |
+                              (file.no_fat_chain ? static_cast<u16>(exFATStreamFlags::NoFatChain) : 0);
+        stream_entry->secondary_count = secondary_count - 1;
+        stream_entry->name_length = name_length;
+        stream_entry->name_hash = calculate_name_hash(entry.name.c_str());
+        stream_entry->valid_data_length = 0;
+        stream_entry->first_cluster = file.first_cluster;
+        stream_entry->data_length = file.file_size;
+
+        const char* name_ptr = entry.name.c_str();
+        for (u8 i = 0; i < secondary_count - 1; i++) {
+            exFATFileNameEntry* name_entry = 
+                reinterpret_cast<exFATFileNameEntry*>(buffer.data() + free_slot + (i + 2) * 32);
+            name_entry->entry_type = 0xC1;
+            name_entry->flags = 0;
+
+            for (u8 j = 0; j < 15; j++) {
+                u8 idx = i * 15 + j;
+                if (idx < name_length) {
+                    name_entry->name_character[j] = name_ptr[idx];
+                } else {
+                    name_entry->name_character[j] = 0;
+                }
+            }
+        }
+
+        dir_entry->set_checksum = calculate_checksum(buffer.data() + free_slot, secondary_count * 32);
+
+        if (!write_cluster_chain(directory_cluster, free_slot, secondary_count * 32, buffer.data() + free_slot)) {
+            return false;
+        }
+
+        dentry_insert(directory_cluster, entry.name.c_str(), dir_entry, stream_entry);
+
+        file.name = entry.name;
+        file.create_time = now;
+        file.modify_time = now;
+        file.access_time = now;
+
+        return true;
     }
 
     bool exFATVolume::delete_directory_entry(u32 directory_cluster, const char* name) {
@@ -789,163 +1688,802 @@ namespace nk::fs {
                 String current_name;
                 u8 secondary_count = dir_entry->secondary_count;
                 
-                for (u8 j = 0; j < stream_entry->name_length && j < secondary_count - 1; j++) {
-                    const exFATFileNameEntry* name_entry = 
-                        reinterpret_cast<const exFATFileNameEntry*>(buffer.data() + i + (j + 2) * 32);
-                    
-                    for (u8 k = 0; k < 15; k++) {
-                        u16 ch = name_entry->name_character[k];
-                        if (ch == 0) {
-                            break;
-                        }
-                        current_name.push_back(static_cast<char>(ch & 0xFF));
-                    }
+                for (u8 j = 0; j < stream_entry->name_length && j < secondary_count - 1; j++) {
+                    const exFATFileNameEntry* name_entry = 
+                        reinterpret_cast<const exFATFileNameEntry*>(buffer.data() + i + (j + 2) * 32);
+                    
+                    for (u8 k = 0; k < 15; k++) {
+                        u16 ch = name_entry->name_character[k];
+                        if (ch == 0) {
+                            break;
+                        }
+                        current_name.push_back(static_cast<char>(ch & 0xFF));
+                    }
+                }
+
+                if (current_name == name) {
+                    u32 first_cluster = stream_entry->first_cluster;
+                    u32 clusters = clusters_for(stream_entry->data_length);
+                    bool no_fat_chain = (stream_entry->flags &
+                        static_cast<u16>(exFATStreamFlags::NoFatChain)) != 0;
+                    
+                    memset(buffer.data() + i, 0, secondary_count * 32);
+                    
+                    if (!write_cluster_chain(directory_cluster, i, secondary_count * 32, buffer.data() + i)) {
+                        return false;
+                    }
+
+                    dentry_insert(directory_cluster, name, nullptr, nullptr);
+
+                    if (first_cluster >= 2) {
+                        if (no_fat_chain) {
+                            release_clusters(first_cluster, clusters);
+                        } else {
+                            free_cluster_chain(first_cluster);
+                        }
+                    }
+
+                    return true;
+                }
+
+                i += (secondary_count * 32) - 32;
+            }
+        }
+
+        return false;
+    }
+
+    u16 exFATVolume::calculate_name_hash(const char* name) {
+        u16 hash = 0;
+        while (*name) {
+            u8 ch = static_cast<u8>(*name);
+            if (ch >= 'a' && ch <= 'z') {
+                ch -= 'a' - 'A';
+            }
+            hash = ((hash << 15) | (hash >> 1)) + ch;
+            hash = ((hash << 15) | (hash >> 1)) + 0;
+            name++;
+        }
+        return hash;
+    }
+
+    u16 exFATVolume::calculate_checksum(const u8* entries, usize count) {
+        u16 checksum = 0;
+        for (usize i = 0; i < count; i++) {
+            if (i == 2 || i == 3) {
+                checksum = ((checksum << 15) | (checksum >> 1)) + 0;
+            } else {
+                checksum = ((checksum << 15) | (checksum >> 1)) + entries[i];
+            }
+        }
+        return checksum;
+    }
+
+    exFATDateTime exFATVolume::convert_timestamp(u32 timestamp, u8 subseconds, u8 timezone) {
+        exFATDateTime dt;
+        
+        u16 date = timestamp >> 16;
+        u16 time = timestamp & 0xFFFF;
+        
+        dt.year = ((date >> 9) & 0x7F) + 1980;
+        dt.month = (date >> 5) & 0x0F;
+        dt.day = date & 0x1F;
+        dt.hour = (time >> 11) & 0x1F;
+        dt.minute = (time >> 5) & 0x3F;
+        dt.second = (time & 0x1F) * 2;
+        dt.milliseconds = subseconds * 10;
+        
+        return dt;
+    }
+
+    u32 exFATVolume::convert_to_timestamp(const exFATDateTime& dt) {
+        u16 date = ((dt.year - 1980) << 9) | (dt.month << 5) | dt.day;
+        u16 time = (dt.hour << 11) | (dt.minute << 5) | (dt.second / 2);
+        
+        return (date << 16) | time;
+    }
+
+    void exFATVolume::update_cache_statistics(bool hit) {
+        if (hit) {
+            cache_hits_++;
+        } else {
+            cache_misses_++;
+        }
+    }
+
+    void exFATVolume::flush_cache() {
+        ScopedLock lock(lock_);
+        
+        if (!block_) {
+            for (CacheEntry* entry = lru_head_; entry; entry = entry->lru_next) {
+                if (entry->dirty &&
+                    write_sectors(cluster_to_sector(entry->cluster), sectors_per_cluster_, entry->data)) {
+                    entry->dirty = false;
+                    dirty_entries_--;
+                }
+            }
+            return;
+        }
+        
+        task::Thread* waiter = task::Scheduler::instance().get_current_thread();
+        
+        block_->plug();
+        for (CacheEntry* entry = lru_head_; entry; entry = entry->lru_next) {
+            reap_io(entry);
+            if (entry->dirty && !entry->io_active) {
+                start_writeback(entry, waiter);
+            }
+        }
+        block_->unplug();
+        
+        for (CacheEntry* entry = lru_head_; entry; entry = entry->lru_next) {
+            if (!entry->io_active) {
+                continue;
+            }
+            
+            wait_for_io(entry);
+            
+            if (entry->dirty) {
+                debug::log(debug::LogLevel::Error, "exFAT",
+                          "Failed to write back cluster %u", entry->cluster);
+            }
+        }
+    }
+
+    usize exFATVolume::default_cache_capacity() const {
+        usize budget = mm::PhysicalMemoryManager::instance().free_memory() / CACHE_MEMORY_DIVISOR;
+        usize entries = bytes_per_cluster_ ? budget / bytes_per_cluster_ : 0;
+        return min(max(entries, MIN_CACHE_ENTRIES), MAX_CACHE_ENTRIES);
+    }
+
+    bool exFATVolume::init_cache() {
+        if (cache_buckets_) {
+            return true;
+        }
+        
+        if (cache_capacity_ == 0) {
+            cache_capacity_ = default_cache_capacity();
+        }
+        cache_capacity_ = min(max(cache_capacity_, MIN_CACHE_ENTRIES), MAX_CACHE_ENTRIES);
+        
+        usize buckets = 1;
+        while (buckets < cache_capacity_) {
+            buckets <<= 1;
+        }
+        
+        cache_buckets_ = reinterpret_cast<CacheEntry**>(
+            mm::VirtualMemoryManager::instance().kmalloc(buckets * sizeof(CacheEntry*)));
+        if (!cache_buckets_) {
+            return false;
+        }
+        
+        for (usize i = 0; i < buckets; i++) {
+            cache_buckets_[i] = nullptr;
+        }
+        cache_bucket_mask_ = buckets - 1;
+        return true;
+    }
+
+    usize exFATVolume::hash_bucket(u32 cluster) const {
+        return (cluster * 0x9E3779B1u) & cache_bucket_mask_;
+    }
+
+    void exFATVolume::lru_unlink(CacheEntry* entry) {
+        if (entry->lru_prev) {
+            entry->lru_prev->lru_next = entry->lru_next;
+        } else {
+            lru_head_ = entry->lru_next;
+        }
+        
+        if (entry->lru_next) {
+            entry->lru_next->lru_prev = entry->lru_prev;
+        } else {
+            lru_tail_ = entry->lru_prev;
+        }
+        
+        entry->lru_prev = nullptr;
+        entry->lru_next = nullptr;
+    }
+
+    void exFATVolume::lru_push_front(CacheEntry* entry) {
+        entry->lru_prev = nullptr;
+        entry->lru_next = lru_head_;
+        
+        if (lru_head_) {
+            lru_head_->lru_prev = entry;
+        } else {
+            lru_tail_ = entry;
+        }
+        lru_head_ = entry;
+    }
+
+    void exFATVolume::hash_unlink(CacheEntry* entry) {
+        CacheEntry** link = &cache_buckets_[hash_bucket(entry->cluster)];
+        while (*link && *link != entry) {
+            link = &(*link)->hash_next;
+        }
+        
+        if (*link) {
+            *link = entry->hash_next;
+        }
+        entry->hash_next = nullptr;
+    }
+
+    void exFATVolume::mark_dirty(CacheEntry* entry) {
+        if (!entry->dirty) {
+            entry->dirty = true;
+            dirty_entries_++;
+        }
+        
+        if (entry != lru_head_) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+        }
+    }
+
+    void exFATVolume::reap_io(CacheEntry* entry) {
+        if (!entry->io_active ||
+            !__atomic_load_n(&entry->io.completed, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        
+        entry->io_active = false;
+        if (!entry->io_write) {
+            entry->valid = entry->io.success;
+        } else if (entry->io.success) {
+            cache_writebacks_++;
+        } else if (!entry->dirty) {
+            entry->dirty = true;
+            dirty_entries_++;
+        }
+    }
+
+    void exFATVolume::wait_for_io(CacheEntry* entry) {
+        drivers::BlockRequest& request = entry->io;
+        __atomic_store_n(&request.waiter, task::Scheduler::instance().get_current_thread(),
+                         __ATOMIC_SEQ_CST);
+        block_->wait(&request);
+        reap_io(entry);
+    }
+
+    bool exFATVolume::start_writeback(CacheEntry* entry, task::Thread* waiter) {
+        drivers::BlockRequest& request = entry->io;
+        request.lba = partition_start_ + cluster_to_sector(entry->cluster);
+        request.count = sectors_per_cluster_;
+        request.buffer = entry->data;
+        request.write = true;
+        request.callback = nullptr;
+        request.context = nullptr;
+        request.waiter = waiter;
+        
+        entry->dirty = false;
+        dirty_entries_--;
+        entry->io_active = true;
+        entry->io_write = true;
+        
+        if (!block_->submit(&request)) {
+            entry->io_active = false;
+            entry->dirty = true;
+            dirty_entries_++;
+            return false;
+        }
+        
+        return true;
+    }
+
+    usize exFATVolume::writeback_dirty(usize limit) {
+        if (!block_ || dirty_entries_ == 0) {
+            return 0;
+        }
+        
+        usize started = 0;
+        
+        block_->plug();
+        for (CacheEntry* entry = lru_tail_; entry && started < limit; entry = entry->lru_prev) {
+            reap_io(entry);
+            if (entry->dirty && !entry->io_active && start_writeback(entry, nullptr)) {
+                started++;
+            }
+        }
+        block_->unplug();
+        
+        return started;
+    }
+
+    bool exFATVolume::evict_entry(CacheEntry* entry) {
+        if (entry->pins > 0 || entry_mapped(entry)) {
+            return false;
+        }
+        
+        if (entry->io_active) {
+            wait_for_io(entry);
+        }
+        
+        if (entry->dirty) {
+            if (!write_sectors(cluster_to_sector(entry->cluster), sectors_per_cluster_, entry->data)) {
+                debug::log(debug::LogLevel::Error, "exFAT",
+                          "Failed to write back evicted cluster %u", entry->cluster);
+                return false;
+            }
+            entry->dirty = false;
+            dirty_entries_--;
+            cache_writebacks_++;
+        }
+        
+        hash_unlink(entry);
+        lru_unlink(entry);
+        cache_size_--;
+        cache_evictions_++;
+        
+        free_cluster_buffer(entry->data);
+        delete entry;
+        return true;
+    }
+
+    usize exFATVolume::shrink_cache_locked(usize target) {
+        usize released = 0;
+        CacheEntry* entry = lru_tail_;
+        
+        while (entry && cache_size_ > target) {
+            CacheEntry* previous = entry->lru_prev;
+            reap_io(entry);
+            
+            if (!entry->dirty && !entry->io_active && evict_entry(entry)) {
+                released++;
+            }
+            entry = previous;
+        }
+        
+        if (released) {
+            cache_shrinks_++;
+            if (cluster_cache_) {
+                cluster_cache_->shrink();
+            }
+        }
+        
+        return released;
+    }
+
+    bool exFATVolume::memory_low() const {
+        mm::PhysicalMemoryManager& pmm = mm::PhysicalMemoryManager::instance();
+        return pmm.free_memory() < pmm.total_memory() / LOW_MEMORY_DIVISOR;
+    }
+
+    usize exFATVolume::shrink_cache() {
+        ScopedLock lock(lock_);
+        
+        writeback_dirty(cache_size_);
+        return shrink_cache_locked(cache_size_ / 2);
+    }
+
+    usize exFATVolume::writeback() {
+        ScopedLock lock(lock_);
+        return writeback_dirty(WRITEBACK_BATCH);
+    }
+
+    void exFATVolume::set_cache_capacity(usize capacity) {
+        ScopedLock lock(lock_);
+        
+        usize limit = cache_bucket_mask_ + 1;
+        cache_capacity_ = min(max(capacity, MIN_CACHE_ENTRIES), cache_buckets_ ? limit : MAX_CACHE_ENTRIES);
+        
+        if (cache_size_ > cache_capacity_) {
+            writeback_dirty(cache_size_ - cache_capacity_);
+            shrink_cache_locked(cache_capacity_);
+        }
+    }
+
+    exFATVolume::CacheEntry* exFATVolume::find_entry(u32 cluster) {
+        for (CacheEntry* entry = cache_buckets_[hash_bucket(cluster)]; entry; entry = entry->hash_next) {
+            if (entry->cluster == cluster) {
+                return entry;
+            }
+        }
+        
+        return nullptr;
+    }
+
+    exFATVolume::CacheEntry* exFATVolume::get_cached_cluster(u32 cluster) {
+        ScopedLock lock(lock_);
+        
+        if (!cache_buckets_) {
+            return nullptr;
+        }
+        
+        CacheEntry* entry = find_entry(cluster);
+        if (!entry) {
+            return nullptr;
+        }
+        
+        if (entry->io_active && !entry->io_write) {
+            wait_for_io(entry);
+        }
+        
+        if (!entry->valid) {
+            return nullptr;
+        }
+        
+        if (entry->readahead) {
+            entry->readahead = false;
+            readahead_hits_++;
+        }
+        
+        if (entry != lru_head_) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+        }
+        
+        entry->pins++;
+        return entry;
+    }
+
+    void exFATVolume::release_cached_cluster(CacheEntry* entry) {
+        ScopedLock lock(lock_);
+        entry->pins--;
+    }
+
+    exFATVolume::CacheEntry* exFATVolume::insert_entry(u32 cluster) {
+        if (dirty_entries_ > cache_capacity_ / 4) {
+            writeback_dirty(WRITEBACK_BATCH);
+        }
+        
+        if (memory_low()) {
+            shrink_cache_locked(cache_size_ / 2);
+        }
+        
+        while (cache_size_ >= cache_capacity_) {
+            CacheEntry* victim = lru_tail_;
+            for (CacheEntry* entry = lru_tail_; entry; entry = entry->lru_prev) {
+                reap_io(entry);
+                if (!entry->io_active && !entry->pins && (!entry->valid || !entry->dirty) &&
+                    !entry_mapped(entry)) {
+                    victim = entry;
+                    break;
+                }
+            }
+            
+            if (!victim || !evict_entry(victim)) {
+                return nullptr;
+            }
+        }
+        
+        CacheEntry* entry = new CacheEntry;
+        if (!entry) {
+            return nullptr;
+        }
+        
+        entry->data = allocate_cluster_buffer();
+        if (!entry->data) {
+            delete entry;
+            return nullptr;
+        }
+        
+        entry->cluster = cluster;
+        entry->dirty = false;
+        entry->valid = false;
+        entry->readahead = false;
+        entry->io_active = false;
+        entry->io_write = false;
+        entry->pins = 0;
+        
+        usize bucket = hash_bucket(cluster);
+        entry->hash_next = cache_buckets_[bucket];
+        cache_buckets_[bucket] = entry;
+        lru_push_front(entry);
+        cache_size_++;
+        return entry;
+    }
+
+    bool exFATVolume::put_cached_cluster(u32 cluster, const u8* data, bool dirty) {
+        ScopedLock lock(lock_);
+        
+        if (!cache_buckets_) {
+            return false;
+        }
+        
+        CacheEntry* entry = find_entry(cluster);
+        if (entry && entry->io_active) {
+            wait_for_io(entry);
+        }
+        
+        if (!entry) {
+            entry = insert_entry(cluster);
+            if (!entry) {
+                return false;
+            }
+        }
+        
+        memcpy(entry->data, data, bytes_per_cluster_);
+        entry->valid = true;
+        entry->readahead = false;
+        
+        if (dirty) {
+            mark_dirty(entry);
+        }
+        return true;
+    }
+
+    void exFATVolume::start_readahead(FileHandle& file) {
+        if (!block_ || !cache_buckets_ || file.readahead_window == 0 ||
+            file.current_offset >= file.file_size) {
+            return;
+        }
+        
+        u32 file_clusters = static_cast<u32>((file.file_size + bytes_per_cluster_ - 1) / bytes_per_cluster_);
+        u32 window = min(file.readahead_window, static_cast<u32>(cache_capacity_ / 4));
+        u32 first = max(static_cast<u32>(file.current_offset / bytes_per_cluster_), file.readahead_end);
+        u32 last = min(static_cast<u32>(file.current_offset / bytes_per_cluster_) + window, file_clusters);
+        
+        if (first >= last) {
+            return;
+        }
+        
+        ScopedLock lock(lock_);
+        
+        block_->plug();
+        
+        u32 file_cluster = first;
+        while (file_cluster < last) {
+            u32 disk_cluster;
+            u32 run;
+            if (!map_cluster(file, file_cluster, disk_cluster, run)) {
+                break;
+            }
+            
+            for (u32 i = 0; i < run && file_cluster < last; i++, file_cluster++) {
+                if (find_entry(disk_cluster + i)) {
+                    continue;
+                }
+                
+                CacheEntry* entry = insert_entry(disk_cluster + i);
+                if (!entry) {
+                    file_cluster = last;
+                    break;
                 }
-
-                if (current_name == name) {
-                    memset(buffer.data() + i, 0, secondary_count * 32);
-                    
-                    if (!write_cluster_chain(directory_cluster, i, secondary_count * 32, buffer.data() + i)) {
-                        return false;
-                    }
-
-                    if (stream_entry->first_cluster >= 2) {
-                        free_cluster_chain(stream_entry->first_cluster);
-                    }
-
-                    return true;
+                
+                drivers::BlockRequest& request = entry->io;
+                request.lba = partition_start_ + cluster_to_sector(entry->cluster);
+                request.count = sectors_per_cluster_;
+                request.buffer = entry->data;
+                request.write = false;
+                request.callback = nullptr;
+                request.context = nullptr;
+                request.waiter = nullptr;
+                
+                entry->readahead = true;
+                entry->io_active = true;
+                entry->io_write = false;
+                
+                if (!block_->submit(&request)) {
+                    entry->io_active = false;
+                    entry->readahead = false;
+                    continue;
                 }
-
-                i += (secondary_count * 32) - 32;
+                
+                readahead_issued_++;
             }
         }
+        
+        block_->unplug();
+        
+        file.readahead_end = file_cluster;
+    }
 
-        return false;
+    u8* exFATVolume::allocate_cluster_buffer() {
+        if (frame_backed_) {
+            Optional<phys_addr> frames = mm::PhysicalMemoryManager::instance()
+                .allocate_pages(bytes_per_cluster_ / PAGE_SIZE);
+            return frames.has_value() ? reinterpret_cast<u8*>(phys_to_virt(frames.value())) : nullptr;
+        }
+        if (cluster_cache_) {
+            return reinterpret_cast<u8*>(cluster_cache_->allocate());
+        }
+        return reinterpret_cast<u8*>(
+            mm::VirtualMemoryManager::instance().kmalloc(bytes_per_cluster_));
     }
 
-    u16 exFATVolume::calculate_name_hash(const char* name) {
-        u16 hash = 0;
-        while (*name) {
-            hash = ((hash << 15) | (hash >> 1)) + static_cast<u8>(*name);
-            name++;
+    void exFATVolume::free_cluster_buffer(u8* data) {
+        if (!frame_backed_) {
+            mm::VirtualMemoryManager::instance().kfree(data);
+            return;
+        }
+        
+        mm::PhysicalMemoryManager& pmm = mm::PhysicalMemoryManager::instance();
+        phys_addr base = virt_to_phys(reinterpret_cast<virt_addr>(data));
+        for (usize offset = 0; offset < bytes_per_cluster_; offset += PAGE_SIZE) {
+            pmm.unref_page(base + offset);
         }
-        return hash;
     }
 
-    u16 exFATVolume::calculate_checksum(const u8* entries, usize count) {
-        u16 checksum = 0;
-        for (usize i = 0; i < count; i++) {
-            if (i == 2 || i == 3) {
-                checksum = ((checksum << 15) | (checksum >> 1)) + 0;
-            } else {
-                checksum = ((checksum << 15) | (checksum >> 1)) + entries[i];
+    bool exFATVolume::entry_mapped(const CacheEntry* entry) const {
+        if (!frame_backed_) {
+            return false;
+        }
+        
+        mm::PhysicalMemoryManager& pmm = mm::PhysicalMemoryManager::instance();
+        phys_addr base = virt_to_phys(reinterpret_cast<virt_addr>(entry->data));
+        for (usize offset = 0; offset < bytes_per_cluster_; offset += PAGE_SIZE) {
+            if (pmm.page_refcount(base + offset) > 1) {
+                return true;
             }
         }
-        return checksum;
+        
+        return false;
     }
 
-    exFATDateTime exFATVolume::convert_timestamp(u32 timestamp, u8 subseconds, u8 timezone) {
-        exFATDateTime dt;
+    Optional<phys_addr> exFATVolume::map_file_page(FileHandle& file, u64 index) {
+        ScopedLock lock(lock_);
         
-        u16 date = timestamp >> 16;
-        u16 time = timestamp & 0xFFFF;
+        u64 offset = index * PAGE_SIZE;
+        if (!frame_backed_ || !cache_buckets_ || offset >= file.file_size) {
+            return {};
+        }
         
-        dt.year = ((date >> 9) & 0x7F) + 1980;
-        dt.month = (date >> 5) & 0x0F;
-        dt.day = date & 0x1F;
-        dt.hour = (time >> 11) & 0x1F;
-        dt.minute = (time >> 5) & 0x3F;
-        dt.second = (time & 0x1F) * 2;
-        dt.milliseconds = subseconds * 10;
+        u32 disk_cluster;
+        u32 run;
+        if (!map_cluster(file, static_cast<u32>(offset / bytes_per_cluster_), disk_cluster, run)) {
+            return {};
+        }
         
-        return dt;
-    }
-
-    u32 exFATVolume::convert_to_timestamp(const exFATDateTime& dt) {
-        u16 date = ((dt.year - 1980) << 9) | (dt.month << 5) | dt.day;
-        u16 time = (dt.hour << 11) | (dt.minute << 5) | (dt.second / 2);
+        CacheEntry* entry = find_entry(disk_cluster);
+        if (entry && entry->io_active) {
+            wait_for_io(entry);
+        }
         
-        return (date << 16) | time;
-    }
-
-    void exFATVolume::update_cache_statistics(bool hit) {
-        if (hit) {
-            cache_hits_++;
+        if (!entry) {
+            entry = insert_entry(disk_cluster);
+            if (!entry) {
+                return {};
+            }
+        }
+        
+        if (!entry->valid) {
+            if (!read_sectors(cluster_to_sector(disk_cluster), sectors_per_cluster_, entry->data)) {
+                update_cache_statistics(false);
+                return {};
+            }
+            entry->valid = true;
+            update_cache_statistics(false);
         } else {
-            cache_misses_++;
+            update_cache_statistics(true);
+        }
+        
+        u64 cluster_start = offset - offset % bytes_per_cluster_;
+        if (cluster_start + bytes_per_cluster_ > file.file_size) {
+            usize valid = static_cast<usize>(file.file_size - cluster_start);
+            memset(entry->data + valid, 0, bytes_per_cluster_ - valid);
+        }
+        
+        entry->readahead = false;
+        if (entry != lru_head_) {
+            lru_unlink(entry);
+            lru_push_front(entry);
         }
+        
+        phys_addr frame = virt_to_phys(reinterpret_cast<virt_addr>(entry->data)) +
+                          offset % bytes_per_cluster_;
+        mm::PhysicalMemoryManager::instance().ref_page(frame);
+        mapped_faults_++;
+        
+        return frame;
     }
 
-    void exFATVolume::flush_cache() {
+    void exFATVolume::dirty_file_page(FileHandle& file, u64 index) {
         ScopedLock lock(lock_);
         
-        for (CacheEntry& entry : cache_) {
-            if (entry.dirty) {
-                u64 start_sector = cluster_heap_start_sector_ + (entry.cluster - 2) * sectors_per_cluster_;
-                const u8* current = entry.data;
-                
-                for (u32 i = 0; i < sectors_per_cluster_; i++) {
-                    write_sector(start_sector + i, current);
-                    current += bytes_per_sector_;
-                }
-                
-                entry.dirty = false;
-            }
+        u64 offset = index * PAGE_SIZE;
+        u32 disk_cluster;
+        u32 run;
+        if (offset >= file.file_size ||
+            !map_cluster(file, static_cast<u32>(offset / bytes_per_cluster_), disk_cluster, run)) {
+            return;
+        }
+        
+        CacheEntry* entry = find_entry(disk_cluster);
+        if (entry) {
+            mark_dirty(entry);
         }
     }
 
-    exFATVolume::CacheEntry* exFATVolume::get_cached_cluster(u32 cluster) {
-        ScopedLock lock(lock_);
-        
-        for (CacheEntry& entry : cache_) {
-            if (entry.cluster == cluster) {
-                entry.last_access = arch::CPU::read_tsc();
-                return &entry;
+    exFATVolume::Mapping* exFATVolume::find_mapping(u32 first_cluster) {
+        for (Mapping* mapping : mappings_) {
+            if (mapping->file_.first_cluster == first_cluster && mapping->try_retain()) {
+                return mapping;
             }
         }
         
         return nullptr;
     }
 
-    void exFATVolume::put_cached_cluster(u32 cluster, const u8* data) {
+    void exFATVolume::update_mapping(const FileHandle& file) {
+        for (Mapping* mapping : mappings_) {
+            if (mapping->file_.first_cluster == file.first_cluster) {
+                mapping->file_ = file;
+            }
+        }
+    }
+
+    void exFATVolume::detach_mapping(Mapping* mapping) {
         ScopedLock lock(lock_);
         
-        if (cache_.size() >= 64) {
-            auto oldest = cache_.begin();
-            for (auto it = cache_.begin(); it != cache_.end(); ++it) {
-                if (it->last_access < oldest->last_access) {
-                    oldest = it;
-                }
+        for (usize i = 0; i < mappings_.size(); i++) {
+            if (mappings_[i] == mapping) {
+                mappings_.erase(i);
+                return;
+            }
+        }
+    }
+
+    void exFATVolume::zap_mapping(u32 first_cluster, u64 size) {
+        Mapping* mapping;
+        {
+            ScopedLock lock(lock_);
+            
+            mapping = find_mapping(first_cluster);
+            if (!mapping) {
+                return;
             }
             
-            if (oldest->dirty) {
-                u64 start_sector = cluster_heap_start_sector_ + (oldest->cluster - 2) * sectors_per_cluster_;
-                const u8* current = oldest->data;
-                
-                for (u32 i = 0; i < sectors_per_cluster_; i++) {
-                    write_sector(start_sector + i, current);
-                    current += bytes_per_sector_;
+            mapping->file_.file_size = min(mapping->file_.file_size, size);
+            if (size == 0) {
+                for (usize i = 0; i < mappings_.size(); i++) {
+                    if (mappings_[i] == mapping) {
+                        mappings_.erase(i);
+                        break;
+                    }
                 }
             }
-            
-            mm::VirtualMemoryManager::instance().kfree(oldest->data);
-            cache_.erase(oldest);
         }
         
-        CacheEntry entry;
-        entry.cluster = cluster;
-        entry.data = reinterpret_cast<u8*>(
-            mm::VirtualMemoryManager::instance().kmalloc(bytes_per_cluster_));
+        mm::VirtualMemoryManager::instance().zap_provider(mapping, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+        mapping->release();
+    }
+
+    bool exFATVolume::mmap(VFS::FileHandle* handle, mm::VirtualMemoryManager::AddressSpace* space,
+                           virt_addr address, usize length, u64 offset, mm::PageFlags flags) {
+        if (!handle || !space || length == 0 || offset % PAGE_SIZE != 0) {
+            return false;
+        }
         
-        if (!entry.data) {
-            return;
+        if (!frame_backed_ || !block_) {
+            debug::log(debug::LogLevel::Warning, "exFAT",
+                      "mmap requires page-multiple clusters (cluster size %u bytes)",
+                      bytes_per_cluster_);
+            return false;
+        }
+        
+        Mapping* mapping;
+        {
+            ScopedLock lock(lock_);
+            
+            FileHandle* file = reinterpret_cast<FileHandle*>(handle);
+            if (file->attributes & 0x10) {
+                return false;
+            }
+            
+            mapping = find_mapping(file->first_cluster);
+            if (!mapping) {
+                mapping = new Mapping(this, *file);
+                if (!mapping) {
+                    return false;
+                }
+                mappings_.push_back(mapping);
+            }
         }
         
-        memcpy(entry.data, data, bytes_per_cluster_);
-        entry.dirty = false;
-        entry.last_access = arch::CPU::read_tsc();
+        bool mapped = mm::VirtualMemoryManager::instance().map_file(space, address, length, flags,
+                                                                    mapping, offset / PAGE_SIZE);
+        mapping->release();
+        return mapped;
+    }
+
+    bool exFATVolume::msync(mm::VirtualMemoryManager::AddressSpace* space, virt_addr address, usize length) {
+        if (!mm::VirtualMemoryManager::instance().sync_region(space, address, length)) {
+            return false;
+        }
         
-        cache_.push_back(entry);
+        flush_cache();
+        return true;
     }
 
     VFS::FileHandle* exFATVolume::open(const char* path, u32 flags) {
@@ -974,6 +2512,12 @@ namespace nk::fs {
                 file->current_cluster = file->first_cluster;
                 file->cluster_offset = 0;
                 file->attributes = (flags & VFS::OpenFlags::Directory) ? 0x10 : 0x20;
+                file->no_fat_chain = true;
+                file->allocated_clusters = 1;
+                invalidate_extents(*file);
+                file->readahead_next = 0;
+                file->readahead_window = 0;
+                file->readahead_end = 0;
 
                 VFS::DirectoryEntry entry;
                 entry.name = name;
@@ -1010,11 +2554,35 @@ namespace nk::fs {
             return false;
         }
 
+        ScopedLock lock(lock_);
+
         FileHandle* file = reinterpret_cast<FileHandle*>(handle);
+        release_reservation(*file);
         delete file;
         return true;
     }
 
+    bool exFATVolume::fallocate(VFS::FileHandle* handle, u64 size) {
+        if (!handle) {
+            return false;
+        }
+
+        ScopedLock lock(lock_);
+
+        FileHandle* file = reinterpret_cast<FileHandle*>(handle);
+
+        if ((file->attributes & 0x10) || file->first_cluster < 2) {
+            return false;
+        }
+
+        if (!extend_file(*file, clusters_for(size))) {
+            return false;
+        }
+
+        update_mapping(*file);
+        return true;
+    }
+
     usize exFATVolume::read(VFS::FileHandle* handle, void* buffer, usize size) {
         if (!handle || !buffer) {
             return 0;
@@ -1034,24 +2602,22 @@ namespace nk::fs {
 
         usize to_read = min(size, static_cast<usize>(file->file_size - file->current_offset));
         
-        if (!read_cluster_chain(file->first_cluster, file->current_offset, to_read, buffer)) {
+        if (file->current_offset == file->readahead_next) {
+            file->readahead_window = file->readahead_window ?
+                min(file->readahead_window * 2, MAX_READAHEAD_CLUSTERS) : MIN_READAHEAD_CLUSTERS;
+        } else {
+            file->readahead_window /= 2;
+            file->readahead_end = 0;
+        }
+        
+        if (!read_file_data(*file, file->current_offset, to_read, buffer)) {
             return 0;
         }
 
         file->current_offset += to_read;
-        
-        if (file->current_offset >= file->file_size) {
-            file->current_cluster = 0xFFFFFFFF;
-            file->cluster_offset = 0;
-        } else {
-            file->current_cluster = file->first_cluster;
-            file->cluster_offset = file->current_offset;
-            
-            while (file->cluster_offset >= bytes_per_cluster_) {
-                file->current_cluster = find_next_cluster(file->current_cluster);
-                file->cluster_offset -= bytes_per_cluster_;
-            }
-        }
+        file->readahead_next = file->current_offset;
+        update_position(*file);
+        start_readahead(*file);
 
         return to_read;
     }
@@ -1075,24 +2641,12 @@ namespace nk::fs {
             }
         }
 
-        if (!write_cluster_chain(file->first_cluster, file->current_offset, size, buffer)) {
+        if (!write_file_data(*file, file->current_offset, size, buffer)) {
             return 0;
         }
 
         file->current_offset += size;
-        
-        if (file->current_offset >= file->file_size) {
-            file->current_cluster = 0xFFFFFFFF;
-            file->cluster_offset = 0;
-        } else {
-            file->current_cluster = file->first_cluster;
-            file->cluster_offset = file->current_offset;
-            
-            while (file->cluster_offset >= bytes_per_cluster_) {
-                file->current_cluster = find_next_cluster(file->current_cluster);
-                file->cluster_offset -= bytes_per_cluster_;
-            }
-        }
+        update_position(*file);
 
         return size;
     }
@@ -1126,19 +2680,7 @@ namespace nk::fs {
         }
 
         file->current_offset = new_offset;
-        
-        if (new_offset == file->file_size) {
-            file->current_cluster = 0xFFFFFFFF;
-            file->cluster_offset = 0;
-        } else {
-            file->current_cluster = file->first_cluster;
-            file->cluster_offset = new_offset;
-            
-            while (file->cluster_offset >= bytes_per_cluster_) {
-                file->current_cluster = find_next_cluster(file->current_cluster);
-                file->cluster_offset -= bytes_per_cluster_;
-            }
-        }
+        update_position(*file);
 
         return true;
     }
@@ -1157,59 +2699,52 @@ namespace nk::fs {
             return false;
         }
 
-        ScopedLock lock(lock_);
-        
         FileHandle* file = reinterpret_cast<FileHandle*>(handle);
         
         if (file->attributes & 0x10) {
             return false;
         }
 
+        if (size < file->file_size) {
+            zap_mapping(file->first_cluster, size);
+        }
+
+        ScopedLock lock(lock_);
+
         if (size == file->file_size) {
             return true;
         }
 
         if (size < file->file_size) {
-            u32 clusters_needed = (size + bytes_per_cluster_ - 1) / bytes_per_cluster_;
-            u32 current_cluster = file->first_cluster;
-            u32 prev_cluster = 0;
-            
-            for (u32 i = 0; i < clusters_needed; i++) {
-                if (current_cluster >= 0xFFFFFFF8) {
-                    break;
-                }
-                prev_cluster = current_cluster;
-                current_cluster = find_next_cluster(current_cluster);
-            }
-            
-            if (prev_cluster != 0) {
-                write_fat_entry(prev_cluster, 0xFFFFFFFF);
-            }
-            
-            if (current_cluster >= 2 && current_cluster < total_clusters_ + 2) {
-                free_cluster_chain(current_cluster);
+            file->file_size = size;
+            if (!release_reservation(*file)) {
+                return false;
             }
         } else {
-            u64 additional = size - file->file_size;
+            if (!extend_file(*file, clusters_for(size))) {
+                return false;
+            }
+
             u64 current_pos = file->file_size;
-            
-            while (additional > 0) {
-                u64 to_write = min(additional, static_cast<u64>(bytes_per_cluster_));
-                
-                u8 zero_buffer[bytes_per_cluster_];
-                memset(zero_buffer, 0, bytes_per_cluster_);
-                
-                if (!write_cluster_chain(file->first_cluster, current_pos, to_write, zero_buffer)) {
+            file->file_size = size;
+
+            u8 zero_buffer[bytes_per_cluster_];
+            memset(zero_buffer, 0, bytes_per_cluster_);
+
+            while (current_pos < size) {
+                u64 to_write = min(size - current_pos,
+                                   bytes_per_cluster_ - current_pos % bytes_per_cluster_);
+
+                if (!write_file_data(*file, current_pos, to_write, zero_buffer)) {
                     return false;
                 }
-                
+
                 current_pos += to_write;
-                additional -= to_write;
             }
         }
 
-        file->file_size = size;
-        
+        update_mapping(*file);
+
         Vector<u8> buffer;
         if (!read_directory(root_dir_cluster_, buffer)) {
             return false;
@@ -1246,12 +2781,16 @@ namespace nk::fs {
 
                 if (current_name == file->name) {
                     stream_entry->data_length = size;
+                    stream_entry->first_cluster = file->first_cluster;
+                    stream_entry->flags = static_cast<u16>(exFATStreamFlags::AllocationPossible) |
+                        (file->no_fat_chain ? static_cast<u16>(exFATStreamFlags::NoFatChain) : 0);
                     dir_entry->set_checksum = calculate_checksum(buffer.data() + i, secondary_count * 32);
                     
                     if (!write_cluster_chain(root_dir_cluster_, i, secondary_count * 32, buffer.data() + i)) {
                         return false;
                     }
                     
+                    dentry_insert(root_dir_cluster_, file->name.c_str(), dir_entry, stream_entry);
                     break;
                 }
 
@@ -1343,8 +2882,6 @@ namespace nk::fs {
     }
 
     bool exFATVolume::rmdir(const char* path) {
-        ScopedLock lock(lock_);
-        
         if (path == nullptr || path[0] != '/') {
             return false;
         }
@@ -1354,6 +2891,13 @@ namespace nk::fs {
             return false;
         }
 
+        FileHandle file;
+        if (find_file_in_directory(root_dir_cluster_, name, file)) {
+            zap_mapping(file.first_cluster, 0);
+        }
+
+        ScopedLock lock(lock_);
+        
         return delete_directory_entry(root_dir_cluster_, name);
     }
 
@@ -1445,6 +2989,8 @@ namespace nk::fs {
                         return false;
                     }
                     
+                    dentry_insert(root_dir_cluster_, old_name, nullptr, nullptr);
+                    dentry_insert(root_dir_cluster_, new_name, dir_entry, stream_entry);
                     return true;
                 }
 
@@ -1531,6 +3077,22 @@ namespace nk::fs {
         debug::log(debug::LogLevel::Info, "exFAT", "  Cache hit rate: %.2f%%",
                   cache_hits_ + cache_misses_ > 0 ?
                   (100.0 * cache_hits_ / (cache_hits_ + cache_misses_)) : 0.0);
+        debug::log(debug::LogLevel::Info, "exFAT", "  Cache entries: %llu / %llu (%llu dirty)",
+                  cache_size_, cache_capacity_, dirty_entries_);
+        debug::log(debug::LogLevel::Info, "exFAT", "  Cache evictions: %llu, writebacks: %llu, shrinks: %llu",
+                  cache_evictions_, cache_writebacks_, cache_shrinks_);
+        debug::log(debug::LogLevel::Info, "exFAT", "  Read-ahead: %llu clusters issued, %llu hit",
+                  readahead_issued_, readahead_hits_);
+        debug::log(debug::LogLevel::Info, "exFAT", "  Mapped page faults: %llu (%s)",
+                  mapped_faults_, frame_backed_ ? "frame-backed cache" : "mmap unavailable");
+        debug::log(debug::LogLevel::Info, "exFAT", "  Dentries: %llu cached, %llu indexed directories (%llu entries)",
+                  dentry_count_, index_count_, indexed_entries_);
+        debug::log(debug::LogLevel::Info, "exFAT", "  Dentry lookups: %llu hits, %llu negative, %llu misses",
+                  dentry_hits_, dentry_negative_hits_, dentry_misses_);
+        
+        if (block_) {
+            block_->dump_statistics();
+        }
     }
 
     bool exFATVolume::detect(drivers::AHCIController* controller, u32 port_index, u64 partition_start) {
@@ -1547,7 +3109,7 @@ namespace nk::fs {
         return memcmp(bs.file_system_name, "EXFAT   ", 8) == 0;
     }
 
-    exFATFileSystem::exFATFileSystem() {
+    exFATFileSystem::exFATFileSystem() : writeback_thread_(nullptr) {
         debug::log(debug::LogLevel::Info, "exFAT", "exFAT filesystem driver created");
     }
 
@@ -1563,9 +3125,56 @@ namespace nk::fs {
     bool exFATFileSystem::init() {
         debug::log(debug::LogLevel::Info, "exFAT", "Initializing exFAT filesystem");
         detect_volumes();
+        return start_writeback_thread();
+    }
+
+    bool exFATFileSystem::start_writeback_thread() {
+        if (writeback_thread_) {
+            return true;
+        }
+        
+        task::Process* process = task::ProcessManager::instance().get_current_process();
+        if (!process) {
+            return false;
+        }
+        
+        task::Thread* thread = process->create_thread(reinterpret_cast<u64>(&exFATFileSystem::writeback_main),
+                                                      WRITEBACK_STACK_SIZE);
+        if (!thread) {
+            debug::log(debug::LogLevel::Error, "exFAT", "Failed to create write-back thread");
+            return false;
+        }
+        
+        thread->set_background(true);
+        writeback_thread_ = thread;
+        task::Scheduler::instance().add_thread(thread);
         return true;
     }
 
+    usize exFATFileSystem::writeback_volumes() {
+        ScopedLock lock(lock_);
+        
+        usize started = 0;
+        for (auto& pair : volumes_) {
+            started += pair.second->writeback();
+        }
+        
+        return started;
+    }
+
+    void exFATFileSystem::writeback_main() {
+        exFATFileSystem& fs = instance();
+        task::Scheduler& scheduler = task::Scheduler::instance();
+        
+        for (;;) {
+            if (fs.writeback_volumes() == 0) {
+                scheduler.sleep(WRITEBACK_INTERVAL_MS);
+            } else {
+                scheduler.yield();
+            }
+        }
+    }
+
     bool exFATFileSystem::mount(const char* device, const char* mount_point, u32 flags) {
         return true;
     }
@@ -1,8 +1,11 @@
 #include <nanokoton/mm/physical.hpp>
+#include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/bitops.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/idt.hpp>
 
 namespace nk::mm {
     PhysicalMemoryManager& PhysicalMemoryManager::instance() {
@@ -22,10 +25,14 @@ namespace nk::mm {
           page_frames_allocated_(0),
           page_frames_freed_(0),
           global_bitmap_(nullptr, 0),
+          bitmap_storage_used_(0),
+          free_head_storage_used_(0),
           lock_() {
         
         memset(regions_, 0, sizeof(regions_));
+        memset(magazines_, 0, sizeof(magazines_));
         memset(bitmap_storage_, 0, sizeof(bitmap_storage_));
+        memset(free_head_storage_, 0, sizeof(free_head_storage_));
     }
 
     void PhysicalMemoryManager::init(const BootInfo* boot_info) {
@@ -92,6 +99,24 @@ namespace nk::mm {
 
         merge_free_regions();
 
+        for (usize i = 0; i < region_count_; i++) {
+            if (!init_buddy(regions_[i])) {
+                panic("Failed to initialize buddy allocator in PhysicalMemoryManager::init");
+            }
+        }
+
+        for (usize i = 0; i < region_count_; i++) {
+            if (!init_shared_counts(regions_[i])) {
+                panic("Failed to allocate page reference counts in PhysicalMemoryManager::init");
+            }
+        }
+
+        for (usize i = 0; i < region_count_; i++) {
+            if (!init_cached_frames(regions_[i])) {
+                panic("Failed to allocate magazine frame bitmap in PhysicalMemoryManager::init");
+            }
+        }
+
         debug::log(debug::LogLevel::Info, "PMM", 
                   "Memory statistics: Total=%llu MB, Free=%llu MB, Used=%llu MB, Reserved=%llu MB",
                   total_memory_ / (1024 * 1024),
@@ -132,16 +157,15 @@ namespace nk::mm {
             bitmap_size++;
         }
 
-        static usize current_bitmap_offset = 0;
-        if (current_bitmap_offset + bitmap_size > sizeof(bitmap_storage_)) {
+        if (bitmap_storage_used_ + bitmap_size > sizeof(bitmap_storage_)) {
             debug::log(debug::LogLevel::Error, "PMM", 
                       "Bitmap storage exhausted");
             return false;
         }
 
-        region.bitmap = new (bitmap_storage_ + current_bitmap_offset) Bitmap(
-            bitmap_storage_ + current_bitmap_offset, region.total_pages);
-        current_bitmap_offset += bitmap_size;
+        region.bitmap = new (bitmap_storage_ + bitmap_storage_used_) Bitmap(
+            bitmap_storage_ + bitmap_storage_used_, region.total_pages);
+        bitmap_storage_used_ += bitmap_size;
 
         region.bitmap->set_all(false);
         region.free_pages = region.total_pages;
@@ -231,44 +255,282 @@ namespace nk::mm {
         }
     }
 
-    Optional<phys_addr> PhysicalMemoryManager::allocate_page() {
-        ScopedLock lock(*this);
+    u8* PhysicalMemoryManager::allocate_bitmap_storage(usize bits) {
+        usize bytes = (bits + 7) / 8;
+
+        if (free_head_storage_used_ + bytes > sizeof(free_head_storage_)) {
+            debug::log(debug::LogLevel::Error, "PMM",
+                      "Free head bitmap storage exhausted");
+            return nullptr;
+        }
+
+        u8* storage = free_head_storage_ + free_head_storage_used_;
+        memset(storage, 0, bytes);
+        free_head_storage_used_ += bytes;
+
+        return storage;
+    }
+
+    bool PhysicalMemoryManager::init_buddy(MemoryRegion& region) {
+        region.buddy_base = align_down(region.base, PAGE_SIZE * MAX_BLOCK_PAGES);
+        region.buddy_offset = (region.base - region.buddy_base) / PAGE_SIZE;
+        region.buddy_pages = region.buddy_offset + region.total_pages;
+
+        for (usize order = 0; order <= MAX_ORDER; order++) {
+            region.free_heads[order] = allocate_bitmap_storage((region.buddy_pages >> order) + 1);
+            if (!region.free_heads[order]) {
+                return false;
+            }
+
+            region.free_lists[order] = nullptr;
+            region.free_blocks[order] = 0;
+        }
+
+        usize run_start = 0;
+        usize run_length = 0;
+
+        for (usize page = 0; page < region.total_pages; page++) {
+            if (!region.bitmap->test(page)) {
+                if (run_length == 0) {
+                    run_start = page;
+                }
+                run_length++;
+            } else if (run_length > 0) {
+                release_range(region, region.buddy_offset + run_start, run_length);
+                run_length = 0;
+            }
+        }
+
+        if (run_length > 0) {
+            release_range(region, region.buddy_offset + run_start, run_length);
+        }
+
+        return true;
+    }
+
+    bool PhysicalMemoryManager::init_shared_counts(MemoryRegion& region) {
+        usize pages = align_up(region.total_pages * sizeof(u16), PAGE_SIZE) / PAGE_SIZE;
 
+        auto storage_opt = allocate_block(pages, 0);
+        if (!storage_opt.has_value()) {
+            return false;
+        }
+
+        region.shared_counts = reinterpret_cast<u16*>(phys_to_virt(storage_opt.value()));
+        memset(region.shared_counts, 0, pages * PAGE_SIZE);
+
+        return true;
+    }
+
+    bool PhysicalMemoryManager::init_cached_frames(MemoryRegion& region) {
+        usize pages = align_up((region.total_pages + 7) / 8, PAGE_SIZE) / PAGE_SIZE;
+
+        auto storage_opt = allocate_block(pages, 0);
+        if (!storage_opt.has_value()) {
+            return false;
+        }
+
+        region.cached_frames = reinterpret_cast<u8*>(phys_to_virt(storage_opt.value()));
+        memset(region.cached_frames, 0, pages * PAGE_SIZE);
+
+        return true;
+    }
+
+    u16* PhysicalMemoryManager::shared_count_for(phys_addr page) const {
         for (usize i = 0; i < region_count_; i++) {
-            auto page_opt = find_free_page_in_region(i);
-            if (page_opt.has_value()) {
-                usize page = page_opt.value();
-                MemoryRegion& region = regions_[i];
-                
-                region.bitmap->set(page, true);
-                region.free_pages--;
-                free_pages_--;
-                used_pages_++;
-                free_memory_ -= PAGE_SIZE;
-                used_memory_ += PAGE_SIZE;
-                page_frames_allocated_++;
-
-                phys_addr address = region.base + page * PAGE_SIZE;
-                
-                debug::log(debug::LogLevel::Trace, "PMM",
-                          "Allocated page at 0x%016llX", address);
-                
-                return Optional<phys_addr>(address);
+            const MemoryRegion& region = regions_[i];
+            
+            if (page >= region.base && page < region.base + region.total_pages * PAGE_SIZE) {
+                return region.shared_counts ? &region.shared_counts[(page - region.base) / PAGE_SIZE] : nullptr;
             }
         }
 
-        debug::log(debug::LogLevel::Error, "PMM", 
-                  "Out of memory: failed to allocate page");
-        
-        return Optional<phys_addr>();
+        return nullptr;
     }
 
-    Optional<phys_addr> PhysicalMemoryManager::allocate_pages(usize count) {
-        if (count == 0) {
-            return Optional<phys_addr>();
+    void PhysicalMemoryManager::ref_page(phys_addr page) {
+        u16* count = shared_count_for(page);
+        if (!count) {
+            debug::log(debug::LogLevel::Warning, "PMM",
+                      "Attempt to reference unknown page: 0x%016llX", page);
+            return;
         }
 
-        ScopedLock lock(*this);
+        __atomic_add_fetch(count, 1, __ATOMIC_ACQ_REL);
+    }
+
+    void PhysicalMemoryManager::unref_page(phys_addr page) {
+        u16* count = shared_count_for(page);
+        if (!count) {
+            free_page(page);
+            return;
+        }
+
+        u16 current = __atomic_load_n(count, __ATOMIC_ACQUIRE);
+        while (current > 0) {
+            if (__atomic_compare_exchange_n(count, &current, current - 1, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+        }
+
+        free_page(page);
+    }
+
+    usize PhysicalMemoryManager::page_refcount(phys_addr page) const {
+        u16* count = shared_count_for(page);
+        return count ? __atomic_load_n(count, __ATOMIC_ACQUIRE) + 1 : 1;
+    }
+
+    usize PhysicalMemoryManager::order_for_pages(usize count) {
+        usize order = 0;
+        while ((static_cast<usize>(1) << order) < count) {
+            order++;
+        }
+        return order;
+    }
+
+    bool PhysicalMemoryManager::test_free_head(const MemoryRegion& region, usize block, usize order) const {
+        usize bit = block >> order;
+        return (region.free_heads[order][bit / 8] & (1 << (bit % 8))) != 0;
+    }
+
+    void PhysicalMemoryManager::set_free_head(MemoryRegion& region, usize block, usize order, bool free) {
+        usize bit = block >> order;
+        if (free) {
+            region.free_heads[order][bit / 8] |= (1 << (bit % 8));
+        } else {
+            region.free_heads[order][bit / 8] &= ~(1 << (bit % 8));
+        }
+    }
+
+    void PhysicalMemoryManager::push_free_block(MemoryRegion& region, usize block, usize order) {
+        FreeBlock* node = reinterpret_cast<FreeBlock*>(
+            phys_to_virt(region.buddy_base + block * PAGE_SIZE));
+
+        node->prev = nullptr;
+        node->next = region.free_lists[order];
+        if (node->next) {
+            node->next->prev = node;
+        }
+
+        region.free_lists[order] = node;
+        region.free_blocks[order]++;
+        set_free_head(region, block, order, true);
+    }
+
+    void PhysicalMemoryManager::remove_free_block(MemoryRegion& region, usize block, usize order) {
+        FreeBlock* node = reinterpret_cast<FreeBlock*>(
+            phys_to_virt(region.buddy_base + block * PAGE_SIZE));
+
+        if (node->prev) {
+            node->prev->next = node->next;
+        } else {
+            region.free_lists[order] = node->next;
+        }
+
+        if (node->next) {
+            node->next->prev = node->prev;
+        }
+
+        region.free_blocks[order]--;
+        set_free_head(region, block, order, false);
+    }
+
+    void PhysicalMemoryManager::free_block(MemoryRegion& region, usize block, usize order) {
+        while (order < MAX_ORDER) {
+            usize buddy = block ^ (static_cast<usize>(1) << order);
+
+            if (buddy + (static_cast<usize>(1) << order) > region.buddy_pages ||
+                !test_free_head(region, buddy, order)) {
+                break;
+            }
+
+            remove_free_block(region, buddy, order);
+            block = min(block, buddy);
+            order++;
+        }
+
+        push_free_block(region, block, order);
+    }
+
+    void PhysicalMemoryManager::release_range(MemoryRegion& region, usize block, usize count) {
+        while (count > 0) {
+            usize order = 0;
+            while (order < MAX_ORDER &&
+                   (block & ((static_cast<usize>(1) << (order + 1)) - 1)) == 0 &&
+                   (static_cast<usize>(1) << (order + 1)) <= count) {
+                order++;
+            }
+
+            free_block(region, block, order);
+
+            block += static_cast<usize>(1) << order;
+            count -= static_cast<usize>(1) << order;
+        }
+    }
+
+    void PhysicalMemoryManager::claim_pages(MemoryRegion& region, usize block, usize count) {
+        usize start_page = block - region.buddy_offset;
+
+        for (usize p = start_page; p < start_page + count; p++) {
+            region.bitmap->set(p, true);
+        }
+
+        region.free_pages -= count;
+        free_pages_ -= count;
+        used_pages_ += count;
+        free_memory_ -= count * PAGE_SIZE;
+        used_memory_ += count * PAGE_SIZE;
+        page_frames_allocated_ += count;
+    }
+
+    usize PhysicalMemoryManager::release_pages(MemoryRegion& region, usize start_page, usize count) {
+        usize freed = 0;
+        usize run_start = 0;
+        usize run_length = 0;
+
+        for (usize p = 0; p <= count; p++) {
+            usize page_index = start_page + p;
+
+            if (p < count && region.bitmap->test(page_index)) {
+                region.bitmap->set(page_index, false);
+                if (run_length == 0) {
+                    run_start = page_index;
+                }
+                run_length++;
+                continue;
+            }
+
+            if (p < count) {
+                debug::log(debug::LogLevel::Warning, "PMM",
+                          "Double free detected in page range: 0x%016llX", 
+                          region.base + page_index * PAGE_SIZE);
+            }
+
+            if (run_length > 0) {
+                release_range(region, region.buddy_offset + run_start, run_length);
+                freed += run_length;
+                run_length = 0;
+            }
+        }
+
+        region.free_pages += freed;
+        free_pages_ += freed;
+        used_pages_ -= freed;
+        free_memory_ += freed * PAGE_SIZE;
+        used_memory_ -= freed * PAGE_SIZE;
+        page_frames_freed_ += freed;
+
+        return freed;
+    }
+
+    Optional<phys_addr> PhysicalMemoryManager::allocate_block(usize count, usize align_order) {
+        usize order = max(order_for_pages(count), align_order);
+
+        if (order > MAX_ORDER) {
+            return allocate_large(count, align_order);
+        }
 
         for (usize i = 0; i < region_count_; i++) {
             MemoryRegion& region = regions_[i];
@@ -277,42 +539,205 @@ namespace nk::mm {
                 continue;
             }
 
-            usize consecutive_count = 0;
-            usize start_page = 0;
+            usize current_order = order;
+            while (current_order <= MAX_ORDER && !region.free_lists[current_order]) {
+                current_order++;
+            }
 
-            for (usize page = 0; page < region.total_pages; page++) {
-                if (!region.bitmap->test(page)) {
-                    if (consecutive_count == 0) {
-                        start_page = page;
-                    }
-                    consecutive_count++;
-                    
-                    if (consecutive_count == count) {
-                        for (usize p = start_page; p < start_page + count; p++) {
-                            region.bitmap->set(p, true);
-                        }
-                        
-                        region.free_pages -= count;
-                        free_pages_ -= count;
-                        used_pages_ += count;
-                        free_memory_ -= count * PAGE_SIZE;
-                        used_memory_ += count * PAGE_SIZE;
-                        page_frames_allocated_ += count;
-
-                        phys_addr address = region.base + start_page * PAGE_SIZE;
-                        
-                        debug::log(debug::LogLevel::Trace, "PMM",
-                                  "Allocated %llu pages starting at 0x%016llX", 
-                                  count, address);
-                        
-                        return Optional<phys_addr>(address);
+            if (current_order > MAX_ORDER) {
+                continue;
+            }
+
+            phys_addr head = virt_to_phys(reinterpret_cast<virt_addr>(region.free_lists[current_order]));
+            usize block = (head - region.buddy_base) / PAGE_SIZE;
+            remove_free_block(region, block, current_order);
+
+            while (current_order > order) {
+                current_order--;
+                push_free_block(region, block + (static_cast<usize>(1) << current_order), current_order);
+            }
+
+            usize block_pages = static_cast<usize>(1) << order;
+            if (block_pages > count) {
+                release_range(region, block + count, block_pages - count);
+            }
+
+            claim_pages(region, block, count);
+
+            return Optional<phys_addr>(region.buddy_base + block * PAGE_SIZE);
+        }
+
+        return Optional<phys_addr>();
+    }
+
+    Optional<phys_addr> PhysicalMemoryManager::allocate_large(usize count, usize align_order) {
+        usize blocks_needed = (count + MAX_BLOCK_PAGES - 1) / MAX_BLOCK_PAGES;
+        usize align_mask = (static_cast<usize>(1) << align_order) - 1;
+
+        for (usize i = 0; i < region_count_; i++) {
+            MemoryRegion& region = regions_[i];
+            
+            if (region.free_pages < count) {
+                continue;
+            }
+
+            for (FreeBlock* node = region.free_lists[MAX_ORDER]; node; node = node->next) {
+                phys_addr head = virt_to_phys(reinterpret_cast<virt_addr>(node));
+                usize block = (head - region.buddy_base) / PAGE_SIZE;
+
+                if (((head / PAGE_SIZE) & align_mask) != 0) {
+                    continue;
+                }
+
+                bool contiguous = true;
+                for (usize b = 1; b < blocks_needed; b++) {
+                    usize next = block + b * MAX_BLOCK_PAGES;
+                    if (next + MAX_BLOCK_PAGES > region.buddy_pages ||
+                        !test_free_head(region, next, MAX_ORDER)) {
+                        contiguous = false;
+                        break;
                     }
-                } else {
-                    consecutive_count = 0;
                 }
+
+                if (!contiguous) {
+                    continue;
+                }
+
+                for (usize b = 0; b < blocks_needed; b++) {
+                    remove_free_block(region, block + b * MAX_BLOCK_PAGES, MAX_ORDER);
+                }
+
+                usize run_pages = blocks_needed * MAX_BLOCK_PAGES;
+                if (run_pages > count) {
+                    release_range(region, block + count, run_pages - count);
+                }
+
+                claim_pages(region, block, count);
+
+                return Optional<phys_addr>(region.buddy_base + block * PAGE_SIZE);
+            }
+        }
+
+        return Optional<phys_addr>();
+    }
+
+    bool PhysicalMemoryManager::is_cacheable_page(phys_addr page) const {
+        for (usize i = 0; i < region_count_; i++) {
+            const MemoryRegion& region = regions_[i];
+            
+            if (page >= region.base && page < region.base + region.total_pages * PAGE_SIZE) {
+                return region.bitmap->test((page - region.base) / PAGE_SIZE);
+            }
+        }
+
+        return false;
+    }
+
+    bool PhysicalMemoryManager::mark_cached(phys_addr page, bool cached) {
+        for (usize i = 0; i < region_count_; i++) {
+            MemoryRegion& region = regions_[i];
+            
+            if (page >= region.base && page < region.base + region.total_pages * PAGE_SIZE) {
+                if (!region.cached_frames) {
+                    return false;
+                }
+
+                usize index = (page - region.base) / PAGE_SIZE;
+                u8 mask = static_cast<u8>(1 << (index % 8));
+                u8* byte = &region.cached_frames[index / 8];
+
+                u8 previous = cached ? __atomic_fetch_or(byte, mask, __ATOMIC_ACQ_REL)
+                                     : __atomic_fetch_and(byte, static_cast<u8>(~mask), __ATOMIC_ACQ_REL);
+                return (previous & mask) != 0;
+            }
+        }
+
+        return false;
+    }
+
+    bool PhysicalMemoryManager::refill_magazine(PageMagazine& magazine) {
+        ScopedLock lock(*this);
+
+        while (magazine.count < MAGAZINE_BATCH) {
+            auto page_opt = allocate_block(1, 0);
+            if (!page_opt.has_value()) {
+                break;
+            }
+
+            mark_cached(page_opt.value(), true);
+            magazine.frames[magazine.count++] = page_opt.value();
+        }
+
+        magazine.refills++;
+        return magazine.count > 0;
+    }
+
+    void PhysicalMemoryManager::drain_magazine(PageMagazine& magazine, usize count) {
+        ScopedLock lock(*this);
+
+        count = min(count, magazine.count);
+        for (usize i = 0; i < count; i++) {
+            phys_addr page = magazine.frames[--magazine.count];
+            mark_cached(page, false);
+            free_page_locked(page);
+        }
+
+        magazine.drains++;
+    }
+
+    void PhysicalMemoryManager::drain_local_magazine() {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        PageMagazine& magazine = magazines_[arch::SMP::current_cpu_id()];
+
+        drain_magazine(magazine, magazine.count);
+    }
+
+    Optional<phys_addr> PhysicalMemoryManager::allocate_page() {
+        {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            PageMagazine& magazine = magazines_[arch::SMP::current_cpu_id()];
+
+            if (magazine.count > 0) {
+                magazine.hits++;
+                phys_addr page = magazine.frames[--magazine.count];
+                mark_cached(page, false);
+                return Optional<phys_addr>(page);
+            }
+
+            magazine.misses++;
+            if (refill_magazine(magazine)) {
+                phys_addr page = magazine.frames[--magazine.count];
+                mark_cached(page, false);
+
+                debug::Trace::point(debug::TraceComponent::Memory,
+                                   "Allocated page at 0x%016llX", page);
+                
+                return Optional<phys_addr>(page);
             }
         }
 
+        debug::log(debug::LogLevel::Error, "PMM", 
+                  "Out of memory: failed to allocate page");
+        
+        return Optional<phys_addr>();
+    }
+
+    Optional<phys_addr> PhysicalMemoryManager::allocate_pages(usize count) {
+        if (count == 0) {
+            return Optional<phys_addr>();
+        }
+
+        ScopedLock lock(*this);
+
+        auto pages_opt = allocate_block(count, 0);
+        if (pages_opt.has_value()) {
+            debug::Trace::point(debug::TraceComponent::Memory,
+                               "Allocated %llu pages starting at 0x%016llX",
+                               count, pages_opt.value());
+            
+            return pages_opt;
+        }
+
         debug::log(debug::LogLevel::Error, "PMM", 
                   "Out of memory: failed to allocate %llu pages", count);
         
@@ -329,65 +754,22 @@ namespace nk::mm {
             alignment = align_up(alignment, PAGE_SIZE);
         }
 
+        usize align_pages = alignment / PAGE_SIZE;
+        if ((align_pages & (align_pages - 1)) != 0) {
+            debug::log(debug::LogLevel::Error, "PMM",
+                      "Unsupported alignment 0x%llX: must be a power of two", alignment);
+            return Optional<phys_addr>();
+        }
+
         ScopedLock lock(*this);
 
-        for (usize i = 0; i < region_count_; i++) {
-            MemoryRegion& region = regions_[i];
+        auto pages_opt = allocate_block(count, order_for_pages(align_pages));
+        if (pages_opt.has_value()) {
+            debug::Trace::point(debug::TraceComponent::Memory,
+                               "Allocated %llu aligned pages at 0x%016llX (alignment: 0x%llX)",
+                               count, pages_opt.value(), alignment);
             
-            if (region.free_pages < count) {
-                continue;
-            }
-
-            usize consecutive_count = 0;
-            usize start_page = 0;
-
-            for (usize page = 0; page < region.total_pages; page++) {
-                phys_addr candidate_addr = region.base + page * PAGE_SIZE;
-                
-                if (candidate_addr % alignment == 0) {
-                    if (!region.bitmap->test(page)) {
-                        if (consecutive_count == 0) {
-                            start_page = page;
-                        }
-                        consecutive_count++;
-                        
-                        if (consecutive_count == count) {
-                            bool all_free = true;
-                            for (usize p = start_page; p < start_page + count; p++) {
-                                if (region.bitmap->test(p)) {
-                                    all_free = false;
-                                    break;
-                                }
-                            }
-                            
-                            if (all_free) {
-                                for (usize p = start_page; p < start_page + count; p++) {
-                                    region.bitmap->set(p, true);
-                                }
-                                
-                                region.free_pages -= count;
-                                free_pages_ -= count;
-                                used_pages_ += count;
-                                free_memory_ -= count * PAGE_SIZE;
-                                used_memory_ += count * PAGE_SIZE;
-                                page_frames_allocated_ += count;
-
-                                phys_addr address = region.base + start_page * PAGE_SIZE;
-                                
-                                debug::log(debug::LogLevel::Trace, "PMM",
-                                          "Allocated %llu aligned pages at 0x%016llX (alignment: 0x%llX)", 
-                                          count, address, alignment);
-                                
-                                return Optional<phys_addr>(address);
-                            }
-                        }
-                    } else {
-                        consecutive_count = 0;
-                    }
-                } else {
-                    consecutive_count = 0;
-                }
-            }
+            return pages_opt;
         }
 
         debug::log(debug::LogLevel::Error, "PMM", 
@@ -404,8 +786,29 @@ namespace nk::mm {
             return;
         }
 
-        ScopedLock lock(*this);
+        if (!is_cacheable_page(page)) {
+            ScopedLock lock(*this);
+            free_page_locked(page);
+            return;
+        }
 
+        if (mark_cached(page, true)) {
+            debug::log(debug::LogLevel::Warning, "PMM",
+                      "Double free detected: 0x%016llX", page);
+            return;
+        }
+
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        PageMagazine& magazine = magazines_[arch::SMP::current_cpu_id()];
+
+        if (magazine.count == MAGAZINE_SIZE) {
+            drain_magazine(magazine, MAGAZINE_BATCH);
+        }
+
+        magazine.frames[magazine.count++] = page;
+    }
+
+    void PhysicalMemoryManager::free_page_locked(phys_addr page) {
         for (usize i = 0; i < region_count_; i++) {
             MemoryRegion& region = regions_[i];
             
@@ -424,16 +827,10 @@ namespace nk::mm {
                     return;
                 }
 
-                region.bitmap->set(page_index, false);
-                region.free_pages++;
-                free_pages_++;
-                used_pages_--;
-                free_memory_ += PAGE_SIZE;
-                used_memory_ -= PAGE_SIZE;
-                page_frames_freed_++;
-
-                debug::log(debug::LogLevel::Trace, "PMM",
-                          "Freed page at 0x%016llX", page);
+                release_pages(region, page_index, 1);
+
+                debug::Trace::point(debug::TraceComponent::Memory,
+                                   "Freed page at 0x%016llX", page);
                 
                 return;
             }
@@ -469,27 +866,10 @@ namespace nk::mm {
                     return;
                 }
 
-                for (usize p = 0; p < count; p++) {
-                    usize page_index = start_page + p;
-                    
-                    if (!region.bitmap->test(page_index)) {
-                        debug::log(debug::LogLevel::Warning, "PMM",
-                                  "Double free detected in page range: 0x%016llX", 
-                                  base + p * PAGE_SIZE);
-                    } else {
-                        region.bitmap->set(page_index, false);
-                    }
-                }
-
-                region.free_pages += count;
-                free_pages_ += count;
-                used_pages_ -= count;
-                free_memory_ += count * PAGE_SIZE;
-                used_memory_ -= count * PAGE_SIZE;
-                page_frames_freed_ += count;
+                usize freed = release_pages(region, start_page, count);
 
-                debug::log(debug::LogLevel::Trace, "PMM",
-                          "Freed %llu pages starting at 0x%016llX", count, base);
+                debug::Trace::point(debug::TraceComponent::Memory,
+                                   "Freed %llu pages starting at 0x%016llX", freed, base);
                 
                 return;
             }
@@ -499,6 +879,59 @@ namespace nk::mm {
                   "Attempt to free unknown pages: 0x%016llX + %llu pages", base, count);
     }
 
+    usize PhysicalMemoryManager::magazine_hits() const {
+        usize hits = 0;
+        for (usize i = 0; i < arch::MAX_CPUS; i++) {
+            hits += magazines_[i].hits;
+        }
+        return hits;
+    }
+
+    usize PhysicalMemoryManager::magazine_misses() const {
+        usize misses = 0;
+        for (usize i = 0; i < arch::MAX_CPUS; i++) {
+            misses += magazines_[i].misses;
+        }
+        return misses;
+    }
+
+    usize PhysicalMemoryManager::magazine_refills() const {
+        usize refills = 0;
+        for (usize i = 0; i < arch::MAX_CPUS; i++) {
+            refills += magazines_[i].refills;
+        }
+        return refills;
+    }
+
+    usize PhysicalMemoryManager::magazine_drains() const {
+        usize drains = 0;
+        for (usize i = 0; i < arch::MAX_CPUS; i++) {
+            drains += magazines_[i].drains;
+        }
+        return drains;
+    }
+
+    usize PhysicalMemoryManager::magazine_cached_pages() const {
+        usize cached = 0;
+        for (usize i = 0; i < arch::MAX_CPUS; i++) {
+            cached += magazines_[i].count;
+        }
+        return cached;
+    }
+
+    usize PhysicalMemoryManager::free_blocks_of_order(usize order) const {
+        if (order > MAX_ORDER) {
+            return 0;
+        }
+
+        usize blocks = 0;
+        for (usize i = 0; i < region_count_; i++) {
+            blocks += regions_[i].free_blocks[order];
+        }
+
+        return blocks;
+    }
+
     phys_addr PhysicalMemoryManager::page_to_phys(usize page_index) const {
         usize current_page = 0;
         
@@ -583,6 +1016,11 @@ namespace nk::mm {
         debug::log(debug::LogLevel::Info, "PMM", "  Used Pages:   %llu", used_pages_);
         debug::log(debug::LogLevel::Info, "PMM", "  Allocations:  %llu", page_frames_allocated_);
         debug::log(debug::LogLevel::Info, "PMM", "  Frees:        %llu", page_frames_freed_);
+        debug::log(debug::LogLevel::Info, "PMM", "  Mag Hits:     %llu", magazine_hits());
+        debug::log(debug::LogLevel::Info, "PMM", "  Mag Misses:   %llu", magazine_misses());
+        debug::log(debug::LogLevel::Info, "PMM", "  Mag Refills:  %llu", magazine_refills());
+        debug::log(debug::LogLevel::Info, "PMM", "  Mag Drains:   %llu", magazine_drains());
+        debug::log(debug::LogLevel::Info, "PMM", "  Mag Cached:   %llu", magazine_cached_pages());
         debug::log(debug::LogLevel::Info, "PMM", "  Regions:      %llu", region_count_);
         
         for (usize i = 0; i < region_count_; i++) {
@@ -593,6 +1031,13 @@ namespace nk::mm {
                       region.size / (1024 * 1024),
                       region.free_pages, region.total_pages);
         }
+
+        debug::log(debug::LogLevel::Info, "PMM", "  Free blocks per order:");
+        for (usize order = 0; order <= MAX_ORDER; order++) {
+            debug::log(debug::LogLevel::Info, "PMM",
+                      "    Order %2llu (%6llu KB): %llu",
+                      order, (PAGE_SIZE << order) / 1024, free_blocks_of_order(order));
+        }
     }
 
     void PhysicalMemoryManager::dump_bitmap() const {
@@ -0,0 +1,299 @@
+#include <nanokoton/mm/slab.hpp>
+#include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/lib/string.hpp>
+#include <nanokoton/lib/bitops.hpp>
+
+namespace nk::mm {
+    SlabCache::SlabCache(const char* name, usize object_size, usize alignment)
+        : name_(name),
+          object_size_(0),
+          stride_(0),
+          first_offset_(0),
+          slab_pages_(1),
+          objects_per_slab_(0),
+          partial_(nullptr),
+          full_(nullptr),
+          empty_(nullptr),
+          empty_count_(0),
+          slab_count_(0),
+          active_objects_(0),
+          allocations_(0),
+          frees_(0),
+          lock_() {
+
+        if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+            alignment = sizeof(void*);
+        }
+
+        object_size_ = max(object_size, sizeof(FreeObject));
+        stride_ = align_up(object_size_, alignment);
+        first_offset_ = align_up(sizeof(Slab), alignment);
+
+        while (slab_pages_ < MAX_SLAB_PAGES &&
+               (slab_pages_ * PAGE_SIZE - first_offset_) / stride_ < MIN_OBJECTS_PER_SLAB) {
+            slab_pages_ *= 2;
+        }
+
+        if (first_offset_ + stride_ <= slab_pages_ * PAGE_SIZE) {
+            objects_per_slab_ = (slab_pages_ * PAGE_SIZE - first_offset_) / stride_;
+        }
+    }
+
+    SlabCache::~SlabCache() {
+        while (empty_) {
+            Slab* slab = empty_;
+            unlink(empty_, slab);
+            release(slab);
+        }
+
+        if (partial_ || full_) {
+            debug::log(debug::LogLevel::Warning, "SLAB",
+                      "Cache %s destroyed with %llu live objects", name_, active_objects_);
+        }
+    }
+
+    void SlabCache::push(Slab*& list, Slab* slab) {
+        slab->prev = nullptr;
+        slab->next = list;
+        if (list) {
+            list->prev = slab;
+        }
+        list = slab;
+    }
+
+    void SlabCache::unlink(Slab*& list, Slab* slab) {
+        if (slab->prev) {
+            slab->prev->next = slab->next;
+        } else {
+            list = slab->next;
+        }
+
+        if (slab->next) {
+            slab->next->prev = slab->prev;
+        }
+
+        slab->next = nullptr;
+        slab->prev = nullptr;
+    }
+
+    SlabCache::Slab* SlabCache::grow() {
+        if (objects_per_slab_ == 0) {
+            debug::log(debug::LogLevel::Error, "SLAB",
+                      "Cache %s: object size %llu too large for a slab", name_, object_size_);
+            return nullptr;
+        }
+
+        virt_addr base = VirtualMemoryManager::instance().allocate_slab_span(slab_pages_);
+        if (base == 0) {
+            debug::log(debug::LogLevel::Error, "SLAB",
+                      "Cache %s: failed to allocate slab", name_);
+            return nullptr;
+        }
+
+        Slab* slab = reinterpret_cast<Slab*>(base);
+        slab->magic = SLAB_MAGIC;
+        slab->in_use = 0;
+        slab->cache = this;
+        slab->next = nullptr;
+        slab->prev = nullptr;
+        slab->free_list = nullptr;
+
+        u8* objects = reinterpret_cast<u8*>(base) + first_offset_;
+        for (usize i = objects_per_slab_; i > 0; i--) {
+            FreeObject* object = reinterpret_cast<FreeObject*>(objects + (i - 1) * stride_);
+            object->next = slab->free_list;
+            slab->free_list = object;
+        }
+
+        slab_count_++;
+        return slab;
+    }
+
+    void SlabCache::release(Slab* slab) {
+        slab->magic = 0;
+        VirtualMemoryManager::instance().free_slab_span(reinterpret_cast<virt_addr>(slab), slab_pages_);
+        slab_count_--;
+    }
+
+    void* SlabCache::allocate() {
+        ScopedLock lock(lock_);
+
+        Slab* slab = partial_;
+        if (!slab) {
+            if (empty_) {
+                slab = empty_;
+                unlink(empty_, slab);
+                empty_count_--;
+            } else {
+                lock.unlock();
+                Slab* fresh = grow();
+                lock.lock();
+
+                if (!fresh) {
+                    return nullptr;
+                }
+                slab = fresh;
+            }
+            push(partial_, slab);
+        }
+
+        FreeObject* object = slab->free_list;
+        slab->free_list = object->next;
+        slab->in_use++;
+
+        if (!slab->free_list) {
+            unlink(partial_, slab);
+            push(full_, slab);
+        }
+
+        active_objects_++;
+        allocations_++;
+
+        return object;
+    }
+
+    void SlabCache::free(void* ptr) {
+        if (!ptr) {
+            return;
+        }
+
+        Slab* slab = reinterpret_cast<Slab*>(
+            align_down(reinterpret_cast<virt_addr>(ptr), SLAB_SLOT_SIZE));
+
+        if (slab->magic != SLAB_MAGIC || slab->cache != this) {
+            debug::log(debug::LogLevel::Error, "SLAB",
+                      "Cache %s: invalid free of 0x%016llX", name_,
+                      reinterpret_cast<virt_addr>(ptr));
+            return;
+        }
+
+        ScopedLock lock(lock_);
+
+        bool was_full = slab->free_list == nullptr;
+
+        FreeObject* object = reinterpret_cast<FreeObject*>(ptr);
+        object->next = slab->free_list;
+        slab->free_list = object;
+        slab->in_use--;
+
+        active_objects_--;
+        frees_++;
+
+        if (was_full) {
+            unlink(full_, slab);
+            push(partial_, slab);
+        }
+
+        if (slab->in_use == 0) {
+            unlink(partial_, slab);
+
+            if (empty_count_ < MAX_EMPTY_SLABS) {
+                push(empty_, slab);
+                empty_count_++;
+            } else {
+                release(slab);
+            }
+        }
+    }
+
+    usize SlabCache::shrink() {
+        ScopedLock lock(lock_);
+
+        usize released = 0;
+        while (empty_) {
+            Slab* slab = empty_;
+            unlink(empty_, slab);
+            release(slab);
+            released++;
+        }
+
+        empty_count_ = 0;
+        return released;
+    }
+
+    SlabCache* SlabCache::owner(const void* ptr) {
+        virt_addr address = reinterpret_cast<virt_addr>(ptr);
+        if (!VirtualMemoryManager::instance().is_slab_address(address)) {
+            return nullptr;
+        }
+
+        const Slab* slab = reinterpret_cast<const Slab*>(align_down(address, SLAB_SLOT_SIZE));
+        if (slab->magic != SLAB_MAGIC) {
+            return nullptr;
+        }
+
+        return slab->cache;
+    }
+
+    void SlabCache::dump_statistics() const {
+        debug::log(debug::LogLevel::Info, "SLAB",
+                  "  %-16s size=%-5llu slabs=%-4llu active=%-6llu allocs=%llu frees=%llu",
+                  name_, object_size_, slab_count_, active_objects_, allocations_, frees_);
+    }
+
+    SlabAllocator& SlabAllocator::instance() {
+        static SlabAllocator instance;
+        return instance;
+    }
+
+    SlabAllocator::SlabAllocator()
+        : caches_{
+              {"kmalloc-16", 16, 16},
+              {"kmalloc-32", 32, 32},
+              {"kmalloc-64", 64, 64},
+              {"kmalloc-128", 128, 128},
+              {"kmalloc-256", 256, 256},
+              {"kmalloc-512", 512, 512},
+              {"kmalloc-1024", 1024, 1024},
+              {"kmalloc-2048", 2048, 2048}
+          } {}
+
+    usize SlabAllocator::class_index(usize size) {
+        usize shift = MIN_CLASS_SHIFT;
+        while ((static_cast<usize>(1) << shift) < size) {
+            shift++;
+        }
+        return shift - MIN_CLASS_SHIFT;
+    }
+
+    void* SlabAllocator::allocate(usize size) {
+        if (size == 0 || size > MAX_SIZE) {
+            return nullptr;
+        }
+
+        return caches_[class_index(size)].allocate();
+    }
+
+    void SlabAllocator::free(void* ptr) {
+        SlabCache* cache = SlabCache::owner(ptr);
+        if (!cache) {
+            debug::log(debug::LogLevel::Error, "SLAB",
+                      "Attempt to free non-slab pointer: 0x%016llX",
+                      reinterpret_cast<virt_addr>(ptr));
+            return;
+        }
+
+        cache->free(ptr);
+    }
+
+    usize SlabAllocator::allocation_size(const void* ptr) const {
+        SlabCache* cache = SlabCache::owner(ptr);
+        return cache ? cache->object_size() : 0;
+    }
+
+    usize SlabAllocator::shrink() {
+        usize released = 0;
+        for (usize i = 0; i < CLASS_COUNT; i++) {
+            released += caches_[i].shrink();
+        }
+        return released;
+    }
+
+    void SlabAllocator::dump_statistics() const {
+        debug::log(debug::LogLevel::Info, "SLAB", "Slab Allocator Statistics:");
+        for (usize i = 0; i < CLASS_COUNT; i++) {
+            caches_[i].dump_statistics();
+        }
+    }
+}
@@ -1,6 +1,9 @@
 #include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/smp.hpp>
+#include <nanokoton/arch/apic.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/bitops.hpp>
 
@@ -14,9 +17,35 @@ namespace nk::mm {
     VirtualMemoryManager::VirtualMemoryManager() 
         : kernel_space_(nullptr),
           current_space_(nullptr),
+          spaces_(nullptr),
+          spaces_lock_(),
           kernel_heap_current_(0),
           kernel_heap_end_(0),
-          heap_lock_() {}
+          heap_lock_(),
+          gigabyte_pages_(false),
+          pcid_enabled_(false),
+          pcid_map_(pcid_storage_, PCID_COUNT),
+          pcid_hint_(1),
+          shared_pcid_spaces_(0),
+          pcid_lock_(),
+          tlb_single_flushes_(0),
+          tlb_full_flushes_(0),
+          tlb_shootdowns_(0),
+          free_ranges_(nullptr),
+          range_cache_("heap-range", sizeof(HeapRange)),
+          large_pages_(0),
+          slab_slots_(slab_slot_storage_, SLAB_SLOT_COUNT),
+          slab_slot_hint_(0),
+          slab_pages_(0),
+          slab_lock_() {
+        memset(large_allocations_, 0, sizeof(large_allocations_));
+        memset(slab_slot_storage_, 0, sizeof(slab_slot_storage_));
+        memset(pcid_storage_, 0, sizeof(pcid_storage_));
+        memset(active_spaces_, 0, sizeof(active_spaces_));
+        memset(shootdown_requested_, 0, sizeof(shootdown_requested_));
+        memset(shootdown_completed_, 0, sizeof(shootdown_completed_));
+        pcid_map_.set(0, true);
+    }
 
     void VirtualMemoryManager::init() {
         PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
@@ -37,7 +66,15 @@ namespace nk::mm {
         
         current_space_ = kernel_space_;
         
-        kernel_heap_current_ = KERNEL_HEAP_BASE;
+        gigabyte_pages_ = detect_gigabyte_pages();
+        
+        if (detect_pcid()) {
+            write_cr4(read_cr4() | CR4_PCIDE);
+            pcid_enabled_ = true;
+            debug::log(debug::LogLevel::Info, "VMM", "PCID enabled");
+        }
+        
+        kernel_heap_current_ = KERNEL_LARGE_BASE;
         kernel_heap_end_ = KERNEL_HEAP_BASE + KERNEL_HEAP_SIZE;
         
         map_kernel_regions();
@@ -58,11 +95,8 @@ namespace nk::mm {
         
         usize pages = kernel_size / PAGE_SIZE;
         
-        for (usize i = 0; i < pages; i++) {
-            map_page(kernel_virtual + i * PAGE_SIZE,
-                    kernel_physical + i * PAGE_SIZE,
-                    PageFlags::Present | PageFlags::Writable | PageFlags::Global);
-        }
+        map_pages(kernel_virtual, kernel_physical, pages,
+                 PageFlags::Present | PageFlags::Writable | PageFlags::Global);
         
         map_page(0xb8000, 0xb8000, 
                 PageFlags::Present | PageFlags::Writable | PageFlags::CacheDisabled);
@@ -104,29 +138,68 @@ namespace nk::mm {
         return reinterpret_cast<PageTableEntry*>(phys_to_virt(table_phys));
     }
 
-    void VirtualMemoryManager::free_table(PageTableEntry* table, usize level) {
+    void VirtualMemoryManager::free_table(AddressSpace* space, PageTableEntry* table, usize level) {
         if (level == 0) {
             return;
         }
         
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        
         for (usize i = 0; i < PAGE_TABLE_ENTRIES; i++) {
-            if (table[i].is_present()) {
-                if (level > 1) {
-                    phys_addr next_table_phys = table[i].get_address();
-                    PageTableEntry* next_table = reinterpret_cast<PageTableEntry*>(
-                        phys_to_virt(next_table_phys));
-                    free_table(next_table, level - 1);
-                }
+            if (!table[i].is_present()) {
+                continue;
+            }
+            
+            if (level > 1 && table[i].is_huge()) {
+                usize size = level_page_size(level - 1);
+                phys_addr base = align_down(table[i].get_address(), size);
                 
-                PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
-                pmm.free_page(table[i].get_address());
-                current_space_->allocated_pages--;
+                for (usize offset = 0; offset < size; offset += PAGE_SIZE) {
+                    pmm.unref_page(base + offset);
+                }
+                space->mapped_pages -= size / PAGE_SIZE;
+                continue;
+            }
+            
+            if (level > 1) {
+                phys_addr next_table_phys = table[i].get_address();
+                PageTableEntry* next_table = reinterpret_cast<PageTableEntry*>(
+                    phys_to_virt(next_table_phys));
+                free_table(space, next_table, level - 1);
+            } else {
+                pmm.unref_page(table[i].get_address());
+                space->mapped_pages--;
             }
         }
         
-        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
         pmm.free_page(virt_to_phys(reinterpret_cast<virt_addr>(table)));
-        current_space_->allocated_pages--;
+        space->allocated_pages--;
+    }
+
+    usize VirtualMemoryManager::level_page_size(usize level) {
+        return PAGE_SIZE << (9 * level);
+    }
+
+    bool VirtualMemoryManager::detect_gigabyte_pages() {
+        u32 eax, ebx, ecx, edx;
+
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000), "c"(0));
+        if (eax < 0x80000001) {
+            return false;
+        }
+
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+        return (edx & (1 << 26)) != 0;
+    }
+
+    void VirtualMemoryManager::apply_flags(PageTableEntry& entry, PageFlags flags) {
+        entry.present = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::Present)) ? 1 : 0;
+        entry.writable = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::Writable)) ? 1 : 0;
+        entry.user = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::UserAccessible)) ? 1 : 0;
+        entry.write_through = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::WriteThrough)) ? 1 : 0;
+        entry.cache_disabled = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::CacheDisabled)) ? 1 : 0;
+        entry.global = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::Global)) ? 1 : 0;
+        entry.no_execute = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::NoExecute)) ? 1 : 0;
     }
 
     Optional<phys_addr> VirtualMemoryManager::walk_page_table(virt_addr address, usize* level) {
@@ -151,7 +224,8 @@ namespace nk::mm {
             
             if (current[indices[i]].is_huge()) {
                 if (level) *level = i;
-                return Optional<phys_addr>(current[indices[i]].get_address());
+                return Optional<phys_addr>(
+                    align_down(current[indices[i]].get_address(), level_page_size(i)));
             }
             
             phys_addr next_phys = current[indices[i]].get_address();
@@ -161,6 +235,82 @@ namespace nk::mm {
         return Optional<phys_addr>();
     }
 
+    bool VirtualMemoryManager::map_huge_internal(virt_addr virt, phys_addr phys, usize level, PageFlags flags) {
+        usize indices[PAGE_TABLE_LEVELS];
+        indices[3] = (virt >> 39) & 0x1FF;
+        indices[2] = (virt >> 30) & 0x1FF;
+        indices[1] = (virt >> 21) & 0x1FF;
+        
+        PageTableEntry* current = current_space_->pml4;
+        
+        for (int i = 3; i > static_cast<int>(level); i--) {
+            if (current[indices[i]].is_present() && current[indices[i]].is_huge()) {
+                debug::log(debug::LogLevel::Warning, "VMM",
+                          "Range already covered by a huge page: 0x%016llX", virt);
+                return false;
+            }
+
+            PageTableEntry* next = get_next_table(&current[indices[i]], i, true);
+            if (!next) {
+                debug::log(debug::LogLevel::Error, "VMM",
+                          "Failed to allocate page table level %d", i);
+                return false;
+            }
+            current = next;
+        }
+        
+        PageTableEntry& entry = current[indices[level]];
+        if (entry.is_present()) {
+            debug::log(debug::LogLevel::Warning, "VMM",
+                      "Page already mapped: 0x%016llX -> 0x%016llX",
+                      virt, entry.get_address());
+            return false;
+        }
+        
+        entry.raw = 0;
+        entry.set_address(phys);
+        apply_flags(entry, flags);
+        entry.huge = 1;
+        
+        current_space_->mapped_pages += level_page_size(level) / PAGE_SIZE;
+        
+        invalidate_page(virt);
+        
+        return true;
+    }
+
+    bool VirtualMemoryManager::split_huge_entry(AddressSpace* space, PageTableEntry& entry, usize level) {
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        auto page_opt = pmm.allocate_page();
+        if (!page_opt.has_value()) {
+            debug::log(debug::LogLevel::Error, "VMM",
+                      "Failed to allocate page table while splitting huge page");
+            return false;
+        }
+        
+        PageTableEntry* table = reinterpret_cast<PageTableEntry*>(phys_to_virt(page_opt.value()));
+        
+        phys_addr base = align_down(entry.get_address(), level_page_size(level));
+        usize child_size = level_page_size(level - 1);
+        
+        for (usize i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+            table[i].raw = entry.raw;
+            table[i].set_address(base + i * child_size);
+            table[i].huge = (level - 1 > 0) ? 1 : 0;
+        }
+        
+        PageTableEntry parent;
+        parent.set_address(page_opt.value());
+        parent.present = 1;
+        parent.writable = 1;
+        parent.user = entry.user;
+        entry.raw = parent.raw;
+        
+        space->allocated_pages++;
+        
+        return true;
+    }
+
     bool VirtualMemoryManager::map_page_internal(virt_addr virt, phys_addr phys, PageFlags flags) {
         if (virt % PAGE_SIZE != 0 || phys % PAGE_SIZE != 0) {
             debug::log(debug::LogLevel::Error, "VMM",
@@ -178,6 +328,12 @@ namespace nk::mm {
         PageTableEntry* current = current_space_->pml4;
         
         for (int i = 3; i > 0; i--) {
+            if (current[indices[i]].is_present() && current[indices[i]].is_huge()) {
+                debug::log(debug::LogLevel::Warning, "VMM",
+                          "Page already mapped by huge page: 0x%016llX", virt);
+                return false;
+            }
+
             PageTableEntry* next = get_next_table(&current[indices[i]], i, true);
             if (!next) {
                 debug::log(debug::LogLevel::Error, "VMM",
@@ -197,13 +353,7 @@ namespace nk::mm {
         
         entry.raw = 0;
         entry.set_address(phys);
-        entry.present = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::Present)) ? 1 : 0;
-        entry.writable = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::Writable)) ? 1 : 0;
-        entry.user = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::UserAccessible)) ? 1 : 0;
-        entry.write_through = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::WriteThrough)) ? 1 : 0;
-        entry.cache_disabled = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::CacheDisabled)) ? 1 : 0;
-        entry.global = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::Global)) ? 1 : 0;
-        entry.no_execute = (static_cast<u64>(flags) & static_cast<u64>(PageFlags::NoExecute)) ? 1 : 0;
+        apply_flags(entry, flags);
         
         current_space_->mapped_pages++;
         
@@ -212,11 +362,12 @@ namespace nk::mm {
         return true;
     }
 
-    bool VirtualMemoryManager::unmap_page_internal(virt_addr virt) {
+    usize VirtualMemoryManager::unmap_entry_internal(virt_addr virt, usize max_pages, MMUGather* gather,
+                                                     bool release_frames) {
         if (virt % PAGE_SIZE != 0) {
             debug::log(debug::LogLevel::Error, "VMM",
                       "Unaligned address in unmap_page: 0x%016llX", virt);
-            return false;
+            return 0;
         }
         
         usize indices[PAGE_TABLE_LEVELS];
@@ -227,37 +378,49 @@ namespace nk::mm {
         
         PageTableEntry* current = current_space_->pml4;
         PageTableEntry* tables[PAGE_TABLE_LEVELS];
+        usize level = 0;
         
         for (int i = 3; i >= 0; i--) {
             tables[i] = current;
-            if (i == 0) break;
             
-            if (!current[indices[i]].is_present()) {
+            PageTableEntry& entry = current[indices[i]];
+            if (!entry.is_present()) {
                 debug::log(debug::LogLevel::Warning, "VMM",
                           "Page not mapped: 0x%016llX", virt);
-                return false;
+                return 0;
             }
             
-            phys_addr next_phys = current[indices[i]].get_address();
-            current = reinterpret_cast<PageTableEntry*>(phys_to_virt(next_phys));
-        }
-        
-        PageTableEntry& entry = tables[0][indices[0]];
-        if (!entry.is_present()) {
-            debug::log(debug::LogLevel::Warning, "VMM",
-                      "Page not mapped: 0x%016llX", virt);
-            return false;
+            if (i == 0) {
+                break;
+            }
+            
+            if (entry.is_huge()) {
+                usize pages = level_page_size(i) / PAGE_SIZE;
+                if (virt % level_page_size(i) == 0 && max_pages >= pages) {
+                    level = i;
+                    break;
+                }
+                
+                if (!split_huge_entry(current_space_, entry, i)) {
+                    return 0;
+                }
+            }
+            
+            current = reinterpret_cast<PageTableEntry*>(phys_to_virt(entry.get_address()));
         }
         
-        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
-        pmm.free_page(entry.get_address());
+        usize pages = level_page_size(level) / PAGE_SIZE;
+        phys_addr frame = align_down(tables[level][indices[level]].get_address(), level_page_size(level));
         
-        entry.raw = 0;
-        current_space_->mapped_pages--;
+        tables[level][indices[level]].raw = 0;
+        current_space_->mapped_pages -= pages;
         
-        invalidate_page(virt);
+        gather->add(virt, pages * PAGE_SIZE);
+        if (release_frames) {
+            gather->defer_free(frame, pages, false);
+        }
         
-        for (int i = 1; i < PAGE_TABLE_LEVELS; i++) {
+        for (usize i = level; i < PAGE_TABLE_LEVELS - 1; i++) {
             PageTableEntry* table = tables[i];
             bool empty = true;
             
@@ -268,23 +431,217 @@ namespace nk::mm {
                 }
             }
             
-            if (empty) {
-                phys_addr table_phys = virt_to_phys(reinterpret_cast<virt_addr>(table));
-                pmm.free_page(table_phys);
-                current_space_->allocated_pages--;
-                
-                PageTableEntry& parent_entry = tables[i + 1][indices[i + 1]];
-                parent_entry.raw = 0;
+            if (!empty) {
+                break;
             }
+            
+            phys_addr table_phys = virt_to_phys(reinterpret_cast<virt_addr>(table));
+            gather->defer_free(table_phys, 1, false);
+            current_space_->allocated_pages--;
+            
+            tables[i + 1][indices[i + 1]].raw = 0;
         }
         
-        return true;
+        return pages;
+    }
+
+    bool VirtualMemoryManager::unmap_page_internal(virt_addr virt) {
+        MMUGather gather(current_space_);
+        return unmap_entry_internal(virt, 1, &gather, true) != 0;
     }
 
     void VirtualMemoryManager::invalidate_page(virt_addr address) {
         asm volatile("invlpg (%0)" : : "r"(address) : "memory");
     }
 
+    bool VirtualMemoryManager::detect_pcid() {
+        u32 eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+        return (ecx & (1 << 17)) != 0;
+    }
+
+    u64 VirtualMemoryManager::read_cr4() {
+        u64 value;
+        asm volatile("mov %%cr4, %0" : "=r"(value));
+        return value;
+    }
+
+    void VirtualMemoryManager::write_cr4(u64 value) {
+        asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+    }
+
+    void VirtualMemoryManager::flush_tlb_all(bool include_global) {
+        if (include_global) {
+            u64 cr4 = read_cr4();
+            write_cr4(cr4 & ~CR4_PGE);
+            write_cr4(cr4);
+        } else {
+            u64 cr3;
+            asm volatile("mov %%cr3, %0" : "=r"(cr3));
+            asm volatile("mov %0, %%cr3" : : "r"(cr3 & ~CR3_NOFLUSH) : "memory");
+        }
+        
+        tlb_full_flushes_++;
+    }
+
+    void VirtualMemoryManager::flush_tlb_range(AddressSpace* space, virt_addr start, virt_addr end, usize pages) {
+        bool kernel_range = start >= KERNEL_HALF_BASE;
+        u32 self = arch::SMP::current_cpu_id();
+        bool local = kernel_range || space == active_spaces_[self] || space == current_space_;
+        
+        if (local) {
+            if (pages > TLB_FLUSH_THRESHOLD) {
+                flush_tlb_all(kernel_range);
+            } else {
+                for (virt_addr address = start; address < end; address += PAGE_SIZE) {
+                    invalidate_page(address);
+                }
+                tlb_single_flushes_ += pages;
+            }
+        }
+        
+        u64 targets = 0;
+        
+        if (kernel_range) {
+            for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+                if (cpu != self && arch::SMP::cpu(cpu).online) {
+                    targets |= 1ULL << cpu;
+                }
+            }
+        } else {
+            u64 others = local ? ~(1ULL << self) : ~0ULL;
+            __atomic_or_fetch(&space->stale_cpus, others, __ATOMIC_SEQ_CST);
+            targets = __atomic_load_n(&space->active_cpus, __ATOMIC_SEQ_CST) & ~(1ULL << self);
+        }
+        
+        if (targets) {
+            shootdown_tlb(targets);
+        }
+    }
+
+    void VirtualMemoryManager::shootdown_tlb(u64 targets) {
+        if (!arch::LocalAPIC::is_available()) {
+            return;
+        }
+        
+        u64 tickets[arch::MAX_CPUS];
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            if (!(targets & (1ULL << cpu)) || !arch::SMP::cpu(cpu).online) {
+                targets &= ~(1ULL << cpu);
+                continue;
+            }
+            
+            tickets[cpu] = __atomic_add_fetch(&shootdown_requested_[cpu], 1, __ATOMIC_ACQ_REL);
+            arch::LocalAPIC::send_ipi(arch::SMP::cpu(cpu).apic_id, arch::LocalAPIC::TLB_SHOOTDOWN_VECTOR);
+        }
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            if (!(targets & (1ULL << cpu))) {
+                continue;
+            }
+            
+            while (__atomic_load_n(&shootdown_completed_[cpu], __ATOMIC_ACQUIRE) < tickets[cpu]) {
+                handle_tlb_shootdown();
+                arch::CPU::pause();
+            }
+        }
+        
+        __atomic_add_fetch(&tlb_shootdowns_, 1, __ATOMIC_RELAXED);
+    }
+
+    void VirtualMemoryManager::handle_tlb_shootdown() {
+        u32 self = arch::SMP::current_cpu_id();
+        
+        u64 requested = __atomic_load_n(&shootdown_requested_[self], __ATOMIC_ACQUIRE);
+        if (requested == __atomic_load_n(&shootdown_completed_[self], __ATOMIC_RELAXED)) {
+            return;
+        }
+        
+        flush_tlb_all(true);
+        __atomic_store_n(&shootdown_completed_[self], requested, __ATOMIC_RELEASE);
+    }
+
+    void VirtualMemoryManager::MMUGather::add(virt_addr address, usize size) {
+        virt_addr end = address + size;
+        
+        if (pages_ == 0) {
+            start_ = address;
+            end_ = end;
+        } else {
+            start_ = min(start_, address);
+            end_ = max(end_, end);
+        }
+        
+        pages_ += size / PAGE_SIZE;
+    }
+
+    void VirtualMemoryManager::MMUGather::defer_free(phys_addr base, usize pages, bool shared) {
+        if (frame_count_ == MAX_DEFERRED_FRAMES) {
+            flush();
+        }
+        
+        frames_[frame_count_++] = { base, pages, shared };
+    }
+
+    void VirtualMemoryManager::MMUGather::flush() {
+        if (pages_ > 0) {
+            VirtualMemoryManager::instance().flush_tlb_range(
+                space_, start_, end_, max(pages_, (end_ - start_) / PAGE_SIZE));
+            pages_ = 0;
+        }
+        
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        
+        for (usize i = 0; i < frame_count_; i++) {
+            const DeferredFrame& frame = frames_[i];
+            
+            if (frame.shared) {
+                pmm.unref_page(frame.base);
+            } else if (frame.pages == 1) {
+                pmm.free_page(frame.base);
+            } else {
+                pmm.free_pages(frame.base, frame.pages);
+            }
+        }
+        
+        frame_count_ = 0;
+    }
+
+    u16 VirtualMemoryManager::allocate_pcid() {
+        if (!pcid_enabled_) {
+            return 0;
+        }
+        
+        ScopedLock lock(pcid_lock_);
+        
+        for (usize n = 1; n < PCID_COUNT; n++) {
+            usize pcid = (pcid_hint_ + n - 1) % (PCID_COUNT - 1) + 1;
+            if (!pcid_map_.test(pcid)) {
+                pcid_map_.set(pcid, true);
+                pcid_hint_ = pcid + 1;
+                return static_cast<u16>(pcid);
+            }
+        }
+        
+        shared_pcid_spaces_++;
+        debug::log(debug::LogLevel::Warning, "VMM", "PCIDs exhausted, sharing PCID 0");
+        return 0;
+    }
+
+    void VirtualMemoryManager::release_pcid(u16 pcid) {
+        ScopedLock lock(pcid_lock_);
+        
+        if (pcid == 0) {
+            if (shared_pcid_spaces_ > 0) {
+                shared_pcid_spaces_--;
+            }
+            return;
+        }
+        
+        pcid_map_.set(pcid, false);
+    }
+
     bool VirtualMemoryManager::map_page(virt_addr virt, phys_addr phys, PageFlags flags) {
         ScopedLock lock(current_space_->lock);
         return map_page_internal(virt, phys, flags);
@@ -293,18 +650,65 @@ namespace nk::mm {
     bool VirtualMemoryManager::map_pages(virt_addr virt, phys_addr phys, usize count, PageFlags flags) {
         ScopedLock lock(current_space_->lock);
         
-        for (usize i = 0; i < count; i++) {
-            if (!map_page_internal(virt + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags)) {
-                for (usize j = 0; j < i; j++) {
-                    unmap_page_internal(virt + j * PAGE_SIZE);
-                }
+        usize mapped = 0;
+        while (mapped < count) {
+            virt_addr v = virt + mapped * PAGE_SIZE;
+            phys_addr p = phys + mapped * PAGE_SIZE;
+            usize remaining = count - mapped;
+            
+            usize level = 0;
+            if (gigabyte_pages_ && v % GIGA_PAGE_SIZE == 0 && p % GIGA_PAGE_SIZE == 0 &&
+                remaining >= GIGA_PAGE_SIZE / PAGE_SIZE) {
+                level = 2;
+            } else if (v % HUGE_PAGE_SIZE == 0 && p % HUGE_PAGE_SIZE == 0 &&
+                       remaining >= HUGE_PAGE_SIZE / PAGE_SIZE) {
+                level = 1;
+            }
+            
+            bool success = level > 0
+                ? map_huge_internal(v, p, level, flags)
+                : map_page_internal(v, p, flags);
+            
+            if (!success) {
+                MMUGather gather(current_space_);
+                unmap_range_internal(virt, mapped, &gather);
                 return false;
             }
+            
+            mapped += level_page_size(level) / PAGE_SIZE;
         }
         
         return true;
     }
 
+    bool VirtualMemoryManager::unmap_range_internal(virt_addr virt, usize count, MMUGather* gather,
+                                                    bool release_frames) {
+        bool success = true;
+        
+        usize unmapped = 0;
+        while (unmapped < count) {
+            usize pages = unmap_entry_internal(virt + unmapped * PAGE_SIZE, count - unmapped,
+                                               gather, release_frames);
+            if (pages == 0) {
+                success = false;
+                pages = 1;
+            }
+            unmapped += pages;
+        }
+        
+        return success;
+    }
+
+    void VirtualMemoryManager::release_mapped_pages(virt_addr virt, usize count) {
+        if (count == 0) {
+            return;
+        }
+        
+        ScopedLock lock(current_space_->lock);
+        MMUGather gather(current_space_);
+        unmap_range_internal(virt, count, &gather, true);
+    }
+
     bool VirtualMemoryManager::unmap_page(virt_addr virt) {
         ScopedLock lock(current_space_->lock);
         return unmap_page_internal(virt);
@@ -312,15 +716,8 @@ namespace nk::mm {
 
     bool VirtualMemoryManager::unmap_pages(virt_addr virt, usize count) {
         ScopedLock lock(current_space_->lock);
-        
-        bool success = true;
-        for (usize i = 0; i < count; i++) {
-            if (!unmap_page_internal(virt + i * PAGE_SIZE)) {
-                success = false;
-            }
-        }
-        
-        return success;
+        MMUGather gather(current_space_);
+        return unmap_range_internal(virt, count, &gather, true);
     }
 
     Optional<phys_addr> VirtualMemoryManager::get_physical_address(virt_addr virt) {
@@ -371,6 +768,16 @@ namespace nk::mm {
         
         AddressSpace* space = new AddressSpace();
         space->pml4 = pml4;
+        space->pcid = allocate_pcid();
+        
+        {
+            ScopedLock spaces_lock(spaces_lock_);
+            space->next = spaces_;
+            if (spaces_) {
+                spaces_->prev = space;
+            }
+            spaces_ = space;
+        }
         
         debug::log(debug::LogLevel::Debug, "VMM",
                   "Created new address space at 0x%016llX", pml4_phys);
@@ -378,30 +785,566 @@ namespace nk::mm {
         return space;
     }
 
-    void VirtualMemoryManager::destroy_address_space(AddressSpace* space) {
-        if (!space || space == kernel_space_) {
-            return;
-        }
-        
-        space->reference_count--;
-        if (space->reference_count > 0) {
-            return;
-        }
+    VirtualMemoryManager::PageTableEntry*
+    VirtualMemoryManager::lookup_entry(AddressSpace* space, virt_addr virt, bool allocate) {
+        usize indices[PAGE_TABLE_LEVELS];
+        indices[3] = (virt >> 39) & 0x1FF;
+        indices[2] = (virt >> 30) & 0x1FF;
+        indices[1] = (virt >> 21) & 0x1FF;
+        indices[0] = (virt >> 12) & 0x1FF;
         
-        ScopedLock lock(space->lock);
+        PageTableEntry* current = space->pml4;
         
-        for (usize i = 0; i < 256; i++) {
-            if (space->pml4[i].is_present()) {
-                phys_addr pdpt_phys = space->pml4[i].get_address();
-                PageTableEntry* pdpt = reinterpret_cast<PageTableEntry*>(
-                    phys_to_virt(pdpt_phys));
-                free_table(pdpt, 3);
+        for (int i = 3; i > 0; i--) {
+            PageTableEntry& entry = current[indices[i]];
+            
+            if (!entry.is_present()) {
+                if (!allocate) {
+                    return nullptr;
+                }
+                
+                auto page_opt = PhysicalMemoryManager::instance().allocate_page();
+                if (!page_opt.has_value()) {
+                    return nullptr;
+                }
+                
+                memset(reinterpret_cast<void*>(phys_to_virt(page_opt.value())), 0, PAGE_SIZE);
+                
+                entry.raw = 0;
+                entry.set_address(page_opt.value());
+                entry.present = 1;
+                entry.writable = 1;
+                entry.user = virt < KERNEL_HALF_BASE ? 1 : 0;
+                
+                space->allocated_pages++;
+            } else if (entry.is_huge()) {
+                return nullptr;
+            }
+            
+            current = reinterpret_cast<PageTableEntry*>(phys_to_virt(entry.get_address()));
+        }
+        
+        return &current[indices[0]];
+    }
+
+    const VirtualMemoryManager::VirtualMemoryArea*
+    VirtualMemoryManager::find_area(const AddressSpace* space, virt_addr address) const {
+        for (const VirtualMemoryArea& area : space->areas) {
+            if (address >= area.start && address < area.end) {
+                return &area;
+            }
+        }
+        
+        return nullptr;
+    }
+
+    bool VirtualMemoryManager::map_lazy(AddressSpace* space, virt_addr start, usize size, PageFlags flags) {
+        return map_file(space, start, size, flags, nullptr, 0);
+    }
+
+    bool VirtualMemoryManager::map_file(AddressSpace* space, virt_addr start, usize size, PageFlags flags,
+                                        PageProvider* provider, u64 page_offset) {
+        if (!space || start % PAGE_SIZE != 0 || size == 0) {
+            return false;
+        }
+        
+        virt_addr end = start + align_up(size, PAGE_SIZE);
+        
+        ScopedLock lock(space->lock);
+        
+        for (const VirtualMemoryArea& area : space->areas) {
+            if (start < area.end && end > area.start) {
+                debug::log(debug::LogLevel::Warning, "VMM",
+                          "Lazy region 0x%016llX - 0x%016llX overlaps existing area",
+                          start, end);
+                return false;
+            }
+        }
+        
+        VirtualMemoryArea area;
+        area.start = start;
+        area.end = end;
+        area.flags = flags | PageFlags::Present;
+        area.provider = provider;
+        area.page_offset = page_offset;
+        space->areas.push_back(area);
+        
+        if (provider) {
+            provider->retain();
+        }
+        
+        return true;
+    }
+
+    usize VirtualMemoryManager::report_dirty_pages(AddressSpace* space, const VirtualMemoryArea& area,
+                                                   virt_addr start, virt_addr end, MMUGather* gather) {
+        if (!area.provider) {
+            return 0;
+        }
+        
+        usize reported = 0;
+        
+        for (virt_addr page = max(start, area.start); page < min(end, area.end); page += PAGE_SIZE) {
+            PageTableEntry* entry = lookup_entry(space, page, false);
+            if (!entry || !entry->is_present() || !entry->dirty) {
+                continue;
+            }
+            
+            area.provider->set_page_dirty(area.page_offset + (page - area.start) / PAGE_SIZE);
+            reported++;
+            
+            if (gather) {
+                entry->dirty = 0;
+                gather->add(page, PAGE_SIZE);
+            }
+        }
+        
+        return reported;
+    }
+
+    bool VirtualMemoryManager::sync_region(AddressSpace* space, virt_addr start, usize size) {
+        if (!space || start % PAGE_SIZE != 0 || size == 0) {
+            return false;
+        }
+        
+        virt_addr end = start + align_up(size, PAGE_SIZE);
+        
+        ScopedLock lock(space->lock);
+        MMUGather gather(space);
+        
+        for (const VirtualMemoryArea& area : space->areas) {
+            if (start < area.end && end > area.start) {
+                report_dirty_pages(space, area, start, end, &gather);
+            }
+        }
+        
+        return true;
+    }
+
+    bool VirtualMemoryManager::unmap_region(AddressSpace* space, virt_addr start, usize size) {
+        if (!space || start % PAGE_SIZE != 0 || size == 0) {
+            return false;
+        }
+        
+        virt_addr end = start + align_up(size, PAGE_SIZE);
+        
+        ScopedLock lock(space->lock);
+        
+        for (const VirtualMemoryArea& area : space->areas) {
+            if (start < area.end && end > area.start) {
+                report_dirty_pages(space, area, start, end, nullptr);
+            }
+        }
+        
+        for (usize i = 0; i < space->areas.size(); ) {
+            VirtualMemoryArea& area = space->areas[i];
+            
+            if (end <= area.start || start >= area.end) {
+                i++;
+                continue;
+            }
+            
+            if (start <= area.start && end >= area.end) {
+                if (area.provider) {
+                    area.provider->release();
+                }
+                space->areas.erase(i);
+                continue;
+            }
+            
+            if (start > area.start && end < area.end) {
+                VirtualMemoryArea tail = area;
+                tail.start = end;
+                tail.page_offset += (end - area.start) / PAGE_SIZE;
+                area.end = start;
+                if (tail.provider) {
+                    tail.provider->retain();
+                }
+                space->areas.push_back(tail);
+            } else if (start <= area.start) {
+                area.page_offset += (end - area.start) / PAGE_SIZE;
+                area.start = end;
+            } else {
+                area.end = start;
+            }
+            i++;
+        }
+        
+        MMUGather gather(space);
+        
+        for (virt_addr page = start; page < end; page += PAGE_SIZE) {
+            PageTableEntry* entry = lookup_entry(space, page, false);
+            if (!entry || !entry->is_present()) {
+                continue;
+            }
+            
+            phys_addr frame = entry->get_address();
+            entry->raw = 0;
+            space->mapped_pages--;
+            gather.add(page, PAGE_SIZE);
+            gather.defer_free(frame, 1, true);
+        }
+        
+        return true;
+    }
+
+    usize VirtualMemoryManager::zap_provider(PageProvider* provider, u64 first_page) {
+        if (!provider) {
+            return 0;
+        }
+        
+        provider->invalidate();
+        
+        usize zapped = 0;
+        
+        ScopedLock spaces_lock(spaces_lock_);
+        
+        for (AddressSpace* space = spaces_; space; space = space->next) {
+            ScopedLock lock(space->lock);
+            MMUGather gather(space);
+            
+            for (const VirtualMemoryArea& area : space->areas) {
+                if (area.provider != provider) {
+                    continue;
+                }
+                
+                u64 area_pages = (area.end - area.start) / PAGE_SIZE;
+                if (first_page >= area.page_offset + area_pages) {
+                    continue;
+                }
+                
+                virt_addr start = area.start;
+                if (first_page > area.page_offset) {
+                    start += (first_page - area.page_offset) * PAGE_SIZE;
+                }
+                
+                for (virt_addr page = start; page < area.end; page += PAGE_SIZE) {
+                    PageTableEntry* entry = lookup_entry(space, page, false);
+                    if (!entry || !entry->is_present()) {
+                        continue;
+                    }
+                    
+                    phys_addr frame = entry->get_address();
+                    entry->raw = 0;
+                    space->mapped_pages--;
+                    gather.add(page, PAGE_SIZE);
+                    gather.defer_free(frame, 1, true);
+                    zapped++;
+                }
+            }
+        }
+        
+        return zapped;
+    }
+
+    virt_addr VirtualMemoryManager::reserve_user_stack(AddressSpace* space) {
+        virt_addr top = align_down(USER_STACK_BASE, PAGE_SIZE);
+        virt_addr bottom = top - USER_STACK_SIZE;
+        
+        if (!map_lazy(space, bottom, USER_STACK_SIZE,
+                      PageFlags::Writable | PageFlags::UserAccessible | PageFlags::NoExecute)) {
+            return 0;
+        }
+        
+        return top;
+    }
+
+    bool VirtualMemoryManager::resolve_demand_fault(AddressSpace* space, virt_addr page,
+                                                    const VirtualMemoryArea& area) {
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        
+        auto frame_opt = pmm.allocate_page();
+        if (!frame_opt.has_value()) {
+            debug::log(debug::LogLevel::Error, "VMM",
+                      "Out of memory resolving fault at 0x%016llX", page);
+            return false;
+        }
+        
+        PageTableEntry* entry = lookup_entry(space, page, true);
+        if (!entry) {
+            pmm.free_page(frame_opt.value());
+            return false;
+        }
+        
+        memset(reinterpret_cast<void*>(phys_to_virt(frame_opt.value())), 0, PAGE_SIZE);
+        
+        entry->raw = 0;
+        entry->set_address(frame_opt.value());
+        apply_flags(*entry, area.flags);
+        
+        space->mapped_pages++;
+        space->demand_faults++;
+        
+        invalidate_page(page);
+        
+        return true;
+    }
+
+    bool VirtualMemoryManager::resolve_copy_on_write(AddressSpace* space, virt_addr page,
+                                                     PageTableEntry& entry) {
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        phys_addr old_frame = entry.get_address();
+        
+        if (pmm.page_refcount(old_frame) > 1) {
+            auto frame_opt = pmm.allocate_page();
+            if (!frame_opt.has_value()) {
+                debug::log(debug::LogLevel::Error, "VMM",
+                          "Out of memory copying page at 0x%016llX", page);
+                return false;
+            }
+            
+            memcpy(reinterpret_cast<void*>(phys_to_virt(frame_opt.value())),
+                   reinterpret_cast<const void*>(phys_to_virt(old_frame)), PAGE_SIZE);
+            
+            entry.set_address(frame_opt.value());
+            pmm.unref_page(old_frame);
+        }
+        
+        entry.clear_flags(PageFlags::CopyOnWrite);
+        entry.writable = 1;
+        
+        space->cow_faults++;
+        
+        invalidate_page(page);
+        
+        return true;
+    }
+
+    bool VirtualMemoryManager::handle_page_fault(virt_addr address, u64 error_code) {
+        AddressSpace* space = current_space_;
+        if (!space) {
+            return false;
+        }
+        
+        bool present = (error_code & 0x01) != 0;
+        bool write = (error_code & 0x02) != 0;
+        virt_addr page = align_down(address, PAGE_SIZE);
+        
+        debug::Trace::point(debug::TraceComponent::Memory,
+                           "Page fault at 0x%016llX, error 0x%llX", address, error_code);
+        
+        ScopedLock lock(space->lock);
+        
+        if (present) {
+            if (!write) {
+                return false;
+            }
+            
+            PageTableEntry* entry = lookup_entry(space, page, false);
+            if (!entry || !entry->is_present() || !entry->test_flags(PageFlags::CopyOnWrite)) {
+                return false;
+            }
+            
+            return resolve_copy_on_write(space, page, *entry);
+        }
+        
+        const VirtualMemoryArea* area = find_area(space, address);
+        if (!area) {
+            return false;
+        }
+        
+        if (write && !(static_cast<u64>(area->flags) & static_cast<u64>(PageFlags::Writable))) {
+            return false;
+        }
+        
+        if (!area->provider) {
+            return resolve_demand_fault(space, page, *area);
+        }
+        
+        VirtualMemoryArea snapshot = *area;
+        snapshot.provider->retain();
+        u64 sequence = snapshot.provider->sequence();
+        
+        lock.unlock();
+        Optional<phys_addr> frame = snapshot.provider->get_page(
+            snapshot.page_offset + (page - snapshot.start) / PAGE_SIZE);
+        lock.lock();
+        
+        bool resolved = false;
+        if (frame.has_value() && snapshot.provider->sequence() != sequence) {
+            PhysicalMemoryManager::instance().unref_page(frame.value());
+            resolved = true;
+        } else if (frame.has_value()) {
+            area = find_area(space, address);
+            if (area && area->provider == snapshot.provider && area->start == snapshot.start &&
+                area->page_offset == snapshot.page_offset) {
+                resolved = install_file_page(space, page, *area, frame.value());
+            } else {
+                PhysicalMemoryManager::instance().unref_page(frame.value());
+            }
+        }
+        
+        snapshot.provider->release();
+        return resolved;
+    }
+
+    bool VirtualMemoryManager::install_file_page(AddressSpace* space, virt_addr page,
+                                                 const VirtualMemoryArea& area, phys_addr frame) {
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        
+        PageTableEntry* entry = lookup_entry(space, page, true);
+        if (!entry) {
+            pmm.unref_page(frame);
+            return false;
+        }
+        
+        if (entry->is_present()) {
+            pmm.unref_page(frame);
+            return true;
+        }
+        
+        entry->raw = 0;
+        entry->set_address(frame);
+        apply_flags(*entry, area.flags);
+        
+        space->mapped_pages++;
+        space->file_faults++;
+        
+        invalidate_page(page);
+        
+        return true;
+    }
+
+    bool VirtualMemoryManager::clone_table(AddressSpace* parent, PageTableEntry* table, usize level,
+                                           virt_addr base, AddressSpace* child, MMUGather& gather) {
+        usize limit = level == 3 ? PAGE_TABLE_ENTRIES / 2 : PAGE_TABLE_ENTRIES;
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        
+        for (usize i = 0; i < limit; i++) {
+            PageTableEntry& entry = table[i];
+            if (!entry.is_present()) {
+                continue;
+            }
+            
+            virt_addr address = base + i * level_page_size(level);
+            
+            if (level > 0 && entry.is_huge() && !split_huge_entry(parent, entry, level)) {
+                debug::log(debug::LogLevel::Error, "VMM",
+                          "Failed to split huge user mapping at 0x%016llX during clone", address);
+                return false;
+            }
+            
+            if (level > 0) {
+                PageTableEntry* next = reinterpret_cast<PageTableEntry*>(phys_to_virt(entry.get_address()));
+                if (!clone_table(parent, next, level - 1, address, child, gather)) {
+                    return false;
+                }
+                continue;
+            }
+            
+            PageTableEntry* target = lookup_entry(child, address, true);
+            if (!target) {
+                return false;
+            }
+            
+            const VirtualMemoryArea* area = find_area(child, address);
+            bool shared = area && area->provider;
+            
+            if (!shared && (entry.is_writable() || entry.test_flags(PageFlags::CopyOnWrite))) {
+                entry.writable = 0;
+                entry.set_flags(PageFlags::CopyOnWrite);
+                gather.add(address, PAGE_SIZE);
+            }
+            
+            target->raw = entry.raw;
+            pmm.ref_page(entry.get_address());
+            child->mapped_pages++;
+        }
+        
+        return true;
+    }
+
+    VirtualMemoryManager::AddressSpace* VirtualMemoryManager::clone_address_space(AddressSpace* parent) {
+        if (!parent || parent == kernel_space_) {
+            return nullptr;
+        }
+        
+        AddressSpace* child = create_address_space();
+        if (!child) {
+            return nullptr;
+        }
+        
+        bool success;
+        {
+            ScopedLock lock(parent->lock);
+            
+            child->areas = parent->areas;
+            for (const VirtualMemoryArea& area : child->areas) {
+                if (area.provider) {
+                    area.provider->retain();
+                }
+            }
+            
+            MMUGather gather(parent);
+            success = clone_table(parent, parent->pml4, 3, 0, child, gather);
+        }
+        
+        if (!success) {
+            debug::log(debug::LogLevel::Error, "VMM", "Failed to clone address space");
+            destroy_address_space(child);
+            return nullptr;
+        }
+        
+        debug::log(debug::LogLevel::Debug, "VMM",
+                  "Cloned address space: %llu pages shared copy-on-write", child->mapped_pages);
+        
+        return child;
+    }
+
+    void VirtualMemoryManager::destroy_address_space(AddressSpace* space) {
+        if (!space || space == kernel_space_) {
+            return;
+        }
+        
+        space->reference_count--;
+        if (space->reference_count > 0) {
+            return;
+        }
+        
+        {
+            ScopedLock spaces_lock(spaces_lock_);
+            if (space->prev) {
+                space->prev->next = space->next;
+            } else {
+                spaces_ = space->next;
+            }
+            if (space->next) {
+                space->next->prev = space->prev;
+            }
+        }
+        
+        ScopedLock lock(space->lock);
+        
+        for (const VirtualMemoryArea& area : space->areas) {
+            if (area.provider) {
+                report_dirty_pages(space, area, area.start, area.end, nullptr);
+                area.provider->release();
+            }
+        }
+        space->areas.clear();
+        
+        for (usize i = 0; i < 256; i++) {
+            if (space->pml4[i].is_present()) {
+                phys_addr pdpt_phys = space->pml4[i].get_address();
+                PageTableEntry* pdpt = reinterpret_cast<PageTableEntry*>(
+                    phys_to_virt(pdpt_phys));
+                free_table(space, pdpt, 3);
             }
         }
         
         PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
         pmm.free_page(virt_to_phys(reinterpret_cast<virt_addr>(space->pml4)));
         
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            AddressSpace* expected = space;
+            __atomic_compare_exchange_n(&active_spaces_[cpu], &expected, nullptr, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        }
+        
+        if (pcid_enabled_) {
+            release_pcid(space->pcid);
+        }
+        
         delete space;
         
         debug::log(debug::LogLevel::Debug, "VMM", "Destroyed address space");
@@ -415,64 +1358,377 @@ namespace nk::mm {
         ScopedLock lock(space->lock);
         
         phys_addr pml4_phys = virt_to_phys(reinterpret_cast<virt_addr>(space->pml4));
-        asm volatile("mov %0, %%cr3" : : "r"(pml4_phys) : "memory");
+        u64 cr3 = pml4_phys;
+        
+        u32 cpu = arch::SMP::current_cpu_id();
+        __atomic_or_fetch(&space->active_cpus, 1ULL << cpu, __ATOMIC_SEQ_CST);
+        
+        if (pcid_enabled_) {
+            u64 self = 1ULL << cpu;
+            bool stale = (__atomic_fetch_and(&space->stale_cpus, ~self, __ATOMIC_SEQ_CST) & self) != 0;
+            bool shared = space->pcid == 0 && shared_pcid_spaces_ > 0;
+            
+            cr3 |= space->pcid;
+            if (!stale && !shared) {
+                cr3 |= CR3_NOFLUSH;
+            }
+        }
+        
+        asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+        
+        AddressSpace* previous = active_spaces_[cpu];
+        if (previous && previous != space) {
+            __atomic_and_fetch(&previous->active_cpus, ~(1ULL << cpu), __ATOMIC_SEQ_CST);
+        }
+        active_spaces_[cpu] = space;
         
         current_space_ = space;
         space->reference_count++;
+        
+        handle_tlb_shootdown();
     }
 
-    void* VirtualMemoryManager::kmalloc(usize size) {
-        if (size == 0) {
+    void* VirtualMemoryManager::allocate_guarded_stack(usize pages) {
+        if (pages == 0) {
             return nullptr;
         }
-        
+
         ScopedLock lock(heap_lock_);
-        
-        size = align_up(size, 16);
-        
-        if (kernel_heap_current_ + size > kernel_heap_end_) {
+
+        auto base_opt = reserve_heap_range(pages + 1, 1);
+        if (!base_opt.has_value()) {
             debug::log(debug::LogLevel::Error, "VMM",
-                      "Kernel heap exhausted: requested %llu bytes", size);
+                      "Kernel heap exhausted: requested %llu stack pages", pages);
             return nullptr;
         }
-        
+
+        virt_addr stack = base_opt.value() + PAGE_SIZE;
         PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
-        usize pages_needed = align_up(size, PAGE_SIZE) / PAGE_SIZE;
-        
-        for (usize i = 0; i < pages_needed; i++) {
-            virt_addr virt = kernel_heap_current_ + i * PAGE_SIZE;
+
+        for (usize i = 0; i < pages; i++) {
             auto phys_opt = pmm.allocate_page();
-            if (!phys_opt.has_value()) {
-                for (usize j = 0; j < i; j++) {
-                    virt_addr free_virt = kernel_heap_current_ + j * PAGE_SIZE;
-                    auto free_phys_opt = get_physical_address(free_virt);
-                    if (free_phys_opt.has_value()) {
-                        pmm.free_page(free_phys_opt.value());
-                    }
-                    unmap_page(free_virt);
+
+            if (!phys_opt.has_value() ||
+                !map_page(stack + i * PAGE_SIZE, phys_opt.value(),
+                         PageFlags::Present | PageFlags::Writable |
+                         PageFlags::Global | PageFlags::NoExecute)) {
+                if (phys_opt.has_value()) {
+                    pmm.free_page(phys_opt.value());
                 }
+
+                release_mapped_pages(stack, i);
+
+                release_heap_range(base_opt.value(), pages + 1);
                 return nullptr;
             }
-            
-            if (!map_page(virt, phys_opt.value(),
-                         PageFlags::Present | PageFlags::Writable | PageFlags::Global)) {
-                pmm.free_page(phys_opt.value());
-                for (usize j = 0; j < i; j++) {
-                    virt_addr free_virt = kernel_heap_current_ + j * PAGE_SIZE;
-                    auto free_phys_opt = get_physical_address(free_virt);
-                    if (free_phys_opt.has_value()) {
-                        pmm.free_page(free_phys_opt.value());
+
+            memset(reinterpret_cast<void*>(phys_to_virt(phys_opt.value())), 0, PAGE_SIZE);
+        }
+
+        large_pages_ += pages;
+        return reinterpret_cast<void*>(stack);
+    }
+
+    void VirtualMemoryManager::free_guarded_stack(void* stack, usize pages) {
+        virt_addr base = reinterpret_cast<virt_addr>(stack);
+        if (!stack || base % PAGE_SIZE != 0) {
+            return;
+        }
+
+        release_mapped_pages(base, pages);
+
+        ScopedLock lock(heap_lock_);
+        release_heap_range(base - PAGE_SIZE, pages + 1);
+        large_pages_ -= pages;
+    }
+
+    virt_addr VirtualMemoryManager::allocate_slab_span(usize pages) {
+        if (pages == 0 || pages * PAGE_SIZE > SlabCache::SLAB_SLOT_SIZE) {
+            return 0;
+        }
+
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+        auto phys_opt = pmm.allocate_pages(pages);
+        if (!phys_opt.has_value()) {
+            return 0;
+        }
+
+        ScopedLock lock(slab_lock_);
+
+        for (usize n = 0; n < SLAB_SLOT_COUNT; n++) {
+            usize slot = (slab_slot_hint_ + n) % SLAB_SLOT_COUNT;
+            if (slab_slots_.test(slot)) {
+                continue;
+            }
+
+            virt_addr base = KERNEL_SLAB_BASE + slot * SlabCache::SLAB_SLOT_SIZE;
+            if (!map_pages(base, phys_opt.value(), pages,
+                          PageFlags::Present | PageFlags::Writable | PageFlags::Global)) {
+                break;
+            }
+
+            slab_slots_.set(slot, true);
+            slab_slot_hint_ = slot + 1;
+            slab_pages_ += pages;
+
+            return base;
+        }
+
+        pmm.free_pages(phys_opt.value(), pages);
+
+        debug::log(debug::LogLevel::Error, "VMM",
+                  "Slab window exhausted: requested %llu pages", pages);
+        return 0;
+    }
+
+    void VirtualMemoryManager::free_slab_span(virt_addr base, usize pages) {
+        if (!is_slab_address(base) || base % SlabCache::SLAB_SLOT_SIZE != 0) {
+            debug::log(debug::LogLevel::Error, "VMM",
+                      "Invalid slab span: 0x%016llX", base);
+            return;
+        }
+
+        release_mapped_pages(base, pages);
+
+        ScopedLock lock(slab_lock_);
+
+        usize slot = (base - KERNEL_SLAB_BASE) / SlabCache::SLAB_SLOT_SIZE;
+        slab_slots_.set(slot, false);
+        slab_slot_hint_ = min(slab_slot_hint_, slot);
+        slab_pages_ -= pages;
+    }
+
+    usize VirtualMemoryManager::large_bucket(virt_addr base) {
+        return (base / PAGE_SIZE) % LARGE_BUCKETS;
+    }
+
+    Optional<virt_addr> VirtualMemoryManager::reserve_heap_range(usize pages, usize align_pages) {
+        usize alignment = align_pages * PAGE_SIZE;
+
+        HeapRange* prev = nullptr;
+        for (HeapRange* range = free_ranges_; range; prev = range, range = range->next) {
+            virt_addr base = align_up(range->base, alignment);
+            usize skipped = (base - range->base) / PAGE_SIZE;
+
+            if (skipped + pages > range->pages) {
+                continue;
+            }
+
+            usize tail = range->pages - skipped - pages;
+
+            if (skipped == 0 && tail == 0) {
+                if (prev) {
+                    prev->next = range->next;
+                } else {
+                    free_ranges_ = range->next;
+                }
+                range_cache_.free(range);
+            } else if (skipped == 0) {
+                range->base += pages * PAGE_SIZE;
+                range->pages = tail;
+            } else {
+                if (tail > 0) {
+                    HeapRange* split = reinterpret_cast<HeapRange*>(range_cache_.allocate());
+                    if (!split) {
+                        return Optional<virt_addr>();
                     }
-                    unmap_page(free_virt);
+
+                    split->base = base + pages * PAGE_SIZE;
+                    split->pages = tail;
+                    split->next = range->next;
+                    range->next = split;
                 }
+                range->pages = skipped;
+            }
+
+            return Optional<virt_addr>(base);
+        }
+
+        virt_addr base = align_up(kernel_heap_current_, alignment);
+        if (base + pages * PAGE_SIZE > kernel_heap_end_) {
+            return Optional<virt_addr>();
+        }
+
+        if (base > kernel_heap_current_) {
+            release_heap_range(kernel_heap_current_, (base - kernel_heap_current_) / PAGE_SIZE);
+        }
+
+        kernel_heap_current_ = base + pages * PAGE_SIZE;
+        return Optional<virt_addr>(base);
+    }
+
+    void VirtualMemoryManager::release_heap_range(virt_addr base, usize pages) {
+        virt_addr end = base + pages * PAGE_SIZE;
+
+        if (end == kernel_heap_current_) {
+            kernel_heap_current_ = base;
+
+            HeapRange* prev = nullptr;
+            HeapRange* last = free_ranges_;
+            while (last && last->next) {
+                prev = last;
+                last = last->next;
+            }
+
+            if (last && last->base + last->pages * PAGE_SIZE == kernel_heap_current_) {
+                kernel_heap_current_ = last->base;
+                if (prev) {
+                    prev->next = nullptr;
+                } else {
+                    free_ranges_ = nullptr;
+                }
+                range_cache_.free(last);
+            }
+
+            return;
+        }
+
+        HeapRange* prev = nullptr;
+        HeapRange* next = free_ranges_;
+        while (next && next->base < base) {
+            prev = next;
+            next = next->next;
+        }
+
+        if (prev && prev->base + prev->pages * PAGE_SIZE == base) {
+            prev->pages += pages;
+
+            if (next && end == next->base) {
+                prev->pages += next->pages;
+                prev->next = next->next;
+                range_cache_.free(next);
+            }
+            return;
+        }
+
+        if (next && end == next->base) {
+            next->base = base;
+            next->pages += pages;
+            return;
+        }
+
+        HeapRange* range = reinterpret_cast<HeapRange*>(range_cache_.allocate());
+        if (!range) {
+            debug::log(debug::LogLevel::Warning, "VMM",
+                      "Leaking heap range 0x%016llX (%llu pages)", base, pages);
+            return;
+        }
+
+        range->base = base;
+        range->pages = pages;
+        range->next = next;
+
+        if (prev) {
+            prev->next = range;
+        } else {
+            free_ranges_ = range;
+        }
+    }
+
+    void* VirtualMemoryManager::allocate_large(usize pages, usize align_pages) {
+        HeapRange* record = reinterpret_cast<HeapRange*>(range_cache_.allocate());
+        if (!record) {
+            return nullptr;
+        }
+
+        ScopedLock lock(heap_lock_);
+
+        auto base_opt = reserve_heap_range(pages, align_pages);
+        if (!base_opt.has_value()) {
+            range_cache_.free(record);
+            debug::log(debug::LogLevel::Error, "VMM",
+                      "Kernel heap exhausted: requested %llu bytes", pages * PAGE_SIZE);
+            return nullptr;
+        }
+
+        virt_addr base = base_opt.value();
+        PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
+
+        for (usize i = 0; i < pages; i++) {
+            virt_addr virt = base + i * PAGE_SIZE;
+            auto phys_opt = pmm.allocate_page();
+
+            if (!phys_opt.has_value() ||
+                !map_page(virt, phys_opt.value(),
+                         PageFlags::Present | PageFlags::Writable | PageFlags::Global)) {
+                if (phys_opt.has_value()) {
+                    pmm.free_page(phys_opt.value());
+                }
+
+                release_mapped_pages(base, i);
+
+                release_heap_range(base, pages);
+                range_cache_.free(record);
                 return nullptr;
             }
         }
-        
-        void* ptr = reinterpret_cast<void*>(kernel_heap_current_);
-        kernel_heap_current_ += pages_needed * PAGE_SIZE;
-        
-        return ptr;
+
+        usize bucket = large_bucket(base);
+        record->base = base;
+        record->pages = pages;
+        record->next = large_allocations_[bucket];
+        large_allocations_[bucket] = record;
+        large_pages_ += pages;
+
+        return reinterpret_cast<void*>(base);
+    }
+
+    void VirtualMemoryManager::free_large(void* ptr) {
+        virt_addr base = reinterpret_cast<virt_addr>(ptr);
+        usize bucket = large_bucket(base);
+
+        ScopedLock lock(heap_lock_);
+
+        HeapRange* prev = nullptr;
+        HeapRange* record = large_allocations_[bucket];
+        while (record && record->base != base) {
+            prev = record;
+            record = record->next;
+        }
+
+        if (!record) {
+            debug::log(debug::LogLevel::Error, "VMM",
+                      "Attempt to free unknown heap pointer: 0x%016llX", base);
+            return;
+        }
+
+        if (prev) {
+            prev->next = record->next;
+        } else {
+            large_allocations_[bucket] = record->next;
+        }
+
+        release_mapped_pages(base, record->pages);
+
+        large_pages_ -= record->pages;
+        release_heap_range(base, record->pages);
+        range_cache_.free(record);
+    }
+
+    usize VirtualMemoryManager::large_allocation_size(const void* ptr) {
+        virt_addr base = reinterpret_cast<virt_addr>(ptr);
+
+        ScopedLock lock(heap_lock_);
+
+        for (HeapRange* record = large_allocations_[large_bucket(base)]; record; record = record->next) {
+            if (record->base == base) {
+                return record->pages * PAGE_SIZE;
+            }
+        }
+
+        return 0;
+    }
+
+    void* VirtualMemoryManager::kmalloc(usize size) {
+        if (size == 0) {
+            return nullptr;
+        }
+
+        if (size <= SlabAllocator::MAX_SIZE) {
+            return SlabAllocator::instance().allocate(size);
+        }
+
+        return allocate_large(align_up(size, PAGE_SIZE) / PAGE_SIZE, 1);
     }
 
     void* VirtualMemoryManager::kmalloc_aligned(usize size, usize alignment) {
@@ -480,20 +1736,17 @@ namespace nk::mm {
             return kmalloc(size);
         }
         
-        alignment = max(alignment, static_cast<usize>(16));
-        
-        void* ptr = kmalloc(size + alignment - 1 + sizeof(void*));
-        if (!ptr) {
+        if (size == 0) {
             return nullptr;
         }
-        
-        uintptr_t raw = reinterpret_cast<uintptr_t>(ptr);
-        uintptr_t aligned = (raw + sizeof(void*) + alignment - 1) & ~(alignment - 1);
-        
-        void** header = reinterpret_cast<void**>(aligned - sizeof(void*));
-        *header = ptr;
-        
-        return reinterpret_cast<void*>(aligned);
+
+        usize slab_size = max(size, alignment);
+        if (slab_size <= SlabAllocator::MAX_SIZE) {
+            return SlabAllocator::instance().allocate(slab_size);
+        }
+
+        usize align_pages = max(alignment, PAGE_SIZE) / PAGE_SIZE;
+        return allocate_large(align_up(size, PAGE_SIZE) / PAGE_SIZE, align_pages);
     }
 
     void* VirtualMemoryManager::krealloc(void* ptr, usize new_size) {
@@ -506,22 +1759,19 @@ namespace nk::mm {
             return nullptr;
         }
         
-        usize old_size = 0;
-        
-        void** header = reinterpret_cast<void**>(
-            reinterpret_cast<uintptr_t>(ptr) - sizeof(void*));
-        
-        if (reinterpret_cast<void*>(*header) != ptr) {
-            void* new_ptr = kmalloc(new_size);
-            if (!new_ptr) {
-                return nullptr;
-            }
-            
-            usize copy_size = min(old_size, new_size);
-            memcpy(new_ptr, ptr, copy_size);
-            
-            kfree(ptr);
-            return new_ptr;
+        usize old_size = is_slab_address(reinterpret_cast<virt_addr>(ptr))
+            ? SlabAllocator::instance().allocation_size(ptr)
+            : large_allocation_size(ptr);
+
+        if (old_size == 0) {
+            debug::log(debug::LogLevel::Error, "VMM",
+                      "krealloc of unknown pointer: 0x%016llX",
+                      reinterpret_cast<virt_addr>(ptr));
+            return nullptr;
+        }
+
+        if (new_size <= old_size && new_size > old_size / 2) {
+            return ptr;
         }
         
         void* new_ptr = kmalloc(new_size);
@@ -540,24 +1790,12 @@ namespace nk::mm {
             return;
         }
         
-        ScopedLock lock(heap_lock_);
-        
-        void** header = reinterpret_cast<void**>(
-            reinterpret_cast<uintptr_t>(ptr) - sizeof(void*));
-        
-        if (reinterpret_cast<void*>(*header) != ptr) {
-            kfree(*header);
+        if (is_slab_address(reinterpret_cast<virt_addr>(ptr))) {
+            SlabAllocator::instance().free(ptr);
             return;
         }
         
-        virt_addr virt = reinterpret_cast<virt_addr>(ptr);
-        auto phys_opt = get_physical_address(virt);
-        if (phys_opt.has_value()) {
-            PhysicalMemoryManager& pmm = PhysicalMemoryManager::instance();
-            pmm.free_page(phys_opt.value());
-        }
-        
-        unmap_page(virt);
+        free_large(ptr);
     }
 
     usize VirtualMemoryManager::get_allocated_pages() const {
@@ -591,8 +1829,19 @@ namespace nk::mm {
     void VirtualMemoryManager::dump_memory_statistics() {
         debug::log(debug::LogLevel::Info, "VMM", "Virtual Memory Statistics:");
         debug::log(debug::LogLevel::Info, "VMM", "  Kernel Heap: 0x%016llX - 0x%016llX",
-                  KERNEL_HEAP_BASE, kernel_heap_current_);
+                  KERNEL_LARGE_BASE, kernel_heap_current_);
+        debug::log(debug::LogLevel::Info, "VMM", "  Large object pages: %llu", large_pages_);
+        debug::log(debug::LogLevel::Info, "VMM", "  Slab pages: %llu", slab_pages_);
+        debug::log(debug::LogLevel::Info, "VMM", "  PCID: %s", pcid_enabled_ ? "enabled" : "disabled");
+        debug::log(debug::LogLevel::Info, "VMM", "  TLB page flushes: %llu", tlb_single_flushes_);
+        debug::log(debug::LogLevel::Info, "VMM", "  TLB full flushes: %llu", tlb_full_flushes_);
+        debug::log(debug::LogLevel::Info, "VMM", "  TLB shootdowns: %llu", tlb_shootdowns_);
         debug::log(debug::LogLevel::Info, "VMM", "  Allocated pages: %llu", get_allocated_pages());
         debug::log(debug::LogLevel::Info, "VMM", "  Mapped pages: %llu", get_mapped_pages());
+        debug::log(debug::LogLevel::Info, "VMM", "  Demand faults: %llu", current_space_->demand_faults);
+        debug::log(debug::LogLevel::Info, "VMM", "  COW faults: %llu", current_space_->cow_faults);
+        debug::log(debug::LogLevel::Info, "VMM", "  File faults: %llu", current_space_->file_faults);
+
+        SlabAllocator::instance().dump_statistics();
     }
 }
@@ -0,0 +1,464 @@
+#include <nanokoton/net/arp.hpp>
+#include <nanokoton/net/ip.hpp>
+#include <nanokoton/net/rcu.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
+#include <nanokoton/lib/string.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+#include <nanokoton/lib/vector.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/task/timer.hpp>
+
+namespace nk::net {
+    mm::SlabCache ARPLayer::cache_("arp-neighbor", sizeof(ARPLayer::Neighbor));
+
+    ARPLayer::ARPLayer()
+        : neighbor_count_(0),
+          poll_timer_(poll_tick, this),
+          poll_due_(false),
+          hits_(0),
+          misses_(0),
+          requests_sent_(0),
+          replies_sent_(0),
+          queued_(0),
+          dropped_(0) {
+        for (usize i = 0; i < HASH_BUCKETS; i++) {
+            buckets_[i] = nullptr;
+        }
+    }
+
+    ARPLayer::~ARPLayer() {
+        task::TimerWheel::instance().cancel_timer(&poll_timer_);
+
+        ScopedLock lock(lock_);
+
+        for (usize i = 0; i < HASH_BUCKETS; i++) {
+            Neighbor* neighbor = buckets_[i];
+            while (neighbor) {
+                Neighbor* next = neighbor->next;
+                drop_pending(neighbor);
+                cache_.free(neighbor);
+                neighbor = next;
+            }
+            buckets_[i] = nullptr;
+        }
+    }
+
+    bool ARPLayer::init() {
+        EthernetManager::instance().register_packet_callback(
+            static_cast<u16>(EthernetHeader::Type::ARP),
+            [](const u8* source, const u8* destination, u16 ether_type,
+               PacketBuffer* packet, void* user_data) {
+                static_cast<ARPLayer*>(user_data)->process_packet(packet);
+            }, this);
+
+        debug::log(debug::LogLevel::Info, "ARP", "ARP layer initialized");
+        return true;
+    }
+
+    ARPLayer::Neighbor* ARPLayer::find_locked(u32 address, EthernetDevice* device) {
+        for (Neighbor* neighbor = buckets_[bucket_index(address)]; neighbor; neighbor = neighbor->next) {
+            if (neighbor->address == address && (!device || neighbor->device == device)) {
+                return neighbor;
+            }
+        }
+        return nullptr;
+    }
+
+    ARPLayer::Neighbor* ARPLayer::create_locked(u32 address, u32 source, EthernetDevice* device) {
+        Neighbor* neighbor = static_cast<Neighbor*>(cache_.allocate());
+        if (!neighbor) {
+            return nullptr;
+        }
+
+        neighbor->address = address;
+        neighbor->source_address = source;
+        neighbor->device = device;
+        neighbor->sequence = 0;
+        memset(neighbor->mac_address, 0, 6);
+        neighbor->state = NeighborState::Incomplete;
+        neighbor->used = false;
+        neighbor->probes = 0;
+        neighbor->confirmed = 0;
+        neighbor->last_probe = 0;
+        neighbor->pending_count = 0;
+
+        usize index = bucket_index(address);
+        neighbor->next = buckets_[index];
+        RCU::assign(buckets_[index], neighbor);
+
+        neighbor_count_++;
+        arm_poll();
+        return neighbor;
+    }
+
+    void ARPLayer::update_locked(Neighbor* neighbor, const u8* mac_address, PendingFlush& flush) {
+        {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            __atomic_store_n(&neighbor->sequence, neighbor->sequence + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+
+            memcpy(neighbor->mac_address, mac_address, 6);
+            neighbor->state = NeighborState::Reachable;
+
+            __atomic_store_n(&neighbor->sequence, neighbor->sequence + 1, __ATOMIC_RELEASE);
+        }
+
+        neighbor->confirmed = task::TimerWheel::instance().now();
+        neighbor->probes = 0;
+        neighbor->used = false;
+
+        flush.device = neighbor->device;
+        memcpy(flush.mac_address, mac_address, 6);
+        for (u32 i = 0; i < neighbor->pending_count; i++) {
+            flush.packets[i] = neighbor->pending[i];
+            flush.types[i] = neighbor->pending_types[i];
+        }
+        flush.count = neighbor->pending_count;
+        neighbor->pending_count = 0;
+    }
+
+    void ARPLayer::unlink_locked(Neighbor* neighbor) {
+        Neighbor** link = &buckets_[bucket_index(neighbor->address)];
+        while (*link && *link != neighbor) {
+            link = &(*link)->next;
+        }
+
+        if (*link) {
+            RCU::assign(*link, neighbor->next);
+            neighbor_count_--;
+        }
+    }
+
+    void ARPLayer::drop_pending(Neighbor* neighbor) {
+        for (u32 i = 0; i < neighbor->pending_count; i++) {
+            neighbor->pending[i]->release();
+        }
+        dropped_ += neighbor->pending_count;
+        neighbor->pending_count = 0;
+    }
+
+    void ARPLayer::send_request(EthernetDevice* device, u32 source, u32 target, const u8* destination) {
+        ARPHeader request;
+        request.hardware_type = swap_endian_16(HARDWARE_ETHERNET);
+        request.protocol_type = swap_endian_16(static_cast<u16>(EthernetHeader::Type::IPv4));
+        request.hardware_length = 6;
+        request.protocol_length = 4;
+        request.operation = swap_endian_16(OPERATION_REQUEST);
+        memcpy(request.sender_mac, device->get_mac_address(), 6);
+        request.sender_address = source;
+        memset(request.target_mac, 0, 6);
+        request.target_address = target;
+
+        u8 broadcast[6];
+        memset(broadcast, 0xFF, 6);
+
+        device->send(destination ? destination : broadcast,
+                    static_cast<u16>(EthernetHeader::Type::ARP),
+                    reinterpret_cast<const u8*>(&request), sizeof(request));
+        __atomic_add_fetch(&requests_sent_, 1, __ATOMIC_RELAXED);
+    }
+
+    void ARPLayer::send_reply(EthernetDevice* device, u32 source, const ARPHeader* request) {
+        ARPHeader reply;
+        reply.hardware_type = swap_endian_16(HARDWARE_ETHERNET);
+        reply.protocol_type = swap_endian_16(static_cast<u16>(EthernetHeader::Type::IPv4));
+        reply.hardware_length = 6;
+        reply.protocol_length = 4;
+        reply.operation = swap_endian_16(OPERATION_REPLY);
+        memcpy(reply.sender_mac, device->get_mac_address(), 6);
+        reply.sender_address = source;
+        memcpy(reply.target_mac, request->sender_mac, 6);
+        reply.target_address = request->sender_address;
+
+        device->send(request->sender_mac, static_cast<u16>(EthernetHeader::Type::ARP),
+                    reinterpret_cast<const u8*>(&reply), sizeof(reply));
+        __atomic_add_fetch(&replies_sent_, 1, __ATOMIC_RELAXED);
+    }
+
+    void ARPLayer::flush_pending(PendingFlush& flush) {
+        for (u32 i = 0; i < flush.count; i++) {
+            flush.device->send_buffer(flush.mac_address, flush.types[i], flush.packets[i]);
+        }
+        flush.count = 0;
+    }
+
+    bool ARPLayer::lookup(EthernetDevice* device, u32 address, u8* mac_address) {
+        RCU::ReadGuard guard;
+
+        Neighbor* neighbor = RCU::dereference(buckets_[bucket_index(address)]);
+        for (; neighbor; neighbor = RCU::dereference(neighbor->next)) {
+            if (neighbor->address != address || neighbor->device != device) {
+                continue;
+            }
+
+            u32 sequence;
+            NeighborState state;
+            do {
+                sequence = __atomic_load_n(&neighbor->sequence, __ATOMIC_ACQUIRE);
+                state = neighbor->state;
+                memcpy(mac_address, neighbor->mac_address, 6);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            } while ((sequence & 1) || __atomic_load_n(&neighbor->sequence, __ATOMIC_RELAXED) != sequence);
+
+            if (state != NeighborState::Reachable && state != NeighborState::Stale) {
+                break;
+            }
+
+            if (state == NeighborState::Stale && !neighbor->used) {
+                __atomic_store_n(&neighbor->used, true, __ATOMIC_RELAXED);
+            }
+
+            __atomic_add_fetch(&hits_, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        __atomic_add_fetch(&misses_, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    bool ARPLayer::output(EthernetDevice* device, u32 source, u32 next_hop,
+                          u16 ether_type, PacketBuffer* packet) {
+        if (!device || !packet) {
+            if (packet) {
+                packet->release();
+            }
+            return false;
+        }
+
+        poll_if_due();
+
+        u8 mac_address[6];
+        if (lookup(device, next_hop, mac_address)) {
+            return device->send_buffer(mac_address, ether_type, packet);
+        }
+
+        {
+            ScopedLock lock(lock_);
+
+            Neighbor* neighbor = find_locked(next_hop, device);
+            if (!neighbor || neighbor->state == NeighborState::Incomplete ||
+                neighbor->state == NeighborState::Failed) {
+                if (!neighbor) {
+                    neighbor = create_locked(next_hop, source, device);
+                    if (!neighbor) {
+                        dropped_++;
+                        packet->release();
+                        return false;
+                    }
+                } else if (neighbor->state == NeighborState::Failed) {
+                    neighbor->state = NeighborState::Incomplete;
+                    neighbor->probes = 0;
+                }
+
+                if (neighbor->pending_count == MAX_QUEUED_PACKETS) {
+                    neighbor->pending[0]->release();
+                    for (u32 i = 1; i < MAX_QUEUED_PACKETS; i++) {
+                        neighbor->pending[i - 1] = neighbor->pending[i];
+                        neighbor->pending_types[i - 1] = neighbor->pending_types[i];
+                    }
+                    neighbor->pending_count--;
+                    dropped_++;
+                }
+
+                neighbor->pending[neighbor->pending_count] = packet;
+                neighbor->pending_types[neighbor->pending_count] = ether_type;
+                neighbor->pending_count++;
+                queued_++;
+                
+                debug::Trace::point(debug::TraceComponent::Network,
+                                   "ARP: queued packet for 0x%08X, %u pending",
+                                   swap_endian_32(next_hop), neighbor->pending_count);
+
+                u64 now = task::TimerWheel::instance().now();
+                if (neighbor->probes == 0 ||
+                    (neighbor->probes < MAX_PROBES && now - neighbor->last_probe >= RETRANSMIT_MS)) {
+                    send_request(device, neighbor->source_address, next_hop, nullptr);
+                    neighbor->probes++;
+                    neighbor->last_probe = now;
+                }
+                return true;
+            }
+
+            memcpy(mac_address, neighbor->mac_address, 6);
+        }
+
+        return device->send_buffer(mac_address, ether_type, packet);
+    }
+
+    void ARPLayer::process_packet(PacketBuffer* packet) {
+        poll_if_due();
+
+        if (packet->length() < sizeof(ARPHeader)) {
+            return;
+        }
+
+        const ARPHeader* arp = reinterpret_cast<const ARPHeader*>(packet->data());
+        if (swap_endian_16(arp->hardware_type) != HARDWARE_ETHERNET ||
+            swap_endian_16(arp->protocol_type) != static_cast<u16>(EthernetHeader::Type::IPv4) ||
+            arp->hardware_length != 6 || arp->protocol_length != 4) {
+            return;
+        }
+
+        u16 operation = swap_endian_16(arp->operation);
+        u32 sender = arp->sender_address;
+        u32 target = arp->target_address;
+
+        Route route;
+        bool for_us = IPLayer::instance().lookup_route(IPAddress(target), &route) &&
+                      route.local && route.source == target;
+
+        PendingFlush flush;
+        flush.count = 0;
+
+        if (sender != 0) {
+            ScopedLock lock(lock_);
+
+            Neighbor* neighbor = find_locked(sender, for_us ? route.device : nullptr);
+            if (!neighbor && for_us) {
+                neighbor = create_locked(sender, target, route.device);
+            }
+
+            if (neighbor) {
+                update_locked(neighbor, arp->sender_mac, flush);
+            }
+        }
+
+        flush_pending(flush);
+
+        if (for_us && operation == OPERATION_REQUEST) {
+            send_reply(route.device, target, arp);
+        }
+    }
+
+    void ARPLayer::poll_tick(void* context) {
+        ARPLayer* arp = static_cast<ARPLayer*>(context);
+        __atomic_store_n(&arp->poll_due_, true, __ATOMIC_RELEASE);
+    }
+
+    void ARPLayer::arm_poll() {
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        if (!wheel.is_pending(&poll_timer_)) {
+            wheel.add_timer(&poll_timer_, wheel.ms_to_ticks(RETRANSMIT_MS));
+        }
+    }
+
+    void ARPLayer::poll_if_due() {
+        if (__atomic_exchange_n(&poll_due_, false, __ATOMIC_ACQ_REL)) {
+            poll();
+        }
+    }
+
+    void ARPLayer::poll() {
+        u64 now = task::TimerWheel::instance().now();
+        Vector<Neighbor*> retired;
+
+        {
+            ScopedLock lock(lock_);
+
+            for (usize i = 0; i < HASH_BUCKETS; i++) {
+                Neighbor* neighbor = buckets_[i];
+                while (neighbor) {
+                    Neighbor* next = neighbor->next;
+                    bool expired = false;
+
+                    switch (neighbor->state) {
+                        case NeighborState::Incomplete:
+                            if (now - neighbor->last_probe < RETRANSMIT_MS) {
+                                break;
+                            }
+                            if (neighbor->probes >= MAX_PROBES) {
+                                expired = true;
+                                break;
+                            }
+                            send_request(neighbor->device, neighbor->source_address,
+                                        neighbor->address, nullptr);
+                            neighbor->probes++;
+                            neighbor->last_probe = now;
+                            break;
+
+                        case NeighborState::Reachable:
+                            if (now - neighbor->confirmed >= REACHABLE_TIME_MS) {
+                                neighbor->state = NeighborState::Stale;
+                            }
+                            break;
+
+                        case NeighborState::Stale:
+                            if (neighbor->used) {
+                                if (now - neighbor->last_probe < RETRANSMIT_MS) {
+                                    break;
+                                }
+                                if (neighbor->probes >= MAX_PROBES) {
+                                    expired = true;
+                                    break;
+                                }
+                                send_request(neighbor->device, neighbor->source_address,
+                                            neighbor->address, neighbor->mac_address);
+                                neighbor->probes++;
+                                neighbor->last_probe = now;
+                            } else if (now - neighbor->confirmed >= STALE_TIMEOUT_MS) {
+                                expired = true;
+                            }
+                            break;
+
+                        case NeighborState::Failed:
+                            expired = true;
+                            break;
+                    }
+
+                    if (expired) {
+                        neighbor->state = NeighborState::Failed;
+                        drop_pending(neighbor);
+                        unlink_locked(neighbor);
+                        retired.push_back(neighbor);
+                    }
+
+                    neighbor = next;
+                }
+            }
+
+            if (neighbor_count_ > 0) {
+                arm_poll();
+            }
+        }
+
+        if (retired.empty()) {
+            return;
+        }
+
+        RCU::synchronize();
+        for (Neighbor* neighbor : retired) {
+            cache_.free(neighbor);
+        }
+    }
+
+    void ARPLayer::dump_neighbors() const {
+        ScopedLock lock(lock_);
+
+        static const char* state_names[] = { "INCOMPLETE", "REACHABLE", "STALE", "FAILED" };
+
+        debug::log(debug::LogLevel::Info, "ARP", "Neighbor Table: %llu entries", neighbor_count_);
+        for (usize i = 0; i < HASH_BUCKETS; i++) {
+            for (const Neighbor* neighbor = buckets_[i]; neighbor; neighbor = neighbor->next) {
+                const u8* address = reinterpret_cast<const u8*>(&neighbor->address);
+                debug::log(debug::LogLevel::Info, "ARP",
+                          "  %u.%u.%u.%u -> %02X:%02X:%02X:%02X:%02X:%02X %s, queued=%u",
+                          address[0], address[1], address[2], address[3],
+                          neighbor->mac_address[0], neighbor->mac_address[1],
+                          neighbor->mac_address[2], neighbor->mac_address[3],
+                          neighbor->mac_address[4], neighbor->mac_address[5],
+                          state_names[static_cast<u32>(neighbor->state)],
+                          neighbor->pending_count);
+            }
+        }
+
+        debug::log(debug::LogLevel::Info, "ARP", "  Hits: %llu, Misses: %llu", hits_, misses_);
+        debug::log(debug::LogLevel::Info, "ARP", "  Requests: %llu, Replies: %llu, Queued: %llu, Dropped: %llu",
+                  requests_sent_, replies_sent_, queued_, dropped_);
+    }
+
+    ARPLayer& ARPLayer::instance() {
+        static ARPLayer instance;
+        return instance;
+    }
+}
@@ -0,0 +1,220 @@
+#include <nanokoton/net/checksum.hpp>
+#include <nanokoton/arch/fpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+
+#include <immintrin.h>
+
+namespace nk::net {
+    ChecksumKernel Checksum::kernel_ = ChecksumKernel::Scalar;
+    Checksum::VectorKernel Checksum::vector_kernel_ = nullptr;
+
+    u64 Checksum::scalar_bytes_ = 0;
+    u64 Checksum::vector_bytes_ = 0;
+    u64 Checksum::incremental_updates_ = 0;
+
+    void Checksum::init() {
+        u32 eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+        u32 max_leaf = eax;
+
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+        if (edx & (1 << 26)) {
+            kernel_ = ChecksumKernel::SSE2;
+            vector_kernel_ = sum_sse2;
+        }
+
+        u64 ymm_state = 0x6;
+        if (max_leaf >= 7 && arch::FPU::save_mode() != arch::FPUSaveMode::FXSave &&
+            (arch::FPU::enabled_features() & ymm_state) == ymm_state) {
+            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+            if (ebx & (1 << 5)) {
+                kernel_ = ChecksumKernel::AVX2;
+                vector_kernel_ = sum_avx2;
+            }
+        }
+
+        static const char* kernel_names[] = { "scalar", "SSE2", "AVX2" };
+        debug::log(debug::LogLevel::Info, "NET",
+                  "Checksum kernel: 64-bit add-with-carry, %s above %llu bytes",
+                  kernel_names[static_cast<u32>(kernel_)], SIMD_THRESHOLD);
+    }
+
+    u64 Checksum::add_carry(u64 sum, u64 value) {
+        asm("addq %1, %0\n\t"
+            "adcq $0, %0"
+            : "+r"(sum) : "r"(value) : "cc");
+        return sum;
+    }
+
+    u64 Checksum::sum_scalar(const u8* data, usize length, u64 sum) {
+        while (length >= 32) {
+            asm("addq 0(%1), %0\n\t"
+                "adcq 8(%1), %0\n\t"
+                "adcq 16(%1), %0\n\t"
+                "adcq 24(%1), %0\n\t"
+                "adcq $0, %0"
+                : "+r"(sum) : "r"(data) : "cc", "memory");
+            data += 32;
+            length -= 32;
+        }
+
+        while (length >= 8) {
+            sum = add_carry(sum, *reinterpret_cast<const u64*>(data));
+            data += 8;
+            length -= 8;
+        }
+
+        if (length >= 4) {
+            sum = add_carry(sum, *reinterpret_cast<const u32*>(data));
+            data += 4;
+            length -= 4;
+        }
+
+        if (length >= 2) {
+            sum = add_carry(sum, *reinterpret_cast<const u16*>(data));
+            data += 2;
+            length -= 2;
+        }
+
+        if (length > 0) {
+            sum = add_carry(sum, *data);
+        }
+
+        return sum;
+    }
+
+    __attribute__((target("sse2")))
+    u64 Checksum::sum_sse2(const u8* data, usize length) {
+        const __m128i zero = _mm_setzero_si128();
+        u64 sum = 0;
+
+        while (length > 0) {
+            usize chunk = min(length, SIMD_FLUSH_BYTES);
+            __m128i low = zero;
+            __m128i high = zero;
+
+            for (usize offset = 0; offset < chunk; offset += SIMD_BLOCK) {
+                const __m128i* block = reinterpret_cast<const __m128i*>(data + offset);
+                for (usize i = 0; i < SIMD_BLOCK / sizeof(__m128i); i++) {
+                    __m128i words = _mm_loadu_si128(block + i);
+                    low = _mm_add_epi32(low, _mm_unpacklo_epi16(words, zero));
+                    high = _mm_add_epi32(high, _mm_unpackhi_epi16(words, zero));
+                }
+            }
+
+            alignas(16) u32 lanes[8];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), low);
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes + 4), high);
+            for (u32 lane : lanes) {
+                sum += lane;
+            }
+
+            data += chunk;
+            length -= chunk;
+        }
+
+        return sum;
+    }
+
+    __attribute__((target("avx2")))
+    u64 Checksum::sum_avx2(const u8* data, usize length) {
+        const __m256i zero = _mm256_setzero_si256();
+        u64 sum = 0;
+
+        while (length > 0) {
+            usize chunk = min(length, SIMD_FLUSH_BYTES);
+            __m256i low = zero;
+            __m256i high = zero;
+
+            for (usize offset = 0; offset < chunk; offset += SIMD_BLOCK) {
+                const __m256i* block = reinterpret_cast<const __m256i*>(data + offset);
+                for (usize i = 0; i < SIMD_BLOCK / sizeof(__m256i); i++) {
+                    __m256i words = _mm256_loadu_si256(block + i);
+                    low = _mm256_add_epi32(low, _mm256_unpacklo_epi16(words, zero));
+                    high = _mm256_add_epi32(high, _mm256_unpackhi_epi16(words, zero));
+                }
+            }
+
+            alignas(32) u32 lanes[16];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), low);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes + 8), high);
+            for (u32 lane : lanes) {
+                sum += lane;
+            }
+
+            data += chunk;
+            length -= chunk;
+        }
+
+        return sum;
+    }
+
+    u64 Checksum::partial(const void* data, usize length, u64 sum) {
+        const u8* bytes = static_cast<const u8*>(data);
+
+        if (length >= SIMD_THRESHOLD && vector_kernel_) {
+            usize bulk = length & ~(SIMD_BLOCK - 1);
+
+            {
+                arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                arch::FPU::begin_kernel_use();
+                sum = add_carry(sum, vector_kernel_(bytes, bulk));
+                arch::FPU::end_kernel_use();
+            }
+
+            __atomic_add_fetch(&vector_bytes_, bulk, __ATOMIC_RELAXED);
+            bytes += bulk;
+            length -= bulk;
+        }
+
+        __atomic_add_fetch(&scalar_bytes_, length, __ATOMIC_RELAXED);
+        return sum_scalar(bytes, length, sum);
+    }
+
+    u16 Checksum::fold(u64 sum) {
+        sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+        sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+
+        u32 folded = static_cast<u32>(sum);
+        folded = (folded & 0xFFFF) + (folded >> 16);
+        folded = (folded & 0xFFFF) + (folded >> 16);
+        return static_cast<u16>(folded);
+    }
+
+    u64 Checksum::pseudo_header(u32 source, u32 destination, u8 protocol, u16 length) {
+        u64 sum = static_cast<u64>(source & 0xFFFF) + (source >> 16);
+        sum += static_cast<u64>(destination & 0xFFFF) + (destination >> 16);
+        sum += static_cast<u64>(protocol) << 8;
+        sum += swap_endian_16(length);
+        return sum;
+    }
+
+    u16 Checksum::update16(u16 checksum, u16 old_value, u16 new_value) {
+        __atomic_add_fetch(&incremental_updates_, 1, __ATOMIC_RELAXED);
+
+        u64 sum = static_cast<u16>(~checksum);
+        sum += static_cast<u16>(~old_value);
+        sum += new_value;
+        return static_cast<u16>(~fold(sum));
+    }
+
+    u16 Checksum::update32(u16 checksum, u32 old_value, u32 new_value) {
+        __atomic_add_fetch(&incremental_updates_, 1, __ATOMIC_RELAXED);
+
+        u64 sum = static_cast<u16>(~checksum);
+        sum += static_cast<u16>(~old_value) + static_cast<u16>(~(old_value >> 16));
+        sum += (new_value & 0xFFFF) + (new_value >> 16);
+        return static_cast<u16>(~fold(sum));
+    }
+
+    void Checksum::dump_statistics() {
+        static const char* kernel_names[] = { "scalar", "SSE2", "AVX2" };
+        debug::log(debug::LogLevel::Info, "NET", "Checksum Statistics:");
+        debug::log(debug::LogLevel::Info, "NET", "  Kernel: %s", kernel_names[static_cast<u32>(kernel_)]);
+        debug::log(debug::LogLevel::Info, "NET", "  Scalar bytes: %llu, Vector bytes: %llu",
+                  scalar_bytes_, vector_bytes_);
+        debug::log(debug::LogLevel::Info, "NET", "  Incremental updates: %llu", incremental_updates_);
+    }
+}
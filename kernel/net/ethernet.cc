@@ -1,5 +1,6 @@
 #include <nanokoton/net/ethernet.hpp>
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
 #include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/mm/physical.hpp>
 #include <nanokoton/drivers/pci.hpp>
@@ -10,6 +11,16 @@
 #include <nanokoton/lib/algorithm.hpp>
 
 namespace nk::net {
+    mm::SlabCache EthernetDevice::buffer_cache_("packet-buffer", PACKET_BUFFER_SIZE, PACKET_BUFFER_SIZE);
+
+    u8* EthernetDevice::allocate_buffer(usize size) {
+        if (size <= PACKET_BUFFER_SIZE) {
+            return reinterpret_cast<u8*>(buffer_cache_.allocate());
+        }
+        return reinterpret_cast<u8*>(
+            mm::VirtualMemoryManager::instance().kmalloc_aligned(size, PACKET_BUFFER_SIZE));
+    }
+
     EthernetDevice::EthernetDevice(PCI::Device* pci_device)
         : pci_device_(pci_device),
           io_base_(nullptr),
@@ -26,7 +37,18 @@ namespace nk::net {
           rx_buffer_size_(2048),
           tx_buffer_size_(2048),
           rx_descriptor_count_(256),
-          tx_descriptor_count_(256) {
+          tx_descriptor_count_(256),
+          poll_scheduled_(false),
+          tx_reclaim_pending_(false),
+          interrupts_(0),
+          polls_(0),
+          polled_packets_(0),
+          budget_exhausted_(0),
+          tx_reclaimed_(0),
+          checksum_offload_(true),
+          rx_checksum_verified_(0),
+          rx_checksum_errors_(0),
+          tx_checksum_offloaded_(0) {
         
         memset(mac_address_, 0, sizeof(mac_address_));
     }
@@ -36,7 +58,9 @@ namespace nk::net {
         
         if (rx_buffers_) {
             for (u32 i = 0; i < rx_descriptor_count_; i++) {
-                if (rx_buffers_[i].data) {
+                if (rx_buffers_[i].packet) {
+                    rx_buffers_[i].packet->release();
+                } else if (rx_buffers_[i].data) {
                     mm::VirtualMemoryManager::instance().kfree(rx_buffers_[i].data);
                 }
             }
@@ -45,6 +69,9 @@ namespace nk::net {
         
         if (tx_buffers_) {
             for (u32 i = 0; i < tx_descriptor_count_; i++) {
+                if (tx_buffers_[i].packet) {
+                    tx_buffers_[i].packet->release();
+                }
                 if (tx_buffers_[i].data) {
                     mm::VirtualMemoryManager::instance().kfree(tx_buffers_[i].data);
                 }
@@ -175,14 +202,17 @@ namespace nk::net {
 
         set_promiscuous(false);
 
-        u32 rxcsum = read_register(0x0500);
-        rxcsum |= 0x00000001;
-        write_register(0x0500, rxcsum);
+        u32 rxcsum = read_register(0x5000);
+        rxcsum &= ~0x000000FFu;
+        rxcsum |= sizeof(EthernetHeader);
+        rxcsum |= 0x00000100;
+        rxcsum |= 0x00000200;
+        write_register(0x5000, rxcsum);
 
         interrupts_enabled_ = read_register(0x00D0);
-        interrupts_enabled_ |= 0x00000004;
-        interrupts_enabled_ |= 0x00000080;
-        interrupts_enabled_ |= 0x00000400;
+        interrupts_enabled_ |= INTERRUPT_LINK;
+        interrupts_enabled_ |= INTERRUPT_RX;
+        interrupts_enabled_ |= INTERRUPT_TX;
         write_register(0x00D0, interrupts_enabled_);
 
         return true;
@@ -210,34 +240,19 @@ namespace nk::net {
         tx_buffers_ = new Buffer[tx_descriptor_count_];
 
         for (u32 i = 0; i < rx_descriptor_count_; i++) {
-            rx_buffers_[i].data = reinterpret_cast<u8*>(
-                mm::VirtualMemoryManager::instance().kmalloc_aligned(rx_buffer_size_, 16));
+            rx_buffers_[i].data = nullptr;
+            rx_buffers_[i].packet = nullptr;
             
-            if (!rx_buffers_[i].data) {
+            if (!refill_rx_buffer(i)) {
                 debug::log(debug::LogLevel::Error, "ETH",
                           "Failed to allocate RX buffer %u", i);
                 return false;
             }
-
-            rx_buffers_[i].size = rx_buffer_size_;
-            rx_buffers_[i].physical = mm::VirtualMemoryManager::instance()
-                .get_physical_address(reinterpret_cast<virt_addr>(rx_buffers_[i].data))
-                .value_or(0);
-            
-            if (!rx_buffers_[i].physical) {
-                debug::log(debug::LogLevel::Error, "ETH",
-                          "Failed to get physical address for RX buffer %u", i);
-                return false;
-            }
-
-            rx_descriptors_[i].buffer_address = rx_buffers_[i].physical & 0xFFFFFFFF;
-            rx_descriptors_[i].buffer_address_high = rx_buffers_[i].physical >> 32;
-            rx_descriptors_[i].status = 0;
         }
 
         for (u32 i = 0; i < tx_descriptor_count_; i++) {
-            tx_buffers_[i].data = reinterpret_cast<u8*>(
-                mm::VirtualMemoryManager::instance().kmalloc_aligned(tx_buffer_size_, 16));
+            tx_buffers_[i].packet = nullptr;
+            tx_buffers_[i].data = allocate_buffer(tx_buffer_size_);
             
             if (!tx_buffers_[i].data) {
                 debug::log(debug::LogLevel::Error, "ETH",
@@ -355,13 +370,15 @@ namespace nk::net {
 
         ScopedLock lock(tx_lock_);
 
-        cleanup_tx_descriptors();
+        if (tx_index_ - tx_clean_index_ >= tx_descriptor_count_ - TX_CLEAN_BUDGET) {
+            cleanup_tx_descriptors(TX_CLEAN_BUDGET);
+        }
 
         u32 desc_index = tx_index_ % tx_descriptor_count_;
         TransmitDescriptor* desc = &tx_descriptors_[desc_index];
         Buffer* buffer = &tx_buffers_[desc_index];
 
-        if (desc->status & 0x01) {
+        if (tx_index_ - tx_clean_index_ >= tx_descriptor_count_) {
             debug::log(debug::LogLevel::Warning, "ETH",
                       "TX descriptor %u busy", desc_index);
             return false;
@@ -375,23 +392,248 @@ namespace nk::net {
         memcpy(buffer->data, &header, sizeof(EthernetHeader));
         memcpy(buffer->data + sizeof(EthernetHeader), data, size);
 
+        desc->buffer_address = buffer->physical & 0xFFFFFFFF;
+        desc->buffer_address_high = buffer->physical >> 32;
         desc->length = sizeof(EthernetHeader) + size;
         desc->cso = 0;
+        desc->css = 0;
         desc->cmd = 0x01 | 0x02 | 0x08 | 0x10;
         desc->status = 0;
 
         tx_index_++;
         write_register(0x3818, tx_index_);
 
-        debug::log(debug::LogLevel::Trace, "ETH",
-                  "Sent packet: dest=%02X:%02X:%02X:%02X:%02X:%02X, type=0x%04X, size=%llu",
-                  destination[0], destination[1], destination[2],
-                  destination[3], destination[4], destination[5],
-                  ether_type, size);
+        if (debug::Trace::enabled(debug::TraceComponent::Network)) {
+            u64 mac = 0;
+            for (usize i = 0; i < 6; i++) {
+                mac = (mac << 8) | destination[i];
+            }
+            debug::Trace::point(debug::TraceComponent::Network,
+                               "Sent packet: dest=%012llX, type=0x%04X, size=%llu",
+                               mac, ether_type, size);
+        }
+
+        return true;
+    }
+
+    bool EthernetDevice::send_buffer(const u8* destination, u16 ether_type, PacketBuffer* packet) {
+        if (!destination || !packet || packet->length() == 0) {
+            if (packet) {
+                packet->release();
+            }
+            return false;
+        }
+
+        if (packet->length() > 1500 || packet->headroom() < sizeof(EthernetHeader)) {
+            packet->finish_checksum();
+            bool sent = send(destination, ether_type, packet->data(), packet->length());
+            packet->release();
+            return sent;
+        }
+
+        EthernetHeader* header = reinterpret_cast<EthernetHeader*>(packet->push(sizeof(EthernetHeader)));
+        memcpy(header->destination, destination, 6);
+        memcpy(header->source, mac_address_, 6);
+        header->ether_type = swap_endian_16(ether_type);
+
+        u8 checksum_start = 0;
+        u8 checksum_offset = 0;
+        u8 command = 0x01 | 0x02 | 0x08 | 0x10;
+        if (packet->checksum_flags() & PacketBuffer::CHECKSUM_PARTIAL) {
+            usize start = packet->checksum_start() - packet->data();
+            usize offset = start + packet->checksum_offset();
+            if (checksum_offload_ && offset + sizeof(u16) <= 0xFF) {
+                checksum_start = static_cast<u8>(start);
+                checksum_offset = static_cast<u8>(offset);
+                command |= TX_CMD_IC;
+                __atomic_add_fetch(&tx_checksum_offloaded_, 1, __ATOMIC_RELAXED);
+            } else {
+                packet->finish_checksum();
+            }
+        }
+
+        phys_addr physical = packet->physical_address();
+        if (!physical) {
+            packet->release();
+            return false;
+        }
+
+        ScopedLock lock(tx_lock_);
+
+        if (tx_index_ - tx_clean_index_ >= tx_descriptor_count_ - TX_CLEAN_BUDGET) {
+            cleanup_tx_descriptors(TX_CLEAN_BUDGET);
+        }
+
+        u32 desc_index = tx_index_ % tx_descriptor_count_;
+        TransmitDescriptor* desc = &tx_descriptors_[desc_index];
+        Buffer* buffer = &tx_buffers_[desc_index];
+
+        if (tx_index_ - tx_clean_index_ >= tx_descriptor_count_) {
+            debug::log(debug::LogLevel::Warning, "ETH",
+                      "TX descriptor %u busy", desc_index);
+            packet->release();
+            return false;
+        }
+
+        if (buffer->packet) {
+            buffer->packet->release();
+        }
+        buffer->packet = packet;
+
+        desc->buffer_address = physical & 0xFFFFFFFF;
+        desc->buffer_address_high = physical >> 32;
+        desc->length = packet->length();
+        desc->cso = checksum_offset;
+        desc->css = checksum_start;
+        desc->cmd = command;
+        desc->status = 0;
+
+        tx_index_++;
+        write_register(0x3818, tx_index_);
+
+        return true;
+    }
+
+    bool EthernetDevice::refill_rx_buffer(u32 index) {
+        PacketBuffer* packet = PacketBuffer::allocate(rx_buffer_size_, 0);
+        if (!packet) {
+            return false;
+        }
 
+        phys_addr physical = packet->physical_address();
+        if (!physical) {
+            debug::log(debug::LogLevel::Error, "ETH",
+                      "Failed to get physical address for RX buffer %u", index);
+            packet->release();
+            return false;
+        }
+
+        Buffer& buffer = rx_buffers_[index];
+        buffer.packet = packet;
+        buffer.data = packet->data();
+        buffer.size = rx_buffer_size_;
+        buffer.physical = physical;
+
+        rx_descriptors_[index].buffer_address = physical & 0xFFFFFFFF;
+        rx_descriptors_[index].buffer_address_high = physical >> 32;
+        rx_descriptors_[index].status = 0;
         return true;
     }
 
+    PacketBuffer* EthernetDevice::receive_buffer() {
+        ScopedLock lock(rx_lock_);
+
+        u32 index = rx_index_ % rx_descriptor_count_;
+        if (!(rx_descriptors_[index].status & 0x01)) {
+            return nullptr;
+        }
+
+        PacketBuffer* packet = take_rx_packet(index);
+
+        rx_index_++;
+        write_register(0x2818, rx_index_);
+
+        return packet;
+    }
+
+    PacketBuffer* EthernetDevice::take_rx_packet(u32 index) {
+        ReceiveDescriptor* desc = &rx_descriptors_[index];
+        u16 packet_size = desc->length - 4;
+        Buffer* rx_buffer = &rx_buffers_[index];
+        PacketBuffer* packet = rx_buffer->packet;
+
+        u8 checksum_flags = 0;
+        if (!(desc->status & RX_STATUS_IXSM)) {
+            if ((desc->status & RX_STATUS_IPCS) && !(desc->errors & RX_ERROR_IPE)) {
+                checksum_flags |= PacketBuffer::CHECKSUM_IP_VERIFIED;
+            }
+            if ((desc->status & RX_STATUS_TCPCS) && !(desc->errors & RX_ERROR_TCPE)) {
+                checksum_flags |= PacketBuffer::CHECKSUM_L4_VERIFIED;
+            }
+            if (desc->errors & (RX_ERROR_IPE | RX_ERROR_TCPE)) {
+                rx_checksum_errors_++;
+            } else if (checksum_flags) {
+                rx_checksum_verified_++;
+            }
+        }
+
+        if (packet && refill_rx_buffer(index)) {
+            packet->trim(packet_size);
+        } else {
+            packet = PacketBuffer::allocate(packet_size, 0);
+            if (packet) {
+                memcpy(packet->data(), rx_buffer->data, packet_size);
+            }
+        }
+
+        if (packet) {
+            packet->set_checksum_flags(checksum_flags);
+        }
+
+        desc->status = 0;
+        update_rx_descriptor(index);
+
+        return packet;
+    }
+
+    usize EthernetDevice::poll_receive(PacketBuffer** packets, usize budget) {
+        ScopedLock lock(rx_lock_);
+
+        usize count = 0;
+        usize processed = 0;
+
+        while (processed < budget) {
+            u32 index = rx_index_ % rx_descriptor_count_;
+            if (!(rx_descriptors_[index].status & 0x01)) {
+                break;
+            }
+
+            PacketBuffer* packet = take_rx_packet(index);
+            if (packet) {
+                packets[count++] = packet;
+            }
+
+            rx_index_++;
+            processed++;
+        }
+
+        if (processed > 0) {
+            write_register(0x2818, rx_index_);
+        }
+
+        polls_++;
+        polled_packets_ += count;
+
+        if (processed == budget) {
+            budget_exhausted_++;
+            return count;
+        }
+
+        __atomic_store_n(&poll_scheduled_, false, __ATOMIC_RELEASE);
+        interrupts_enabled_ |= INTERRUPT_RX;
+        write_register(0x00D0, INTERRUPT_RX);
+
+        if (rx_descriptors_[rx_index_ % rx_descriptor_count_].status & 0x01) {
+            write_register(0x00D8, INTERRUPT_RX);
+            interrupts_enabled_ &= ~INTERRUPT_RX;
+            __atomic_store_n(&poll_scheduled_, true, __ATOMIC_RELEASE);
+        }
+
+        return count;
+    }
+
+    void EthernetDevice::reclaim_tx() {
+        if (!__atomic_exchange_n(&tx_reclaim_pending_, false, __ATOMIC_ACQ_REL)) {
+            return;
+        }
+
+        ScopedLock lock(tx_lock_);
+
+        if (cleanup_tx_descriptors(TX_CLEAN_BUDGET) == TX_CLEAN_BUDGET) {
+            __atomic_store_n(&tx_reclaim_pending_, true, __ATOMIC_RELEASE);
+        }
+    }
+
     bool EthernetDevice::receive(u8* buffer, usize* size, u64 timeout_ms) {
         if (!buffer || !size) {
             return false;
@@ -534,17 +776,24 @@ namespace nk::net {
 
     void EthernetDevice::handle_interrupt() {
         u32 interrupt_cause = read_register(0x00C0);
+        if (!interrupt_cause) {
+            return;
+        }
 
-        if (interrupt_cause & 0x00000004) {
+        __atomic_add_fetch(&interrupts_, 1, __ATOMIC_RELAXED);
+
+        if (interrupt_cause & INTERRUPT_LINK) {
             debug::log(debug::LogLevel::Debug, "ETH", "Link state changed");
         }
 
-        if (interrupt_cause & 0x00000080) {
-            debug::log(debug::LogLevel::Debug, "ETH", "RX interrupt");
+        if (interrupt_cause & INTERRUPT_RX) {
+            write_register(0x00D8, INTERRUPT_RX);
+            interrupts_enabled_ &= ~INTERRUPT_RX;
+            __atomic_store_n(&poll_scheduled_, true, __ATOMIC_RELEASE);
         }
 
-        if (interrupt_cause & 0x00000400) {
-            debug::log(debug::LogLevel::Debug, "ETH", "TX interrupt");
+        if (interrupt_cause & INTERRUPT_TX) {
+            __atomic_store_n(&tx_reclaim_pending_, true, __ATOMIC_RELEASE);
         }
 
         write_register(0x00C0, interrupt_cause);
@@ -585,6 +834,16 @@ namespace nk::net {
             debug::log(debug::LogLevel::Info, "ETH", "  RX errors: %llu", rx_errors);
             debug::log(debug::LogLevel::Info, "ETH", "  TX errors: %llu", tx_errors);
         }
+        
+        debug::log(debug::LogLevel::Info, "ETH", "  Interrupts: %llu, Polls: %llu (%llu over budget)",
+                  interrupts_, polls_, budget_exhausted_);
+        debug::log(debug::LogLevel::Info, "ETH", "  Polled packets: %llu (%.1f per poll)",
+                  polled_packets_, polls_ ? static_cast<double>(polled_packets_) / polls_ : 0.0);
+        debug::log(debug::LogLevel::Info, "ETH", "  TX descriptors reclaimed: %llu", tx_reclaimed_);
+        debug::log(debug::LogLevel::Info, "ETH", "  Checksum offload: %s, TX offloaded: %llu",
+                  checksum_offload_ ? "on" : "off", tx_checksum_offloaded_);
+        debug::log(debug::LogLevel::Info, "ETH", "  RX checksums verified: %llu, errors: %llu",
+                  rx_checksum_verified_, rx_checksum_errors_);
     }
 
     void EthernetDevice::update_rx_descriptor(u32 index) {
@@ -598,8 +857,10 @@ namespace nk::net {
         desc->status = 0;
     }
 
-    void EthernetDevice::cleanup_tx_descriptors() {
-        while (tx_clean_index_ != tx_index_) {
+    u32 EthernetDevice::cleanup_tx_descriptors(u32 budget) {
+        u32 reclaimed = 0;
+        
+        while (tx_clean_index_ != tx_index_ && reclaimed < budget) {
             u32 desc_index = tx_clean_index_ % tx_descriptor_count_;
             TransmitDescriptor* desc = &tx_descriptors_[desc_index];
             
@@ -607,9 +868,18 @@ namespace nk::net {
                 break;
             }
             
+            if (tx_buffers_[desc_index].packet) {
+                tx_buffers_[desc_index].packet->release();
+                tx_buffers_[desc_index].packet = nullptr;
+            }
+            
             update_tx_descriptor(desc_index);
             tx_clean_index_++;
+            reclaimed++;
         }
+        
+        tx_reclaimed_ += reclaimed;
+        return reclaimed;
     }
 
     u32 EthernetDevice::read_register(u32 offset) {
@@ -631,7 +901,11 @@ namespace nk::net {
         }
     }
 
-    EthernetManager::EthernetManager() {
+    EthernetManager::EthernetManager() : dispatched_(0), unhandled_(0) {
+        for (usize i = 0; i < HANDLER_SLOTS; i++) {
+            handlers_[i] = nullptr;
+        }
+        
         debug::log(debug::LogLevel::Info, "ETH", "Ethernet Manager created");
     }
 
@@ -642,6 +916,15 @@ namespace nk::net {
             delete device;
         }
         devices_.clear();
+        
+        ScopedLock callback_lock(callback_lock_);
+        for (usize i = 0; i < HANDLER_SLOTS; i++) {
+            while (handlers_[i]) {
+                CallbackEntry* entry = handlers_[i];
+                handlers_[i] = entry->next;
+                delete entry;
+            }
+        }
     }
 
     bool EthernetManager::init() {
@@ -710,15 +993,43 @@ namespace nk::net {
         return send(device_index, broadcast_addr, ether_type, data, size);
     }
 
+    void EthernetManager::add_handler(u16 ether_type, ReceiveCallback callback,
+                                      PacketCallback packet_callback, void* user_data) {
+        CallbackEntry* entry = new CallbackEntry;
+        entry->ether_type = ether_type;
+        entry->callback = callback;
+        entry->packet_callback = packet_callback;
+        entry->user_data = user_data;
+        entry->next = nullptr;
+        
+        CallbackEntry** link = &handlers_[handler_slot(ether_type)];
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = entry;
+    }
+
+    bool EthernetManager::remove_handler(u16 ether_type, ReceiveCallback callback,
+                                         PacketCallback packet_callback) {
+        CallbackEntry** link = &handlers_[handler_slot(ether_type)];
+        while (*link) {
+            CallbackEntry* entry = *link;
+            if (entry->ether_type == ether_type && entry->callback == callback &&
+                entry->packet_callback == packet_callback) {
+                *link = entry->next;
+                delete entry;
+                return true;
+            }
+            link = &entry->next;
+        }
+        
+        return false;
+    }
+
     bool EthernetManager::register_callback(u16 ether_type, ReceiveCallback callback, void* user_data) {
         ScopedLock lock(callback_lock_);
         
-        CallbackEntry entry;
-        entry.ether_type = ether_type;
-        entry.callback = callback;
-        entry.user_data = user_data;
-        
-        callbacks_.push_back(entry);
+        add_handler(ether_type, callback, nullptr, user_data);
         
         debug::log(debug::LogLevel::Info, "ETH",
                   "Registered callback for ethertype 0x%04X", ether_type);
@@ -729,49 +1040,95 @@ namespace nk::net {
     bool EthernetManager::unregister_callback(u16 ether_type, ReceiveCallback callback) {
         ScopedLock lock(callback_lock_);
         
-        for (usize i = 0; i < callbacks_.size(); i++) {
-            if (callbacks_[i].ether_type == ether_type && 
-                callbacks_[i].callback == callback) {
-                callbacks_.erase(i);
-                return true;
+        return remove_handler(ether_type, callback, nullptr);
+    }
+
+    bool EthernetManager::register_packet_callback(u16 ether_type, PacketCallback callback,
+                                                   void* user_data) {
+        ScopedLock lock(callback_lock_);
+        
+        add_handler(ether_type, nullptr, callback, user_data);
+        
+        debug::log(debug::LogLevel::Info, "ETH",
+                  "Registered packet callback for ethertype 0x%04X", ether_type);
+        
+        return true;
+    }
+
+    bool EthernetManager::unregister_packet_callback(u16 ether_type, PacketCallback callback) {
+        ScopedLock lock(callback_lock_);
+        
+        return remove_handler(ether_type, nullptr, callback);
+    }
+
+    void EthernetManager::deliver_packet(PacketBuffer* packet) {
+        if (packet->length() < sizeof(EthernetHeader)) {
+            packet->release();
+            return;
+        }
+        
+        EthernetHeader* header = reinterpret_cast<EthernetHeader*>(packet->pull(sizeof(EthernetHeader)));
+        u16 ether_type = swap_endian_16(header->ether_type);
+        bool handled = false;
+        
+        for (CallbackEntry* entry = handlers_[handler_slot(ether_type)]; entry; entry = entry->next) {
+            if (entry->ether_type != ether_type) {
+                continue;
+            }
+            
+            if (entry->packet_callback) {
+                entry->packet_callback(header->source, header->destination,
+                                      ether_type, packet, entry->user_data);
+            } else {
+                entry->callback(header->source, header->destination,
+                               ether_type, packet->data(), packet->length(),
+                               entry->user_data);
             }
+            handled = true;
         }
         
-        return false;
+        if (handled) {
+            dispatched_++;
+        } else {
+            unhandled_++;
+        }
+        
+        packet->release();
     }
 
     void EthernetManager::process_packets() {
-        ScopedLock lock(lock_);
+        PacketBuffer* batch[EthernetDevice::RX_POLL_BUDGET];
         
-        for (EthernetDevice* device : devices_) {
-            u8 buffer[2048];
-            usize size = sizeof(buffer);
+        for (usize i = 0; i < get_device_count(); i++) {
+            EthernetDevice* device = get_device(i);
+            if (!device || !device->poll_pending()) {
+                continue;
+            }
             
-            if (device->receive(buffer, &size, 0)) {
-                if (size < sizeof(EthernetHeader)) {
-                    continue;
-                }
-                
-                EthernetHeader* header = reinterpret_cast<EthernetHeader*>(buffer);
-                u16 ether_type = swap_endian_16(header->ether_type);
-                
-                ScopedLock callback_lock(callback_lock_);
-                for (const CallbackEntry& entry : callbacks_) {
-                    if (entry.ether_type == ether_type) {
-                        entry.callback(header->source, header->destination,
-                                      ether_type, buffer + sizeof(EthernetHeader),
-                                      size - sizeof(EthernetHeader), entry.user_data);
-                    }
-                }
+            usize count = device->poll_receive(batch, EthernetDevice::RX_POLL_BUDGET);
+            if (count == 0) {
+                continue;
+            }
+            
+            debug::Trace::point(debug::TraceComponent::Network,
+                               "Device %llu: RX poll delivered %llu packets", i, count);
+            
+            ScopedLock callback_lock(callback_lock_);
+            for (usize j = 0; j < count; j++) {
+                deliver_packet(batch[j]);
             }
         }
     }
 
     void EthernetManager::poll_devices() {
-        ScopedLock lock(lock_);
-        
-        for (EthernetDevice* device : devices_) {
+        for (usize i = 0; i < get_device_count(); i++) {
+            EthernetDevice* device = get_device(i);
+            if (!device) {
+                continue;
+            }
+            
             device->poll();
+            device->reclaim_tx();
         }
         
         process_packets();
@@ -791,6 +1148,16 @@ namespace nk::net {
         }
     }
 
+    void EthernetManager::dump_statistics() const {
+        debug::log(debug::LogLevel::Info, "ETH", "Ethernet Dispatch Statistics:");
+        debug::log(debug::LogLevel::Info, "ETH", "  Dispatched: %llu, Unhandled: %llu",
+                  dispatched_, unhandled_);
+        
+        for (usize i = 0; i < devices_.size(); i++) {
+            devices_[i]->dump_statistics();
+        }
+    }
+
     EthernetManager& EthernetManager::instance() {
         static EthernetManager instance;
         return instance;
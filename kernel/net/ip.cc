@@ -1,5 +1,7 @@
 #include <nanokoton/net/ip.hpp>
 #include <nanokoton/net/ethernet.hpp>
+#include <nanokoton/net/arp.hpp>
+#include <nanokoton/net/checksum.hpp>
 #include <nanokoton/core/debug.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/algorithm.hpp>
@@ -30,40 +32,37 @@ namespace nk::net {
         
         debug::log(debug::LogLevel::Info, "IP", "Initializing IP Layer");
         
+        Checksum::init();
+        ARPLayer::instance().init();
+        
         EthernetManager& eth_mgr = EthernetManager::instance();
-        eth_mgr.register_callback(static_cast<u16>(EthernetHeader::Type::IPv4),
-                                 [](const u8* source, const u8* destination,
-                                    u16 ether_type, const u8* data, usize size,
-                                    void* user_data) {
+        eth_mgr.register_packet_callback(static_cast<u16>(EthernetHeader::Type::IPv4),
+                                        [](const u8* source, const u8* destination,
+                                           u16 ether_type, PacketBuffer* packet,
+                                           void* user_data) {
             IPLayer* ip = static_cast<IPLayer*>(user_data);
-            ip->process_packet(source, destination, data, size);
+            ip->process_packet_buffer(source, destination, packet);
         }, this);
         
         debug::log(debug::LogLevel::Info, "IP", "IP Layer initialized");
         return true;
     }
 
-    u16 IPLayer::calculate_checksum(const u8* data, usize length) {
-        u32 sum = 0;
-        const u16* ptr = reinterpret_cast<const u16*>(data);
-        
-        while (length > 1) {
-            sum += *ptr++;
-            length -= 2;
-        }
-        
-        if (length > 0) {
-            sum += *reinterpret_cast<const u8*>(ptr);
-        }
-        
-        while (sum >> 16) {
-            sum = (sum & 0xFFFF) + (sum >> 16);
+    bool IPPacket::verify_checksum() const {
+        if (buffer && (buffer->checksum_flags() & PacketBuffer::CHECKSUM_L4_VERIFIED)) {
+            return true;
         }
         
-        return static_cast<u16>(~sum);
+        u64 sum = Checksum::pseudo_header(source.ipv4, destination.ipv4,
+                                          static_cast<u8>(protocol), payload_size());
+        return Checksum::compute(payload(), payload_size(), sum) == 0;
     }
 
-    bool IPLayer::validate_packet(const u8* buffer, usize size) {
+    u16 IPLayer::calculate_checksum(const u8* data, usize length) {
+        return Checksum::compute(data, length);
+    }
+
+    bool IPLayer::validate_packet(const u8* buffer, usize size, bool checksum_verified) {
         if (size < sizeof(IPv4Header)) {
             return false;
         }
@@ -83,12 +82,7 @@ namespace nk::net {
             return false;
         }
         
-        u16 checksum = header->checksum;
-        const_cast<IPv4Header*>(header)->checksum = 0;
-        u16 calculated = calculate_checksum(buffer, header_length);
-        const_cast<IPv4Header*>(header)->checksum = checksum;
-        
-        if (checksum != calculated) {
+        if (!checksum_verified && calculate_checksum(buffer, header_length) != 0) {
             return false;
         }
         
@@ -215,68 +209,190 @@ namespace nk::net {
         reassemble_packets();
     }
 
-    bool IPLayer::find_route(const IPAddress& destination, RouteEntry* route) {
+    void IPLayer::rebuild_routes() {
+        RouteTrie* trie = new RouteTrie();
+        if (!trie) {
+            debug::log(debug::LogLevel::Error, "IP", "Failed to allocate route trie");
+            return;
+        }
+        
+        for (const Interface& iface : interfaces_) {
+            if (!iface.is_up || iface.address.ipv4 == 0) {
+                continue;
+            }
+            
+            Route local;
+            local.network = iface.address.ipv4;
+            local.netmask = 0xFFFFFFFF;
+            local.gateway = 0;
+            local.source = iface.address.ipv4;
+            local.interface_index = iface.index;
+            local.metric = 0;
+            local.mtu = iface.mtu;
+            local.local = true;
+            local.device = iface.device;
+            
+            trie->insert(local);
+        }
+        
         for (const RouteEntry& entry : routing_table_) {
-            if (destination.is_ipv4 && entry.network.is_ipv4) {
-                u32 dest_ip = destination.ipv4;
-                u32 net_ip = entry.network.ipv4;
-                u32 mask = entry.netmask.ipv4;
-                
-                if ((dest_ip & mask) == (net_ip & mask)) {
-                    if (route) *route = entry;
-                    return true;
-                }
+            if (!entry.network.is_ipv4 || entry.interface_index >= interfaces_.size()) {
+                continue;
+            }
+            
+            const Interface& iface = interfaces_[entry.interface_index];
+            if (!iface.is_up) {
+                continue;
+            }
+            
+            Route route;
+            route.network = entry.network.ipv4 & entry.netmask.ipv4;
+            route.netmask = entry.netmask.ipv4;
+            route.gateway = entry.gateway.ipv4;
+            route.source = iface.address.ipv4;
+            route.interface_index = entry.interface_index;
+            route.metric = entry.metric;
+            route.mtu = iface.mtu;
+            route.local = false;
+            route.device = iface.device;
+            
+            if (!trie->insert(route)) {
+                debug::log(debug::LogLevel::Warning, "IP",
+                          "Route table full, dropped %u.%u.%u.%u/%u.%u.%u.%u",
+                          entry.network.ipv4_bytes[0], entry.network.ipv4_bytes[1],
+                          entry.network.ipv4_bytes[2], entry.network.ipv4_bytes[3],
+                          entry.netmask.ipv4_bytes[0], entry.netmask.ipv4_bytes[1],
+                          entry.netmask.ipv4_bytes[2], entry.netmask.ipv4_bytes[3]);
             }
         }
         
-        return false;
+        routes_.publish(trie);
+    }
+
+    bool IPLayer::lookup_route(const IPAddress& destination, Route* route) {
+        if (!destination.is_ipv4) {
+            return false;
+        }
+        
+        return routes_.lookup(destination.ipv4, route);
     }
 
     u32 IPLayer::find_interface_for_address(const IPAddress& address) {
-        for (usize i = 0; i < interfaces_.size(); i++) {
-            if (interfaces_[i].address == address) {
-                return i;
-            }
+        Route route;
+        if (lookup_route(address, &route) && route.local && route.source == address.ipv4) {
+            return route.interface_index;
         }
         return static_cast<u32>(-1);
     }
 
-    void IPLayer::send_packet_to_interface(u32 interface_index, const IPAddress& destination,
-                                          IPProtocol protocol, const u8* data, usize size) {
-        if (interface_index >= interfaces_.size()) {
-            return;
+    PacketBuffer* IPLayer::reserve_headroom(PacketBuffer* packet) {
+        if (packet->headroom() >= sizeof(IPv4Header) + sizeof(EthernetHeader)) {
+            return packet;
         }
         
-        Interface& iface = interfaces_[interface_index];
+        usize size = packet->length();
+        PacketBuffer* copy = PacketBuffer::allocate(size);
+        if (!copy) {
+            packet->release();
+            return nullptr;
+        }
+        
+        memcpy(copy->data(), packet->data(), size);
+        if (packet->checksum_flags() & PacketBuffer::CHECKSUM_PARTIAL) {
+            copy->set_checksum_partial(copy->data() + (packet->checksum_start() - packet->data()),
+                                      packet->checksum_offset());
+        }
+        
+        packet->release();
+        return copy;
+    }
+
+    bool IPLayer::resolve_link_address(const Route& route, const IPAddress& destination,
+                                      u8* mac_address, u32* next_hop) {
+        u32 address = destination.ipv4;
+        
+        if (address == IPAddress::broadcast().ipv4 ||
+            (route.gateway == 0 && route.netmask != 0xFFFFFFFF &&
+             (address | route.netmask) == 0xFFFFFFFF)) {
+            memset(mac_address, 0xFF, 6);
+            return true;
+        }
         
-        Vector<u8> packet(sizeof(IPv4Header) + size);
-        IPv4Header* header = reinterpret_cast<IPv4Header*>(packet.data());
+        if ((destination.ipv4_bytes[0] & 0xF0) == 0xE0) {
+            mac_address[0] = 0x01;
+            mac_address[1] = 0x00;
+            mac_address[2] = 0x5E;
+            mac_address[3] = destination.ipv4_bytes[1] & 0x7F;
+            mac_address[4] = destination.ipv4_bytes[2];
+            mac_address[5] = destination.ipv4_bytes[3];
+            return true;
+        }
         
-        header->version_ihl = (4 << 4) | 5;
-        header->dscp_ecn = 0;
-        header->total_length = swap_endian_16(sizeof(IPv4Header) + size);
-        header->identification = swap_endian_16(identification_counter_++);
-        header->flags_fragment_offset = 0;
-        header->time_to_live = 64;
-        header->protocol = static_cast<u8>(protocol);
-        header->checksum = 0;
-        header->source_address = iface.address.ipv4;
-        header->destination_address = destination.ipv4;
+        *next_hop = route.gateway ? route.gateway : address;
+        return ARPLayer::instance().lookup(route.device, *next_hop, mac_address);
+    }
+
+    usize IPLayer::send_batch_via(const Route& route, const IPAddress& destination,
+                                 IPProtocol protocol, PacketBuffer** packets, usize count) {
+        if (route.local) {
+            debug::log(debug::LogLevel::Warning, "IP",
+                      "Loopback delivery to %u.%u.%u.%u is not supported",
+                      destination.ipv4_bytes[0], destination.ipv4_bytes[1],
+                      destination.ipv4_bytes[2], destination.ipv4_bytes[3]);
+            for (usize i = 0; i < count; i++) {
+                packets[i]->release();
+            }
+            return 0;
+        }
         
-        header->checksum = calculate_checksum(packet.data(), sizeof(IPv4Header));
+        IPv4Header header_template;
+        header_template.version_ihl = (4 << 4) | 5;
+        header_template.dscp_ecn = 0;
+        header_template.total_length = 0;
+        header_template.identification = 0;
+        header_template.flags_fragment_offset = 0;
+        header_template.time_to_live = 64;
+        header_template.protocol = static_cast<u8>(protocol);
+        header_template.header_checksum = 0;
+        header_template.source_address = route.source;
+        header_template.destination_address = destination.ipv4;
+        header_template.header_checksum = calculate_checksum(
+            reinterpret_cast<const u8*>(&header_template), sizeof(IPv4Header));
         
-        memcpy(packet.data() + sizeof(IPv4Header), data, size);
+        u16 identification = __atomic_fetch_add(&identification_counter_, count, __ATOMIC_RELAXED);
         
         u8 destination_mac[6];
-        if (destination.ipv4 == IPAddress::broadcast().ipv4) {
-            memset(destination_mac, 0xFF, 6);
-        } else {
-            memset(destination_mac, 0, 6);
+        u32 next_hop = 0;
+        bool resolved = resolve_link_address(route, destination, destination_mac, &next_hop);
+        
+        usize sent = 0;
+        for (usize i = 0; i < count; i++) {
+            PacketBuffer* packet = reserve_headroom(packets[i]);
+            if (!packet) {
+                continue;
+            }
+            
+            u16 total_length = swap_endian_16(sizeof(IPv4Header) + packet->length());
+            u16 packet_id = swap_endian_16(static_cast<u16>(identification + i));
+            
+            IPv4Header* header = reinterpret_cast<IPv4Header*>(packet->push(sizeof(IPv4Header)));
+            *header = header_template;
+            header->total_length = total_length;
+            header->identification = packet_id;
+            header->header_checksum = Checksum::update16(
+                Checksum::update16(header_template.header_checksum, 0, total_length), 0, packet_id);
+            
+            bool ok = resolved
+                ? route.device->send_buffer(destination_mac,
+                                           static_cast<u16>(EthernetHeader::Type::IPv4), packet)
+                : ARPLayer::instance().output(route.device, route.source, next_hop,
+                                              static_cast<u16>(EthernetHeader::Type::IPv4), packet);
+            if (ok) {
+                sent++;
+            }
         }
         
-        iface.device->send(destination_mac, 
-                          static_cast<u16>(EthernetHeader::Type::IPv4),
-                          packet.data(), packet.size());
+        return sent;
     }
 
     bool IPLayer::add_interface(u32 device_index, const IPAddress& address,
@@ -320,6 +436,8 @@ namespace nk::net {
             routing_table_.push_back(default_route);
         }
         
+        rebuild_routes();
+        
         debug::log(debug::LogLevel::Info, "IP",
                   "Added interface %u: %u.%u.%u.%u/%u.%u.%u.%u, MAC: %02X:%02X:%02X:%02X:%02X:%02X",
                   iface.index,
@@ -342,14 +460,20 @@ namespace nk::net {
         }
         
         interfaces_.erase(interface_index);
+        for (usize i = interface_index; i < interfaces_.size(); i++) {
+            interfaces_[i].index = i;
+        }
         
         for (usize i = 0; i < routing_table_.size(); i++) {
             if (routing_table_[i].interface_index == interface_index) {
                 routing_table_.erase(i);
                 i--;
+            } else if (routing_table_[i].interface_index > interface_index) {
+                routing_table_[i].interface_index--;
             }
         }
         
+        rebuild_routes();
         return true;
     }
 
@@ -361,6 +485,7 @@ namespace nk::net {
         }
         
         interfaces_[interface_index].address = address;
+        rebuild_routes();
         return true;
     }
 
@@ -412,6 +537,7 @@ namespace nk::net {
         route.metric = metric;
         
         routing_table_.push_back(route);
+        rebuild_routes();
         return true;
     }
 
@@ -422,6 +548,7 @@ namespace nk::net {
             if (routing_table_[i].network == network && 
                 routing_table_[i].netmask == netmask) {
                 routing_table_.erase(i);
+                rebuild_routes();
                 return true;
             }
         }
@@ -431,24 +558,16 @@ namespace nk::net {
 
     bool IPLayer::send_packet(const IPAddress& destination, IPProtocol protocol,
                              const u8* data, usize size) {
-        ScopedLock lock(lock_);
-        
-        RouteEntry route;
-        if (!find_route(destination, &route)) {
-            debug::log(debug::LogLevel::Error, "IP",
-                      "No route to host: %u.%u.%u.%u",
-                      destination.ipv4_bytes[0], destination.ipv4_bytes[1],
-                      destination.ipv4_bytes[2], destination.ipv4_bytes[3]);
+        PacketBuffer* packet = PacketBuffer::allocate(size);
+        if (!packet) {
             return false;
         }
         
-        IPAddress next_hop = route.gateway;
-        if (next_hop.ipv4 == 0) {
-            next_hop = destination;
+        memcpy(packet->data(), data, size);
+        if (!send_buffer(destination, protocol, packet)) {
+            return false;
         }
         
-        send_packet_to_interface(route.interface_index, next_hop, protocol, data, size);
-        
         debug::log(debug::LogLevel::Debug, "IP",
                   "Sent packet: dest=%u.%u.%u.%u, protocol=%u, size=%llu",
                   destination.ipv4_bytes[0], destination.ipv4_bytes[1],
@@ -458,6 +577,45 @@ namespace nk::net {
         return true;
     }
 
+    bool IPLayer::send_buffer(const IPAddress& destination, IPProtocol protocol, PacketBuffer* packet) {
+        if (!packet) {
+            return false;
+        }
+        
+        Route route;
+        if (!lookup_route(destination, &route)) {
+            debug::log(debug::LogLevel::Error, "IP",
+                      "No route to host: %u.%u.%u.%u",
+                      destination.ipv4_bytes[0], destination.ipv4_bytes[1],
+                      destination.ipv4_bytes[2], destination.ipv4_bytes[3]);
+            packet->release();
+            return false;
+        }
+        
+        return send_batch_via(route, destination, protocol, &packet, 1) == 1;
+    }
+
+    usize IPLayer::send_buffers(const IPAddress& destination, IPProtocol protocol,
+                               PacketBuffer** packets, usize count) {
+        if (count == 0) {
+            return 0;
+        }
+        
+        Route route;
+        if (!lookup_route(destination, &route)) {
+            debug::log(debug::LogLevel::Error, "IP",
+                      "No route to host: %u.%u.%u.%u",
+                      destination.ipv4_bytes[0], destination.ipv4_bytes[1],
+                      destination.ipv4_bytes[2], destination.ipv4_bytes[3]);
+            for (usize i = 0; i < count; i++) {
+                packets[i]->release();
+            }
+            return 0;
+        }
+        
+        return send_batch_via(route, destination, protocol, packets, count);
+    }
+
     bool IPLayer::register_protocol_handler(IPProtocol protocol, PacketCallback callback,
                                            void* user_data) {
         ScopedLock lock(callback_lock_);
@@ -529,6 +687,47 @@ namespace nk::net {
         packet.fragment_offset = 0;
         packet.more_fragments = false;
         
+        dispatch_packet(packet);
+    }
+
+    void IPLayer::process_packet_buffer(const u8* source_mac, const u8* destination_mac,
+                                       PacketBuffer* buffer) {
+        bool checksum_verified = buffer->checksum_flags() & PacketBuffer::CHECKSUM_IP_VERIFIED;
+        if (!validate_packet(buffer->data(), buffer->length(), checksum_verified)) {
+            debug::log(debug::LogLevel::Warning, "IP", "Invalid IP packet");
+            return;
+        }
+        
+        const IPv4Header* header = reinterpret_cast<const IPv4Header*>(buffer->data());
+        u16 total_length = swap_endian_16(header->total_length);
+        
+        if (header->fragment_offset() > 0 || header->more_fragments()) {
+            process_fragment(header, buffer->data(), total_length);
+            return;
+        }
+        
+        usize data_offset = header->header_length();
+        
+        IPPacket packet;
+        packet.source.ipv4 = header->source_address;
+        packet.destination.ipv4 = header->destination_address;
+        packet.protocol = static_cast<IPProtocol>(header->protocol);
+        packet.identification = swap_endian_16(header->identification);
+        packet.time_to_live = header->time_to_live;
+        packet.buffer = buffer->slice(data_offset, total_length - data_offset);
+        packet.is_fragment = false;
+        packet.fragment_offset = 0;
+        packet.more_fragments = false;
+        
+        if (!packet.buffer) {
+            return;
+        }
+        
+        dispatch_packet(packet);
+        packet.buffer->release();
+    }
+
+    void IPLayer::dispatch_packet(const IPPacket& packet) {
         ScopedLock callback_lock(callback_lock_);
         for (const ProtocolHandler& handler : protocol_handlers_) {
             if (handler.protocol == packet.protocol) {
@@ -539,6 +738,7 @@ namespace nk::net {
 
     void IPLayer::poll() {
         cleanup_old_fragments();
+        ARPLayer::instance().poll();
     }
 
     void IPLayer::dump_interfaces() const {
@@ -587,6 +787,8 @@ namespace nk::net {
                       route.gateway.ipv4_bytes[2], route.gateway.ipv4_bytes[3],
                       route.interface_index, route.metric);
         }
+        
+        routes_.dump_statistics();
     }
 
     void IPLayer::dump_fragment_buffers() const {
@@ -0,0 +1,179 @@
+#include <nanokoton/net/packet.hpp>
+#include <nanokoton/net/checksum.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/mm/virtual.hpp>
+
+namespace nk::net {
+    mm::SlabCache PacketBuffer::cache_("packet-head", sizeof(PacketBuffer));
+    mm::SlabCache PacketBuffer::data_cache_("packet-data", BUFFER_SIZE, BUFFER_SIZE);
+    mm::SlabCache PacketBuffer::storage_cache_("packet-storage", sizeof(Storage));
+
+    u64 PacketBuffer::allocations_ = 0;
+    u64 PacketBuffer::slices_ = 0;
+    u64 PacketBuffer::frees_ = 0;
+
+    void* PacketBuffer::operator new(usize size) {
+        if (size != sizeof(PacketBuffer)) {
+            return mm::VirtualMemoryManager::instance().kmalloc(size);
+        }
+        return cache_.allocate();
+    }
+
+    void PacketBuffer::operator delete(void* ptr) {
+        mm::VirtualMemoryManager::instance().kfree(ptr);
+    }
+
+    PacketBuffer::PacketBuffer(Storage* storage, u8* data, usize length)
+        : storage_(storage),
+          data_(data),
+          length_(length),
+          references_(1),
+          checksum_flags_(0),
+          checksum_offset_(0),
+          checksum_start_(nullptr) {}
+
+    PacketBuffer::~PacketBuffer() {
+        release_storage(storage_);
+    }
+
+    void PacketBuffer::release_storage(Storage* storage) {
+        if (__atomic_sub_fetch(&storage->references, 1, __ATOMIC_ACQ_REL) != 0) {
+            return;
+        }
+
+        mm::VirtualMemoryManager::instance().kfree(storage->buffer);
+        storage_cache_.free(storage);
+        __atomic_add_fetch(&frees_, 1, __ATOMIC_RELAXED);
+    }
+
+    PacketBuffer* PacketBuffer::allocate(usize size, usize headroom) {
+        usize capacity = headroom + size;
+
+        Storage* storage = reinterpret_cast<Storage*>(storage_cache_.allocate());
+        if (!storage) {
+            return nullptr;
+        }
+
+        if (capacity <= BUFFER_SIZE) {
+            storage->buffer = reinterpret_cast<u8*>(data_cache_.allocate());
+            capacity = BUFFER_SIZE;
+        } else {
+            storage->buffer = reinterpret_cast<u8*>(
+                mm::VirtualMemoryManager::instance().kmalloc(capacity));
+        }
+
+        if (!storage->buffer) {
+            storage_cache_.free(storage);
+            return nullptr;
+        }
+
+        storage->capacity = capacity;
+        storage->references = 1;
+
+        PacketBuffer* packet = new PacketBuffer(storage, storage->buffer + headroom, size);
+        if (!packet) {
+            release_storage(storage);
+            return nullptr;
+        }
+
+        __atomic_add_fetch(&allocations_, 1, __ATOMIC_RELAXED);
+        return packet;
+    }
+
+    void PacketBuffer::release() {
+        if (__atomic_sub_fetch(&references_, 1, __ATOMIC_ACQ_REL) == 0) {
+            delete this;
+        }
+    }
+
+    PacketBuffer* PacketBuffer::slice(usize offset, usize length) {
+        if (offset > length_ || length > length_ - offset) {
+            return nullptr;
+        }
+
+        __atomic_add_fetch(&storage_->references, 1, __ATOMIC_RELAXED);
+
+        PacketBuffer* packet = new PacketBuffer(storage_, data_ + offset, length);
+        if (!packet) {
+            release_storage(storage_);
+            return nullptr;
+        }
+
+        packet->checksum_flags_ = checksum_flags_ & (CHECKSUM_IP_VERIFIED | CHECKSUM_L4_VERIFIED);
+
+        __atomic_add_fetch(&slices_, 1, __ATOMIC_RELAXED);
+        return packet;
+    }
+
+    u8* PacketBuffer::push(usize size) {
+        if (size > headroom()) {
+            return nullptr;
+        }
+
+        data_ -= size;
+        length_ += size;
+        return data_;
+    }
+
+    u8* PacketBuffer::pull(usize size) {
+        if (size > length_) {
+            return nullptr;
+        }
+
+        u8* header = data_;
+        data_ += size;
+        length_ -= size;
+        return header;
+    }
+
+    u8* PacketBuffer::put(usize size) {
+        if (size > tailroom()) {
+            return nullptr;
+        }
+
+        u8* tail = data_ + length_;
+        length_ += size;
+        return tail;
+    }
+
+    bool PacketBuffer::trim(usize length) {
+        if (length > length_) {
+            return false;
+        }
+
+        length_ = length;
+        return true;
+    }
+
+    void PacketBuffer::set_checksum_partial(u8* start, u16 offset) {
+        checksum_start_ = start;
+        checksum_offset_ = offset;
+        checksum_flags_ |= CHECKSUM_PARTIAL;
+    }
+
+    void PacketBuffer::finish_checksum() {
+        if (!(checksum_flags_ & CHECKSUM_PARTIAL)) {
+            return;
+        }
+
+        usize length = data_ + length_ - checksum_start_;
+        u16* field = reinterpret_cast<u16*>(checksum_start_ + checksum_offset_);
+        u16 checksum = Checksum::compute(checksum_start_, length);
+        *field = checksum ? checksum : 0xFFFF;
+        checksum_flags_ &= ~CHECKSUM_PARTIAL;
+    }
+
+    phys_addr PacketBuffer::physical_address() const {
+        return mm::VirtualMemoryManager::instance()
+            .get_physical_address(reinterpret_cast<virt_addr>(data_))
+            .value_or(0);
+    }
+
+    void PacketBuffer::dump_statistics() {
+        debug::log(debug::LogLevel::Info, "NET", "Packet Buffer Statistics:");
+        debug::log(debug::LogLevel::Info, "NET", "  Allocations: %llu, Slices: %llu, Freed: %llu",
+                  allocations_, slices_, frees_);
+        debug::log(debug::LogLevel::Info, "NET", "  Live heads: %llu, Live data buffers: %llu",
+                  cache_.active_objects(), data_cache_.active_objects());
+    }
+}
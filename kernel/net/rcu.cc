@@ -0,0 +1,24 @@
+#include <nanokoton/net/rcu.hpp>
+#include <nanokoton/arch/cpu.hpp>
+
+namespace nk::net {
+    RCU::ReaderState RCU::readers_[arch::MAX_CPUS];
+    u64 RCU::synchronizations_ = 0;
+
+    void RCU::synchronize() {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        for (u32 cpu = 0; cpu < arch::SMP::cpu_count(); cpu++) {
+            u64 sequence = __atomic_load_n(&readers_[cpu].sequence, __ATOMIC_ACQUIRE);
+            if (!(sequence & 1)) {
+                continue;
+            }
+
+            while (__atomic_load_n(&readers_[cpu].sequence, __ATOMIC_ACQUIRE) == sequence) {
+                arch::CPU::pause();
+            }
+        }
+
+        __atomic_add_fetch(&synchronizations_, 1, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,221 @@
+#include <nanokoton/net/route.hpp>
+#include <nanokoton/net/rcu.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+
+namespace nk::net {
+    mm::SlabCache RouteTrie::cache_("route-node", sizeof(RouteTrie::Node));
+
+    RouteTrie::RouteTrie() : root_(nullptr), node_count_(0), route_count_(0) {}
+
+    RouteTrie::~RouteTrie() {
+        destroy(root_);
+    }
+
+    u8 RouteTrie::common_length(u32 a, u32 b, u8 limit) {
+        u32 difference = a ^ b;
+        u8 common = difference ? __builtin_clz(difference) : 32;
+        return min(common, limit);
+    }
+
+    RouteTrie::Node* RouteTrie::create_node(u32 prefix, u8 length) {
+        Node* node = static_cast<Node*>(cache_.allocate());
+        if (!node) {
+            return nullptr;
+        }
+
+        node->prefix = prefix;
+        node->length = length;
+        node->has_route = false;
+        node->children[0] = nullptr;
+        node->children[1] = nullptr;
+
+        node_count_++;
+        return node;
+    }
+
+    void RouteTrie::destroy(Node* node) {
+        if (!node) {
+            return;
+        }
+
+        destroy(node->children[0]);
+        destroy(node->children[1]);
+        cache_.free(node);
+    }
+
+    bool RouteTrie::insert(const Route& route) {
+        u32 mask = swap_endian_32(route.netmask);
+        u8 length = __builtin_popcount(mask);
+        u32 prefix = swap_endian_32(route.network) & prefix_mask(length);
+
+        Node** link = &root_;
+        while (true) {
+            Node* node = *link;
+
+            if (!node) {
+                node = create_node(prefix, length);
+                if (!node) {
+                    return false;
+                }
+
+                node->has_route = true;
+                node->route = route;
+                route_count_++;
+                *link = node;
+                return true;
+            }
+
+            u8 common = common_length(prefix, node->prefix, min(length, node->length));
+
+            if (common < node->length) {
+                Node* split = create_node(prefix & prefix_mask(common), common);
+                if (!split) {
+                    return false;
+                }
+
+                split->children[bit_at(node->prefix, common)] = node;
+                *link = split;
+
+                if (common == length) {
+                    split->has_route = true;
+                    split->route = route;
+                    route_count_++;
+                    return true;
+                }
+
+                link = &split->children[bit_at(prefix, common)];
+                continue;
+            }
+
+            if (length == node->length) {
+                if (!node->has_route) {
+                    node->has_route = true;
+                    node->route = route;
+                    route_count_++;
+                } else if (route.metric < node->route.metric) {
+                    node->route = route;
+                }
+                return true;
+            }
+
+            link = &node->children[bit_at(prefix, node->length)];
+        }
+    }
+
+    const Route* RouteTrie::lookup(u32 destination) const {
+        u32 address = swap_endian_32(destination);
+        const Route* best = nullptr;
+
+        const Node* node = root_;
+        while (node) {
+            if ((address & prefix_mask(node->length)) != node->prefix) {
+                break;
+            }
+
+            if (node->has_route) {
+                best = &node->route;
+            }
+
+            if (node->length == 32) {
+                break;
+            }
+
+            node = node->children[bit_at(address, node->length)];
+        }
+
+        return best;
+    }
+
+    RouteCache::RouteCache() : generation_(1), hits_(0), misses_(0) {
+        for (Slot& slot : slots_) {
+            slot.sequence = 0;
+            slot.generation = 0;
+            slot.destination = 0;
+        }
+    }
+
+    bool RouteCache::lookup(u32 destination, u32 generation, Route* route) {
+        Slot& slot = slots_[slot_index(destination)];
+
+        u32 sequence = __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+        bool match = !(sequence & 1) &&
+                     __atomic_load_n(&slot.generation, __ATOMIC_RELAXED) == generation &&
+                     __atomic_load_n(&slot.destination, __ATOMIC_RELAXED) == destination;
+        if (match) {
+            *route = slot.route;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (!match || __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED) != sequence) {
+            __atomic_add_fetch(&misses_, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+
+        __atomic_add_fetch(&hits_, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void RouteCache::insert(u32 destination, u32 generation, const Route& route) {
+        Slot& slot = slots_[slot_index(destination)];
+
+        u32 sequence = __atomic_load_n(&slot.sequence, __ATOMIC_RELAXED);
+        if ((sequence & 1) ||
+            !__atomic_compare_exchange_n(&slot.sequence, &sequence, sequence + 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        __atomic_store_n(&slot.generation, generation, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot.destination, destination, __ATOMIC_RELAXED);
+        slot.route = route;
+
+        __atomic_store_n(&slot.sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+
+    RouteTable::RouteTable() : trie_(nullptr), publications_(0) {}
+
+    RouteTable::~RouteTable() {
+        delete trie_;
+    }
+
+    void RouteTable::publish(RouteTrie* trie) {
+        RouteTrie* old = trie_;
+
+        RCU::assign(trie_, trie);
+        cache_.invalidate();
+        RCU::synchronize();
+
+        delete old;
+        publications_++;
+    }
+
+    bool RouteTable::lookup(u32 destination, Route* route) {
+        u32 generation = cache_.generation();
+        if (cache_.lookup(destination, generation, route)) {
+            return true;
+        }
+
+        RCU::ReadGuard guard;
+
+        RouteTrie* trie = RCU::dereference(trie_);
+        const Route* match = trie ? trie->lookup(destination) : nullptr;
+        if (!match) {
+            return false;
+        }
+
+        *route = *match;
+        cache_.insert(destination, generation, *route);
+        return true;
+    }
+
+    void RouteTable::dump_statistics() const {
+        const RouteTrie* trie = trie_;
+
+        debug::log(debug::LogLevel::Info, "IP", "Route Table Statistics:");
+        debug::log(debug::LogLevel::Info, "IP", "  Trie: %llu routes in %llu nodes, %llu publications",
+                  trie ? trie->route_count() : 0, trie ? trie->node_count() : 0, publications_);
+        debug::log(debug::LogLevel::Info, "IP", "  Cache: generation %u, hits %llu, misses %llu",
+                  cache_.generation(), cache_.hits(), cache_.misses());
+    }
+}
@@ -1,11 +1,83 @@
 #include <nanokoton/net/tcp.hpp>
 #include <nanokoton/net/ip.hpp>
+#include <nanokoton/net/checksum.hpp>
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/algorithm.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/task/timer.hpp>
+#include <nanokoton/task/scheduler.hpp>
 
 namespace nk::net {
+    mm::SlabCache TCPSocket::cache_("tcp-socket", sizeof(TCPSocket));
+
+    void* TCPSocket::operator new(usize size) {
+        if (size != sizeof(TCPSocket)) {
+            return mm::VirtualMemoryManager::instance().kmalloc(size);
+        }
+        return cache_.allocate();
+    }
+
+    void TCPSocket::operator delete(void* ptr) {
+        mm::VirtualMemoryManager::instance().kfree(ptr);
+    }
+
+    StreamBuffer::StreamBuffer(u32 capacity)
+        : data_(reinterpret_cast<u8*>(mm::VirtualMemoryManager::instance().kmalloc(capacity))),
+          capacity_(0),
+          head_(0),
+          tail_(0) {
+        if (data_) {
+            capacity_ = capacity;
+        }
+    }
+
+    StreamBuffer::~StreamBuffer() {
+        if (data_) {
+            mm::VirtualMemoryManager::instance().kfree(data_);
+        }
+    }
+
+    u32 StreamBuffer::write(const u8* data, u32 length) {
+        length = min(length, free_space());
+        if (length == 0) {
+            return 0;
+        }
+        
+        u32 offset = tail_ & (capacity_ - 1);
+        u32 first = min(length, capacity_ - offset);
+        memcpy(data_ + offset, data, first);
+        memcpy(data_, data + first, length - first);
+        
+        tail_ += length;
+        return length;
+    }
+
+    u32 StreamBuffer::peek(u32 offset, u8* buffer, u32 length) const {
+        if (offset >= size()) {
+            return 0;
+        }
+        
+        length = min(length, size() - offset);
+        u32 position = (head_ + offset) & (capacity_ - 1);
+        u32 first = min(length, capacity_ - position);
+        memcpy(buffer, data_ + position, first);
+        memcpy(buffer + first, data_, length - first);
+        
+        return length;
+    }
+
+    u32 StreamBuffer::read(u8* buffer, u32 length) {
+        u32 copied = peek(0, buffer, length);
+        head_ += copied;
+        return copied;
+    }
+
+    void StreamBuffer::consume(u32 length) {
+        head_ += min(length, size());
+    }
+
     TCPSocket::TCPSocket()
         : local_port_(0),
           remote_port_(0),
@@ -15,12 +87,43 @@ namespace nk::net {
           send_unacknowledged_(0),
           receive_next_expected_(0),
           send_window_(65535),
-          receive_window_(65535),
-          maximum_segment_size_(1460),
-          receive_queue_(8192),
+          receive_window_(0),
+          advertised_window_(0),
+          maximum_segment_size_(DEFAULT_MSS),
+          window_scaling_(false),
+          send_window_scale_(0),
+          receive_window_scale_(0),
+          sack_permitted_(false),
+          timestamps_(false),
+          timestamp_recent_(0),
+          last_ack_sent_(0),
+          send_queue_(SEND_BUFFER_SIZE),
+          receive_queue_(RECEIVE_BUFFER_SIZE),
+          last_out_of_order_(0),
+          nodelay_(false),
+          corked_(false),
+          fin_pending_(false),
           last_activity_(0),
-          retransmit_timeout_(1000000),
-          retransmit_count_(0) {
+          smoothed_rtt_(0),
+          rtt_variance_(0),
+          retransmit_timeout_(INITIAL_RTO_MS),
+          retransmit_count_(0),
+          duplicate_acks_(0),
+          rtt_active_(false),
+          rtt_sequence_(0),
+          rtt_start_(0),
+          retransmit_timer_(retransmit_timer_expired, this),
+          retransmit_due_(false),
+          pending_ack_segments_(0),
+          delayed_ack_timer_(delayed_ack_expired, this),
+          delayed_ack_due_(false),
+          segments_sent_(0),
+          segments_received_(0),
+          retransmits_(0),
+          fast_retransmits_(0),
+          delayed_acks_(0),
+          out_of_order_segments_(0) {
+        receive_window_ = receive_queue_.free_space();
         last_activity_ = arch::CPU::read_tsc();
     }
 
@@ -28,6 +131,10 @@ namespace nk::net {
         if (state_ != TCPState::Closed) {
             close();
         }
+        
+        task::TimerWheel::instance().cancel_timer(&retransmit_timer_);
+        task::TimerWheel::instance().cancel_timer(&delayed_ack_timer_);
+        release_out_of_order();
     }
 
     bool TCPSocket::bind(const IPAddress& address, u16 port) {
@@ -80,17 +187,18 @@ namespace nk::net {
         remote_port_ = port;
         
         send_sequence_ = arch::CPU::read_tsc() & 0xFFFFFFFF;
+        send_unacknowledged_ = send_sequence_;
         state_ = TCPState::SynSent;
         
+        window_scaling_ = true;
+        receive_window_scale_ = WINDOW_SCALE;
+        sack_permitted_ = true;
+        timestamps_ = true;
+        
         TCPSegment syn_segment;
-        syn_segment.sequence_number = send_sequence_;
-        syn_segment.acknowledgment_number = 0;
-        syn_segment.window_size = receive_window_;
+        init_segment(syn_segment, send_sequence_);
         syn_segment.syn = true;
         syn_segment.ack = false;
-        syn_segment.fin = false;
-        syn_segment.rst = false;
-        syn_segment.timestamp = arch::CPU::read_tsc();
         
         if (!send_segment(syn_segment)) {
             state_ = TCPState::Closed;
@@ -98,6 +206,7 @@ namespace nk::net {
         }
         
         send_sequence_++;
+        arm_retransmit_timer();
         
         return true;
     }
@@ -107,72 +216,41 @@ namespace nk::net {
     }
 
     usize TCPSocket::send(const u8* data, usize size) {
-        ScopedLock lock(send_lock_);
+        ScopedLock lock1(send_lock_);
+        ScopedLock lock2(receive_lock_);
         
-        if (state_ != TCPState::Established) {
+        if (state_ != TCPState::Established && state_ != TCPState::CloseWait) {
             return 0;
         }
         
-        if (size == 0) {
+        if (size == 0 || fin_pending_) {
             return 0;
         }
         
-        usize sent = 0;
-        while (sent < size) {
-            usize chunk_size = min(size - sent, static_cast<usize>(maximum_segment_size_));
-            
-            SendBuffer buffer;
-            buffer.sequence_start = send_sequence_;
-            buffer.sequence_end = send_sequence_ + chunk_size;
-            buffer.data.resize(chunk_size);
-            memcpy(buffer.data.data(), data + sent, chunk_size);
-            buffer.timestamp = arch::CPU::read_tsc();
-            buffer.acknowledged = false;
-            
-            TCPSegment segment;
-            segment.sequence_number = send_sequence_;
-            segment.acknowledgment_number = receive_next_expected_;
-            segment.window_size = receive_window_;
-            segment.syn = false;
-            segment.ack = true;
-            segment.fin = false;
-            segment.rst = false;
-            segment.data.resize(chunk_size);
-            memcpy(segment.data.data(), data + sent, chunk_size);
-            segment.timestamp = buffer.timestamp;
-            
-            if (!send_segment(segment)) {
-                break;
-            }
-            
-            send_buffers_.push_back(buffer);
-            send_sequence_ += chunk_size;
-            sent += chunk_size;
-            
-            if (send_sequence_ - send_unacknowledged_ > send_window_) {
-                break;
-            }
-        }
+        usize queued = send_queue_.write(data, min(size, static_cast<usize>(send_queue_.free_space())));
+        transmit_pending(false);
         
-        return sent;
+        return queued;
     }
 
     usize TCPSocket::receive(u8* buffer, usize size, u64 timeout_ms) {
         ScopedLock lock(receive_lock_);
         
-        if (state_ != TCPState::Established) {
+        if (state_ != TCPState::Established && state_ != TCPState::CloseWait) {
             return 0;
         }
         
-        u64 start_time = arch::CPU::read_tsc();
-        u64 timeout_cycles = timeout_ms * 1000000;
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        bool timed_out = false;
+        task::Timer timeout(task::TimerWheel::signal_flag, &timed_out);
+        if (timeout_ms != 0) {
+            wheel.add_timer(&timeout, wheel.ms_to_ticks(timeout_ms));
+        }
         
-        while (receive_queue_.size() == 0) {
-            if (timeout_ms != 0) {
-                u64 current_time = arch::CPU::read_tsc();
-                if (current_time - start_time > timeout_cycles) {
-                    return 0;
-                }
+        while (receive_queue_.empty()) {
+            if (__atomic_load_n(&timed_out, __ATOMIC_ACQUIRE) || state_ != TCPState::Established) {
+                wheel.cancel_timer(&timeout);
+                return 0;
             }
             
             lock.unlock();
@@ -180,30 +258,46 @@ namespace nk::net {
             lock.lock();
         }
         
-        usize to_read = min(size, receive_queue_.size());
-        for (usize i = 0; i < to_read; i++) {
-            buffer[i] = receive_queue_.pop();
-        }
+        wheel.cancel_timer(&timeout);
         
-        receive_window_ = receive_queue_.capacity() - receive_queue_.size();
+        usize to_read = receive_queue_.read(buffer, min(size, static_cast<usize>(receive_queue_.size())));
         
-        if (to_read > 0) {
-            TCPSegment ack_segment;
-            ack_segment.sequence_number = send_sequence_;
-            ack_segment.acknowledgment_number = receive_next_expected_;
-            ack_segment.window_size = receive_window_;
-            ack_segment.syn = false;
-            ack_segment.ack = true;
-            ack_segment.fin = false;
-            ack_segment.rst = false;
-            ack_segment.timestamp = arch::CPU::read_tsc();
-            
-            send_segment(ack_segment);
+        u32 window = receive_queue_.free_space();
+        u32 threshold = min(RECEIVE_BUFFER_SIZE / 2, 2 * maximum_segment_size_);
+        bool window_update = window > advertised_window_ && window - advertised_window_ >= threshold;
+        
+        lock.unlock();
+        
+        if (window_update) {
+            ScopedLock lock1(send_lock_);
+            ScopedLock lock2(receive_lock_);
+            update_receive_window();
+            send_ack();
         }
         
         return to_read;
     }
 
+    void TCPSocket::set_nodelay(bool enable) {
+        ScopedLock lock1(send_lock_);
+        ScopedLock lock2(receive_lock_);
+        
+        nodelay_ = enable;
+        if (enable) {
+            transmit_pending(false);
+        }
+    }
+
+    void TCPSocket::set_cork(bool enable) {
+        ScopedLock lock1(send_lock_);
+        ScopedLock lock2(receive_lock_);
+        
+        corked_ = enable;
+        if (!enable) {
+            transmit_pending(true);
+        }
+    }
+
     bool TCPSocket::close() {
         ScopedLock lock1(send_lock_);
         ScopedLock lock2(receive_lock_);
@@ -212,21 +306,11 @@ namespace nk::net {
             return true;
         }
         
-        if (state_ == TCPState::Established) {
-            state_ = TCPState::FinWait1;
-            
-            TCPSeggment fin_segment;
-            fin_segment.sequence_number = send_sequence_;
-            fin_segment.acknowledgment_number = receive_next_expected_;
-            fin_segment.window_size = receive_window_;
-            fin_segment.syn = false;
-            fin_segment.ack = true;
-            fin_segment.fin = true;
-            fin_segment.rst = false;
-            fin_segment.timestamp = arch::CPU::read_tsc();
-            
-            send_segment(fin_segment);
-            send_sequence_++;
+        if (state_ == TCPState::Established || state_ == TCPState::CloseWait) {
+            state_ = state_ == TCPState::Established ? TCPState::FinWait1 : TCPState::LastAck;
+            fin_pending_ = true;
+            corked_ = false;
+            transmit_pending(true);
         } else {
             state_ = TCPState::Closed;
         }
@@ -245,38 +329,44 @@ namespace nk::net {
             return true;
         }
         
-        state_ = TCPState::Closed;
+        reset_connection();
         
+        TCPLayer& tcp_layer = TCPLayer::instance();
+        tcp_layer.remove_socket(this);
+        
+        return true;
+    }
+
+    void TCPSocket::reset_connection() {
         TCPSegment rst_segment;
-        rst_segment.sequence_number = send_sequence_;
-        rst_segment.acknowledgment_number = receive_next_expected_;
-        rst_segment.window_size = 0;
-        rst_segment.syn = false;
+        init_segment(rst_segment, send_sequence_);
         rst_segment.ack = false;
-        rst_segment.fin = false;
         rst_segment.rst = true;
-        rst_segment.timestamp = arch::CPU::read_tsc();
         
         send_segment(rst_segment);
         
-        TCPLayer& tcp_layer = TCPLayer::instance();
-        tcp_layer.remove_socket(this);
-        
-        return true;
+        state_ = TCPState::Closed;
+        task::TimerWheel::instance().cancel_timer(&retransmit_timer_);
+        task::TimerWheel::instance().cancel_timer(&delayed_ack_timer_);
     }
 
     void TCPSocket::poll() {
         ScopedLock lock1(send_lock_);
         ScopedLock lock2(receive_lock_);
         
-        u64 current_time = arch::CPU::read_tsc();
-        
-        if (state_ == TCPState::Established) {
+        if (__atomic_exchange_n(&retransmit_due_, false, __ATOMIC_ACQ_REL) &&
+            send_unacknowledged_ != send_sequence_) {
             retransmit_pending_data();
+            arm_retransmit_timer();
         }
         
-        cleanup_acknowledged_data();
-        reorder_buffers();
+        if (__atomic_exchange_n(&delayed_ack_due_, false, __ATOMIC_ACQ_REL) &&
+            pending_ack_segments_ > 0) {
+            delayed_acks_++;
+            send_ack();
+        }
+        
+        transmit_pending(false);
     }
 
     void TCPSocket::dump_state() const {
@@ -290,128 +380,394 @@ namespace nk::net {
                   remote_address_.ipv4_bytes[2], remote_address_.ipv4_bytes[3],
                   remote_port_);
         debug::log(debug::LogLevel::Info, "TCP", "  State: %u", static_cast<u32>(state_));
-        debug::log(debug::LogLevel::Info, "TCP", "  Send Seq: %u, Recv Seq: %u",
-                  send_sequence_, receive_sequence_);
-        debug::log(debug::LogLevel::Info, "TCP", "  Send Window: %u, Recv Window: %u",
-                  send_window_, receive_window_);
-        debug::log(debug::LogLevel::Info, "TCP", "  Send Buffers: %llu, Recv Queue: %llu/%llu",
-                  send_buffers_.size(), receive_queue_.size(), receive_queue_.capacity());
+        debug::log(debug::LogLevel::Info, "TCP", "  Send Seq: %u, Unacked: %u, Recv Next: %u",
+                  send_sequence_, send_unacknowledged_, receive_next_expected_);
+        debug::log(debug::LogLevel::Info, "TCP", "  Send Window: %u (scale %u), Recv Window: %u (scale %u)",
+                  send_window_, send_window_scale_, receive_window_, receive_window_scale_);
+        debug::log(debug::LogLevel::Info, "TCP", "  MSS: %u, SACK: %s, Timestamps: %s, Nodelay: %s, Cork: %s",
+                  maximum_segment_size_, sack_permitted_ ? "yes" : "no", timestamps_ ? "yes" : "no",
+                  nodelay_ ? "yes" : "no", corked_ ? "yes" : "no");
+        debug::log(debug::LogLevel::Info, "TCP", "  Send Queue: %u/%u, Recv Queue: %u/%u, Out of order: %llu",
+                  send_queue_.size(), send_queue_.capacity(),
+                  receive_queue_.size(), receive_queue_.capacity(), out_of_order_.size());
+        debug::log(debug::LogLevel::Info, "TCP", "  SRTT: %u ms, RTTVAR: %u ms, RTO: %u ms",
+                  smoothed_rtt_, rtt_variance_, retransmit_timeout_);
+        debug::log(debug::LogLevel::Info, "TCP",
+                  "  Segments: sent=%llu received=%llu, Retransmits: %llu (fast %llu), "
+                  "Delayed ACKs: %llu, Out-of-order: %llu",
+                  segments_sent_, segments_received_, retransmits_, fast_retransmits_,
+                  delayed_acks_, out_of_order_segments_);
+    }
+
+    void TCPSocket::init_segment(TCPSegment& segment, u32 sequence_number) const {
+        segment.sequence_number = sequence_number;
+        segment.acknowledgment_number = receive_next_expected_;
+        segment.window_size = 0;
+        segment.syn = false;
+        segment.ack = true;
+        segment.fin = false;
+        segment.rst = false;
+        segment.timestamp = arch::CPU::read_tsc();
+    }
+
+    u32 TCPSocket::effective_mss() const {
+        u32 options = timestamps_ ? TIMESTAMP_OPTION_SIZE : 0;
+        if (sack_permitted_ && !out_of_order_.empty()) {
+            options += 4 + 8 * min(MAX_SACK_BLOCKS, (40 - options - 4) / 8);
+        }
+        return maximum_segment_size_ - options;
+    }
+
+    u32 TCPSocket::build_sack_blocks(TCPSackBlock* blocks, u32 max_blocks) const {
+        TCPSackBlock ranges[MAX_OUT_OF_ORDER];
+        u32 range_count = 0;
+        
+        for (const ReceiveBuffer& buffer : out_of_order_) {
+            if (range_count > 0 && !sequence_after(buffer.sequence_start, ranges[range_count - 1].end)) {
+                if (sequence_after(buffer.sequence_end, ranges[range_count - 1].end)) {
+                    ranges[range_count - 1].end = buffer.sequence_end;
+                }
+                continue;
+            }
+            ranges[range_count].start = buffer.sequence_start;
+            ranges[range_count].end = buffer.sequence_end;
+            range_count++;
+        }
+        
+        u32 count = 0;
+        u32 recent = range_count;
+        for (u32 i = 0; i < range_count && count < max_blocks; i++) {
+            if (!sequence_before(last_out_of_order_, ranges[i].start) &&
+                sequence_before(last_out_of_order_, ranges[i].end)) {
+                blocks[count++] = ranges[i];
+                recent = i;
+                break;
+            }
+        }
+        
+        for (u32 i = 0; i < range_count && count < max_blocks; i++) {
+            if (i != recent) {
+                blocks[count++] = ranges[i];
+            }
+        }
+        
+        return count;
+    }
+
+    usize TCPSocket::write_options(const TCPSegment& segment, u8* options) const {
+        usize length = 0;
+        
+        if (segment.syn) {
+            options[length++] = 2;
+            options[length++] = 4;
+            options[length++] = DEFAULT_MSS >> 8;
+            options[length++] = DEFAULT_MSS & 0xFF;
+            
+            if (window_scaling_) {
+                options[length++] = 1;
+                options[length++] = 3;
+                options[length++] = 3;
+                options[length++] = receive_window_scale_;
+            }
+            
+            if (sack_permitted_) {
+                options[length++] = 1;
+                options[length++] = 1;
+                options[length++] = 4;
+                options[length++] = 2;
+            }
+        }
+        
+        if (timestamps_) {
+            u32 value = swap_endian_32(static_cast<u32>(task::TimerWheel::instance().now()));
+            u32 echo = swap_endian_32(segment.ack ? timestamp_recent_ : 0);
+            
+            options[length++] = 1;
+            options[length++] = 1;
+            options[length++] = 8;
+            options[length++] = 10;
+            memcpy(options + length, &value, sizeof(u32));
+            memcpy(options + length + 4, &echo, sizeof(u32));
+            length += 8;
+        }
+        
+        if (!segment.syn && segment.ack && sack_permitted_ && !out_of_order_.empty()) {
+            TCPSackBlock blocks[MAX_SACK_BLOCKS];
+            u32 count = build_sack_blocks(blocks, min(MAX_SACK_BLOCKS, static_cast<u32>((40 - length - 4) / 8)));
+            
+            if (count > 0) {
+                options[length++] = 1;
+                options[length++] = 1;
+                options[length++] = 5;
+                options[length++] = 2 + 8 * count;
+                for (u32 i = 0; i < count; i++) {
+                    u32 start = swap_endian_32(blocks[i].start);
+                    u32 end = swap_endian_32(blocks[i].end);
+                    memcpy(options + length, &start, sizeof(u32));
+                    memcpy(options + length + 4, &end, sizeof(u32));
+                    length += 8;
+                }
+            }
+        }
+        
+        return length;
     }
 
     bool TCPSocket::send_segment(const TCPSegment& segment) {
-        Vector<u8> packet(sizeof(TCPHeader) + segment.data.size());
-        TCPHeader* header = reinterpret_cast<TCPHeader*>(packet.data());
+        usize payload_size = segment.payload_size();
+        PacketBuffer* packet = segment.buffer;
+        
+        if (packet) {
+            packet->retain();
+        } else {
+            packet = PacketBuffer::allocate(payload_size);
+            if (!packet) {
+                return false;
+            }
+            memcpy(packet->data(), segment.data.data(), payload_size);
+        }
+        
+        u8 options[40];
+        usize options_length = write_options(segment, options);
+        usize header_length = sizeof(TCPHeader) + options_length;
+        
+        TCPHeader* header = reinterpret_cast<TCPHeader*>(packet->push(header_length));
+        if (!header) {
+            packet->release();
+            return false;
+        }
+        memcpy(reinterpret_cast<u8*>(header) + sizeof(TCPHeader), options, options_length);
         
         header->source_port = swap_endian_16(local_port_);
         header->destination_port = swap_endian_16(remote_port_);
         header->sequence_number = swap_endian_32(segment.sequence_number);
         header->acknowledgment_number = swap_endian_32(segment.acknowledgment_number);
         
-        u8 data_offset = 5;
+        u8 data_offset = header_length / 4;
         u8 flags = 0;
         if (segment.syn) flags |= 0x02;
         if (segment.ack) flags |= 0x10;
         if (segment.fin) flags |= 0x01;
         if (segment.rst) flags |= 0x04;
+        if (segment.psh) flags |= 0x08;
+        
+        u32 window = segment.syn ? receive_window_ : receive_window_ >> receive_window_scale_;
+        window = min(window, static_cast<u32>(65535));
         
         header->data_offset_reserved = (data_offset << 4);
         header->flags = flags;
-        header->window_size = swap_endian_16(segment.window_size);
+        header->window_size = swap_endian_16(window);
         header->checksum = 0;
         header->urgent_pointer = 0;
         
-        memcpy(packet.data() + sizeof(TCPHeader), segment.data.data(), segment.data.size());
-        
-        TCPPseudoHeader pseudo;
-        pseudo.source_address = local_address_.ipv4;
-        pseudo.destination_address = remote_address_.ipv4;
-        pseudo.zero = 0;
-        pseudo.protocol = static_cast<u8>(IPProtocol::TCP);
-        pseudo.tcp_length = swap_endian_16(sizeof(TCPHeader) + segment.data.size());
+        u64 pseudo = Checksum::pseudo_header(local_address_.ipv4, remote_address_.ipv4,
+                                             static_cast<u8>(IPProtocol::TCP),
+                                             header_length + payload_size);
+        header->checksum = Checksum::fold(pseudo);
+        packet->set_checksum_partial(reinterpret_cast<u8*>(header), TCPHeader::CHECKSUM_OFFSET);
         
-        Vector<u8> checksum_data(sizeof(TCPPseudoHeader) + packet.size());
-        memcpy(checksum_data.data(), &pseudo, sizeof(TCPPseudoHeader));
-        memcpy(checksum_data.data() + sizeof(TCPPseudoHeader), packet.data(), packet.size());
+        if (segment.ack) {
+            last_ack_sent_ = segment.acknowledgment_number;
+            advertised_window_ = segment.syn ? window : window << receive_window_scale_;
+            pending_ack_segments_ = 0;
+            
+            task::TimerWheel& wheel = task::TimerWheel::instance();
+            if (wheel.is_pending(&delayed_ack_timer_)) {
+                wheel.cancel_timer(&delayed_ack_timer_);
+            }
+        }
         
-        header->checksum = IPLayer::instance().calculate_checksum(
-            checksum_data.data(), checksum_data.size());
+        segments_sent_++;
         
         IPLayer& ip_layer = IPLayer::instance();
-        return ip_layer.send_packet(remote_address_, IPProtocol::TCP,
-                                   packet.data(), packet.size());
+        return ip_layer.send_buffer(remote_address_, IPProtocol::TCP, packet);
     }
 
     bool TCPSocket::receive_segment(const TCPSegment& segment) {
-        if (!validate_sequence(segment.sequence_number, segment.data.size())) {
-            return false;
+        ScopedLock lock1(send_lock_);
+        ScopedLock lock2(receive_lock_);
+        
+        segments_received_++;
+        last_activity_ = arch::CPU::read_tsc();
+        
+        if (segment.rst) {
+            process_rst(segment);
+            return true;
         }
         
         if (segment.syn) {
-            process_syn(segment);
-        } else if (segment.ack) {
+            if (state_ == TCPState::Listen) {
+                process_syn(segment);
+            } else if (state_ == TCPState::SynSent && segment.ack) {
+                process_syn_ack(segment);
+            }
+            return true;
+        }
+        
+        u32 length = segment.payload_size();
+        if (!validate_sequence(segment.sequence_number, length)) {
+            if (length > 0) {
+                send_ack();
+            }
+            return false;
+        }
+        
+        if (timestamps_ && segment.has_timestamp) {
+            if (length > 0 && sequence_before(segment.timestamp_value, timestamp_recent_)) {
+                send_ack();
+                return false;
+            }
+            if (!sequence_after(segment.sequence_number, last_ack_sent_)) {
+                timestamp_recent_ = segment.timestamp_value;
+            }
+        }
+        
+        if (segment.ack) {
             process_ack(segment);
-        } else if (segment.fin) {
-            process_fin(segment);
-        } else if (segment.rst) {
-            process_rst(segment);
-        } else if (segment.data.size() > 0) {
+        }
+        
+        if (length > 0) {
             process_data(segment);
         }
         
-        last_activity_ = arch::CPU::read_tsc();
+        if (segment.fin) {
+            process_fin(segment);
+        }
+        
         return true;
     }
 
+    void TCPSocket::negotiate_options(const TCPSegment& segment) {
+        if (segment.mss != 0) {
+            maximum_segment_size_ = min(DEFAULT_MSS, static_cast<u32>(segment.mss));
+        }
+        
+        window_scaling_ = segment.has_window_scale;
+        send_window_scale_ = window_scaling_ ? min(segment.window_scale, MAX_WINDOW_SCALE) : 0;
+        receive_window_scale_ = window_scaling_ ? WINDOW_SCALE : 0;
+        
+        sack_permitted_ = segment.sack_permitted;
+        
+        timestamps_ = segment.has_timestamp;
+        if (timestamps_) {
+            timestamp_recent_ = segment.timestamp_value;
+        }
+        
+        send_window_ = segment.window_size;
+        update_receive_window();
+    }
+
     void TCPSocket::process_syn(const TCPSegment& segment) {
-        if (state_ == TCPState::Listen) {
-            state_ = TCPState::SynReceived;
-            remote_address_ = segment.source_address;
-            remote_port_ = segment.source_port;
-            receive_sequence_ = segment.sequence_number + 1;
-            receive_next_expected_ = receive_sequence_;
-            
-            TCPSegment syn_ack;
-            syn_ack.sequence_number = send_sequence_;
-            syn_ack.acknowledgment_number = receive_sequence_;
-            syn_ack.window_size = receive_window_;
-            syn_ack.syn = true;
-            syn_ack.ack = true;
-            syn_ack.fin = false;
-            syn_ack.rst = false;
-            syn_ack.timestamp = arch::CPU::read_tsc();
-            
-            send_segment(syn_ack);
-            send_sequence_++;
+        state_ = TCPState::SynReceived;
+        remote_address_ = segment.source_address;
+        remote_port_ = segment.source_port;
+        receive_sequence_ = segment.sequence_number;
+        receive_next_expected_ = receive_sequence_ + 1;
+        
+        negotiate_options(segment);
+        
+        send_sequence_ = arch::CPU::read_tsc() & 0xFFFFFFFF;
+        send_unacknowledged_ = send_sequence_;
+        
+        TCPSegment syn_ack;
+        init_segment(syn_ack, send_sequence_);
+        syn_ack.syn = true;
+        
+        send_segment(syn_ack);
+        send_sequence_++;
+        arm_retransmit_timer();
+    }
+
+    void TCPSocket::process_syn_ack(const TCPSegment& segment) {
+        if (segment.acknowledgment_number != send_sequence_) {
+            return;
         }
+        
+        receive_sequence_ = segment.sequence_number;
+        receive_next_expected_ = receive_sequence_ + 1;
+        
+        negotiate_options(segment);
+        
+        send_unacknowledged_ = segment.acknowledgment_number;
+        retransmit_count_ = 0;
+        state_ = TCPState::Established;
+        restart_retransmit_timer();
+        
+        send_ack();
     }
 
     void TCPSocket::process_ack(const TCPSegment& segment) {
-        if (segment.acknowledgment_number > send_unacknowledged_) {
-            acknowledge_data(segment.acknowledgment_number);
+        u32 ack = segment.acknowledgment_number;
+        
+        if (sequence_after(ack, send_sequence_)) {
+            send_ack();
+            return;
         }
         
-        if (segment.window_size != send_window_) {
-            update_window(segment.window_size);
+        if (state_ == TCPState::SynReceived) {
+            if (ack != send_sequence_) {
+                return;
+            }
+            state_ = TCPState::Established;
         }
+        
+        u32 window = static_cast<u32>(segment.window_size) << send_window_scale_;
+        record_sack_blocks(segment);
+        
+        if (sequence_after(ack, send_unacknowledged_)) {
+            u64 now = task::TimerWheel::instance().now();
+            if (timestamps_ && segment.has_timestamp && segment.timestamp_echo != 0) {
+                update_rtt(static_cast<u32>(now) - segment.timestamp_echo);
+            } else if (rtt_active_ && !sequence_before(ack, rtt_sequence_)) {
+                update_rtt(static_cast<u32>(now - rtt_start_));
+            }
+            if (rtt_active_ && !sequence_before(ack, rtt_sequence_)) {
+                rtt_active_ = false;
+            }
+            
+            acknowledge_data(ack);
+            duplicate_acks_ = 0;
+            retransmit_count_ = 0;
+            restart_retransmit_timer();
+            
+            if (ack == send_sequence_ && !fin_pending_) {
+                if (state_ == TCPState::FinWait1) {
+                    state_ = TCPState::FinWait2;
+                } else if (state_ == TCPState::Closing) {
+                    state_ = TCPState::TimeWait;
+                } else if (state_ == TCPState::LastAck) {
+                    state_ = TCPState::Closed;
+                }
+            }
+        } else if (ack == send_unacknowledged_ && segment.payload_size() == 0 &&
+                   window == send_window_ && send_unacknowledged_ != send_sequence_) {
+            if (++duplicate_acks_ == DUPLICATE_ACK_THRESHOLD) {
+                fast_retransmits_++;
+                rtt_active_ = false;
+                retransmit_holes(1);
+            }
+        }
+        
+        update_window(window);
+        transmit_pending(false);
     }
 
     void TCPSocket::process_fin(const TCPSegment& segment) {
+        if (segment.sequence_number + segment.payload_size() != receive_next_expected_) {
+            return;
+        }
+        
+        receive_next_expected_++;
+        
         if (state_ == TCPState::Established) {
             state_ = TCPState::CloseWait;
-            receive_sequence_++;
-            
-            TCPSegment ack;
-            ack.sequence_number = send_sequence_;
-            ack.acknowledgment_number = receive_sequence_;
-            ack.window_size = receive_window_;
-            ack.syn = false;
-            ack.ack = true;
-            ack.fin = false;
-            ack.rst = false;
-            ack.timestamp = arch::CPU::read_tsc();
-            
-            send_segment(ack);
+        } else if (state_ == TCPState::FinWait1) {
+            state_ = send_unacknowledged_ == send_sequence_ ? TCPState::TimeWait : TCPState::Closing;
+        } else if (state_ == TCPState::FinWait2) {
+            state_ = TCPState::TimeWait;
         }
+        
+        send_ack();
     }
 
     void TCPSocket::process_rst(const TCPSegment& segment) {
@@ -419,123 +775,380 @@ namespace nk::net {
     }
 
     void TCPSocket::process_data(const TCPSegment& segment) {
-        ReceiveBuffer buffer;
-        buffer.sequence_start = segment.sequence_number;
-        buffer.sequence_end = segment.sequence_number + segment.data.size();
-        buffer.data = segment.data;
-        buffer.consumed = false;
+        u32 sequence = segment.sequence_number;
+        u32 length = segment.payload_size();
+        u32 offset = 0;
+        
+        if (sequence_before(sequence, receive_next_expected_)) {
+            offset = receive_next_expected_ - sequence;
+            sequence = receive_next_expected_;
+            length -= offset;
+        }
         
-        receive_buffers_.push_back(buffer);
-        reorder_buffers();
+        if (sequence != receive_next_expected_) {
+            queue_out_of_order(segment, offset, sequence, length);
+            send_ack();
+            return;
+        }
         
-        receive_sequence_ = segment.sequence_number + segment.data.size();
+        u32 written = receive_queue_.write(segment.payload() + offset, length);
+        receive_next_expected_ += written;
         
-        TCPSegment ack;
-        ack.sequence_number = send_sequence_;
-        ack.acknowledgment_number = receive_sequence_;
-        ack.window_size = receive_window_;
-        ack.syn = false;
-        ack.ack = true;
-        ack.fin = false;
-        ack.rst = false;
-        ack.timestamp = arch::CPU::read_tsc();
+        bool filled_hole = !out_of_order_.empty();
+        drain_out_of_order();
+        update_receive_window();
         
-        send_segment(ack);
+        if (filled_hole || written < length) {
+            send_ack();
+        } else {
+            schedule_ack();
+        }
     }
 
-    void TCPSocket::retransmit_pending_data() {
-        u64 current_time = arch::CPU::read_tsc();
-        
-        for (SendBuffer& buffer : send_buffers_) {
-            if (!buffer.acknowledged && 
-                current_time - buffer.timestamp > retransmit_timeout_) {
-                
-                if (retransmit_count_ > 10) {
-                    abort();
-                    return;
+    void TCPSocket::queue_out_of_order(const TCPSegment& segment, u32 offset,
+                                       u32 sequence_number, u32 length) {
+        u32 end = sequence_number + length;
+        last_out_of_order_ = sequence_number;
+        
+        for (const ReceiveBuffer& buffer : out_of_order_) {
+            if (!sequence_before(sequence_number, buffer.sequence_start) &&
+                !sequence_after(end, buffer.sequence_end)) {
+                return;
+            }
+        }
+        
+        if (out_of_order_.size() >= MAX_OUT_OF_ORDER) {
+            return;
+        }
+        
+        ReceiveBuffer buffer;
+        buffer.sequence_start = sequence_number;
+        buffer.sequence_end = end;
+        buffer.packet = nullptr;
+        
+        if (segment.buffer) {
+            buffer.packet = segment.buffer->slice(offset, length);
+            if (!buffer.packet) {
+                return;
+            }
+        } else {
+            buffer.data.resize(length);
+            memcpy(buffer.data.data(), segment.data.data() + offset, length);
+        }
+        
+        out_of_order_.push_back(buffer);
+        out_of_order_segments_++;
+        
+        for (usize i = out_of_order_.size() - 1;
+             i > 0 && sequence_before(out_of_order_[i].sequence_start, out_of_order_[i - 1].sequence_start);
+             i--) {
+            ReceiveBuffer previous = out_of_order_[i - 1];
+            out_of_order_[i - 1] = out_of_order_[i];
+            out_of_order_[i] = previous;
+        }
+    }
+
+    void TCPSocket::drain_out_of_order() {
+        while (!out_of_order_.empty()) {
+            ReceiveBuffer& buffer = out_of_order_[0];
+            if (sequence_after(buffer.sequence_start, receive_next_expected_)) {
+                break;
+            }
+            
+            if (sequence_after(buffer.sequence_end, receive_next_expected_)) {
+                u32 skip = receive_next_expected_ - buffer.sequence_start;
+                u32 length = buffer.sequence_end - receive_next_expected_;
+                u32 written = receive_queue_.write(buffer.payload() + skip, length);
+                receive_next_expected_ += written;
+                if (written < length) {
+                    break;
                 }
-                
-                TCPSegment segment;
-                segment.sequence_number = buffer.sequence_start;
-                segment.acknowledgment_number = receive_next_expected_;
-                segment.window_size = receive_window_;
-                segment.syn = false;
-                segment.ack = true;
-                segment.fin = false;
-                segment.rst = false;
-                segment.data = buffer.data;
-                segment.timestamp = current_time;
-                
-                send_segment(segment);
-                buffer.timestamp = current_time;
-                retransmit_count_++;
             }
+            
+            if (buffer.packet) {
+                buffer.packet->release();
+            }
+            out_of_order_.erase(0);
         }
     }
 
-    void TCPSocket::acknowledge_data(u32 acknowledgment_number) {
-        for (SendBuffer& buffer : send_buffers_) {
-            if (buffer.sequence_end <= acknowledgment_number) {
-                buffer.acknowledged = true;
+    void TCPSocket::release_out_of_order() {
+        for (ReceiveBuffer& buffer : out_of_order_) {
+            if (buffer.packet) {
+                buffer.packet->release();
             }
         }
-        send_unacknowledged_ = acknowledgment_number;
+        out_of_order_.clear();
     }
 
-    void TCPSocket::update_window(u32 window_size) {
-        send_window_ = window_size;
+    void TCPSocket::update_receive_window() {
+        receive_window_ = receive_queue_.free_space();
     }
 
-    bool TCPSocket::validate_sequence(u32 sequence_number, u32 length) {
-        if (length == 0) {
-            return true;
+    void TCPSocket::send_ack() {
+        TCPSegment ack;
+        init_segment(ack, send_sequence_);
+        send_segment(ack);
+    }
+
+    void TCPSocket::schedule_ack() {
+        if (++pending_ack_segments_ >= ACK_EVERY_SEGMENTS) {
+            send_ack();
+            return;
         }
         
-        if (sequence_number >= receive_sequence_ && 
-            sequence_number + length <= receive_sequence_ + receive_window_) {
-            return true;
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        if (!wheel.is_pending(&delayed_ack_timer_)) {
+            wheel.add_timer(&delayed_ack_timer_, wheel.ms_to_ticks(DELAYED_ACK_MS));
         }
+    }
+
+    void TCPSocket::delayed_ack_expired(void* context) {
+        TCPSocket* socket = static_cast<TCPSocket*>(context);
+        __atomic_store_n(&socket->delayed_ack_due_, true, __ATOMIC_RELEASE);
+        TCPLayer::instance().timer_expired();
+    }
+
+    bool TCPSocket::send_data_segment(u32 sequence_number, u32 length) {
+        PacketBuffer* packet = PacketBuffer::allocate(length);
+        if (!packet) {
+            return false;
+        }
+        
+        send_queue_.peek(sequence_number - send_unacknowledged_, packet->data(), length);
         
-        return false;
+        TCPSegment segment;
+        init_segment(segment, sequence_number);
+        segment.buffer = packet;
+        segment.psh = sequence_number + length == send_unacknowledged_ + send_queue_.size();
+        
+        bool sent = send_segment(segment);
+        packet->release();
+        return sent;
     }
 
-    void TCPSocket::reorder_buffers() {
-        sort(receive_buffers_.begin(), receive_buffers_.end(),
-             [](const ReceiveBuffer& a, const ReceiveBuffer& b) {
-                 return a.sequence_start < b.sequence_start;
-             });
+    void TCPSocket::transmit_pending(bool force) {
+        if (state_ != TCPState::Established && state_ != TCPState::CloseWait &&
+            state_ != TCPState::FinWait1 && state_ != TCPState::LastAck) {
+            return;
+        }
         
-        for (const ReceiveBuffer& buffer : receive_buffers_) {
-            if (buffer.sequence_start == receive_next_expected_ && !buffer.consumed) {
-                for (u8 byte : buffer.data) {
-                    if (receive_queue_.full()) {
-                        break;
-                    }
-                    receive_queue_.push(byte);
+        u32 mss = effective_mss();
+        
+        while (true) {
+            u32 in_flight = send_sequence_ - send_unacknowledged_;
+            u32 queued = send_queue_.size();
+            u32 unsent = queued > in_flight ? queued - in_flight : 0;
+            if (unsent == 0) {
+                break;
+            }
+            
+            u32 window = send_window_ > in_flight ? send_window_ - in_flight : 0;
+            u32 length = min(min(unsent, mss), window);
+            if (length == 0) {
+                break;
+            }
+            
+            if (length < mss && !force) {
+                if (corked_ || (!nodelay_ && in_flight > 0)) {
+                    break;
                 }
-                receive_next_expected_ = buffer.sequence_end;
-                const_cast<ReceiveBuffer&>(buffer).consumed = true;
             }
+            
+            if (!send_data_segment(send_sequence_, length)) {
+                break;
+            }
+            
+            if (!rtt_active_ && !timestamps_) {
+                rtt_active_ = true;
+                rtt_sequence_ = send_sequence_ + length;
+                rtt_start_ = task::TimerWheel::instance().now();
+            }
+            
+            send_sequence_ += length;
         }
+        
+        if (fin_pending_ && send_unacknowledged_ + send_queue_.size() == send_sequence_) {
+            TCPSegment fin_segment;
+            init_segment(fin_segment, send_sequence_);
+            fin_segment.fin = true;
+            
+            if (send_segment(fin_segment)) {
+                send_sequence_++;
+                fin_pending_ = false;
+            }
+        }
+        
+        arm_retransmit_timer();
+    }
+
+    void TCPSocket::retransmit_timer_expired(void* context) {
+        TCPSocket* socket = static_cast<TCPSocket*>(context);
+        __atomic_store_n(&socket->retransmit_due_, true, __ATOMIC_RELEASE);
+        TCPLayer::instance().timer_expired();
+    }
+
+    void TCPSocket::arm_retransmit_timer() {
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        if (wheel.is_pending(&retransmit_timer_) || send_unacknowledged_ == send_sequence_) {
+            return;
+        }
+        
+        wheel.add_timer(&retransmit_timer_, wheel.ms_to_ticks(retransmit_timeout_));
     }
 
-    void TCPSocket::cleanup_acknowledged_data() {
-        for (usize i = 0; i < send_buffers_.size(); i++) {
-            if (send_buffers_[i].acknowledged) {
-                send_buffers_.erase(i);
-                i--;
+    void TCPSocket::restart_retransmit_timer() {
+        task::TimerWheel::instance().cancel_timer(&retransmit_timer_);
+        arm_retransmit_timer();
+    }
+
+    void TCPSocket::retransmit_pending_data() {
+        if (retransmit_count_ >= MAX_RETRANSMITS) {
+            reset_connection();
+            return;
+        }
+        
+        retransmit_count_++;
+        retransmit_timeout_ = min(retransmit_timeout_ * 2, MAX_RTO_MS);
+        rtt_active_ = false;
+        
+        if (state_ == TCPState::SynSent || state_ == TCPState::SynReceived) {
+            TCPSegment syn_segment;
+            init_segment(syn_segment, send_unacknowledged_);
+            syn_segment.syn = true;
+            syn_segment.ack = state_ == TCPState::SynReceived;
+            send_segment(syn_segment);
+            retransmits_++;
+            return;
+        }
+        
+        if (retransmit_holes(RETRANSMIT_BURST) == 0 && !fin_pending_ &&
+            send_unacknowledged_ + send_queue_.size() + 1 == send_sequence_) {
+            TCPSegment fin_segment;
+            init_segment(fin_segment, send_sequence_ - 1);
+            fin_segment.fin = true;
+            send_segment(fin_segment);
+            retransmits_++;
+        }
+    }
+
+    u32 TCPSocket::retransmit_holes(u32 limit) {
+        u32 sequence = send_unacknowledged_;
+        u32 end = send_unacknowledged_ + min(send_queue_.size(), send_sequence_ - send_unacknowledged_);
+        u32 mss = effective_mss();
+        u32 sent = 0;
+        usize block = 0;
+        
+        while (sent < limit && sequence_before(sequence, end)) {
+            while (block < sacked_.size() && !sequence_after(sacked_[block].end, sequence)) {
+                block++;
+            }
+            
+            if (block < sacked_.size() && !sequence_after(sacked_[block].start, sequence)) {
+                sequence = sacked_[block].end;
+                continue;
             }
+            
+            u32 hole_end = end;
+            if (block < sacked_.size() && sequence_before(sacked_[block].start, end)) {
+                hole_end = sacked_[block].start;
+            }
+            
+            u32 length = min(hole_end - sequence, mss);
+            if (!send_data_segment(sequence, length)) {
+                break;
+            }
+            
+            sequence += length;
+            sent++;
+            retransmits_++;
         }
         
-        for (usize i = 0; i < receive_buffers_.size(); i++) {
-            if (receive_buffers_[i].consumed) {
-                receive_buffers_.erase(i);
-                i--;
+        return sent;
+    }
+
+    void TCPSocket::acknowledge_data(u32 acknowledgment_number) {
+        u32 acknowledged = acknowledgment_number - send_unacknowledged_;
+        send_queue_.consume(min(acknowledged, send_queue_.size()));
+        send_unacknowledged_ = acknowledgment_number;
+        
+        usize kept = 0;
+        for (usize i = 0; i < sacked_.size(); i++) {
+            if (!sequence_after(sacked_[i].end, acknowledgment_number)) {
+                continue;
+            }
+            if (sequence_before(sacked_[i].start, acknowledgment_number)) {
+                sacked_[i].start = acknowledgment_number;
             }
+            sacked_[kept++] = sacked_[i];
         }
+        sacked_.resize(kept);
     }
 
-    TCPLayer::TCPLayer() {
+    void TCPSocket::record_sack_blocks(const TCPSegment& segment) {
+        if (!sack_permitted_ || segment.sack_count == 0) {
+            return;
+        }
+        
+        for (u32 i = 0; i < segment.sack_count; i++) {
+            TCPSackBlock block = segment.sack_blocks[i];
+            if (!sequence_after(block.end, block.start) ||
+                !sequence_after(block.end, send_unacknowledged_) ||
+                sequence_after(block.end, send_sequence_)) {
+                continue;
+            }
+            if (sequence_before(block.start, send_unacknowledged_)) {
+                block.start = send_unacknowledged_;
+            }
+            sacked_.push_back(block);
+        }
+        
+        sort(sacked_.begin(), sacked_.end(),
+             [](const TCPSackBlock& a, const TCPSackBlock& b) {
+                 return sequence_before(a.start, b.start);
+             });
+        
+        usize merged = 0;
+        for (usize i = 0; i < sacked_.size(); i++) {
+            if (merged > 0 && !sequence_after(sacked_[i].start, sacked_[merged - 1].end)) {
+                if (sequence_after(sacked_[i].end, sacked_[merged - 1].end)) {
+                    sacked_[merged - 1].end = sacked_[i].end;
+                }
+                continue;
+            }
+            sacked_[merged++] = sacked_[i];
+        }
+        sacked_.resize(merged);
+    }
+
+    void TCPSocket::update_rtt(u32 sample) {
+        if (smoothed_rtt_ == 0) {
+            smoothed_rtt_ = max(sample, 1u);
+            rtt_variance_ = sample / 2;
+        } else {
+            u32 delta = sample > smoothed_rtt_ ? sample - smoothed_rtt_ : smoothed_rtt_ - sample;
+            rtt_variance_ = (3 * rtt_variance_ + delta) / 4;
+            smoothed_rtt_ = (7 * smoothed_rtt_ + sample) / 8;
+        }
+        
+        u32 timeout = smoothed_rtt_ + max(1u, 4 * rtt_variance_);
+        retransmit_timeout_ = min(max(timeout, MIN_RTO_MS), MAX_RTO_MS);
+    }
+
+    void TCPSocket::update_window(u32 window_size) {
+        send_window_ = window_size;
+    }
+
+    bool TCPSocket::validate_sequence(u32 sequence_number, u32 length) {
+        if (length == 0) {
+            return true;
+        }
+        
+        return sequence_before(sequence_number, receive_next_expected_ + receive_window_) &&
+               sequence_after(sequence_number + length, receive_next_expected_);
+    }
+
+    TCPLayer::TCPLayer() : checksum_errors_(0), timer_thread_(nullptr), timers_due_(false) {
         debug::log(debug::LogLevel::Info, "TCP", "TCP Layer created");
     }
 
@@ -565,10 +1178,49 @@ namespace nk::net {
             tcp->process_packet(packet);
         }, this);
         
+        if (!start_timer_thread()) {
+            return false;
+        }
+        
         debug::log(debug::LogLevel::Info, "TCP", "TCP Layer initialized");
         return true;
     }
 
+    bool TCPLayer::start_timer_thread() {
+        if (timer_thread_) {
+            return true;
+        }
+        
+        task::Process* process = task::ProcessManager::instance().get_current_process();
+        if (!process) {
+            return false;
+        }
+        
+        task::Thread* thread = process->create_thread(reinterpret_cast<u64>(&TCPLayer::timer_main),
+                                                      TIMER_STACK_SIZE);
+        if (!thread) {
+            debug::log(debug::LogLevel::Error, "TCP", "Failed to create TCP timer thread");
+            return false;
+        }
+        
+        thread->set_background(true);
+        timer_thread_ = thread;
+        task::Scheduler::instance().add_thread(thread);
+        return true;
+    }
+
+    void TCPLayer::timer_main() {
+        TCPLayer& layer = instance();
+        task::Scheduler& scheduler = task::Scheduler::instance();
+        
+        for (;;) {
+            if (__atomic_exchange_n(&layer.timers_due_, false, __ATOMIC_ACQ_REL)) {
+                layer.poll_sockets();
+            }
+            scheduler.sleep(TIMER_INTERVAL_MS);
+        }
+    }
+
     u16 TCPLayer::allocate_port() {
         static u16 next_port = 1024;
         
@@ -598,12 +1250,80 @@ namespace nk::net {
         return true;
     }
 
+    void TCPLayer::parse_options(const TCPHeader* header, TCPSegment& segment) {
+        const u8* options = reinterpret_cast<const u8*>(header) + sizeof(TCPHeader);
+        usize size = header->header_length() - sizeof(TCPHeader);
+        usize i = 0;
+        
+        while (i < size) {
+            u8 kind = options[i];
+            if (kind == 0) {
+                break;
+            }
+            if (kind == 1) {
+                i++;
+                continue;
+            }
+            
+            if (i + 1 >= size) {
+                break;
+            }
+            u8 length = options[i + 1];
+            if (length < 2 || i + length > size) {
+                break;
+            }
+            
+            const u8* value = options + i + 2;
+            switch (kind) {
+                case 2:
+                    if (length == 4) {
+                        segment.mss = (static_cast<u16>(value[0]) << 8) | value[1];
+                    }
+                    break;
+                case 3:
+                    if (length == 3) {
+                        segment.has_window_scale = true;
+                        segment.window_scale = value[0];
+                    }
+                    break;
+                case 4:
+                    if (length == 2) {
+                        segment.sack_permitted = true;
+                    }
+                    break;
+                case 5:
+                    segment.sack_count = min(static_cast<u32>((length - 2) / 8), 4u);
+                    for (u32 block = 0; block < segment.sack_count; block++) {
+                        segment.sack_blocks[block].start =
+                            swap_endian_32(*reinterpret_cast<const u32*>(value + block * 8));
+                        segment.sack_blocks[block].end =
+                            swap_endian_32(*reinterpret_cast<const u32*>(value + block * 8 + 4));
+                    }
+                    break;
+                case 8:
+                    if (length == 10) {
+                        segment.has_timestamp = true;
+                        segment.timestamp_value = swap_endian_32(*reinterpret_cast<const u32*>(value));
+                        segment.timestamp_echo = swap_endian_32(*reinterpret_cast<const u32*>(value + 4));
+                    }
+                    break;
+            }
+            
+            i += length;
+        }
+    }
+
     void TCPLayer::process_tcp_packet(const IPPacket& packet) {
-        if (packet.data.size() < sizeof(TCPHeader)) {
+        if (packet.payload_size() < sizeof(TCPHeader)) {
+            return;
+        }
+        
+        if (!packet.verify_checksum()) {
+            checksum_errors_++;
             return;
         }
         
-        const TCPHeader* header = reinterpret_cast<const TCPHeader*>(packet.data.data());
+        const TCPHeader* header = reinterpret_cast<const TCPHeader*>(packet.payload());
         
         u16 source_port = swap_endian_16(header->source_port);
         u16 dest_port = swap_endian_16(header->destination_port);
@@ -642,36 +1362,60 @@ namespace nk::net {
         segment.ack = header->ack();
         segment.fin = header->fin();
         segment.rst = header->rst();
+        segment.psh = header->psh();
         
         usize data_offset = header->data_offset() * 4;
-        usize data_size = packet.data.size() - data_offset;
+        if (data_offset < sizeof(TCPHeader) || data_offset > packet.payload_size()) {
+            return;
+        }
+        parse_options(header, segment);
+        usize data_size = packet.payload_size() - data_offset;
         
         if (data_size > 0) {
-            segment.data.resize(data_size);
-            memcpy(segment.data.data(), packet.data.data() + data_offset, data_size);
+            if (packet.buffer) {
+                segment.buffer = packet.buffer->slice(data_offset, data_size);
+                if (!segment.buffer) {
+                    return;
+                }
+            } else {
+                segment.data.resize(data_size);
+                memcpy(segment.data.data(), packet.data.data() + data_offset, data_size);
+            }
         }
         
         segment.timestamp = arch::CPU::read_tsc();
         
         socket->receive_segment(segment);
+        
+        if (segment.buffer) {
+            segment.buffer->release();
+        }
     }
 
     void TCPLayer::handle_new_connection(TCPSocket* listening_socket, const IPPacket& packet) {
-        const TCPHeader* header = reinterpret_cast<const TCPHeader*>(packet.data.data());
+        const TCPHeader* header = reinterpret_cast<const TCPHeader*>(packet.payload());
         
         if (!header->syn()) {
             return;
         }
         
+        if (header->header_length() < sizeof(TCPHeader) ||
+            header->header_length() > packet.payload_size()) {
+            return;
+        }
+        
         u16 source_port = swap_endian_16(header->source_port);
         u16 dest_port = swap_endian_16(header->destination_port);
         
         TCPSocket* new_socket = new TCPSocket();
+        if (!new_socket) {
+            return;
+        }
         new_socket->local_address_ = packet.destination;
         new_socket->local_port_ = dest_port;
         new_socket->remote_address_ = packet.source;
         new_socket->remote_port_ = source_port;
-        new_socket->state_ = TCPState::SynReceived;
+        new_socket->state_ = TCPState::Listen;
         
         ConnectionKey key;
         key.local_address = packet.destination;
@@ -694,6 +1438,7 @@ namespace nk::net {
         segment.fin = false;
         segment.rst = false;
         segment.timestamp = arch::CPU::read_tsc();
+        parse_options(header, segment);
         
         new_socket->receive_segment(segment);
     }
@@ -797,6 +1542,8 @@ namespace nk::net {
                       static_cast<u32>(socket->state_));
         }
         
+        debug::log(debug::LogLevel::Info, "TCP", "Checksum errors: %llu", checksum_errors_);
+        
         debug::log(debug::LogLevel::Info, "TCP", "Listening Sockets: %llu", listening_sockets_.size());
         for (const auto& pair : listening_sockets_) {
             const TCPSocket* socket = pair.second;
@@ -1,9 +1,11 @@
 #include <nanokoton/net/udp.hpp>
 #include <nanokoton/net/ip.hpp>
+#include <nanokoton/net/checksum.hpp>
 #include <nanokoton/core/debug.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/algorithm.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/task/timer.hpp>
 
 namespace nk::net {
     UDPSocket::UDPSocket()
@@ -11,11 +13,16 @@ namespace nk::net {
           remote_port_(0),
           bound_(false),
           connected_(false),
+          ring_(new RingEntry[RECEIVE_RING_SIZE]),
+          ring_head_(0),
+          ring_tail_(0),
+          ring_drops_(0),
           callback_(nullptr),
           callback_user_data_(nullptr) {}
 
     UDPSocket::~UDPSocket() {
         close();
+        delete[] ring_;
     }
 
     bool UDPSocket::bind(const IPAddress& address, u16 port) {
@@ -60,35 +67,101 @@ namespace nk::net {
         return send_to(remote_address_, remote_port_, data, size);
     }
 
-    usize UDPSocket::send_to(const IPAddress& address, u16 port, const u8* data, usize size) {
-        ScopedLock lock(queue_lock_);
-        
-        if (!bound_) {
-            return 0;
+    PacketBuffer* UDPSocket::build_datagram(u16 port, const u8* data, usize size, u64 pseudo_base) {
+        if (size > MAX_PAYLOAD) {
+            return nullptr;
         }
         
-        if (size > 65507) {
-            return 0;
+        PacketBuffer* packet = PacketBuffer::allocate(size);
+        if (!packet) {
+            return nullptr;
         }
         
-        Vector<u8> packet(sizeof(UDPHeader) + size);
-        UDPHeader* header = reinterpret_cast<UDPHeader*>(packet.data());
+        memcpy(packet->data(), data, size);
         
+        u16 length = sizeof(UDPHeader) + size;
+        UDPHeader* header = reinterpret_cast<UDPHeader*>(packet->push(sizeof(UDPHeader)));
         header->source_port = swap_endian_16(local_port_);
         header->destination_port = swap_endian_16(port);
-        header->length = swap_endian_16(sizeof(UDPHeader) + size);
+        header->length = swap_endian_16(length);
         header->checksum = 0;
         
-        memcpy(packet.data() + sizeof(UDPHeader), data, size);
+        if (local_address_.ipv4 != 0) {
+            header->checksum = Checksum::fold(pseudo_base + swap_endian_16(length));
+            packet->set_checksum_partial(reinterpret_cast<u8*>(header), UDPHeader::CHECKSUM_OFFSET);
+        }
+        
+        return packet;
+    }
+
+    usize UDPSocket::send_to(const IPAddress& address, u16 port, const u8* data, usize size) {
+        if (!bound_) {
+            return 0;
+        }
+        
+        u64 pseudo_base = Checksum::pseudo_header(local_address_.ipv4, address.ipv4,
+                                                  static_cast<u8>(IPProtocol::UDP), 0);
+        PacketBuffer* packet = build_datagram(port, data, size, pseudo_base);
+        if (!packet) {
+            return 0;
+        }
         
         IPLayer& ip_layer = IPLayer::instance();
-        if (!ip_layer.send_packet(address, IPProtocol::UDP, packet.data(), packet.size())) {
+        if (!ip_layer.send_buffer(address, IPProtocol::UDP, packet)) {
             return 0;
         }
         
         return size;
     }
 
+    usize UDPSocket::send_batch(const UDPMessage* messages, usize count) {
+        if (!bound_) {
+            return 0;
+        }
+        
+        IPLayer& ip_layer = IPLayer::instance();
+        PacketBuffer* packets[MAX_BATCH];
+        usize sent = 0;
+        usize i = 0;
+        
+        while (i < count) {
+            IPAddress address = messages[i].address;
+            u16 port = messages[i].port;
+            if (address.ipv4 == 0 && connected_) {
+                address = remote_address_;
+                port = remote_port_;
+            }
+            
+            u64 pseudo_base = Checksum::pseudo_header(local_address_.ipv4, address.ipv4,
+                                                      static_cast<u8>(IPProtocol::UDP), 0);
+            usize built = 0;
+            
+            for (; i < count && built < MAX_BATCH; i++) {
+                const UDPMessage& message = messages[i];
+                bool same_destination = message.address.ipv4 == 0
+                    ? connected_ && address == remote_address_ && port == remote_port_
+                    : message.address == address && message.port == port;
+                if (!same_destination) {
+                    break;
+                }
+                
+                PacketBuffer* packet = build_datagram(port, message.buffer, message.length, pseudo_base);
+                if (!packet) {
+                    break;
+                }
+                packets[built++] = packet;
+            }
+            
+            if (built == 0) {
+                break;
+            }
+            
+            sent += ip_layer.send_buffers(address, IPProtocol::UDP, packets, built);
+        }
+        
+        return sent;
+    }
+
     usize UDPSocket::receive(u8* buffer, usize size, u64 timeout_ms) {
         IPAddress source_addr;
         u16 source_port;
@@ -97,43 +170,79 @@ namespace nk::net {
 
     usize UDPSocket::receive_from(u8* buffer, usize size, IPAddress* source_address,
                                  u16* source_port, u64 timeout_ms) {
-        ScopedLock lock(queue_lock_);
+        UDPMessage message;
+        message.buffer = buffer;
+        message.capacity = size;
         
-        if (!bound_) {
+        if (receive_batch(&message, 1, timeout_ms) == 0) {
             return 0;
         }
         
-        u64 start_time = arch::CPU::read_tsc();
-        u64 timeout_cycles = timeout_ms * 1000000;
+        if (source_address) {
+            *source_address = message.address;
+        }
         
-        while (receive_queue_.empty()) {
-            if (timeout_ms != 0) {
-                u64 current_time = arch::CPU::read_tsc();
-                if (current_time - start_time > timeout_cycles) {
-                    return 0;
-                }
-            }
+        if (source_port) {
+            *source_port = message.port;
+        }
+        
+        return message.length;
+    }
+
+    usize UDPSocket::drain_ring(UDPMessage* messages, usize count) {
+        usize tail = ring_tail_;
+        usize head = __atomic_load_n(&ring_head_, __ATOMIC_ACQUIRE);
+        usize received = 0;
+        
+        while (tail != head && received < count) {
+            RingEntry& entry = ring_[tail & (RECEIVE_RING_SIZE - 1)];
+            UDPMessage& message = messages[received++];
             
-            lock.unlock();
-            arch::CPU::pause();
-            lock.lock();
+            usize length = entry.buffer->length();
+            usize to_copy = min(message.capacity, length);
+            memcpy(message.buffer, entry.buffer->data(), to_copy);
+            
+            message.address = entry.source_address;
+            message.port = entry.source_port;
+            message.length = to_copy;
+            message.timestamp = entry.timestamp;
+            message.truncated = to_copy < length;
+            
+            entry.buffer->release();
+            tail++;
         }
         
-        UDPDatagram datagram = receive_queue_.front();
-        receive_queue_.pop();
+        __atomic_store_n(&ring_tail_, tail, __ATOMIC_RELEASE);
+        return received;
+    }
+
+    usize UDPSocket::receive_batch(UDPMessage* messages, usize count, u64 timeout_ms) {
+        ScopedLock lock(queue_lock_);
         
-        usize to_copy = min(size, datagram.data.size());
-        memcpy(buffer, datagram.data.data(), to_copy);
+        if (!bound_ || count == 0) {
+            return 0;
+        }
         
-        if (source_address) {
-            *source_address = datagram.source_address;
+        task::TimerWheel& wheel = task::TimerWheel::instance();
+        bool timed_out = false;
+        task::Timer timeout(task::TimerWheel::signal_flag, &timed_out);
+        if (timeout_ms != 0) {
+            wheel.add_timer(&timeout, wheel.ms_to_ticks(timeout_ms));
         }
         
-        if (source_port) {
-            *source_port = datagram.source_port;
+        while (get_queued_count() == 0) {
+            if (__atomic_load_n(&timed_out, __ATOMIC_ACQUIRE) || !bound_) {
+                return 0;
+            }
+            
+            lock.unlock();
+            arch::CPU::pause();
+            lock.lock();
         }
         
-        return to_copy;
+        wheel.cancel_timer(&timeout);
+        
+        return drain_ring(messages, count);
     }
 
     bool UDPSocket::close() {
@@ -149,16 +258,17 @@ namespace nk::net {
         bound_ = false;
         connected_ = false;
         
-        while (!receive_queue_.empty()) {
-            receive_queue_.pop();
+        usize tail = ring_tail_;
+        usize head = __atomic_load_n(&ring_head_, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++) {
+            ring_[tail & (RECEIVE_RING_SIZE - 1)].buffer->release();
         }
+        __atomic_store_n(&ring_tail_, tail, __ATOMIC_RELEASE);
         
         return true;
     }
 
     void UDPSocket::queue_datagram(const UDPDatagram& datagram) {
-        ScopedLock lock(queue_lock_);
-        
         if (!bound_) {
             return;
         }
@@ -167,13 +277,39 @@ namespace nk::net {
             return;
         }
         
-        if (!connected_ || (connected_ && datagram.source_address == remote_address_ &&
-                          datagram.source_port == remote_port_)) {
-            receive_queue_.push(datagram);
-            
-            if (callback_) {
-                callback_(datagram, callback_user_data_);
+        if (connected_ && (datagram.source_address != remote_address_ ||
+                           datagram.source_port != remote_port_)) {
+            return;
+        }
+        
+        usize head = ring_head_;
+        if (head - __atomic_load_n(&ring_tail_, __ATOMIC_ACQUIRE) == RECEIVE_RING_SIZE) {
+            ring_drops_++;
+            return;
+        }
+        
+        PacketBuffer* buffer = datagram.buffer;
+        if (buffer) {
+            buffer->retain();
+        } else {
+            buffer = PacketBuffer::allocate(datagram.data.size(), 0);
+            if (!buffer) {
+                ring_drops_++;
+                return;
             }
+            memcpy(buffer->data(), datagram.data.data(), datagram.data.size());
+        }
+        
+        RingEntry& entry = ring_[head & (RECEIVE_RING_SIZE - 1)];
+        entry.buffer = buffer;
+        entry.source_address = datagram.source_address;
+        entry.source_port = datagram.source_port;
+        entry.timestamp = datagram.timestamp;
+        
+        __atomic_store_n(&ring_head_, head + 1, __ATOMIC_RELEASE);
+        
+        if (callback_) {
+            callback_(datagram, callback_user_data_);
         }
     }
 
@@ -181,7 +317,7 @@ namespace nk::net {
         // UDP sockets are connectionless, polling is handled by the UDP layer
     }
 
-    UDPLayer::UDPLayer() {
+    UDPLayer::UDPLayer() : checksum_errors_(0) {
         debug::log(debug::LogLevel::Info, "UDP", "UDP Layer created");
     }
 
@@ -233,17 +369,22 @@ namespace nk::net {
     }
 
     void UDPLayer::process_udp_packet(const IPPacket& packet) {
-        if (packet.data.size() < sizeof(UDPHeader)) {
+        if (packet.payload_size() < sizeof(UDPHeader)) {
             return;
         }
         
-        const UDPHeader* header = reinterpret_cast<const UDPHeader*>(packet.data.data());
+        const UDPHeader* header = reinterpret_cast<const UDPHeader*>(packet.payload());
         
         u16 source_port = swap_endian_16(header->source_port);
         u16 dest_port = swap_endian_16(header->destination_port);
         u16 length = swap_endian_16(header->length);
         
-        if (length < sizeof(UDPHeader) || length > packet.data.size()) {
+        if (length < sizeof(UDPHeader) || length > packet.payload_size()) {
+            return;
+        }
+        
+        if (header->checksum != 0 && !packet.verify_checksum()) {
+            checksum_errors_++;
             return;
         }
         
@@ -254,7 +395,11 @@ namespace nk::net {
         ScopedLock lock(lock_);
         auto it = bound_sockets_.find(key);
         if (it == bound_sockets_.end()) {
-            return;
+            key.address = IPAddress::any();
+            it = bound_sockets_.find(key);
+            if (it == bound_sockets_.end()) {
+                return;
+            }
         }
         
         UDPSocket* socket = it->second;
@@ -267,10 +412,21 @@ namespace nk::net {
         datagram.timestamp = arch::CPU::read_tsc();
         
         usize data_size = length - sizeof(UDPHeader);
-        datagram.data.resize(data_size);
-        memcpy(datagram.data.data(), packet.data.data() + sizeof(UDPHeader), data_size);
+        if (packet.buffer) {
+            datagram.buffer = packet.buffer->slice(sizeof(UDPHeader), data_size);
+            if (!datagram.buffer) {
+                return;
+            }
+        } else {
+            datagram.data.resize(data_size);
+            memcpy(datagram.data.data(), packet.data.data() + sizeof(UDPHeader), data_size);
+        }
         
         socket->queue_datagram(datagram);
+        
+        if (datagram.buffer) {
+            datagram.buffer->release();
+        }
     }
 
     UDPSocket* UDPLayer::create_socket() {
@@ -314,7 +470,6 @@ namespace nk::net {
     }
 
     void UDPLayer::process_packet(const IPPacket& packet) {
-        ScopedLock lock(lock_);
         process_udp_packet(packet);
     }
 
@@ -322,14 +477,16 @@ namespace nk::net {
         ScopedLock lock(lock_);
         
         debug::log(debug::LogLevel::Info, "UDP", "UDP Bound Sockets: %llu", bound_sockets_.size());
+        debug::log(debug::LogLevel::Info, "UDP", "Checksum errors: %llu", checksum_errors_);
         for (const auto& pair : bound_sockets_) {
             const UDPSocket* socket = pair.second;
             debug::log(debug::LogLevel::Info, "UDP",
-                      "  %u.%u.%u.%u:%u, Connected: %s",
+                      "  %u.%u.%u.%u:%u, Connected: %s, Queued: %llu, Dropped: %llu",
                       pair.first.address.ipv4_bytes[0], pair.first.address.ipv4_bytes[1],
                       pair.first.address.ipv4_bytes[2], pair.first.address.ipv4_bytes[3],
                       pair.first.port,
-                      socket->is_connected() ? "yes" : "no");
+                      socket->is_connected() ? "yes" : "no",
+                      socket->get_queued_count(), socket->get_drop_count());
         }
     }
 
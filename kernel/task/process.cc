@@ -1,24 +1,53 @@
 #include <nanokoton/task/process.hpp>
 #include <nanokoton/core/debug.hpp>
 #include <nanokoton/task/scheduler.hpp>
+#include <nanokoton/task/thread_pool.hpp>
 #include <nanokoton/mm/virtual.hpp>
 #include <nanokoton/arch/cpu.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/algorithm.hpp>
 
 namespace nk::task {
+    mm::SlabCache Thread::cache_("thread", sizeof(Thread));
+    u64 Thread::next_id_ = 1;
+
+    void* Thread::operator new(usize size) {
+        if (size != sizeof(Thread)) {
+            return mm::VirtualMemoryManager::instance().kmalloc(size);
+        }
+        return cache_.allocate();
+    }
+
+    void Thread::operator delete(void* ptr) {
+        mm::VirtualMemoryManager::instance().kfree(ptr);
+    }
+
+    u64 Thread::allocate_id() {
+        return __atomic_fetch_add(&next_id_, 1, __ATOMIC_RELAXED);
+    }
+
     Thread::Thread(Process* process, u64 entry_point, usize stack_size)
-        : id_(reinterpret_cast<u64>(this)),
-          stack_size_(align_up(stack_size, PAGE_SIZE)),
+        : id_(allocate_id()),
+          stack_(nullptr),
+          stack_size_(ThreadPool::stack_size_for(stack_size)),
           state_(ThreadState::Created),
           entry_point_(entry_point),
+          registers_(nullptr),
           process_(process),
           sleep_until_(0),
           tls_base_(nullptr),
-          tls_size_(0) {
-        
-        stack_ = reinterpret_cast<u64*>(
-            mm::VirtualMemoryManager::instance().kmalloc_aligned(stack_size_, PAGE_SIZE));
+          tls_size_(0),
+          cpu_affinity_(~0ULL),
+          last_cpu_(arch::SMP::current_cpu_id()),
+          background_(false),
+          last_run_time_(0),
+          run_ticket_(0),
+          queued_ticket_(0),
+          list_next_(nullptr),
+          list_prev_(nullptr),
+          list_owner_(nullptr) {
+        
+        stack_ = ThreadPool::instance().allocate_stack(stack_size_);
         
         if (!stack_) {
             debug::log(debug::LogLevel::Error, "PROC", 
@@ -30,20 +59,15 @@ namespace nk::task {
             mm::VirtualMemoryManager::instance().kmalloc(sizeof(RegisterState)));
         
         if (!registers_) {
-            mm::VirtualMemoryManager::instance().kfree(stack_);
+            ThreadPool::instance().free_stack(stack_, stack_size_);
             stack_ = nullptr;
             debug::log(debug::LogLevel::Error, "PROC", 
                       "Failed to allocate registers for thread");
             return;
         }
         
-        memset(registers_, 0, sizeof(RegisterState));
-        
-        registers_->rip = entry_point_;
-        registers_->rsp = reinterpret_cast<u64>(stack_) + stack_size_ - 128;
-        registers_->cs = 0x08;
-        registers_->ss = 0x10;
-        registers_->rflags = 0x202;
+        memset(&sched_statistics_, 0, sizeof(sched_statistics_));
+        init_registers();
         
         tls_size_ = 4096;
         tls_base_ = mm::VirtualMemoryManager::instance().kmalloc_aligned(tls_size_, PAGE_SIZE);
@@ -60,8 +84,10 @@ namespace nk::task {
     }
 
     Thread::~Thread() {
+        arch::FPU::release(fpu_state_);
+        
         if (stack_) {
-            mm::VirtualMemoryManager::instance().kfree(stack_);
+            ThreadPool::instance().free_stack(stack_, stack_size_);
         }
         
         if (registers_) {
@@ -73,6 +99,43 @@ namespace nk::task {
         }
     }
 
+    void Thread::init_registers() {
+        memset(registers_, 0, sizeof(RegisterState));
+        
+        registers_->rip = entry_point_;
+        registers_->rsp = reinterpret_cast<u64>(stack_) + stack_size_ - 128;
+        registers_->cs = 0x08;
+        registers_->ss = 0x10;
+        registers_->rflags = 0x202;
+    }
+
+    void Thread::recycle(Process* process, u64 entry_point) {
+        id_ = allocate_id();
+        entry_point_ = entry_point;
+        process_ = process;
+        sleep_until_ = 0;
+        cpu_affinity_ = ~0ULL;
+        last_cpu_ = arch::SMP::current_cpu_id();
+        background_ = false;
+        last_run_time_ = 0;
+        list_next_ = nullptr;
+        list_prev_ = nullptr;
+        list_owner_ = nullptr;
+        
+        memset(&sched_statistics_, 0, sizeof(sched_statistics_));
+        init_registers();
+        
+        if (tls_base_) {
+            memset(tls_base_, 0, tls_size_);
+        }
+        
+        state_ = ThreadState::Created;
+        
+        debug::log(debug::LogLevel::Debug, "PROC",
+                  "Recycled thread %llu into process %llu, entry: 0x%016llX",
+                  id_, process->get_pid(), entry_point_);
+    }
+
     bool Thread::should_wake_up(u64 current_time) const {
         return is_sleeping() && current_time >= sleep_until_;
     }
@@ -128,6 +191,11 @@ namespace nk::task {
             return;
         }
         
+        if (!mm::VirtualMemoryManager::instance().reserve_user_stack(address_space_)) {
+            debug::log(debug::LogLevel::Warning, "PROC",
+                      "Failed to reserve user stack for process %llu", pid_);
+        }
+        
         main_thread_ = create_thread(0, 8192);
         if (!main_thread_) {
             mm::VirtualMemoryManager::instance().destroy_address_space(address_space_);
@@ -150,7 +218,7 @@ namespace nk::task {
         }
         
         for (Thread* thread : threads_) {
-            delete thread;
+            ThreadPool::instance().release(thread);
         }
         threads_.clear();
         
@@ -174,9 +242,8 @@ namespace nk::task {
             return nullptr;
         }
         
-        Thread* thread = new Thread(this, entry_point, stack_size);
-        if (!thread || !thread->get_registers()) {
-            delete thread;
+        Thread* thread = ThreadPool::instance().acquire(this, entry_point, stack_size);
+        if (!thread) {
             return nullptr;
         }
         
@@ -198,7 +265,24 @@ namespace nk::task {
                     main_thread_ = nullptr;
                 }
                 
-                delete threads_[i];
+                ThreadPool::instance().release(threads_[i]);
+                threads_.erase(i);
+                return true;
+            }
+        }
+        
+        return false;
+    }
+
+    bool Process::detach_thread(Thread* thread) {
+        ScopedLock lock(lock_);
+        
+        for (usize i = 0; i < threads_.size(); i++) {
+            if (threads_[i] == thread) {
+                if (thread == main_thread_) {
+                    main_thread_ = nullptr;
+                }
+                
                 threads_.erase(i);
                 return true;
             }
@@ -324,6 +408,9 @@ namespace nk::task {
         
         kernel_process_->state_ = ProcessState::Running;
         
+        ThreadPool::instance().prefill(static_cast<usize>(1) << ThreadPool::MIN_STACK_SHIFT,
+                                       ThreadPool::PREFILL_STACKS);
+        
         debug::log(debug::LogLevel::Info, "PROCMGR", 
                   "Process Manager initialized with kernel process %llu",
                   kernel_process_->get_pid());
@@ -1,50 +1,126 @@
 #include <nanokoton/task/scheduler.hpp>
 #include <nanokoton/core/debug.hpp>
+#include <nanokoton/core/trace.hpp>
 #include <nanokoton/task/process.hpp>
+#include <nanokoton/task/thread_pool.hpp>
 #include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/arch/apic.hpp>
+#include <nanokoton/arch/fpu.hpp>
 #include <nanokoton/lib/string.hpp>
 #include <nanokoton/lib/algorithm.hpp>
 
 namespace nk::task {
     Scheduler::Scheduler()
-        : idle_thread_(nullptr),
-          current_thread_(nullptr),
-          idle_process_(nullptr),
+        : idle_process_(nullptr),
+          reaper_thread_(nullptr),
           policy_(SchedulingPolicy::RoundRobin),
           time_slice_default_(10000),
-          last_schedule_time_(0),
           timer_ticks_(0),
-          cpu_count_(1) {
+          cpu_affinity_storage_(0),
+          cpu_count_(0),
+          latency_tracing_(false),
+          overflow_count_(0),
+          overflows_(0) {
         
-        memset(&statistics_, 0, sizeof(statistics_));
-        
-        for (u32 i = 0; i < 4; i++) {
-            RunQueue queue;
-            queue.current_index = 0;
-            queue.time_slice = time_slice_default_;
-            queue.priority_level = i;
-            run_queues_.push_back(queue);
+        for (u32 i = 0; i < arch::MAX_CPUS; i++) {
+            cpus_[i] = nullptr;
         }
         
-        cpu_affinity_ = Bitmap(nullptr, 64);
+        list_init(overflow_);
+        
+        cpu_affinity_ = Bitmap(reinterpret_cast<u8*>(&cpu_affinity_storage_), arch::MAX_CPUS);
     }
 
     Scheduler::~Scheduler() {
-        if (idle_thread_) {
-            delete idle_thread_;
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            for (RunQueue& level : queue->levels) {
+                RunQueueSlot entry;
+                while (pop(level, entry)) {
+                    if (claim(entry)) {
+                        delete entry.thread;
+                    }
+                }
+            }
+            
+            while (queue->reaper.head) {
+                Thread* thread = queue->reaper.head;
+                list_unlink(queue->reaper, thread);
+                delete thread;
+            }
+            
+            delete queue->idle;
+            delete queue;
+            cpus_[cpu] = nullptr;
+        }
+        
+        while (overflow_.head) {
+            Thread* thread = overflow_.head;
+            list_unlink(overflow_, thread);
+            delete thread;
         }
         
         if (idle_process_) {
             delete idle_process_;
         }
+    }
+
+    Scheduler::CpuQueue* Scheduler::create_cpu_queue(u32 cpu) {
+        CpuQueue* queue = new CpuQueue();
+        if (!queue) {
+            return nullptr;
+        }
         
-        for (RunQueue& queue : run_queues_) {
-            for (Thread* thread : queue.threads) {
-                delete thread;
+        for (u32 i = 0; i < PRIORITY_LEVELS; i++) {
+            RunQueue& level = queue->levels[i];
+            for (usize slot = 0; slot < RUN_QUEUE_CAPACITY; slot++) {
+                level.slots[slot].sequence = slot;
+                level.slots[slot].thread = nullptr;
+                level.slots[slot].ticket = 0;
             }
-            queue.threads.clear();
+            level.enqueue_pos = 0;
+            level.dequeue_pos = 0;
+            level.time_slice = time_slice_default_;
+            level.priority_level = i;
+        }
+        
+        queue->ready_mask = 0;
+        queue->ready_count = 0;
+        queue->current = nullptr;
+        list_init(queue->reaper);
+        queue->idle = idle_process_->create_thread(0, 4096);
+        if (!queue->idle) {
+            delete queue;
+            return nullptr;
         }
-        run_queues_.clear();
+        
+        queue->idle->cpu_affinity_ = 1ULL << cpu;
+        queue->idle->last_cpu_ = cpu;
+        queue->idle->set_state(ThreadState::Running);
+        queue->current = queue->idle;
+        
+        queue->last_schedule_time = arch::CPU::read_tsc();
+        memset(&queue->statistics, 0, sizeof(queue->statistics));
+        queue->statistics.last_switch_time = queue->last_schedule_time;
+        queue->local_picks = 0;
+        queue->steals = 0;
+        queue->stolen = 0;
+        queue->remote_enqueues = 0;
+        queue->migrations = 0;
+        queue->reaped = 0;
+        queue->tickless_idle = 0;
+        memset(queue->wait_histogram, 0, sizeof(queue->wait_histogram));
+        queue->switch_cost_total = 0;
+        queue->switch_cost_min = ~0ULL;
+        queue->switch_cost_max = 0;
+        queue->switch_cost_samples = 0;
+        
+        return queue;
     }
 
     bool Scheduler::init() {
@@ -63,8 +139,10 @@ namespace nk::task {
         
         idle_process_->state_ = ProcessState::Running;
         
-        idle_thread_ = idle_process_->create_thread(0, 4096);
-        if (!idle_thread_) {
+        u32 cpu = arch::SMP::current_cpu_id();
+        debug::Trace::init_cpu(cpu);
+        cpus_[cpu] = create_cpu_queue(cpu);
+        if (!cpus_[cpu]) {
             delete idle_process_;
             idle_process_ = nullptr;
             debug::log(debug::LogLevel::Error, "SCHED",
@@ -72,191 +150,686 @@ namespace nk::task {
             return false;
         }
         
-        idle_thread_->set_state(ThreadState::Running);
-        current_thread_ = idle_thread_;
-        
-        last_schedule_time_ = arch::CPU::read_tsc();
-        statistics_.last_switch_time = last_schedule_time_;
+        cpu_affinity_.set(cpu, true);
+        cpu_count_ = 1;
         
         debug::log(debug::LogLevel::Info, "SCHED",
                   "Scheduler initialized with %u priority levels",
-                  run_queues_.size());
+                  PRIORITY_LEVELS);
+        
+        return true;
+    }
+
+    bool Scheduler::init_cpu(u32 cpu) {
+        ScopedLock lock(lock_);
+        
+        if (cpu >= arch::MAX_CPUS || !idle_process_) {
+            return false;
+        }
         
+        if (cpus_[cpu]) {
+            return true;
+        }
+        
+        debug::Trace::init_cpu(cpu);
+        
+        CpuQueue* queue = create_cpu_queue(cpu);
+        if (!queue) {
+            debug::log(debug::LogLevel::Error, "SCHED",
+                      "Failed to create run queue for CPU %u", cpu);
+            return false;
+        }
+        
+        __atomic_store_n(&cpus_[cpu], queue, __ATOMIC_RELEASE);
+        cpu_affinity_.set(cpu, true);
+        __atomic_add_fetch(&cpu_count_, 1, __ATOMIC_RELEASE);
+        
+        debug::log(debug::LogLevel::Info, "SCHED", "CPU %u joined the scheduler", cpu);
         return true;
     }
 
     void Scheduler::start() {
+        Process* process = ProcessManager::instance().get_current_process();
+        if (!reaper_thread_ && process) {
+            reaper_thread_ = process->create_thread(reinterpret_cast<u64>(&Scheduler::reaper_main),
+                                                    REAPER_STACK_SIZE);
+            if (reaper_thread_) {
+                reaper_thread_->set_background(true);
+                add_thread(reaper_thread_);
+            } else {
+                debug::log(debug::LogLevel::Error, "SCHED", "Failed to create reaper thread");
+            }
+        }
+        
+        debug::Trace::start();
         debug::log(debug::LogLevel::Info, "SCHED", "Scheduler started");
     }
 
-    void Scheduler::add_thread(Thread* thread) {
-        ScopedLock lock(lock_);
+    bool Scheduler::push(RunQueue& queue, Thread* thread, u64 ticket) {
+        u64 pos = __atomic_load_n(&queue.enqueue_pos, __ATOMIC_RELAXED);
+        
+        for (;;) {
+            RunQueueSlot& slot = queue.slots[pos & (RUN_QUEUE_CAPACITY - 1)];
+            u64 sequence = __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+            i64 diff = static_cast<i64>(sequence) - static_cast<i64>(pos);
+            
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&queue.enqueue_pos, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    slot.thread = thread;
+                    slot.ticket = ticket;
+                    __atomic_store_n(&slot.sequence, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = __atomic_load_n(&queue.enqueue_pos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    bool Scheduler::pop(RunQueue& queue, RunQueueSlot& entry) {
+        u64 pos = __atomic_load_n(&queue.dequeue_pos, __ATOMIC_RELAXED);
+        
+        for (;;) {
+            RunQueueSlot& slot = queue.slots[pos & (RUN_QUEUE_CAPACITY - 1)];
+            u64 sequence = __atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE);
+            i64 diff = static_cast<i64>(sequence) - static_cast<i64>(pos + 1);
+            
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&queue.dequeue_pos, &pos, pos + 1, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    entry.thread = slot.thread;
+                    entry.ticket = slot.ticket;
+                    __atomic_store_n(&slot.sequence, pos + RUN_QUEUE_CAPACITY, __ATOMIC_RELEASE);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = __atomic_load_n(&queue.dequeue_pos, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    bool Scheduler::claim(const RunQueueSlot& entry) {
+        u64 expected = entry.ticket;
+        return __atomic_compare_exchange_n(&entry.thread->run_ticket_, &expected, expected + 1,
+                                           false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+
+    void Scheduler::list_init(ThreadList& list) {
+        list.head = nullptr;
+        list.tail = nullptr;
+        list.count = 0;
+    }
+
+    void Scheduler::list_push(ThreadList& list, Thread* thread) {
+        thread->list_next_ = nullptr;
+        thread->list_prev_ = list.tail;
+        thread->list_owner_ = &list;
+        
+        if (list.tail) {
+            list.tail->list_next_ = thread;
+        } else {
+            list.head = thread;
+        }
+        
+        list.tail = thread;
+        list.count++;
+    }
+
+    void Scheduler::list_unlink(ThreadList& list, Thread* thread) {
+        if (thread->list_prev_) {
+            thread->list_prev_->list_next_ = thread->list_next_;
+        } else {
+            list.head = thread->list_next_;
+        }
+        
+        if (thread->list_next_) {
+            thread->list_next_->list_prev_ = thread->list_prev_;
+        } else {
+            list.tail = thread->list_prev_;
+        }
+        
+        thread->list_next_ = nullptr;
+        thread->list_prev_ = nullptr;
+        thread->list_owner_ = nullptr;
+        list.count--;
+    }
+
+    bool Scheduler::cpu_allowed(const Thread* thread, u32 cpu) const {
+        if (cpu >= arch::MAX_CPUS || !__atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        
+        return cpu_affinity_.test(cpu) && (thread->cpu_affinity_ & (1ULL << cpu)) != 0;
+    }
+
+    u32 Scheduler::select_cpu(Thread* thread, u32 current_cpu) {
+        u32 warm_cpu = thread->last_cpu_;
+        u32 best_cpu = arch::MAX_CPUS;
+        u64 best_load = ~0ULL;
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            if (!cpu_allowed(thread, cpu)) {
+                continue;
+            }
+            
+            u64 load = runnable_threads(cpu);
+            if (load < best_load || (load == best_load && cpu == current_cpu)) {
+                best_load = load;
+                best_cpu = cpu;
+            }
+        }
         
+        if (best_cpu == arch::MAX_CPUS) {
+            return current_cpu;
+        }
+        
+        if (cpu_allowed(thread, warm_cpu) &&
+            runnable_threads(warm_cpu) < best_load + STEAL_THRESHOLD) {
+            return warm_cpu;
+        }
+        
+        return best_cpu;
+    }
+
+    void Scheduler::enqueue(u32 cpu, Thread* thread) {
+        CpuQueue* queue = __atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE);
+        u32 priority = calculate_priority(thread);
+        
+        if (latency_tracing_) {
+            thread->sched_statistics_.last_enqueue = arch::CPU::read_tsc();
+            thread->sched_statistics_.last_priority = priority;
+        }
+        
+        u64 ticket = __atomic_add_fetch(&thread->run_ticket_, 1, __ATOMIC_ACQ_REL);
+        if (!queue || !push(queue->levels[priority], thread, ticket)) {
+            spill(thread, ticket);
+            return;
+        }
+        
+        __atomic_add_fetch(&queue->ready_count, 1, __ATOMIC_RELEASE);
+        __atomic_or_fetch(&queue->ready_mask, 1u << priority, __ATOMIC_RELEASE);
+    }
+
+    void Scheduler::spill(Thread* thread, u64 ticket) {
+        ScopedLock lock(overflow_lock_);
+        
+        thread->queued_ticket_ = ticket;
+        if (thread->list_owner_) {
+            return;
+        }
+        
+        list_push(overflow_, thread);
+        __atomic_add_fetch(&overflow_count_, 1, __ATOMIC_RELEASE);
+        overflows_++;
+        
+        debug::Trace::point(debug::TraceComponent::Scheduler,
+                           "Run queue full, thread %llu parked on overflow list", thread->get_id());
+    }
+
+    void Scheduler::drain_overflow(CpuQueue& queue, u32 cpu) {
+        if (__atomic_load_n(&overflow_count_, __ATOMIC_ACQUIRE) == 0) {
+            return;
+        }
+        
+        ScopedLock lock(overflow_lock_);
+        
+        Thread* next = overflow_.head;
+        while (next) {
+            Thread* thread = next;
+            next = thread->list_next_;
+            
+            if (!cpu_allowed(thread, cpu)) {
+                continue;
+            }
+            
+            u32 priority = calculate_priority(thread);
+            if (!push(queue.levels[priority], thread, thread->queued_ticket_)) {
+                continue;
+            }
+            
+            list_unlink(overflow_, thread);
+            __atomic_sub_fetch(&overflow_count_, 1, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&queue.ready_count, 1, __ATOMIC_RELEASE);
+            __atomic_or_fetch(&queue.ready_mask, 1u << priority, __ATOMIC_RELEASE);
+        }
+    }
+
+    Thread* Scheduler::dequeue(u32 cpu, u32 thief_cpu) {
+        CpuQueue* queue = cpus_[cpu];
+        u32 mask = __atomic_load_n(&queue->ready_mask, __ATOMIC_ACQUIRE);
+        
+        while (mask) {
+            u32 priority = __builtin_ctz(mask);
+            mask &= mask - 1;
+            
+            RunQueue& level = queue->levels[priority];
+            RunQueueSlot entry;
+            bool drained = true;
+            
+            while (pop(level, entry)) {
+                __atomic_sub_fetch(&queue->ready_count, 1, __ATOMIC_RELEASE);
+                
+                if (!claim(entry)) {
+                    continue;
+                }
+                
+                Thread* thread = entry.thread;
+                if (cpu_allowed(thread, thief_cpu)) {
+                    return thread;
+                }
+                
+                enqueue(cpu_allowed(thread, cpu) ? cpu : select_cpu(thread, cpu), thread);
+                drained = false;
+                break;
+            }
+            
+            if (drained) {
+                __atomic_and_fetch(&queue->ready_mask, ~(1u << priority), __ATOMIC_ACQ_REL);
+                if (__atomic_load_n(&level.enqueue_pos, __ATOMIC_ACQUIRE) !=
+                    __atomic_load_n(&level.dequeue_pos, __ATOMIC_ACQUIRE)) {
+                    __atomic_or_fetch(&queue->ready_mask, 1u << priority, __ATOMIC_RELEASE);
+                }
+            }
+        }
+        
+        return nullptr;
+    }
+
+    void Scheduler::add_thread(Thread* thread) {
         if (!validate_thread(thread)) {
             debug::log(debug::LogLevel::Error, "SCHED",
-                      "Invalid thread %llu", thread->get_id());
+                      "Invalid thread %llu", thread ? thread->get_id() : 0);
             return;
         }
         
-        u32 priority = calculate_priority(thread);
-        if (priority >= run_queues_.size()) {
-            priority = run_queues_.size() - 1;
-        }
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        
+        u32 current_cpu = arch::SMP::current_cpu_id();
+        u32 cpu = select_cpu(thread, current_cpu);
         
         thread->set_state(ThreadState::Ready);
-        run_queues_[priority].threads.push_back(thread);
         
-        debug::log(debug::LogLevel::Debug, "SCHED",
-                  "Added thread %llu to priority queue %u",
-                  thread->get_id(), priority);
+        enqueue(cpu, thread);
+        
+        if (cpu != current_cpu && cpus_[current_cpu]) {
+            cpus_[current_cpu]->remote_enqueues++;
+            
+            CpuQueue* target = __atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE);
+            if (target && __atomic_load_n(&target->current, __ATOMIC_ACQUIRE) == target->idle &&
+                arch::LocalAPIC::is_available()) {
+                arch::LocalAPIC::send_ipi(arch::SMP::cpu(cpu).apic_id, arch::LocalAPIC::RESCHEDULE_VECTOR);
+            }
+        } else if (cpus_[cpu] && cpus_[cpu]->current == cpus_[cpu]->idle &&
+                   arch::LocalAPIC::is_available()) {
+            arch::LocalAPIC::arm_oneshot(1);
+        }
+        
+        debug::Trace::point(debug::TraceComponent::Scheduler,
+                           "Added thread %llu to CPU %u", thread->get_id(), cpu);
     }
 
     void Scheduler::remove_thread(Thread* thread) {
-        ScopedLock lock(lock_);
+        if (!thread) {
+            return;
+        }
         
-        for (RunQueue& queue : run_queues_) {
-            for (usize i = 0; i < queue.threads.size(); i++) {
-                if (queue.threads[i] == thread) {
-                    queue.threads.erase(i);
-                    
-                    if (thread == current_thread_) {
-                        current_thread_ = idle_thread_;
-                    }
-                    
-                    debug::log(debug::LogLevel::Debug, "SCHED",
-                              "Removed thread %llu from scheduler",
-                              thread->get_id());
-                    return;
-                }
+        __atomic_add_fetch(&thread->run_ticket_, 1, __ATOMIC_ACQ_REL);
+        TimerWheel::instance().cancel_timer(&thread->sleep_timer_);
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            CpuQueue* queue = __atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE);
+            if (!queue) {
+                continue;
             }
+            
+            Thread* expected = thread;
+            __atomic_compare_exchange_n(&queue->current, &expected, queue->idle,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
         }
+        
+        debug::Trace::point(debug::TraceComponent::Scheduler,
+                           "Removed thread %llu from scheduler", thread->get_id());
     }
 
     void Scheduler::yield() {
-        ScopedLock lock(lock_);
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        
+        u32 cpu = arch::SMP::current_cpu_id();
+        CpuQueue& queue = *cpus_[cpu];
         
-        if (current_thread_ == idle_thread_) {
+        if (queue.current == queue.idle) {
             return;
         }
         
-        Thread* next_thread = select_next_thread();
-        if (next_thread && next_thread != current_thread_) {
-            switch_to_thread(next_thread);
+        Thread* next_thread = select_next_thread(queue, cpu);
+        if (next_thread && next_thread != queue.current) {
+            switch_to_thread(next_thread, true);
         }
+        
+        program_next_event(queue);
     }
 
     void Scheduler::sleep(u64 milliseconds) {
-        ScopedLock lock(lock_);
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        
+        u32 cpu = arch::SMP::current_cpu_id();
+        CpuQueue& queue = *cpus_[cpu];
+        Thread* thread = queue.current;
         
-        if (current_thread_ == idle_thread_) {
+        if (thread == queue.idle) {
             return;
         }
         
-        u64 wake_time = arch::CPU::read_tsc() + milliseconds * 1000000;
-        current_thread_->set_sleep_until(wake_time);
-        current_thread_->set_state(ThreadState::Sleeping);
+        TimerWheel& wheel = TimerWheel::instance();
+        u64 ticks = wheel.ms_to_ticks(milliseconds);
+        
+        thread->set_sleep_until(arch::CPU::read_tsc() + wheel.ticks_to_cycles(ticks));
+        thread->set_state(ThreadState::Sleeping);
         
-        Thread* next_thread = select_next_thread();
+        thread->sleep_timer_.callback = sleep_timeout;
+        thread->sleep_timer_.context = thread;
+        wheel.add_timer(&thread->sleep_timer_, ticks);
+        
+        Thread* next_thread = select_next_thread(queue, cpu);
         if (next_thread) {
-            switch_to_thread(next_thread);
+            switch_to_thread(next_thread, true);
         }
+        
+        program_next_event(queue);
+    }
+
+    bool Scheduler::wait(const bool* condition, u64 milliseconds) {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+        
+        CpuQueue* queue = cpus_[arch::SMP::current_cpu_id()];
+        if (!queue || !queue->current || queue->current == queue->idle) {
+            return __atomic_load_n(condition, __ATOMIC_ACQUIRE);
+        }
+        
+        u32 cpu = arch::SMP::current_cpu_id();
+        Thread* thread = queue->current;
+        
+        ThreadState sleeping = ThreadState::Sleeping;
+        __atomic_store(&thread->state_, &sleeping, __ATOMIC_SEQ_CST);
+        
+        if (__atomic_load_n(condition, __ATOMIC_SEQ_CST)) {
+            ThreadState expected = ThreadState::Sleeping;
+            ThreadState running = ThreadState::Running;
+            if (__atomic_compare_exchange(&thread->state_, &expected, &running,
+                                          false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return true;
+            }
+        } else {
+            TimerWheel& wheel = TimerWheel::instance();
+            u64 ticks = wheel.ms_to_ticks(milliseconds);
+            
+            thread->set_sleep_until(arch::CPU::read_tsc() + wheel.ticks_to_cycles(ticks));
+            thread->sleep_timer_.callback = sleep_timeout;
+            thread->sleep_timer_.context = thread;
+            wheel.add_timer(&thread->sleep_timer_, ticks);
+        }
+        
+        Thread* next_thread = select_next_thread(*queue, cpu);
+        if (next_thread) {
+            switch_to_thread(next_thread, true);
+        }
+        
+        program_next_event(*queue);
+        return __atomic_load_n(condition, __ATOMIC_ACQUIRE);
+    }
+
+    void Scheduler::sleep_timeout(void* context) {
+        instance().wake_up(static_cast<Thread*>(context));
     }
 
     void Scheduler::wake_up(Thread* thread) {
-        ScopedLock lock(lock_);
+        if (!thread) {
+            return;
+        }
         
-        if (!thread || thread->get_state() != ThreadState::Sleeping) {
+        ThreadState expected = ThreadState::Sleeping;
+        ThreadState ready = ThreadState::Ready;
+        if (!__atomic_compare_exchange(&thread->state_, &expected, &ready,
+                                       false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
             return;
         }
         
-        thread->set_state(ThreadState::Ready);
+        TimerWheel::instance().cancel_timer(&thread->sleep_timer_);
         add_thread(thread);
         
-        debug::log(debug::LogLevel::Debug, "SCHED",
-                  "Woke up thread %llu", thread->get_id());
+        debug::Trace::point(debug::TraceComponent::Scheduler,
+                           "Woke up thread %llu", thread->get_id());
     }
 
-    Thread* Scheduler::select_next_thread() {
-        u64 current_time = arch::CPU::read_tsc();
-        
-        cleanup_dead_threads();
+    Thread* Scheduler::select_next_thread(CpuQueue& queue, u32 cpu) {
+        drain_overflow(queue, cpu);
         
-        for (usize priority = 0; priority < run_queues_.size(); priority++) {
-            RunQueue& queue = run_queues_[priority];
+        for (;;) {
+            Thread* thread = dequeue(cpu, cpu);
+            if (!thread) {
+                break;
+            }
             
-            if (queue.threads.empty()) {
-                continue;
+            if (validate_thread(thread)) {
+                queue.local_picks++;
+                return thread;
             }
             
-            queue.current_index %= queue.threads.size();
+            discard_thread(queue, thread);
+        }
+        
+        Thread* stolen = steal_work(queue, cpu);
+        if (stolen) {
+            return stolen;
+        }
+        
+        return queue.idle;
+    }
+
+    Thread* Scheduler::steal_work(CpuQueue& queue, u32 cpu) {
+        if (!cpu_affinity_.test(cpu) || __atomic_load_n(&cpu_count_, __ATOMIC_ACQUIRE) < 2) {
+            return nullptr;
+        }
+        
+        u64 now = arch::CPU::read_tsc();
+        
+        for (u32 attempt = 0; attempt < MAX_STEAL_ATTEMPTS; attempt++) {
+            u32 victim = arch::MAX_CPUS;
+            u64 victim_load = 0;
             
-            for (usize i = 0; i < queue.threads.size(); i++) {
-                Thread* thread = queue.threads[queue.current_index];
-                queue.current_index = (queue.current_index + 1) % queue.threads.size();
+            for (u32 offset = 1; offset < arch::MAX_CPUS; offset++) {
+                u32 candidate = (cpu + offset) % arch::MAX_CPUS;
+                CpuQueue* other = __atomic_load_n(&cpus_[candidate], __ATOMIC_ACQUIRE);
+                if (!other) {
+                    continue;
+                }
                 
-                if (validate_thread(thread)) {
-                    if (thread->get_state() == ThreadState::Ready) {
-                        return thread;
-                    }
-                    
-                    if (thread->get_state() == ThreadState::Sleeping) {
-                        if (thread->should_wake_up(current_time)) {
-                            thread->set_state(ThreadState::Ready);
-                            return thread;
-                        }
-                    }
+                u64 load = runnable_threads(candidate);
+                if (load > victim_load) {
+                    victim = candidate;
+                    victim_load = load;
                 }
             }
+            
+            if (victim == arch::MAX_CPUS) {
+                return nullptr;
+            }
+            
+            Thread* thread = dequeue(victim, cpu);
+            if (!thread) {
+                continue;
+            }
+            
+            if (!validate_thread(thread)) {
+                discard_thread(queue, thread);
+                continue;
+            }
+            
+            bool cache_hot = now - thread->last_run_time_ < CACHE_HOT_CYCLES;
+            if (cache_hot && victim_load < STEAL_THRESHOLD) {
+                enqueue(victim, thread);
+                return nullptr;
+            }
+            
+            thread->last_cpu_ = cpu;
+            queue.steals++;
+            queue.migrations++;
+            __atomic_add_fetch(&cpus_[victim]->stolen, 1, __ATOMIC_RELAXED);
+            return thread;
         }
         
-        return idle_thread_;
+        return nullptr;
     }
 
-    void Scheduler::update_thread_priorities() {
-        u64 current_time = arch::CPU::read_tsc();
+    void Scheduler::handle_timer_tick() {
+        __atomic_add_fetch(&timer_ticks_, 1, __ATOMIC_RELAXED);
         
-        for (RunQueue& queue : run_queues_) {
-            for (Thread* thread : queue.threads) {
-                if (thread->get_state() == ThreadState::Running) {
-                    u64 time_slice = calculate_time_slice(thread);
-                    if (current_time - last_schedule_time_ > time_slice) {
-                        u32 new_priority = calculate_priority(thread);
-                        if (new_priority != queue.priority_level) {
-                            remove_thread(thread);
-                            add_thread(thread);
-                        }
-                    }
-                }
+        u32 cpu = arch::SMP::current_cpu_id();
+        CpuQueue* queue = cpus_[cpu];
+        if (!queue) {
+            return;
+        }
+        
+        TimerWheel::instance().run_timers();
+        
+        u64 current_time = arch::CPU::read_tsc();
+        bool expired = queue->current == queue->idle || !validate_thread(queue->current) ||
+                       current_time - queue->last_schedule_time > calculate_time_slice(queue->current);
+        if (expired) {
+            Thread* next_thread = select_next_thread(*queue, cpu);
+            if (next_thread && next_thread != queue->current) {
+                switch_to_thread(next_thread, false);
             }
         }
+        
+        program_next_event(*queue);
     }
 
-    void Scheduler::handle_timer_tick() {
-        ScopedLock lock(lock_);
+    void Scheduler::program_next_event(CpuQueue& queue) {
+        if (!arch::LocalAPIC::is_available()) {
+            return;
+        }
         
-        timer_ticks_++;
+        TimerWheel& wheel = TimerWheel::instance();
+        u64 delay = wheel.ticks_until_next_event();
         
-        u64 current_time = arch::CPU::read_tsc();
+        if (queue.current != queue.idle) {
+            u64 slice = max(wheel.cycles_to_ticks(calculate_time_slice(queue.current)),
+                            static_cast<u64>(1));
+            delay = min(delay, slice);
+        } else if (__atomic_load_n(&queue.ready_count, __ATOMIC_ACQUIRE) != 0 ||
+                   __atomic_load_n(&overflow_count_, __ATOMIC_ACQUIRE) != 0) {
+            delay = 1;
+        } else if (__atomic_load_n(&cpu_count_, __ATOMIC_ACQUIRE) > 1) {
+            delay = min(delay, MAX_IDLE_TICKS);
+        }
         
-        if (current_thread_ != idle_thread_) {
-            u64 time_slice = calculate_time_slice(current_thread_);
-            if (current_time - last_schedule_time_ > time_slice) {
-                Thread* next_thread = select_next_thread();
-                if (next_thread && next_thread != current_thread_) {
-                    switch_to_thread(next_thread);
-                }
+        if (delay == TimerWheel::NO_DEADLINE) {
+            arch::LocalAPIC::stop_timer();
+            queue.tickless_idle++;
+            return;
+        }
+        
+        if (queue.current == queue.idle && delay > 1) {
+            queue.tickless_idle++;
+        }
+        
+        arch::LocalAPIC::arm_oneshot(delay);
+    }
+
+    void Scheduler::discard_thread(CpuQueue& queue, Thread* thread) {
+        if (!thread || thread == queue.idle || thread->list_owner_) {
+            return;
+        }
+        
+        if (thread->get_state() != ThreadState::Dead) {
+            Process* process = thread->get_process();
+            if (process && !process->is_dead() && !process->is_zombie()) {
+                return;
+            }
+            
+            TimerWheel::instance().cancel_timer(&thread->sleep_timer_);
+            thread->set_state(ThreadState::Dead);
+        }
+        
+        ScopedLock lock(queue.reaper_lock);
+        list_push(queue.reaper, thread);
+    }
+
+    bool Scheduler::is_running_anywhere(const Thread* thread) const {
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            CpuQueue* queue = __atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE);
+            if (queue && __atomic_load_n(&queue->current, __ATOMIC_ACQUIRE) == thread) {
+                return true;
             }
         }
         
-        for (RunQueue& queue : run_queues_) {
-            for (Thread* thread : queue.threads) {
-                if (thread->is_sleeping() && thread->should_wake_up(current_time)) {
-                    thread->set_state(ThreadState::Ready);
+        return false;
+    }
+
+    usize Scheduler::reap_dead_threads() {
+        usize reaped = 0;
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            CpuQueue* queue = __atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE);
+            if (!queue) {
+                continue;
+            }
+            
+            ThreadList batch;
+            list_init(batch);
+            
+            {
+                arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                ScopedLock lock(queue->reaper_lock);
+                
+                Thread* next = queue->reaper.head;
+                while (next && batch.count < REAP_BATCH) {
+                    Thread* thread = next;
+                    next = thread->list_next_;
+                    
+                    if (is_running_anywhere(thread)) {
+                        continue;
+                    }
+                    
+                    list_unlink(queue->reaper, thread);
+                    __atomic_add_fetch(&thread->run_ticket_, 1, __ATOMIC_ACQ_REL);
+                    list_push(batch, thread);
+                }
+                
+                queue->reaped += batch.count;
+            }
+            
+            while (batch.head) {
+                Thread* thread = batch.head;
+                list_unlink(batch, thread);
+                
+                if (Process* process = thread->get_process()) {
+                    process->detach_thread(thread);
                 }
+                ThreadPool::instance().release(thread);
+                reaped++;
             }
         }
         
-        cleanup_dead_threads();
+        return reaped;
+    }
+
+    void Scheduler::reaper_main() {
+        Scheduler& scheduler = instance();
+        
+        for (;;) {
+            if (scheduler.reap_dead_threads() == 0) {
+                scheduler.sleep(REAP_INTERVAL_MS);
+            } else {
+                scheduler.yield();
+            }
+        }
     }
 
     bool Scheduler::validate_thread(Thread* thread) {
@@ -276,22 +849,6 @@ namespace nk::task {
         return true;
     }
 
-    void Scheduler::cleanup_dead_threads() {
-        for (RunQueue& queue : run_queues_) {
-            for (usize i = 0; i < queue.threads.size(); i++) {
-                Thread* thread = queue.threads[i];
-                if (thread->get_state() == ThreadState::Dead) {
-                    if (thread == current_thread_) {
-                        current_thread_ = idle_thread_;
-                    }
-                    delete thread;
-                    queue.threads.erase(i);
-                    i--;
-                }
-            }
-        }
-    }
-
     u64 Scheduler::calculate_time_slice(Thread* thread) {
         Process* process = thread->get_process();
         if (!process) {
@@ -312,7 +869,7 @@ namespace nk::task {
                 
             case SchedulingPolicy::Fair:
                 return base_slice * process->get_statistics().cpu_time_used / 
-                       (statistics_.total_cpu_time + 1);
+                       (get_statistics().total_cpu_time + 1);
                 
             default:
                 return base_slice;
@@ -325,6 +882,10 @@ namespace nk::task {
             return 0;
         }
         
+        if (thread->is_background()) {
+            return PRIORITY_LEVELS - 1;
+        }
+        
         u32 priority = 0;
         
         switch (policy_) {
@@ -348,59 +909,116 @@ namespace nk::task {
                 priority = 1;
         }
         
-        if (priority >= run_queues_.size()) {
-            priority = run_queues_.size() - 1;
+        if (priority >= PRIORITY_LEVELS) {
+            priority = PRIORITY_LEVELS - 1;
         }
         
         return priority;
     }
 
-    void Scheduler::switch_to_thread(Thread* thread) {
-        if (!thread || thread == current_thread_) {
+    usize Scheduler::latency_bucket(u64 cycles) {
+        usize bucket = 63 - __builtin_clzll(cycles | 1);
+        return min(bucket, LATENCY_BUCKETS - 1);
+    }
+
+    void Scheduler::trace_switch(CpuQueue& queue, Thread* old_thread, Thread* thread,
+                                 bool voluntary, u64 current_time) {
+        if (old_thread && old_thread != queue.idle) {
+            ThreadSchedulingStatistics& stats = old_thread->sched_statistics_;
+            if (stats.last_dispatch) {
+                stats.run_time += current_time - stats.last_dispatch;
+            }
+            
+            if (voluntary || old_thread->get_state() != ThreadState::Running) {
+                stats.voluntary_switches++;
+            } else {
+                stats.involuntary_switches++;
+            }
+        }
+        
+        if (thread != queue.idle) {
+            ThreadSchedulingStatistics& stats = thread->sched_statistics_;
+            if (stats.last_enqueue && current_time > stats.last_enqueue) {
+                u64 wait = current_time - stats.last_enqueue;
+                stats.wait_time += wait;
+                stats.max_wait = max(stats.max_wait, wait);
+                queue.wait_histogram[stats.last_priority][latency_bucket(wait)]++;
+            }
+            
+            stats.last_enqueue = 0;
+            stats.last_dispatch = current_time;
+            stats.dispatches++;
+        }
+    }
+
+    void Scheduler::switch_to_thread(Thread* thread, bool voluntary) {
+        CpuQueue& queue = local_queue();
+        
+        if (!thread || thread == queue.current) {
             return;
         }
         
-        Thread* old_thread = current_thread_;
-        current_thread_ = thread;
+        Thread* old_thread = queue.current;
+        queue.current = thread;
         
-        if (old_thread && old_thread != idle_thread_) {
-            if (old_thread->get_state() == ThreadState::Running) {
+        arch::FPU::switch_out(old_thread ? old_thread->get_fpu_state() : nullptr);
+        
+        u64 current_time = arch::CPU::read_tsc();
+        u64 elapsed = current_time - queue.last_schedule_time;
+        bool tracing = latency_tracing_;
+        
+        if (tracing) {
+            trace_switch(queue, old_thread, thread, voluntary, current_time);
+        }
+        
+        if (old_thread && old_thread != queue.idle) {
+            old_thread->last_run_time_ = current_time;
+            
+            if (!validate_thread(old_thread)) {
+                discard_thread(queue, old_thread);
+            } else if (old_thread->get_state() == ThreadState::Running) {
                 old_thread->set_state(ThreadState::Ready);
                 add_thread(old_thread);
             }
             
-            u64 current_time = arch::CPU::read_tsc();
-            u64 cpu_time = current_time - last_schedule_time_;
-            
             Process* old_process = old_thread->get_process();
             if (old_process) {
-                old_process->update_statistics(cpu_time, 0);
+                old_process->update_statistics(elapsed, 0);
             }
             
-            statistics_.total_cpu_time += cpu_time;
+            queue.statistics.total_cpu_time += elapsed;
+        } else {
+            queue.statistics.idle_time += elapsed;
         }
         
         thread->set_state(ThreadState::Running);
+        thread->last_cpu_ = arch::SMP::current_cpu_id();
         
-        u64 current_time = arch::CPU::read_tsc();
-        last_schedule_time_ = current_time;
-        statistics_.last_switch_time = current_time;
-        statistics_.total_context_switches++;
+        queue.last_schedule_time = current_time;
+        queue.statistics.last_switch_time = current_time;
+        queue.statistics.total_context_switches++;
         
-        if (thread != idle_thread_) {
-            statistics_.total_processes_scheduled++;
-        } else {
-            statistics_.idle_time += current_time - last_schedule_time_;
+        if (thread != queue.idle) {
+            queue.statistics.total_processes_scheduled++;
         }
         
-        debug::log(debug::LogLevel::Trace, "SCHED",
-                  "Context switch: %llu -> %llu",
-                  old_thread ? old_thread->get_id() : 0,
-                  thread->get_id());
+        if (tracing) {
+            u64 cost = arch::CPU::read_tsc() - current_time;
+            queue.switch_cost_total += cost;
+            queue.switch_cost_min = min(queue.switch_cost_min, cost);
+            queue.switch_cost_max = max(queue.switch_cost_max, cost);
+            queue.switch_cost_samples++;
+        }
+        
+        debug::Trace::point(debug::TraceComponent::Scheduler,
+                           "Context switch: %llu -> %llu",
+                           old_thread ? old_thread->get_id() : 0,
+                           thread->get_id());
     }
 
     void Scheduler::save_current_context() {
-        if (current_thread_ && current_thread_ != idle_thread_) {
+        CpuQueue& queue = local_queue();
+        if (queue.current && queue.current != queue.idle) {
             RegisterState regs;
             asm volatile(
                 "mov %%r15, %0\n"
@@ -436,12 +1054,12 @@ namespace nk::task {
                 : "=m"(regs.rsp)
             );
             
-            current_thread_->save_context(&regs);
+            queue.current->save_context(&regs);
         }
     }
 
     void Scheduler::load_thread_context(Thread* thread) {
-        if (thread && thread != idle_thread_) {
+        if (thread && thread != local_queue().idle) {
             RegisterState regs;
             thread->restore_context(&regs);
             
@@ -484,57 +1102,251 @@ namespace nk::task {
         }
     }
 
+    Thread* Scheduler::get_current_thread() {
+        CpuQueue* queue = cpus_[arch::SMP::current_cpu_id()];
+        return queue ? queue->current : nullptr;
+    }
+
     Process* Scheduler::get_current_process() {
-        if (current_thread_ && current_thread_ != idle_thread_) {
-            return current_thread_->get_process();
+        CpuQueue* queue = cpus_[arch::SMP::current_cpu_id()];
+        if (queue && queue->current && queue->current != queue->idle) {
+            return queue->current->get_process();
         }
         return nullptr;
     }
 
+    u64 Scheduler::runnable_threads(u32 cpu) const {
+        CpuQueue* queue = __atomic_load_n(&cpus_[cpu], __ATOMIC_ACQUIRE);
+        if (!queue) {
+            return 0;
+        }
+        
+        u64 load = __atomic_load_n(&queue->ready_count, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&queue->current, __ATOMIC_RELAXED) != queue->idle) {
+            load++;
+        }
+        return load;
+    }
+
+    SchedulingStatistics Scheduler::get_statistics() const {
+        SchedulingStatistics total;
+        memset(&total, 0, sizeof(total));
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            total.total_context_switches += queue->statistics.total_context_switches;
+            total.total_processes_scheduled += queue->statistics.total_processes_scheduled;
+            total.total_cpu_time += queue->statistics.total_cpu_time;
+            total.idle_time += queue->statistics.idle_time;
+            total.last_switch_time = max(total.last_switch_time, queue->statistics.last_switch_time);
+        }
+        
+        return total;
+    }
+
     void Scheduler::dump_run_queues() const {
-        ScopedLock lock(lock_);
+        debug::log(debug::LogLevel::Info, "SCHED", "Run Queues: %llu overflowed, %llu parked",
+                  overflows_, __atomic_load_n(&overflow_count_, __ATOMIC_ACQUIRE));
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            debug::log(debug::LogLevel::Info, "SCHED", "  CPU %u: %llu runnable",
+                      cpu, runnable_threads(cpu));
+            for (u32 i = 0; i < PRIORITY_LEVELS; i++) {
+                const RunQueue& level = queue->levels[i];
+                u64 head = __atomic_load_n(&level.dequeue_pos, __ATOMIC_ACQUIRE);
+                u64 tail = __atomic_load_n(&level.enqueue_pos, __ATOMIC_ACQUIRE);
+                
+                debug::log(debug::LogLevel::Info, "SCHED",
+                          "    Priority %u: %llu entries", i, tail - head);
+                for (u64 pos = head; pos != tail; pos++) {
+                    const RunQueueSlot& slot = level.slots[pos & (RUN_QUEUE_CAPACITY - 1)];
+                    const Thread* thread = slot.thread;
+                    if (!thread || thread->run_ticket_ != slot.ticket) {
+                        continue;
+                    }
+                    debug::log(debug::LogLevel::Info, "SCHED",
+                              "      Thread %llu (PID: %llu, State: %u)",
+                              thread->get_id(), thread->get_process()->get_pid(),
+                              static_cast<u32>(thread->get_state()));
+                }
+            }
+        }
+    }
+
+    void Scheduler::set_latency_tracing(bool enabled) {
+        if (enabled && !latency_tracing_) {
+            reset_latency_statistics();
+        }
         
-        debug::log(debug::LogLevel::Info, "SCHED", "Run Queues:");
-        for (usize i = 0; i < run_queues_.size(); i++) {
-            const RunQueue& queue = run_queues_[i];
+        __atomic_store_n(&latency_tracing_, enabled, __ATOMIC_RELEASE);
+        
+        debug::log(debug::LogLevel::Info, "SCHED", "Latency tracing %s",
+                  enabled ? "enabled" : "disabled");
+    }
+
+    void Scheduler::reset_latency_statistics() {
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            memset(queue->wait_histogram, 0, sizeof(queue->wait_histogram));
+            queue->switch_cost_total = 0;
+            queue->switch_cost_min = ~0ULL;
+            queue->switch_cost_max = 0;
+            queue->switch_cost_samples = 0;
+        }
+    }
+
+    usize Scheduler::export_latency_histogram(u32 priority, u64* buckets, usize count) const {
+        if (priority >= PRIORITY_LEVELS || !buckets) {
+            return 0;
+        }
+        
+        count = min(count, LATENCY_BUCKETS);
+        for (usize i = 0; i < count; i++) {
+            buckets[i] = 0;
+        }
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            for (usize i = 0; i < count; i++) {
+                buckets[i] += queue->wait_histogram[priority][i];
+            }
+        }
+        
+        return count;
+    }
+
+    void Scheduler::dump_latency() const {
+        debug::log(debug::LogLevel::Info, "SCHED", "Scheduling Latency (%s):",
+                  latency_tracing_ ? "tracing" : "disabled");
+        
+        for (u32 priority = 0; priority < PRIORITY_LEVELS; priority++) {
+            u64 buckets[LATENCY_BUCKETS];
+            export_latency_histogram(priority, buckets, LATENCY_BUCKETS);
+            
+            u64 samples = 0;
+            for (usize i = 0; i < LATENCY_BUCKETS; i++) {
+                samples += buckets[i];
+            }
+            
             debug::log(debug::LogLevel::Info, "SCHED",
-                      "  Priority %u: %llu threads", i, queue.threads.size());
-            for (const Thread* thread : queue.threads) {
-                debug::log(debug::LogLevel::Info, "SCHED",
-                          "    Thread %llu (PID: %llu, State: %u)",
-                          thread->get_id(), thread->get_process()->get_pid(),
-                          static_cast<u32>(thread->get_state()));
+                      "  Priority %u run-queue wait: %llu samples", priority, samples);
+            for (usize i = 0; i < LATENCY_BUCKETS; i++) {
+                if (buckets[i]) {
+                    debug::log(debug::LogLevel::Info, "SCHED",
+                              "    [%llu, %llu) cycles: %llu",
+                              1ULL << i, 1ULL << (i + 1), buckets[i]);
+                }
             }
         }
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const CpuQueue* queue = cpus_[cpu];
+            if (!queue || queue->switch_cost_samples == 0) {
+                continue;
+            }
+            
+            debug::log(debug::LogLevel::Info, "SCHED",
+                      "  CPU %u switch cost: avg=%llu min=%llu max=%llu cycles (%llu samples)",
+                      cpu, queue->switch_cost_total / queue->switch_cost_samples,
+                      queue->switch_cost_min, queue->switch_cost_max,
+                      queue->switch_cost_samples);
+        }
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            const Thread* current = queue->current;
+            if (!current || current == queue->idle) {
+                continue;
+            }
+            
+            const ThreadSchedulingStatistics& stats = current->get_scheduling_statistics();
+            debug::log(debug::LogLevel::Info, "SCHED",
+                      "  CPU %u thread %llu: run=%llu wait=%llu max_wait=%llu "
+                      "dispatches=%llu voluntary=%llu involuntary=%llu",
+                      cpu, current->get_id(), stats.run_time, stats.wait_time, stats.max_wait,
+                      stats.dispatches, stats.voluntary_switches, stats.involuntary_switches);
+        }
     }
 
     void Scheduler::dump_statistics() const {
-        ScopedLock lock(lock_);
+        SchedulingStatistics statistics = get_statistics();
         
         debug::log(debug::LogLevel::Info, "SCHED", "Scheduler Statistics:");
         debug::log(debug::LogLevel::Info, "SCHED", "  Total Context Switches: %llu",
-                  statistics_.total_context_switches);
+                  statistics.total_context_switches);
         debug::log(debug::LogLevel::Info, "SCHED", "  Total Processes Scheduled: %llu",
-                  statistics_.total_processes_scheduled);
+                  statistics.total_processes_scheduled);
         debug::log(debug::LogLevel::Info, "SCHED", "  Total CPU Time: %llu",
-                  statistics_.total_cpu_time);
+                  statistics.total_cpu_time);
         debug::log(debug::LogLevel::Info, "SCHED", "  Idle Time: %llu",
-                  statistics_.idle_time);
+                  statistics.idle_time);
         debug::log(debug::LogLevel::Info, "SCHED", "  Last Switch Time: %llu",
-                  statistics_.last_switch_time);
+                  statistics.last_switch_time);
         
         double utilization = 0.0;
-        if (statistics_.total_cpu_time + statistics_.idle_time > 0) {
-            utilization = 100.0 * statistics_.total_cpu_time /
-                         (statistics_.total_cpu_time + statistics_.idle_time);
+        if (statistics.total_cpu_time + statistics.idle_time > 0) {
+            utilization = 100.0 * statistics.total_cpu_time /
+                         (statistics.total_cpu_time + statistics.idle_time);
         }
         debug::log(debug::LogLevel::Info, "SCHED", "  CPU Utilization: %.2f%%", utilization);
+        
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const CpuQueue* queue = cpus_[cpu];
+            if (!queue) {
+                continue;
+            }
+            
+            debug::log(debug::LogLevel::Info, "SCHED",
+                      "  CPU %u: runnable=%llu switches=%llu local=%llu steals=%llu "
+                      "stolen=%llu remote=%llu migrations=%llu reaped=%llu tickless=%llu",
+                      cpu, runnable_threads(cpu), queue->statistics.total_context_switches,
+                      queue->local_picks, queue->steals, queue->stolen,
+                      queue->remote_enqueues, queue->migrations,
+                      queue->reaped, queue->tickless_idle);
+        }
     }
 
     void Scheduler::on_timer_tick() {
         handle_timer_tick();
     }
 
+    void Scheduler::on_reschedule() {
+        u32 cpu = arch::SMP::current_cpu_id();
+        CpuQueue* queue = cpus_[cpu];
+        if (!queue) {
+            return;
+        }
+        
+        if (queue->current == queue->idle) {
+            Thread* next_thread = select_next_thread(*queue, cpu);
+            if (next_thread && next_thread != queue->current) {
+                switch_to_thread(next_thread, false);
+            }
+        }
+        
+        program_next_event(*queue);
+    }
+
     Scheduler& Scheduler::instance() {
         static Scheduler instance;
         return instance;
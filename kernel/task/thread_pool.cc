@@ -0,0 +1,236 @@
+#include <nanokoton/task/thread_pool.hpp>
+#include <nanokoton/task/process.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/mm/virtual.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+
+namespace nk::task {
+    ThreadPool::ThreadPool() : recycled_(0), destroyed_(0) {
+        for (usize i = 0; i < STACK_CLASSES; i++) {
+            SizeClass& size_class = classes_[i];
+            size_class.threads = nullptr;
+            size_class.thread_count = 0;
+            size_class.stacks = nullptr;
+            size_class.stack_count = 0;
+            size_class.thread_hits = 0;
+            size_class.thread_misses = 0;
+            size_class.stack_hits = 0;
+            size_class.stack_misses = 0;
+        }
+    }
+
+    ThreadPool& ThreadPool::instance() {
+        static ThreadPool instance;
+        return instance;
+    }
+
+    usize ThreadPool::class_index(usize stack_size) {
+        usize index = 0;
+        while (index < STACK_CLASSES && (static_cast<usize>(1) << (MIN_STACK_SHIFT + index)) < stack_size) {
+            index++;
+        }
+        return index;
+    }
+
+    usize ThreadPool::stack_size_for(usize size) {
+        usize index = class_index(size);
+        if (index >= STACK_CLASSES) {
+            return align_up(size, PAGE_SIZE);
+        }
+        return static_cast<usize>(1) << (MIN_STACK_SHIFT + index);
+    }
+
+    u64* ThreadPool::allocate_stack(usize stack_size) {
+        usize index = class_index(stack_size);
+
+        if (index < STACK_CLASSES) {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(lock_);
+
+            SizeClass& size_class = classes_[index];
+            if (size_class.stacks) {
+                PooledStack* stack = size_class.stacks;
+                size_class.stacks = stack->next;
+                size_class.stack_count--;
+                size_class.stack_hits++;
+                stack->next = nullptr;
+                return reinterpret_cast<u64*>(stack);
+            }
+
+            size_class.stack_misses++;
+        }
+
+        return reinterpret_cast<u64*>(mm::VirtualMemoryManager::instance()
+            .allocate_guarded_stack(stack_size_for(stack_size) / PAGE_SIZE));
+    }
+
+    void ThreadPool::free_stack(u64* stack, usize stack_size) {
+        if (!stack) {
+            return;
+        }
+
+        usize index = class_index(stack_size);
+
+        if (index < STACK_CLASSES) {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(lock_);
+
+            SizeClass& size_class = classes_[index];
+            if (size_class.stack_count < MAX_POOLED_STACKS) {
+                PooledStack* pooled = reinterpret_cast<PooledStack*>(stack);
+                pooled->next = size_class.stacks;
+                size_class.stacks = pooled;
+                size_class.stack_count++;
+                return;
+            }
+        }
+
+        mm::VirtualMemoryManager::instance()
+            .free_guarded_stack(stack, stack_size_for(stack_size) / PAGE_SIZE);
+    }
+
+    Thread* ThreadPool::acquire(Process* process, u64 entry_point, usize stack_size) {
+        usize index = class_index(stack_size);
+
+        if (index < STACK_CLASSES) {
+            Thread* thread = nullptr;
+
+            {
+                arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                ScopedLock lock(lock_);
+
+                SizeClass& size_class = classes_[index];
+                thread = size_class.threads;
+                if (thread) {
+                    size_class.threads = thread->list_next_;
+                    size_class.thread_count--;
+                    size_class.thread_hits++;
+                } else {
+                    size_class.thread_misses++;
+                }
+            }
+
+            if (thread) {
+                thread->recycle(process, entry_point);
+                return thread;
+            }
+        }
+
+        Thread* thread = new Thread(process, entry_point, stack_size);
+        if (thread && (!thread->stack_ || !thread->get_registers())) {
+            delete thread;
+            return nullptr;
+        }
+
+        return thread;
+    }
+
+    void ThreadPool::release(Thread* thread) {
+        if (!thread) {
+            return;
+        }
+
+        TimerWheel::instance().cancel_timer(&thread->sleep_timer_);
+        arch::FPU::release(thread->fpu_state_);
+
+        usize index = class_index(thread->get_stack_size());
+
+        if (index < STACK_CLASSES && thread->stack_ && thread->registers_) {
+            arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+            ScopedLock lock(lock_);
+
+            SizeClass& size_class = classes_[index];
+            if (size_class.thread_count < MAX_POOLED_THREADS) {
+                thread->state_ = ThreadState::Dead;
+                thread->process_ = nullptr;
+                thread->list_prev_ = nullptr;
+                thread->list_owner_ = &classes_[index];
+                thread->list_next_ = size_class.threads;
+                size_class.threads = thread;
+                size_class.thread_count++;
+                recycled_++;
+                return;
+            }
+        }
+
+        destroyed_++;
+        delete thread;
+    }
+
+    usize ThreadPool::prefill(usize stack_size, usize count) {
+        usize index = class_index(stack_size);
+        if (index >= STACK_CLASSES) {
+            return 0;
+        }
+
+        usize filled = 0;
+        while (filled < count) {
+            {
+                arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+                ScopedLock lock(lock_);
+                if (classes_[index].stack_count >= MAX_POOLED_STACKS) {
+                    break;
+                }
+            }
+
+            void* stack = mm::VirtualMemoryManager::instance()
+                .allocate_guarded_stack(stack_size_for(stack_size) / PAGE_SIZE);
+            if (!stack) {
+                break;
+            }
+
+            free_stack(reinterpret_cast<u64*>(stack), stack_size);
+            filled++;
+        }
+
+        return filled;
+    }
+
+    u64 ThreadPool::thread_hits() const {
+        u64 total = 0;
+        for (usize i = 0; i < STACK_CLASSES; i++) {
+            total += classes_[i].thread_hits;
+        }
+        return total;
+    }
+
+    u64 ThreadPool::thread_misses() const {
+        u64 total = 0;
+        for (usize i = 0; i < STACK_CLASSES; i++) {
+            total += classes_[i].thread_misses;
+        }
+        return total;
+    }
+
+    u64 ThreadPool::stack_hits() const {
+        u64 total = 0;
+        for (usize i = 0; i < STACK_CLASSES; i++) {
+            total += classes_[i].stack_hits;
+        }
+        return total;
+    }
+
+    u64 ThreadPool::stack_misses() const {
+        u64 total = 0;
+        for (usize i = 0; i < STACK_CLASSES; i++) {
+            total += classes_[i].stack_misses;
+        }
+        return total;
+    }
+
+    void ThreadPool::dump_statistics() const {
+        debug::log(debug::LogLevel::Info, "THREAD", "Thread Pool Statistics:");
+        for (usize i = 0; i < STACK_CLASSES; i++) {
+            const SizeClass& size_class = classes_[i];
+            debug::log(debug::LogLevel::Info, "THREAD",
+                      "  %6llu-byte stacks: threads=%llu (hits=%llu misses=%llu) "
+                      "stacks=%llu (hits=%llu misses=%llu)",
+                      static_cast<usize>(1) << (MIN_STACK_SHIFT + i),
+                      size_class.thread_count, size_class.thread_hits, size_class.thread_misses,
+                      size_class.stack_count, size_class.stack_hits, size_class.stack_misses);
+        }
+        debug::log(debug::LogLevel::Info, "THREAD", "  Recycled: %llu, Destroyed: %llu",
+                  recycled_, destroyed_);
+    }
+}
@@ -0,0 +1,345 @@
+#include <nanokoton/task/timer.hpp>
+#include <nanokoton/core/debug.hpp>
+#include <nanokoton/arch/cpu.hpp>
+#include <nanokoton/arch/idt.hpp>
+#include <nanokoton/lib/string.hpp>
+#include <nanokoton/lib/algorithm.hpp>
+
+namespace nk::task {
+    namespace {
+        constexpr u16 PIT_CHANNEL2 = 0x42;
+        constexpr u16 PIT_COMMAND = 0x43;
+        constexpr u16 PIT_GATE = 0x61;
+        constexpr u8 PIT_GATE_ENABLE = 0x01;
+        constexpr u8 PIT_SPEAKER_ENABLE = 0x02;
+        constexpr u8 PIT_OUTPUT_HIGH = 0x20;
+        constexpr u8 PIT_CHANNEL2_ONESHOT = 0xB0;
+
+        u8 port_read(u16 port) {
+            u8 value;
+            asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+            return value;
+        }
+
+        void port_write(u16 port, u8 value) {
+            asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+        }
+    }
+
+    TimerWheel::TimerWheel() : tsc_per_tick_(DEFAULT_TSC_PER_TICK) {
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            Wheel& wheel = wheels_[cpu];
+            for (u32 level = 0; level < LEVEL_COUNT; level++) {
+                for (u32 slot = 0; slot < LEVEL_SIZE; slot++) {
+                    wheel.slots[level][slot] = nullptr;
+                }
+                wheel.occupied[level] = 0;
+            }
+            wheel.current_tick = 0;
+            wheel.pending = 0;
+            wheel.started = false;
+            wheel.armed = 0;
+            wheel.expired = 0;
+            wheel.cancelled = 0;
+            wheel.cascaded = 0;
+            wheel.ticks_skipped = 0;
+        }
+    }
+
+    TimerWheel& TimerWheel::instance() {
+        static TimerWheel instance;
+        return instance;
+    }
+
+    void TimerWheel::set_tsc_frequency(u64 hz) {
+        tsc_per_tick_ = max(hz / 1000, static_cast<u64>(1));
+    }
+
+    u64 TimerWheel::tsc_frequency_from_cpuid(u32 leaf) {
+        u32 eax, ebx, ecx, edx;
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+        if (eax < leaf) {
+            return 0;
+        }
+
+        asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf), "c"(0));
+        if (leaf == 0x15) {
+            if (eax == 0 || ebx == 0 || ecx == 0) {
+                return 0;
+            }
+            return static_cast<u64>(ecx) * ebx / eax;
+        }
+
+        return static_cast<u64>(eax & 0xFFFF) * 1000000;
+    }
+
+    u64 TimerWheel::tsc_frequency_from_pit() {
+        u64 latch = PIT_FREQUENCY * PIT_CALIBRATION_MS / 1000;
+
+        u8 gate = port_read(PIT_GATE);
+        port_write(PIT_GATE, (gate & ~PIT_SPEAKER_ENABLE) | PIT_GATE_ENABLE);
+        port_write(PIT_COMMAND, PIT_CHANNEL2_ONESHOT);
+        port_write(PIT_CHANNEL2, static_cast<u8>(latch));
+        port_write(PIT_CHANNEL2, static_cast<u8>(latch >> 8));
+
+        u64 start = arch::CPU::read_tsc();
+        u64 polls = 0;
+        while (!(port_read(PIT_GATE) & PIT_OUTPUT_HIGH)) {
+            if (++polls > PIT_POLL_LIMIT) {
+                port_write(PIT_GATE, gate);
+                return 0;
+            }
+        }
+        u64 elapsed = arch::CPU::read_tsc() - start;
+
+        port_write(PIT_GATE, gate);
+        return elapsed * PIT_FREQUENCY / latch;
+    }
+
+    bool TimerWheel::calibrate_tsc() {
+        const char* source = "CPUID 15h";
+        u64 hz = tsc_frequency_from_cpuid(0x15);
+        if (hz == 0) {
+            source = "PIT";
+            hz = tsc_frequency_from_pit();
+        }
+        if (hz == 0) {
+            source = "CPUID 16h";
+            hz = tsc_frequency_from_cpuid(0x16);
+        }
+        if (hz == 0) {
+            debug::log(debug::LogLevel::Warning, "TIMER",
+                      "TSC calibration failed, assuming %llu Hz", DEFAULT_TSC_PER_TICK * 1000);
+            return false;
+        }
+
+        set_tsc_frequency(hz);
+        debug::log(debug::LogLevel::Info, "TIMER", "TSC frequency %llu Hz (%s)", hz, source);
+        return true;
+    }
+
+    u64 TimerWheel::now() const {
+        return arch::CPU::read_tsc() / tsc_per_tick_;
+    }
+
+    TimerWheel::Wheel& TimerWheel::local_wheel() {
+        Wheel& wheel = wheels_[arch::SMP::current_cpu_id()];
+        if (!wheel.started) {
+            wheel.current_tick = now();
+            wheel.started = true;
+        }
+        return wheel;
+    }
+
+    void TimerWheel::insert(Wheel& wheel, Timer* timer) {
+        if (timer->expires < wheel.current_tick) {
+            timer->expires = wheel.current_tick;
+        }
+
+        u64 delta = timer->expires - wheel.current_tick;
+        if (delta > MAX_DELAY) {
+            timer->expires = wheel.current_tick + MAX_DELAY;
+            delta = MAX_DELAY;
+        }
+
+        u32 level = 0;
+        while (level + 1 < LEVEL_COUNT && delta >= (1ULL << level_shift(level + 1))) {
+            level++;
+        }
+
+        u32 slot = (timer->expires >> level_shift(level)) & LEVEL_MASK;
+
+        timer->level = level;
+        timer->slot = slot;
+        timer->prev = nullptr;
+        timer->next = wheel.slots[level][slot];
+        if (timer->next) {
+            timer->next->prev = timer;
+        }
+        wheel.slots[level][slot] = timer;
+        wheel.occupied[level] |= 1ULL << slot;
+    }
+
+    void TimerWheel::unlink(Wheel& wheel, Timer* timer) {
+        if (timer->prev) {
+            timer->prev->next = timer->next;
+        } else {
+            wheel.slots[timer->level][timer->slot] = timer->next;
+        }
+
+        if (timer->next) {
+            timer->next->prev = timer->prev;
+        }
+
+        if (!wheel.slots[timer->level][timer->slot]) {
+            wheel.occupied[timer->level] &= ~(1ULL << timer->slot);
+        }
+
+        timer->next = nullptr;
+        timer->prev = nullptr;
+    }
+
+    void TimerWheel::cascade(Wheel& wheel, u32 level) {
+        u32 slot = (wheel.current_tick >> level_shift(level)) & LEVEL_MASK;
+
+        Timer* timer = wheel.slots[level][slot];
+        wheel.slots[level][slot] = nullptr;
+        wheel.occupied[level] &= ~(1ULL << slot);
+
+        while (timer) {
+            Timer* next = timer->next;
+            insert(wheel, timer);
+            wheel.cascaded++;
+            timer = next;
+        }
+    }
+
+    u64 TimerWheel::next_event_tick(const Wheel& wheel) const {
+        u64 next = NO_DEADLINE;
+
+        for (u32 level = 0; level < LEVEL_COUNT; level++) {
+            u64 occupied = wheel.occupied[level];
+            if (!occupied) {
+                continue;
+            }
+
+            u64 shift = level_shift(level);
+            u64 block = (wheel.current_tick + (1ULL << shift) - 1) >> shift;
+            u32 start = block & LEVEL_MASK;
+
+            u64 rotated = (occupied >> start) | (start ? occupied << (LEVEL_SIZE - start) : 0);
+            u64 offset = __builtin_ctzll(rotated);
+
+            next = min(next, (block + offset) << shift);
+        }
+
+        return next;
+    }
+
+    void TimerWheel::add_timer(Timer* timer, u64 delay_ticks) {
+        if (!timer || !timer->callback) {
+            return;
+        }
+
+        cancel_timer(timer);
+
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+
+        u32 cpu = arch::SMP::current_cpu_id();
+        Wheel& wheel = local_wheel();
+        ScopedLock lock(wheel.lock);
+
+        timer->cpu = cpu;
+        timer->expires = now() + max(delay_ticks, static_cast<u64>(1));
+        insert(wheel, timer);
+        __atomic_store_n(&timer->pending, true, __ATOMIC_RELEASE);
+
+        wheel.pending++;
+        wheel.armed++;
+    }
+
+    bool TimerWheel::cancel_timer(Timer* timer) {
+        if (!timer || !is_pending(timer)) {
+            return false;
+        }
+
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+
+        Wheel& wheel = wheels_[timer->cpu];
+        ScopedLock lock(wheel.lock);
+
+        if (!timer->pending) {
+            return false;
+        }
+
+        unlink(wheel, timer);
+        __atomic_store_n(&timer->pending, false, __ATOMIC_RELEASE);
+
+        wheel.pending--;
+        wheel.cancelled++;
+        return true;
+    }
+
+    void TimerWheel::signal_flag(void* context) {
+        __atomic_store_n(static_cast<bool*>(context), true, __ATOMIC_RELEASE);
+    }
+
+    usize TimerWheel::run_timers() {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+
+        Wheel& wheel = local_wheel();
+        u64 target = now();
+        usize fired = 0;
+
+        ScopedLock lock(wheel.lock);
+
+        while (wheel.current_tick <= target) {
+            u64 next = wheel.pending ? next_event_tick(wheel) : NO_DEADLINE;
+            if (next > target) {
+                wheel.ticks_skipped += target + 1 - wheel.current_tick;
+                wheel.current_tick = target + 1;
+                break;
+            }
+
+            wheel.ticks_skipped += next - wheel.current_tick;
+            wheel.current_tick = next;
+
+            for (u32 level = LEVEL_COUNT - 1; level > 0; level--) {
+                if ((wheel.current_tick & ((1ULL << level_shift(level)) - 1)) == 0) {
+                    cascade(wheel, level);
+                }
+            }
+
+            u32 slot = wheel.current_tick & LEVEL_MASK;
+            while (Timer* timer = wheel.slots[0][slot]) {
+                unlink(wheel, timer);
+                __atomic_store_n(&timer->pending, false, __ATOMIC_RELEASE);
+                wheel.pending--;
+                wheel.expired++;
+                fired++;
+
+                TimerCallback callback = timer->callback;
+                void* context = timer->context;
+
+                lock.unlock();
+                callback(context);
+                lock.lock();
+            }
+
+            wheel.current_tick++;
+        }
+
+        return fired;
+    }
+
+    u64 TimerWheel::ticks_until_next_event() {
+        arch::InterruptDescriptorTable::ScopedInterruptDisable irq;
+
+        Wheel& wheel = local_wheel();
+        ScopedLock lock(wheel.lock);
+
+        if (wheel.pending == 0) {
+            return NO_DEADLINE;
+        }
+
+        u64 next = next_event_tick(wheel);
+        u64 current = now();
+        return next > current ? next - current : 0;
+    }
+
+    void TimerWheel::dump_statistics() const {
+        debug::log(debug::LogLevel::Info, "TIMER", "Timer Wheel Statistics:");
+        for (u32 cpu = 0; cpu < arch::MAX_CPUS; cpu++) {
+            const Wheel& wheel = wheels_[cpu];
+            if (!wheel.started) {
+                continue;
+            }
+
+            debug::log(debug::LogLevel::Info, "TIMER",
+                      "  CPU %u: pending=%llu armed=%llu expired=%llu cancelled=%llu "
+                      "cascaded=%llu skipped_ticks=%llu",
+                      cpu, wheel.pending, wheel.armed, wheel.expired, wheel.cancelled,
+                      wheel.cascaded, wheel.ticks_skipped);
+        }
+    }
+}